@@ -0,0 +1,267 @@
+#include "AsyncLogger.h"
+
+#include <iostream>
+
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <cerrno>
+#include <codecvt>
+#include <cstdio>
+#include <fcntl.h>
+#include <locale>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef WINDOWS
+	// Same line ending the text mode streams used to write
+	const char kLineEnd[] = "\r\n";
+
+	bool RenameLogFile(const std::wstring& sFrom, const std::wstring& sTo)
+	{
+		return MoveFileExW(sFrom.c_str(), sTo.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+	}
+
+	void RemoveLogFile(const std::wstring& sPath)
+	{
+		DeleteFileW(sPath.c_str());
+	}
+#else
+	const char kLineEnd[] = "\n";
+
+	std::string ToNativePath(const std::wstring& sPath)
+	{
+		return std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(sPath);
+	}
+
+	bool RenameLogFile(const std::wstring& sFrom, const std::wstring& sTo)
+	{
+		return std::rename(ToNativePath(sFrom).c_str(), ToNativePath(sTo).c_str()) == 0;
+	}
+
+	void RemoveLogFile(const std::wstring& sPath)
+	{
+		std::remove(ToNativePath(sPath).c_str());
+	}
+#endif
+}
+
+CAsyncLogger::CAsyncLogger(size_t nQueueCapacity) :
+	m_Queue(nQueueCapacity),
+	m_bStopped(false),
+	m_nDropped(0),
+	m_nReportedDropped(0),
+	m_bConsole(true),
+	m_nMaxFileSize(0),
+	m_nMaxFiles(0),
+	m_nFileSize(0),
+#ifdef WINDOWS
+	m_hFile(INVALID_HANDLE_VALUE),
+#else
+	m_nFd(-1),
+#endif
+	m_nCachedSecond(-1)
+{
+}
+
+CAsyncLogger::~CAsyncLogger()
+{
+	Stop();
+}
+
+bool CAsyncLogger::Start(const std::wstring& sPath, bool bConsole, uint64_t nMaxFileSize, uint32_t nMaxFiles)
+{
+	if (m_WriterThread.joinable())
+		return false;
+
+	m_sPath = sPath;
+	m_bConsole = bConsole;
+	m_nMaxFileSize = nMaxFileSize;
+	m_nMaxFiles = nMaxFiles;
+
+	bool bOpened = OpenFile();
+	if (!bOpened)
+		std::cerr << "Failed to create the log file." << std::endl;
+
+	m_WriterThread = std::thread([this]() { WriterThread(); });
+	return bOpened;
+}
+
+void CAsyncLogger::Log(const std::string& sMessage)
+{
+	LOG_RECORD record;
+	record.time = Clock::now();
+	record.sMessage = sMessage;
+
+	if (!m_Queue.TryPush(record))
+		m_nDropped++;
+}
+
+void CAsyncLogger::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_WaitMutex);
+		m_bStopped = true;
+	}
+	m_WaitCondition.notify_all();
+
+	if (m_WriterThread.joinable())
+		m_WriterThread.join();
+
+	CloseFile();
+}
+
+void CAsyncLogger::WriterThread()
+{
+	LOG_RECORD record;
+	std::string sBatch;
+	sBatch.reserve(kLogMaxBatchSize + 4096);
+
+	for (;;)
+	{
+		// Read before draining, so lines queued before Stop() are never left behind
+		bool bStopping = m_bStopped;
+
+		while (sBatch.size() < kLogMaxBatchSize && m_Queue.TryPop(record))
+		{
+			AppendTimestamp(record.time, sBatch);
+			sBatch += record.sMessage;
+			sBatch += kLineEnd;
+		}
+
+		uint64_t nDropped = m_nDropped;
+		if (sBatch.size() < kLogMaxBatchSize && nDropped != m_nReportedDropped)
+		{
+			AppendTimestamp(Clock::now(), sBatch);
+			sBatch += "[CAsyncLogger][WARNING] " + std::to_string(nDropped - m_nReportedDropped) + " log lines dropped, the queue was full";
+			sBatch += kLineEnd;
+			m_nReportedDropped = nDropped;
+		}
+
+		if (!sBatch.empty())
+		{
+			WriteBatch(sBatch);
+			sBatch.clear();
+			continue;
+		}
+
+		if (bStopping)
+			return;
+
+		// Producers never signal, an idle writer polls the queue instead
+		std::unique_lock<std::mutex> lock(m_WaitMutex);
+		m_WaitCondition.wait_for(lock, std::chrono::milliseconds(kLogFlushIntervalMs), [this]() { return m_bStopped.load(); });
+	}
+}
+
+void CAsyncLogger::AppendTimestamp(Clock::time_point time, std::string& sBatch)
+{
+	std::time_t nSecond = Clock::to_time_t(time);
+	if (nSecond != m_nCachedSecond)
+	{
+		std::tm localTime;
+#ifdef WINDOWS
+		localtime_s(&localTime, &nSecond);
+#else
+		localtime_r(&nSecond, &localTime);
+#endif
+		char szTimestamp[32];
+		size_t nLength = std::strftime(szTimestamp, sizeof(szTimestamp), "[%H:%M:%S %d-%m-%Y] ", &localTime);
+		m_sCachedTimestamp.assign(szTimestamp, nLength);
+		m_nCachedSecond = nSecond;
+	}
+
+	sBatch += m_sCachedTimestamp;
+}
+
+void CAsyncLogger::WriteBatch(const std::string& sBatch)
+{
+	if (m_bConsole)
+	{
+		std::cout.write(sBatch.data(), sBatch.size());
+		std::cout.flush();
+	}
+
+	if (m_nMaxFileSize > 0 && m_nFileSize > 0 && m_nFileSize + sBatch.size() > m_nMaxFileSize)
+		RotateFile();
+
+	size_t nOffset = 0;
+#ifdef WINDOWS
+	while (m_hFile != INVALID_HANDLE_VALUE && nOffset < sBatch.size())
+	{
+		DWORD nWritten = 0;
+		if (!WriteFile(m_hFile, sBatch.data() + nOffset, static_cast<DWORD>(sBatch.size() - nOffset), &nWritten, NULL) || nWritten == 0)
+			break;
+		nOffset += nWritten;
+	}
+#else
+	while (m_nFd >= 0 && nOffset < sBatch.size())
+	{
+		ssize_t nWritten = write(m_nFd, sBatch.data() + nOffset, sBatch.size() - nOffset);
+		if (nWritten < 0 && errno == EINTR)
+			continue;
+		if (nWritten <= 0)
+			break;
+		nOffset += static_cast<size_t>(nWritten);
+	}
+#endif
+	m_nFileSize += nOffset;
+}
+
+bool CAsyncLogger::OpenFile()
+{
+#ifdef WINDOWS
+	m_hFile = CreateFileW(m_sPath.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER nSize;
+	m_nFileSize = GetFileSizeEx(m_hFile, &nSize) ? static_cast<uint64_t>(nSize.QuadPart) : 0;
+#else
+	m_nFd = open(ToNativePath(m_sPath).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (m_nFd < 0)
+		return false;
+
+	struct stat fileStat;
+	m_nFileSize = fstat(m_nFd, &fileStat) == 0 ? static_cast<uint64_t>(fileStat.st_size) : 0;
+#endif
+	return true;
+}
+
+void CAsyncLogger::CloseFile()
+{
+#ifdef WINDOWS
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+#else
+	if (m_nFd >= 0)
+		close(m_nFd);
+	m_nFd = -1;
+#endif
+	m_nFileSize = 0;
+}
+
+void CAsyncLogger::RotateFile()
+{
+	CloseFile();
+
+	if (m_nMaxFiles == 0)
+	{
+		RemoveLogFile(m_sPath);
+	}
+	else
+	{
+		RemoveLogFile(m_sPath + L"." + std::to_wstring(m_nMaxFiles));
+		for (uint32_t i = m_nMaxFiles - 1; i > 0; --i)
+			RenameLogFile(m_sPath + L"." + std::to_wstring(i), m_sPath + L"." + std::to_wstring(i + 1));
+		RenameLogFile(m_sPath, m_sPath + L".1");
+	}
+
+	if (!OpenFile())
+		std::cerr << "Failed to create the log file." << std::endl;
+}
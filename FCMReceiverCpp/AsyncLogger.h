@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "BoundedQueue.h"
+
+constexpr size_t kLogQueueDefaultCapacity = 65536;
+constexpr uint64_t kLogDefaultMaxFileSize = 10 * 1024 * 1024;
+constexpr uint32_t kLogDefaultMaxFiles = 5;
+constexpr uint32_t kLogFlushIntervalMs = 50;
+constexpr size_t kLogMaxBatchSize = 256 * 1024;
+
+/**
+ * Writes log lines to a file, and optionally the console, on a background thread.
+ *
+ * Log() only stamps the line and pushes it to a bounded lock-free queue, it never waits
+ * for the disk. The writer thread drains the queue in batches, formats the timestamp once
+ * per second and issues one write per batch to a file it keeps open. The file is rotated
+ * to "<path>.1" ... "<path>.<max files>" when it grows past the size limit.
+ *
+ * A line logged while the queue is full is dropped and counted, the writer reports the
+ * count in the log once it catches up.
+ */
+class CAsyncLogger
+{
+public:
+	/**
+	 * @param nQueueCapacity The number of lines that may wait for the writer.
+	 */
+	explicit CAsyncLogger(size_t nQueueCapacity = kLogQueueDefaultCapacity);
+	~CAsyncLogger();
+
+	CAsyncLogger(const CAsyncLogger&) = delete;
+	CAsyncLogger& operator=(const CAsyncLogger&) = delete;
+
+	/**
+	 * Opens the log file and starts the writer thread. Lines logged before are kept in the
+	 * queue and written first.
+	 *
+	 * @param sPath The log file, appended to if it exists.
+	 * @param bConsole Whether lines are also printed to stdout.
+	 * @param nMaxFileSize The file size that triggers a rotation, 0 never rotates.
+	 * @param nMaxFiles The number of rotated files kept.
+	 * @return False if the file cannot be opened, lines then only go to the console.
+	 */
+	bool Start(const std::wstring& sPath, bool bConsole = true,
+		uint64_t nMaxFileSize = kLogDefaultMaxFileSize, uint32_t nMaxFiles = kLogDefaultMaxFiles);
+
+	/**
+	 * Queues a line. Thread safe, never blocks.
+	 *
+	 * @param sMessage The line, without timestamp and line break.
+	 */
+	void Log(const std::string& sMessage);
+
+	/**
+	 * Writes the queued lines, closes the file and joins the writer thread.
+	 */
+	void Stop();
+
+	/**
+	 * @return The number of lines dropped because the queue was full.
+	 */
+	uint64_t DroppedCount() const { return m_nDropped; }
+
+	/**
+	 * @return The number of lines waiting for the writer.
+	 */
+	size_t QueueDepth() const { return m_Queue.Size(); }
+
+private:
+	typedef std::chrono::system_clock Clock;
+
+	typedef struct _LOG_RECORD
+	{
+		Clock::time_point time;
+		std::string sMessage;
+	} LOG_RECORD;
+
+	void WriterThread();
+	void AppendTimestamp(Clock::time_point time, std::string& sBatch);
+	void WriteBatch(const std::string& sBatch);
+
+	bool OpenFile();
+	void CloseFile();
+	void RotateFile();
+
+private:
+	CBoundedQueue<LOG_RECORD> m_Queue;
+	std::thread m_WriterThread;
+
+	std::mutex m_WaitMutex;
+	std::condition_variable m_WaitCondition;
+	std::atomic<bool> m_bStopped;
+
+	std::atomic<uint64_t> m_nDropped;
+	uint64_t m_nReportedDropped;
+
+	// Owned by the writer thread once started
+	std::wstring m_sPath;
+	bool m_bConsole;
+	uint64_t m_nMaxFileSize;
+	uint32_t m_nMaxFiles;
+	uint64_t m_nFileSize;
+#ifdef WINDOWS
+	void* m_hFile;
+#else
+	int m_nFd;
+#endif
+
+	std::time_t m_nCachedSecond;
+	std::string m_sCachedTimestamp;
+};
@@ -0,0 +1,349 @@
+// Entry point of fcm_bench, which benchmarks the receive path or runs a mock MCS server for load tests.
+// Neither links into FCMReceiverCpp.exe.
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ArgumentParser.h"
+#include "Benchmark.h"
+#include "LogUtil.h"
+#include "MockMCSServer.h"
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+enum ExitCode
+{
+	SUCCESS = 0,
+	PARSE_ERROR,
+	ARGUMENT_ERROR,
+	BENCHMARK_OUTPUT_FILE_TYPE_INVALID,
+	CANT_WRITE_BENCHMARK_REPORT,
+	BENCHMARK_INCOMPLETE,
+	MOCK_INPUT_FILE_TYPE_INVALID,
+	CANT_READ_MOCK_INPUT_FILE,
+	MOCK_INPUT_DATA_INVALID
+};
+
+// Replaced for fcm_bench only, so the benchmark counts the allocations of each stage.
+// The array and nothrow forms call these, the aligned forms are not counted.
+void* operator new(std::size_t nSize)
+{
+	CBenchmark::CountAllocation();
+	if (void* pMemory = std::malloc(nSize > 0 ? nSize : 1))
+		return pMemory;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* pMemory) noexcept
+{
+	std::free(pMemory);
+}
+
+void operator delete(void* pMemory, std::size_t) noexcept
+{
+	std::free(pMemory);
+}
+
+std::mutex g_LogMutex;
+
+auto MyLogPrinter = [](const std::string& strLogMsg)
+	{
+		std::lock_guard<std::mutex> lock(g_LogMutex);
+		std::cerr << strLogMsg << std::endl;
+	};
+
+bool LoadJsonFromFile(const std::string& sFilename, json& jsonData)
+{
+	std::ifstream file(sFilename);
+	if (!file.is_open())
+		return false;
+
+	try {
+		file >> jsonData;
+	}
+	catch (json::parse_error& e)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool IsRegisterDataValid(const json& data)
+{
+	return data.contains("acg") && data["acg"].contains("ID") && data["acg"].contains("SecurityToken") &&
+		data.contains("ece") && data["ece"].contains("AuthSecret") && data["ece"].contains("PrivateKey");
+}
+
+int main(int argc, char* argv[])
+{
+	// CArgumentParser takes the wide arguments wmain gets on Windows
+	std::vector<std::wstring> arguments;
+	std::vector<wchar_t*> argumentValues;
+	for (int nIndex = 0; nIndex < argc; ++nIndex)
+		arguments.emplace_back(argv[nIndex], argv[nIndex] + strlen(argv[nIndex]));
+	for (std::wstring& sArgument : arguments)
+		argumentValues.push_back(&sArgument[0]);
+
+	CArgumentParser cArgumentParser(argc, argumentValues.data(), L"fcm_bench", L"v1.0.0", L"FCM receive path benchmark and mock MCS server by UyBH");
+
+	CArgumentOption cBenchmarkOption(ArgumentOptionType::InputOption, { }, { L"benchmark" }, L"Benchmark the receive path stage by stage and end to end against an in-process mock MCS server, then write the report to this json file. Defaults to 'benchmark.json', the benchmark runs unless --mock_server is set.");
+	CArgumentOption cBenchIterationsOption(ArgumentOptionType::InputOption, { }, { L"bench_iterations" }, L"Operations --benchmark times per stage. Defaults to 100000.");
+	CArgumentOption cBenchSessionsOption(ArgumentOptionType::InputOption, { }, { L"bench_sessions" }, L"Sessions of the --benchmark end-to-end stage, 0 skips it. Defaults to 100.");
+	CArgumentOption cBenchDurationOption(ArgumentOptionType::InputOption, { }, { L"bench_duration" }, L"Seconds the --benchmark end-to-end stage is measured for once every session is online. Defaults to 10.");
+	CArgumentOption cBenchPortOption(ArgumentOptionType::InputOption, { }, { L"bench_port" }, L"Loopback port of the --benchmark mock server. Defaults to 15228.");
+	CArgumentOption cThreadsOption(ArgumentOptionType::InputOption, { }, { L"threads" }, L"Number of session and mock server threads. Defaults to one per CPU.");
+	CArgumentOption cDecryptThreadsOption(ArgumentOptionType::InputOption, { }, { L"decrypt_threads" }, L"Number of threads that decrypt messages. Defaults to 0, messages are decrypted on the session threads.");
+	CArgumentOption cMockServerOption(ArgumentOptionType::InputOption, { }, { L"mock_server" }, L"Run a mock MCS server on this port for offline load tests instead of the benchmark. Clients log in with the identities of --mock_input and are pushed encrypted messages.");
+	CArgumentOption cMockInputFileOption(ArgumentOptionType::InputOption, { }, { L"mock_input" }, L"The identities allowed to log in to --mock_server, a json array of 'fcm_register_data.json' objects (a single object is one identity). Defaults to 'fcm_register_data.json'.");
+	CArgumentOption cMockCertFileOption(ArgumentOptionType::InputOption, { }, { L"mock_cert" }, L"The PEM certificate of the mock server. Defaults to 'mock_cert.pem'.");
+	CArgumentOption cMockKeyFileOption(ArgumentOptionType::InputOption, { }, { L"mock_key" }, L"The PEM private key of the mock server. Defaults to 'mock_key.pem'.");
+	CArgumentOption cMockRateOption(ArgumentOptionType::InputOption, { }, { L"mock_rate" }, L"Messages per second the mock server pushes to each client, fractions allowed. Defaults to 1, 0 pushes none with --mock_server.");
+	CArgumentOption cMockBurstOption(ArgumentOptionType::InputOption, { }, { L"mock_burst" }, L"Messages the mock server pushes back to back. Defaults to 1.");
+	CArgumentOption cMockSizeOption(ArgumentOptionType::InputOption, { }, { L"mock_size" }, L"Plaintext size in bytes of the messages, 'min-max' picks sizes uniformly in the range. Defaults to 256-1024.");
+	CArgumentOption cMockCountOption(ArgumentOptionType::InputOption, { }, { L"mock_count" }, L"Messages --mock_server pushes to each client before it stops. Defaults to 0, no limit.");
+	CArgumentOption cLogLevelOption(ArgumentOptionType::InputOption, { }, { L"log_level" }, L"Lowest level logged: debug, info, warning, error, fatal or off. Defaults to warning.");
+	CArgumentOption helpOption(ArgumentOptionType::HelpOption, { 'h' }, { L"help" }, L"Prints out this message.");
+
+	cArgumentParser.AddArgumentOption({
+		&cBenchmarkOption,
+		&cBenchIterationsOption,
+		&cBenchSessionsOption,
+		&cBenchDurationOption,
+		&cBenchPortOption,
+		&cThreadsOption,
+		&cDecryptThreadsOption,
+		&cMockServerOption,
+		&cMockInputFileOption,
+		&cMockCertFileOption,
+		&cMockKeyFileOption,
+		&cMockRateOption,
+		&cMockBurstOption,
+		&cMockSizeOption,
+		&cMockCountOption,
+		&cLogLevelOption,
+		&helpOption
+		});
+
+	ParseResult parseResult = cArgumentParser.Parse();
+	if (parseResult != ParseResult::ParseSuccessful)
+	{
+		std::wcout << cArgumentParser.ErrorText();
+		return ExitCode::PARSE_ERROR;
+	}
+
+	if (helpOption.WasSet())
+	{
+		std::wcout << cArgumentParser.HelpText();
+		return ExitCode::SUCCESS;
+	}
+
+	// Per message info logs would be measured along with the receive path
+	LogLevel eLogLevel = LOG_LEVEL_WARNING;
+	if (cLogLevelOption.WasSet())
+	{
+		std::wstring sLogLevel = cLogLevelOption.GetValue();
+		if (!LogUtil::ParseLevel(std::string(sLogLevel.begin(), sLogLevel.end()), eLogLevel))
+		{
+			std::cerr << "Log level must be one of debug, info, warning, error, fatal or off." << std::endl;
+			return ExitCode::ARGUMENT_ERROR;
+		}
+	}
+	LogUtil::SetLevel(eLogLevel);
+
+	if (cMockServerOption.WasSet())
+	{
+		std::wstring sMockInputFile = cMockInputFileOption.WasSet() ? cMockInputFileOption.GetValue() : L"fcm_register_data.json";
+		std::string sMockInputFilePath(sMockInputFile.begin(), sMockInputFile.end());
+		if (sMockInputFilePath.size() < 5 || sMockInputFilePath.substr(sMockInputFilePath.size() - 5) != ".json")
+		{
+			std::cerr << "Mock server input file must be a json file." << std::endl;
+			return ExitCode::MOCK_INPUT_FILE_TYPE_INVALID;
+		}
+
+		json identities;
+		if (!LoadJsonFromFile(sMockInputFilePath, identities))
+		{
+			std::cerr << "Unable to read from file: " << sMockInputFilePath << std::endl;
+			return ExitCode::CANT_READ_MOCK_INPUT_FILE;
+		}
+
+		if (!identities.is_array())
+			identities = json::array({ identities });
+
+		MOCK_MCS_CONFIG config;
+		std::wstring sMockPort = cMockServerOption.GetValue();
+		std::wstring sMockCertFile = cMockCertFileOption.WasSet() ? cMockCertFileOption.GetValue() : L"mock_cert.pem";
+		std::wstring sMockKeyFile = cMockKeyFileOption.WasSet() ? cMockKeyFileOption.GetValue() : L"mock_key.pem";
+		config.sPort = std::string(sMockPort.begin(), sMockPort.end());
+		config.sCertFile = std::string(sMockCertFile.begin(), sMockCertFile.end());
+		config.sKeyFile = std::string(sMockKeyFile.begin(), sMockKeyFile.end());
+
+		try {
+			if (std::stoul(config.sPort) == 0)
+				throw std::invalid_argument("port");
+			if (cThreadsOption.WasSet())
+				config.nThreadCount = std::stoul(cThreadsOption.GetValue());
+			if (cMockRateOption.WasSet())
+				config.dRatePerSecond = std::stod(cMockRateOption.GetValue());
+			if (cMockBurstOption.WasSet())
+				config.nBurst = std::stoul(cMockBurstOption.GetValue());
+			if (cMockCountOption.WasSet())
+				config.nMessagesPerClient = std::stoull(cMockCountOption.GetValue());
+			if (cMockSizeOption.WasSet())
+			{
+				std::wstring sMockSize = cMockSizeOption.GetValue();
+				size_t nDash = sMockSize.find(L'-');
+				config.nMinPayload = std::stoul(sMockSize.substr(0, nDash));
+				config.nMaxPayload = nDash == std::wstring::npos ? config.nMinPayload : std::stoul(sMockSize.substr(nDash + 1));
+			}
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << "Mock server port, rate, burst, size, count and threads must be numbers." << std::endl;
+			return ExitCode::ARGUMENT_ERROR;
+		}
+
+		if (config.dRatePerSecond < 0 || config.nBurst == 0 || config.nMinPayload == 0 || config.nMinPayload > config.nMaxPayload)
+		{
+			std::cerr << "Mock server rate must not be negative, burst must be greater than 0 and size must be a non-empty range." << std::endl;
+			return ExitCode::ARGUMENT_ERROR;
+		}
+
+		CMockMCSServer cMockServer(MyLogPrinter, config);
+		for (const json& registerData : identities)
+		{
+			if (!IsRegisterDataValid(registerData))
+			{
+				std::cerr << "Mock server input register data is invalid." << std::endl;
+				return ExitCode::MOCK_INPUT_DATA_INVALID;
+			}
+
+			try {
+				cMockServer.AddIdentity(registerData["acg"]["ID"], registerData["acg"]["SecurityToken"],
+					registerData["ece"]["PrivateKey"], registerData["ece"]["AuthSecret"]);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Mock server input register data is invalid: " << e.what() << std::endl;
+				return ExitCode::MOCK_INPUT_DATA_INVALID;
+			}
+		}
+
+		cMockServer.Start();
+		std::cout << "Mock MCS server listening on port " << config.sPort << " for " << cMockServer.IdentityCount() << " identities." << std::endl;
+
+		MOCK_MCS_METRICS last = cMockServer.GetMetrics();
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(10));
+
+			MOCK_MCS_METRICS metrics = cMockServer.GetMetrics();
+			MyLogPrinter("[MAIN][INFO] Mock server clients " + std::to_string(metrics.nActive) +
+				", accepted " + std::to_string(metrics.nAccepted) +
+				", logged in " + std::to_string(metrics.nLoggedIn) +
+				", rejected " + std::to_string(metrics.nLoginRejected) +
+				", messages " + std::to_string(metrics.nMessagesSent) + " (" + std::to_string((metrics.nMessagesSent - last.nMessagesSent) / 10) + "/s)" +
+				", bytes " + std::to_string(metrics.nBytesSent) + " (" + std::to_string((metrics.nBytesSent - last.nBytesSent) / 10) + "/s)" +
+				", acked ids " + std::to_string(metrics.nAckedIds) +
+				" in " + std::to_string(metrics.nSelectiveAcks) + " selective acks" +
+				", stream acks " + std::to_string(metrics.nStreamAcks) +
+				", heartbeats " + std::to_string(metrics.nHeartbeats) +
+				", bursts skipped " + std::to_string(metrics.nBurstsSkipped));
+			last = metrics;
+		}
+	}
+
+	std::wstring sOutputFileName = cBenchmarkOption.WasSet() ? cBenchmarkOption.GetValue() : L"benchmark.json";
+	if (sOutputFileName.size() < 5 || sOutputFileName.substr(sOutputFileName.size() - 5) != L".json")
+	{
+		std::cerr << "Benchmark output file must be a json file." << std::endl;
+		return ExitCode::BENCHMARK_OUTPUT_FILE_TYPE_INVALID;
+	}
+
+	BENCHMARK_CONFIG config;
+	std::wstring sMockCertFile = cMockCertFileOption.WasSet() ? cMockCertFileOption.GetValue() : L"mock_cert.pem";
+	std::wstring sMockKeyFile = cMockKeyFileOption.WasSet() ? cMockKeyFileOption.GetValue() : L"mock_key.pem";
+	config.server.sPort = kBenchmarkDefaultPort;
+	config.server.sCertFile = std::string(sMockCertFile.begin(), sMockCertFile.end());
+	config.server.sKeyFile = std::string(sMockKeyFile.begin(), sMockKeyFile.end());
+
+	try {
+		if (cBenchIterationsOption.WasSet())
+			config.nIterations = std::stoul(cBenchIterationsOption.GetValue());
+		if (cBenchSessionsOption.WasSet())
+			config.nSessions = std::stoul(cBenchSessionsOption.GetValue());
+		if (cBenchDurationOption.WasSet())
+			config.nDurationSec = std::stoul(cBenchDurationOption.GetValue());
+		if (cBenchPortOption.WasSet())
+		{
+			std::wstring sPort = cBenchPortOption.GetValue();
+			if (std::stoul(sPort) == 0)
+				throw std::invalid_argument("port");
+			config.server.sPort = std::string(sPort.begin(), sPort.end());
+		}
+		if (cThreadsOption.WasSet())
+			config.nThreadCount = config.server.nThreadCount = std::stoul(cThreadsOption.GetValue());
+		if (cDecryptThreadsOption.WasSet())
+			config.nDecryptThreadCount = std::stoul(cDecryptThreadsOption.GetValue());
+		if (cMockRateOption.WasSet())
+			config.server.dRatePerSecond = std::stod(cMockRateOption.GetValue());
+		if (cMockBurstOption.WasSet())
+			config.server.nBurst = std::stoul(cMockBurstOption.GetValue());
+		if (cMockSizeOption.WasSet())
+		{
+			std::wstring sMockSize = cMockSizeOption.GetValue();
+			size_t nDash = sMockSize.find(L'-');
+			config.server.nMinPayload = std::stoul(sMockSize.substr(0, nDash));
+			config.server.nMaxPayload = nDash == std::wstring::npos ? config.server.nMinPayload : std::stoul(sMockSize.substr(nDash + 1));
+			config.nPayloadSize = (config.server.nMinPayload + config.server.nMaxPayload) / 2;
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Benchmark iterations, sessions, duration, port, rate, burst, size and threads must be numbers." << std::endl;
+		return ExitCode::ARGUMENT_ERROR;
+	}
+
+	if (config.nIterations == 0 || config.server.dRatePerSecond <= 0 || config.server.nBurst == 0 ||
+		config.server.nMinPayload == 0 || config.server.nMinPayload > config.server.nMaxPayload)
+	{
+		std::cerr << "Benchmark iterations, rate and burst must be greater than 0 and size must be a non-empty range." << std::endl;
+		return ExitCode::ARGUMENT_ERROR;
+	}
+
+	CBenchmark cBenchmark(MyLogPrinter, config);
+	std::vector<BENCHMARK_RESULT> results = cBenchmark.Run(config.nSessions > 0);
+
+	bool bCompleted = !results.empty();
+	for (const BENCHMARK_RESULT& result : results)
+	{
+		bCompleted = bCompleted && result.bCompleted;
+		std::cout << CBenchmark::FormatSummary(result) << std::endl;
+	}
+
+	std::string sOutputFile(sOutputFileName.begin(), sOutputFileName.end());
+	std::ofstream file(sOutputFile);
+	if (file.is_open())
+	{
+		file << CBenchmark::FormatReport(config, results);
+		file.close();
+	}
+	if (file.fail())
+	{
+		std::cerr << "Unable to write to file: " << sOutputFile << std::endl;
+		return ExitCode::CANT_WRITE_BENCHMARK_REPORT;
+	}
+
+	std::cout << "Benchmark report has been saved to " << sOutputFile << std::endl;
+
+	return bCompleted ? ExitCode::SUCCESS : ExitCode::BENCHMARK_INCOMPLETE;
+}
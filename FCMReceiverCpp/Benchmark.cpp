@@ -0,0 +1,1271 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#ifdef WINDOWS
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "mcs.pb.h"
+#include "Base64.h"
+#include "EceHeaderParser.h"
+#include "Emitter.h"
+#include "FastBase64.h"
+#include "LibCurlWrapper.h"
+#include "LatencyHistogram.h"
+#include "MCSFrameDecoder.h"
+#include "MCSWireParser.h"
+#include "StringUtil.h"
+#include "UtilFunction.h"
+#include "Http_ece/ece.h"
+#include "SecureSocket/TCPSSLClient.h"
+#include "SecureSocket/TCPSSLServer.h"
+
+#include <openssl/crypto.h>
+
+#include "json.hpp"
+using json = nlohmann::json;
+
+namespace
+{
+	// Stages faster than this many clock reads are timed in batches
+	constexpr size_t kFastStageBatch = 16;
+	// The chunk sizes frame_decode_chunked writes the stream in, log-uniform so small ones are common
+	constexpr size_t kChunkedDecodeMaxChunk = 8192;
+	constexpr size_t kChunkedDecodeChunks = 4096;
+	constexpr uint32_t kChunkedDecodeSeed = 5228;
+	constexpr size_t kLocalServerAcceptPollMs = 100;
+	constexpr unsigned int kLocalServerIdleTimeoutMs = 1000; // a keep-alive connection left idle this long is closed
+	constexpr uint64_t kAckCheckBurst = 25; // data messages of the acks stage, not a multiple of kMCSSelectiveAckMaxIds
+	constexpr uint32_t kAckCheckPingIntervalMs = 20; // of the HeartbeatPings, and then the IqStanzas, of the acks stage
+	constexpr uint32_t kAckCheckPingSec = 2;
+
+	// Heap allocations made by each thread, counted by CountAllocation() and OpenSSL's allocation functions
+	thread_local uint64_t t_nAllocations = 0;
+
+	void* CountingCryptoMalloc(size_t nSize, const char*, int)
+	{
+		++t_nAllocations;
+		return std::malloc(nSize);
+	}
+
+	void* CountingCryptoRealloc(void* pMemory, size_t nSize, const char*, int)
+	{
+		++t_nAllocations;
+		return std::realloc(pMemory, nSize);
+	}
+
+	void CountingCryptoFree(void* pMemory, const char*, int)
+	{
+		std::free(pMemory);
+	}
+
+	int64_t NowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// Resident memory and CPU time, user and kernel, of the whole process
+	bool GetProcessUsage(uint64_t& nResidentBytes, double& dCpuSec)
+	{
+#ifdef WINDOWS
+		PROCESS_MEMORY_COUNTERS counters;
+		FILETIME creationTime, exitTime, kernelTime, userTime;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ||
+			!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+			return false;
+
+		auto seconds = [](const FILETIME& time) {
+			return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+		};
+		nResidentBytes = counters.WorkingSetSize;
+		dCpuSec = seconds(kernelTime) + seconds(userTime);
+		return true;
+#else
+		uint64_t nTotalPages = 0;
+		uint64_t nResidentPages = 0;
+		FILE* pStatm = fopen("/proc/self/statm", "r");
+		if (pStatm == nullptr)
+			return false;
+		int nFields = fscanf(pStatm, "%llu %llu", reinterpret_cast<unsigned long long*>(&nTotalPages),
+			reinterpret_cast<unsigned long long*>(&nResidentPages));
+		fclose(pStatm);
+
+		struct rusage usage;
+		if (nFields != 2 || getrusage(RUSAGE_SELF, &usage) != 0)
+			return false;
+
+		nResidentBytes = nResidentPages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+		dCpuSec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+		return true;
+#endif
+	}
+
+	// ece_base64url_decode before FastBase64, one table lookup per character and one quantum at a time,
+	// for unpadded input
+	bool BaselineBase64UrlDecode(const char* szBase64, size_t nBase64Len, uint8_t* pBinary, size_t nBinaryLen, size_t& nDecodedLen)
+	{
+		// Per RFC 4648, Table 2, invalid characters map to 64
+		static const uint8_t decodeTable[] = {
+			64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+			64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+			64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 52, 53, 54, 55, 56, 57, 58, 59, 60,
+			61, 64, 64, 64, 64, 64, 64, 64, 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10,
+			11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64,
+			63, 64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
+			43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64,
+		};
+
+		// A 4-character quantum decodes to 3 bytes, a 3-character one to 2 and a 2-character one to 1
+		auto decodeQuantum = [](const char* szQuantum, size_t nLen, uint8_t* pOut) {
+			uint32_t nQuantum = 0;
+			for (size_t i = 0; i < nLen; ++i)
+			{
+				uint8_t nValue = (szQuantum[i] & ~0x7f) ? 64 : decodeTable[szQuantum[i] & 0x7f];
+				if (nValue == 64)
+					return false;
+				nQuantum = (nQuantum << 6) | nValue;
+			}
+
+			switch (nLen)
+			{
+			case 0:
+				return true;
+			case 2:
+				pOut[0] = (nQuantum >> 4) & 0xff;
+				return true;
+			case 3:
+				pOut[0] = (nQuantum >> 10) & 0xff;
+				pOut[1] = (nQuantum >> 2) & 0xff;
+				return true;
+			case 4:
+				pOut[0] = (nQuantum >> 16) & 0xff;
+				pOut[1] = (nQuantum >> 8) & 0xff;
+				pOut[2] = nQuantum & 0xff;
+				return true;
+			}
+			return false;
+		};
+
+		nDecodedLen = (nBase64Len / 4) * 3 + (nBase64Len % 4 == 3 ? 2 : nBase64Len % 4 == 2 ? 1 : 0);
+		if (nBase64Len == 0 || nBase64Len % 4 == 1 || nBinaryLen < nDecodedLen)
+			return false;
+
+		for (; nBase64Len >= 4; nBase64Len -= 4)
+		{
+			if (!decodeQuantum(szBase64, 4, pBinary))
+				return false;
+			szBase64 += 4;
+			pBinary += 3;
+		}
+		return decodeQuantum(szBase64, nBase64Len, pBinary);
+	}
+
+	// Exposes the session cache, so the full handshake stage can connect without a session
+	class CBenchmarkSSLClient : public CTCPSSLClient
+	{
+	public:
+		using CTCPSSLClient::CTCPSSLClient;
+		using ASecureSocket::ForgetSession;
+	};
+
+	/**
+	 * A CTCPSSLServer on the loopback interface, serving one connection at a time on a thread of its own.
+	 */
+	class CLocalTLSServer
+	{
+	public:
+		typedef std::function<void(CTCPSSLServer&, ASecureSocket::SSLSocket&)> ServeFn;
+
+		CLocalTLSServer(const LogFnCallback oLogger, const MOCK_MCS_CONFIG& config, ServeFn serve) :
+			// Quiet, a failed request fails the stage instead
+			m_Server(oLogger, config.sPort, ASecureSocket::OpenSSLProtocol::TLS, ASocket::NO_FLAGS),
+			m_bStopping(false)
+		{
+#ifndef WINDOWS
+			// The server writes the session tickets even to a client that already closed
+			signal(SIGPIPE, SIG_IGN);
+#endif
+			m_Server.SetSSLCertFile(config.sCertFile);
+			m_Server.SetSSLKeyFile(config.sKeyFile);
+
+			// Listening before the first connect, the call itself times out, 0 would block
+			ASecureSocket::SSLSocket clientSocket;
+			m_Server.Listen(clientSocket, 1);
+
+			m_Thread = std::thread([this, serve]() {
+				while (!m_bStopping)
+				{
+					ASecureSocket::SSLSocket clientSocket;
+					if (!m_Server.Listen(clientSocket, kLocalServerAcceptPollMs))
+						continue;
+
+					// Or a small write waits for the ack of the previous one
+					int iNoDelay = 1;
+					setsockopt(clientSocket.m_SockFd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&iNoDelay), sizeof(iNoDelay));
+					m_Server.SetRcvTimeout(clientSocket, kLocalServerIdleTimeoutMs);
+
+					serve(m_Server, clientSocket);
+					m_Server.Disconnect(clientSocket);
+				}
+			});
+		}
+
+		/**
+		 * Waits for the connection being served, at most kLocalServerIdleTimeoutMs after the client's last request.
+		 */
+		~CLocalTLSServer()
+		{
+			m_bStopping = true;
+			m_Thread.join();
+		}
+
+		CLocalTLSServer(const CLocalTLSServer&) = delete;
+		CLocalTLSServer& operator=(const CLocalTLSServer&) = delete;
+
+	private:
+		CTCPSSLServer m_Server;
+		std::atomic<bool> m_bStopping;
+		std::thread m_Thread;
+	};
+
+	// Answers every HTTP/1.1 request of the connection with "ok", until the client closes it or leaves it idle
+	void ServeHttp(CTCPSSLServer& cServer, ASecureSocket::SSLSocket& clientSocket)
+	{
+		static const std::string sResponse = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok";
+		std::string sRequests;
+		char buffer[4096];
+		for (;;)
+		{
+			size_t nHeaderEnd = sRequests.find("\r\n\r\n");
+			if (nHeaderEnd != std::string::npos)
+			{
+				size_t nField = sRequests.find("\r\nContent-Length:");
+				size_t nContentLength = nField < nHeaderEnd ? std::strtoul(sRequests.c_str() + nField + 17, nullptr, 10) : 0;
+				size_t nRequestSize = nHeaderEnd + 4 + nContentLength;
+				if (sRequests.size() >= nRequestSize)
+				{
+					sRequests.erase(0, nRequestSize);
+					if (!cServer.Send(clientSocket, sResponse))
+						return;
+					continue;
+				}
+			}
+
+			int nReceived = cServer.Receive(clientSocket, buffer, sizeof(buffer), false);
+			if (nReceived <= 0)
+				return;
+			sRequests.append(buffer, nReceived);
+		}
+	}
+
+	size_t AppendResponse(void* pContents, size_t nSize, size_t nCount, std::string* pResponse)
+	{
+		pResponse->append(static_cast<char*>(pContents), nSize * nCount);
+		return nSize * nCount;
+	}
+
+	// CLibCurlWrapper before the handle pool: a handle, so a connection and a full TLS handshake, per request
+	bool PostWithFreshHandle(const std::string& sUrl, const std::string& sCAFile, curl_slist* pHeaders,
+		const std::string& sBody, std::string& sResponse)
+	{
+		CURL* pCurl = curl_easy_init();
+		if (pCurl == nullptr)
+			return false;
+
+		curl_easy_setopt(pCurl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(pCurl, CURLOPT_CAINFO, sCAFile.c_str());
+		curl_easy_setopt(pCurl, CURLOPT_HTTPHEADER, pHeaders);
+		curl_easy_setopt(pCurl, CURLOPT_URL, sUrl.c_str());
+		curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION, AppendResponse);
+		curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &sResponse);
+		curl_easy_setopt(pCurl, CURLOPT_POST, 1L);
+		curl_easy_setopt(pCurl, CURLOPT_POSTFIELDS, sBody.c_str());
+		curl_easy_setopt(pCurl, CURLOPT_POSTFIELDSIZE, static_cast<long>(sBody.size()));
+
+		CURLcode eResult = curl_easy_perform(pCurl);
+		curl_easy_cleanup(pCurl);
+		return eResult == CURLE_OK;
+	}
+
+	// The mock server writes "0:<unix time in us>%<android id>-<sequence>"
+	int64_t SentUsFromPersistentId(const std::string& sPersistentId)
+	{
+		size_t nColon = sPersistentId.find(':');
+		if (nColon == std::string::npos)
+			return 0;
+		return std::strtoll(sPersistentId.c_str() + nColon + 1, nullptr, 10);
+	}
+}
+
+CBenchmark::CBenchmark(const LogFnCallback oLogger, const BENCHMARK_CONFIG& config) :
+	m_oLogger(oLogger),
+	m_Config(config),
+	m_nSink(0)
+{
+	// Only possible before OpenSSL's first allocation
+	if (!CRYPTO_set_mem_functions(CountingCryptoMalloc, CountingCryptoRealloc, CountingCryptoFree))
+		FCM_LOG_WARNING(m_oLogger, "[CBenchmark][WARNING] OpenSSL is already in use, its allocations are not counted");
+}
+
+void CBenchmark::CountAllocation()
+{
+	++t_nAllocations;
+}
+
+std::vector<BENCHMARK_RESULT> CBenchmark::Run(bool bEndToEnd)
+{
+	std::vector<BENCHMARK_RESULT> results;
+	if (!PrepareMessages())
+	{
+		BENCHMARK_RESULT result = {};
+		result.sStage = "prepare";
+		result.sError = "Cannot encrypt the benchmark messages";
+		results.push_back(result);
+		return results;
+	}
+
+	{
+		CMCSFrameDecoder cDecoder;
+		uint8_t nVersion = kMCSVersion;
+		cDecoder.Feed(&nVersion, 1);
+		results.push_back(Measure("frame_decode", kFastStageBatch, [this, &cDecoder](size_t nIndex) -> size_t {
+			const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+			cDecoder.Feed(message.frame.data(), message.frame.size());
+
+			MCS_FRAME frame;
+			return cDecoder.Next(frame) ? frame.nSize : 0;
+		}));
+	}
+
+	results.push_back(RunChunkedDecode());
+
+	results.push_back(Measure("parse_wire", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+
+		DATA_MESSAGE_STANZA_VIEW stanza;
+		if (!MCSWireParser::ParseDataMessageStanza(message.frame.data() + message.nHeaderSize,
+			message.frame.size() - message.nHeaderSize, stanza))
+			return 0;
+		return stanza.sRawData.size() + stanza.sEncryption.size() + stanza.sCryptoKey.size();
+	}));
+
+	{
+		mcs_proto::DataMessageStanza cStanza;
+		results.push_back(Measure("parse_generated", kFastStageBatch, [this, &cStanza](size_t nIndex) -> size_t {
+			const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+			if (!cStanza.ParseFromArray(message.frame.data() + message.nHeaderSize,
+				static_cast<int>(message.frame.size() - message.nHeaderSize)))
+				return 0;
+			return cStanza.raw_data().size();
+		}));
+	}
+
+	results.push_back(Measure("base64_decode", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		return base64_decode(message.sBase64Salt, true).size() + base64_decode(message.sBase64SenderPubKey, true).size();
+	}));
+
+	results.push_back(Measure("ece_base64url_decode_baseline", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		size_t nSaltLen = 0;
+		size_t nSenderPubKeyLen = 0;
+		BaselineBase64UrlDecode(message.sBase64Salt.data(), message.sBase64Salt.size(), salt, sizeof(salt), nSaltLen);
+		BaselineBase64UrlDecode(message.sBase64SenderPubKey.data(), message.sBase64SenderPubKey.size(),
+			rawSenderPubKey, sizeof(rawSenderPubKey), nSenderPubKeyLen);
+		return nSaltLen + nSenderPubKeyLen + salt[0] + rawSenderPubKey[0];
+	}));
+
+	results.push_back(Measure("ece_base64url_decode", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		return ece_base64url_decode(message.sBase64Salt.data(), message.sBase64Salt.size(), ECE_BASE64URL_REJECT_PADDING, salt, sizeof(salt)) +
+			ece_base64url_decode(message.sBase64SenderPubKey.data(), message.sBase64SenderPubKey.size(), ECE_BASE64URL_REJECT_PADDING,
+				rawSenderPubKey, sizeof(rawSenderPubKey)) + salt[0] + rawSenderPubKey[0];
+	}));
+
+	// Every implementation the CPU supports, the client uses the last one
+	for (int nImplementation = 0; nImplementation <= static_cast<int>(FastBase64::Best()); ++nImplementation)
+	{
+		FastBase64::Implementation eImplementation = static_cast<FastBase64::Implementation>(nImplementation);
+		std::string sStage = std::string("fast_base64_decode_") + FastBase64::Name(eImplementation);
+		results.push_back(Measure(sStage.c_str(), kFastStageBatch, [this, eImplementation](size_t nIndex) -> size_t {
+			const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+			uint8_t salt[ECE_SALT_LENGTH];
+			uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+			size_t nSaltLen = 0;
+			size_t nSenderPubKeyLen = 0;
+			FastBase64::Decode(message.sBase64Salt, salt, sizeof(salt), nSaltLen, FastBase64::Alphabet::Either, eImplementation);
+			FastBase64::Decode(message.sBase64SenderPubKey, rawSenderPubKey, sizeof(rawSenderPubKey), nSenderPubKeyLen,
+				FastBase64::Alphabet::Either, eImplementation);
+			return nSaltLen + nSenderPubKeyLen + salt[0] + rawSenderPubKey[0];
+		}));
+	}
+
+	results.push_back(Measure("ece_headers_extract_params", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		uint32_t nRecordSize = 0;
+		int nErrorCode = ece_webpush_aesgcm_headers_extract_params(message.sCryptoKey.c_str(), message.sEncryption.c_str(),
+			salt, sizeof(salt), rawSenderPubKey, sizeof(rawSenderPubKey), &nRecordSize);
+		return nErrorCode == ECE_OK ? nRecordSize + salt[0] + rawSenderPubKey[0] : 0;
+	}));
+
+	results.push_back(Measure("header_parse", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		uint32_t nRecordSize = 0;
+		int nErrorCode = EceHeaderParser::ExtractAesgcmParams(message.sCryptoKey, message.sEncryption, salt, rawSenderPubKey, nRecordSize);
+		return nErrorCode == ECE_OK ? nRecordSize + salt[0] + rawSenderPubKey[0] : 0;
+	}));
+
+	results.push_back(Measure("base64_encode", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		return base64_encode(message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, true).size();
+	}));
+
+	results.push_back(Measure("fast_base64_encode", kFastStageBatch, [this](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		char szEncoded[FastBase64::EncodedLength(ECE_WEBPUSH_PUBLIC_KEY_LENGTH, true)];
+		return FastBase64::Encode(message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, szEncoded, sizeof(szEncoded), true, true) + szEncoded[0];
+	}));
+
+	std::vector<uint8_t> plaintext(m_Config.nPayloadSize + RS_LENGTH);
+	results.push_back(Measure("decrypt", 1, [this, &plaintext](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		size_t nPlaintextLen = plaintext.size();
+		int nErrorCode = ece_webpush_aesgcm_decrypt(
+			reinterpret_cast<const uint8_t*>(m_sPrivateKey.data()), m_sPrivateKey.size(),
+			reinterpret_cast<const uint8_t*>(m_sAuthSecret.data()), m_sAuthSecret.size(),
+			message.salt, ECE_SALT_LENGTH, message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, RS_LENGTH,
+			reinterpret_cast<const uint8_t*>(message.sCiphertext.data()), message.sCiphertext.size(),
+			plaintext.data(), &nPlaintextLen);
+		return nErrorCode == ECE_OK ? nPlaintextLen : 0;
+	}));
+
+	{
+		std::unique_ptr<ece_webpush_decrypt_ctx_t, void (*)(ece_webpush_decrypt_ctx_t*)> ctx(ece_webpush_decrypt_ctx_new(
+			reinterpret_cast<const uint8_t*>(m_sPrivateKey.data()), m_sPrivateKey.size(),
+			reinterpret_cast<const uint8_t*>(m_sAuthSecret.data()), m_sAuthSecret.size()),
+			&ece_webpush_decrypt_ctx_free);
+		results.push_back(Measure("decrypt_ctx", 1, [this, &ctx, &plaintext](size_t nIndex) -> size_t {
+			const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+			size_t nPlaintextLen = plaintext.size();
+			int nErrorCode = ece_webpush_aesgcm_decrypt_with_ctx(ctx.get(),
+				message.salt, ECE_SALT_LENGTH, message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, RS_LENGTH,
+				reinterpret_cast<const uint8_t*>(message.sCiphertext.data()), message.sCiphertext.size(),
+				plaintext.data(), &nPlaintextLen);
+			return nErrorCode == ECE_OK ? nPlaintextLen : 0;
+		}));
+	}
+
+	{
+		CEmitter cEmitter;
+		size_t nReceived = 0;
+		cEmitter.On("message", [&nReceived](const std::string& sMessage) { nReceived += sMessage.size(); });
+		results.push_back(Measure("emit", kFastStageBatch, [this, &cEmitter, &nReceived](size_t nIndex) -> size_t {
+			cEmitter.Emit("message", m_Messages[nIndex % m_Messages.size()].sPlaintext);
+			return nReceived;
+		}));
+	}
+
+	{
+		// What every stage sample costs the client: a clock read and the record
+		CLatencyHistogram cHistogram;
+		CLatencyHistogram::Clock::time_point start = CLatencyHistogram::Clock::now();
+		results.push_back(Measure("histogram_record", kFastStageBatch, [&cHistogram, start](size_t nIndex) -> size_t {
+			cHistogram.RecordSince(start);
+			return nIndex;
+		}));
+	}
+
+	results.push_back(RunClientReceive());
+	RunLogging(results);
+
+	if (bEndToEnd)
+	{
+		RunHandshakes(results);
+		RunHttpRequests(results);
+		results.push_back(RunAckCheck());
+
+		// Before the end-to-end stage leaves its freed memory to the allocator
+		results.push_back(RunIdleSessions());
+		results.push_back(RunEndToEnd());
+	}
+
+	return results;
+}
+
+std::string CBenchmark::FormatReport(const BENCHMARK_CONFIG& config, const std::vector<BENCHMARK_RESULT>& results)
+{
+	json stages = json::array();
+	for (const BENCHMARK_RESULT& result : results)
+	{
+		stages.push_back(json{ {"stage", result.sStage},
+								{"completed", result.bCompleted},
+								{"error", result.sError},
+								{"operations", result.nOperations},
+								{"elapsed_sec", result.dElapsedSec},
+								{"ops_per_sec", result.dOpsPerSec},
+								{"p50_ns", result.dP50Ns},
+								{"p99_ns", result.dP99Ns},
+								{"p999_ns", result.dP999Ns},
+								{"max_ns", result.dMaxNs},
+								{"allocations_per_op", result.dAllocationsPerOp},
+								{"bytes_per_session", result.dBytesPerSession},
+								{"cpu_us_per_session_sec", result.dCpuUsPerSessionSec},
+								{"detail", result.sDetail} });
+	}
+
+	json j = json{ {"timestamp", static_cast<int64_t>(std::time(nullptr))},
+					{"config", {{"iterations", config.nIterations},
+								{"payload_size", config.nPayloadSize},
+								{"sessions", config.nSessions},
+								{"threads", config.nThreadCount},
+								{"decrypt_threads", config.nDecryptThreadCount},
+								{"duration_sec", config.nDurationSec},
+								{"mock_rate", config.server.dRatePerSecond},
+								{"mock_burst", config.server.nBurst},
+								{"mock_min_payload", config.server.nMinPayload},
+								{"mock_max_payload", config.server.nMaxPayload}}},
+					{"stages", stages} };
+
+	return j.dump(4);
+}
+
+bool CBenchmark::PrepareMessages()
+{
+	ECDH_KEYS keys;
+	if (UtilFunction::GenerateECDHKeys(keys) != ECE_OK)
+		return false;
+
+	m_Keys = keys;
+	m_sPrivateKey = base64_decode(keys.sBase64PrivateKey, true);
+	m_sAuthSecret = base64_decode(keys.sBase64AuthSecret, true);
+	std::string sPublicKey = base64_decode(keys.sBase64PublicKey, true);
+	// Any P-256 public key stands in for the sender's VAPID key
+	std::string sBase64VapidKey = keys.sBase64PublicKey;
+	StringUtil::replace_all(sBase64VapidKey, "=", "");
+
+	std::string sPlaintext(m_Config.nPayloadSize, ' ');
+	for (size_t i = 0; i < sPlaintext.size(); ++i)
+		sPlaintext[i] = static_cast<char>('a' + i % 26);
+
+	m_Messages.resize(kBenchmarkMessageVariants);
+	for (size_t nIndex = 0; nIndex < m_Messages.size(); ++nIndex)
+	{
+		MESSAGE& message = m_Messages[nIndex];
+		message.sPlaintext = sPlaintext;
+
+		std::string sCiphertext(ece_aesgcm_ciphertext_max_length(RS_LENGTH, 0, sPlaintext.size()), '\0');
+		size_t nCiphertextLen = sCiphertext.size();
+		int nErrorCode = ece_webpush_aesgcm_encrypt(
+			reinterpret_cast<const uint8_t*>(sPublicKey.data()), sPublicKey.size(),
+			reinterpret_cast<const uint8_t*>(m_sAuthSecret.data()), m_sAuthSecret.size(), RS_LENGTH, 0,
+			reinterpret_cast<const uint8_t*>(sPlaintext.data()), sPlaintext.size(),
+			message.salt, ECE_SALT_LENGTH, message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+			reinterpret_cast<uint8_t*>(&sCiphertext[0]), &nCiphertextLen);
+		if (nErrorCode != ECE_OK)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CBenchmark][ERROR] PrepareMessages: Encrypt failed with error code ", nErrorCode);
+			return false;
+		}
+		sCiphertext.resize(nCiphertextLen);
+		message.sCiphertext = sCiphertext;
+
+		message.sBase64Salt = base64_encode(message.salt, ECE_SALT_LENGTH, true);
+		message.sBase64SenderPubKey = base64_encode(message.rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, true);
+		StringUtil::replace_all(message.sBase64Salt, "=", "");
+		StringUtil::replace_all(message.sBase64SenderPubKey, "=", "");
+		// FCM appends the VAPID key of the sender to the crypto-key value
+		message.sCryptoKey = "dh=" + message.sBase64SenderPubKey + ";p256ecdsa=" + sBase64VapidKey;
+		message.sEncryption = "salt=" + message.sBase64Salt;
+
+		mcs_proto::DataMessageStanza cStanza;
+		cStanza.set_from("benchmark");
+		cStanza.set_category("org.chromium.linux");
+		cStanza.set_persistent_id("0:" + std::to_string(NowUs()) + "%benchmark-" + std::to_string(nIndex));
+		cStanza.set_stream_id(static_cast<int32_t>(nIndex + 1));
+		cStanza.set_last_stream_id_received(1);
+		mcs_proto::AppData* pAppData = cStanza.add_app_data();
+		pAppData->set_key("crypto-key");
+		pAppData->set_value(message.sCryptoKey);
+		pAppData = cStanza.add_app_data();
+		pAppData->set_key("encryption");
+		pAppData->set_value(message.sEncryption);
+		cStanza.set_raw_data(sCiphertext);
+
+		std::string sSerialized = cStanza.SerializeAsString();
+		message.frame.push_back(kDataMessageStanzaTag);
+		UtilFunction::_EncodeVarint32(static_cast<uint32_t>(sSerialized.size()), message.frame);
+		message.nHeaderSize = message.frame.size();
+		message.frame.insert(message.frame.end(), sSerialized.begin(), sSerialized.end());
+	}
+
+	return true;
+}
+
+template <typename Operation>
+BENCHMARK_RESULT CBenchmark::Measure(const char* szStage, size_t nBatch, Operation operation, size_t nIterations)
+{
+	BENCHMARK_RESULT result = {};
+	result.sStage = szStage;
+
+	size_t nSamples = (std::max)((nIterations > 0 ? nIterations : m_Config.nIterations) / nBatch, size_t(1));
+	std::vector<double> samples;
+	samples.reserve(nSamples);
+
+	// One pass over the messages warms the caches and the allocator up
+	size_t nSink = 0;
+	size_t nIndex = 0;
+	for (; nIndex < m_Messages.size(); ++nIndex)
+		nSink += operation(nIndex);
+
+	uint64_t nStartAllocations = t_nAllocations;
+	Clock::time_point start = Clock::now();
+	for (size_t nSample = 0; nSample < nSamples; ++nSample)
+	{
+		Clock::time_point batchStart = Clock::now();
+		for (size_t i = 0; i < nBatch; ++i)
+			nSink += operation(nIndex++);
+		samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - batchStart).count() / nBatch);
+	}
+
+	result.dElapsedSec = std::chrono::duration<double>(Clock::now() - start).count();
+	result.nOperations = nSamples * nBatch;
+	// The samples vector was reserved up front, every allocation counted is the operation's
+	result.dAllocationsPerOp = static_cast<double>(t_nAllocations - nStartAllocations) / result.nOperations;
+	result.dOpsPerSec = result.dElapsedSec > 0 ? result.nOperations / result.dElapsedSec : 0;
+	result.bCompleted = true;
+	SetLatencies(result, samples);
+	m_nSink = m_nSink + nSink;
+
+	FCM_LOG_INFO(m_oLogger, "[CBenchmark][INFO] ", szStage, ": ", static_cast<uint64_t>(result.dOpsPerSec),
+		" ops/s, p50 ", result.dP50Ns, " ns, p99 ", result.dP99Ns, " ns, ", result.dAllocationsPerOp, " allocations/op");
+	return result;
+}
+
+BENCHMARK_RESULT CBenchmark::RunChunkedDecode()
+{
+	struct EXPECTED_FRAME
+	{
+		int nTag;
+		size_t nOffset; // of the payload in the stream
+		size_t nSize;
+	};
+
+	// The messages with a HeartbeatPing after each and an empty HeartbeatAck after every fourth,
+	// as a connection would record them after the version byte
+	std::vector<uint8_t> stream;
+	std::vector<EXPECTED_FRAME> expectedFrames;
+	auto AppendFrame = [&stream, &expectedFrames](int nTag, const uint8_t* pPayload, size_t nSize) {
+		stream.push_back(static_cast<uint8_t>(nTag));
+		UtilFunction::_EncodeVarint32(static_cast<uint32_t>(nSize), stream);
+		expectedFrames.push_back({ nTag, stream.size(), nSize });
+		stream.insert(stream.end(), pPayload, pPayload + nSize);
+	};
+
+	mcs_proto::HeartbeatPing cHeartbeatPing;
+	cHeartbeatPing.set_stream_id(1);
+	cHeartbeatPing.set_last_stream_id_received(1);
+	cHeartbeatPing.set_status(0);
+	std::string sHeartbeatPing = cHeartbeatPing.SerializeAsString();
+	for (size_t nIndex = 0; nIndex < m_Messages.size(); ++nIndex)
+	{
+		const MESSAGE& message = m_Messages[nIndex];
+		AppendFrame(kDataMessageStanzaTag, message.frame.data() + message.nHeaderSize, message.frame.size() - message.nHeaderSize);
+		AppendFrame(kHeartbeatPingTag, reinterpret_cast<const uint8_t*>(sHeartbeatPing.data()), sHeartbeatPing.size());
+		if (nIndex % 4 == 3)
+			AppendFrame(kHeartbeatAckTag, nullptr, 0);
+	}
+
+	std::mt19937 cRandom(kChunkedDecodeSeed);
+	std::uniform_real_distribution<double> cLogSize(0, std::log(static_cast<double>(kChunkedDecodeMaxChunk + 1)));
+	std::vector<size_t> chunkSizes(kChunkedDecodeChunks);
+	for (size_t& nChunkSize : chunkSizes)
+		nChunkSize = (std::min)((std::max)(static_cast<size_t>(std::exp(cLogSize(cRandom))), size_t(1)), (std::min)(kChunkedDecodeMaxChunk, stream.size()));
+
+	CMCSFrameDecoder cDecoder;
+	uint8_t nVersion = kMCSVersion;
+	cDecoder.Feed(&nVersion, 1);
+
+	size_t nStreamPos = 0;
+	uint64_t nBytesWritten = 0;
+	uint64_t nFramesDecoded = 0;
+	uint64_t nMismatches = 0;
+	auto WriteChunk = [&](size_t nChunkSize) -> size_t {
+		// The stream is replayed over and over, a chunk may span its end and its start
+		uint8_t* pWrite = cDecoder.PrepareWrite(nChunkSize);
+		size_t nFirst = (std::min)(nChunkSize, stream.size() - nStreamPos);
+		std::memcpy(pWrite, stream.data() + nStreamPos, nFirst);
+		std::memcpy(pWrite + nFirst, stream.data(), nChunkSize - nFirst);
+		cDecoder.CommitWrite(nChunkSize);
+		nStreamPos = (nStreamPos + nChunkSize) % stream.size();
+		nBytesWritten += nChunkSize;
+
+		size_t nDecoded = 0;
+		MCS_FRAME frame;
+		while (cDecoder.Next(frame))
+		{
+			const EXPECTED_FRAME& expected = expectedFrames[nFramesDecoded++ % expectedFrames.size()];
+			if (frame.nTag != expected.nTag || frame.nSize != expected.nSize ||
+				(frame.nSize > 0 && std::memcmp(frame.pData, stream.data() + expected.nOffset, frame.nSize) != 0))
+				nMismatches++;
+			nDecoded += frame.nSize;
+		}
+		return nDecoded;
+	};
+
+	BENCHMARK_RESULT result = Measure("frame_decode_chunked", kFastStageBatch, [&chunkSizes, &WriteChunk](size_t nIndex) -> size_t {
+		return WriteChunk(chunkSizes[nIndex % chunkSizes.size()]);
+	});
+
+	// Up to the end of the stream every frame written must have come out, in order
+	if (nStreamPos != 0)
+		WriteChunk(stream.size() - nStreamPos);
+	uint64_t nExpectedFrames = nBytesWritten / stream.size() * expectedFrames.size();
+	if (nMismatches > 0 || nFramesDecoded != nExpectedFrames || cDecoder.ReadableSize() != 0)
+	{
+		result.bCompleted = false;
+		result.sError = std::to_string(nFramesDecoded) + " frames decoded of " + std::to_string(nExpectedFrames) +
+			", " + std::to_string(nMismatches) + " with a different tag or payload";
+		return result;
+	}
+
+	result.sDetail = std::to_string(nFramesDecoded) + " frames in chunks of 1 to " + std::to_string(kChunkedDecodeMaxChunk) +
+		" bytes, seed " + std::to_string(kChunkedDecodeSeed);
+	return result;
+}
+
+BENCHMARK_RESULT CBenchmark::RunClientReceive()
+{
+	// Not connected, so the acks are not sent and the messages are decrypted inline
+	CFCMClient cClient(m_oLogger, "1000000", "benchmark", m_Keys.sBase64PrivateKey, m_Keys.sBase64AuthSecret, {});
+	size_t nReceived = 0;
+	cClient.On("message", [&nReceived](const std::string& sMessage) { nReceived += sMessage.size(); });
+
+	return Measure("client_receive", 1, [this, &cClient, &nReceived](size_t nIndex) -> size_t {
+		const MESSAGE& message = m_Messages[nIndex % m_Messages.size()];
+		MCS_FRAME frame = { kDataMessageStanzaTag, message.frame.data() + message.nHeaderSize, message.frame.size() - message.nHeaderSize };
+		cClient.GotMessageBytes(frame);
+
+		if (cClient.m_UnackedIds.size() >= kMCSSelectiveAckMaxIds)
+		{
+			cClient.m_UnackedIds.clear();
+			cClient.m_PersistentIds.clear();
+		}
+		return nReceived;
+	});
+}
+
+void CBenchmark::RunLogging(std::vector<BENCHMARK_RESULT>& results)
+{
+	size_t nLogged = 0;
+	LogFnCallback oSink = [&nLogged](const std::string& sLine) { nLogged += sLine.size(); };
+	CFCMClient cClient(oSink, "1000000", "benchmark", m_Keys.sBase64PrivateKey, m_Keys.sBase64AuthSecret, {});
+
+	mcs_proto::HeartbeatAck cHeartbeatAck;
+	cHeartbeatAck.set_status(0);
+	cHeartbeatAck.set_last_stream_id_received(1);
+	cHeartbeatAck.set_stream_id(1);
+	std::string sHeartbeatAck = cHeartbeatAck.SerializeAsString();
+	MCS_FRAME frame = { kHeartbeatAckTag, reinterpret_cast<const uint8_t*>(sHeartbeatAck.data()), sHeartbeatAck.size() };
+
+	LogLevel eLevel = LogUtil::GetLevel();
+	for (LogLevel eStageLevel : { LOG_LEVEL_INFO, LOG_LEVEL_WARNING })
+	{
+		LogUtil::SetLevel(eStageLevel);
+		results.push_back(Measure(eStageLevel == LOG_LEVEL_INFO ? "log_enabled" : "log_disabled", kFastStageBatch,
+			[&cClient, &frame, &nLogged](size_t) -> size_t {
+				cClient.GotMessageBytes(frame);
+				return nLogged;
+			}));
+	}
+	LogUtil::SetLevel(eLevel);
+}
+
+void CBenchmark::RunHandshakes(std::vector<BENCHMARK_RESULT>& results)
+{
+	CLocalTLSServer cServer(m_oLogger, m_Config.server, [](CTCPSSLServer& cServer, ASecureSocket::SSLSocket& clientSocket) {
+		// Reading it makes the client take the session tickets in, TLS 1.3 sends them after the handshake
+		char cByte = 0;
+		if (cServer.Send(clientSocket, &cByte, 1))
+			cServer.Receive(clientSocket, &cByte, 1); // returns once the client disconnects
+	});
+
+	CBenchmarkSSLClient cClient(m_oLogger, ASecureSocket::OpenSSLProtocol::TLS, ASocket::NO_FLAGS);
+	const std::string sSessionKey = "127.0.0.1:" + m_Config.server.sPort;
+	size_t nIterations = (std::min)(m_Config.nIterations, kBenchmarkMaxConnects);
+
+	for (bool bResume : { false, true })
+	{
+		size_t nConnected = 0;
+		size_t nResumed = 0;
+		BENCHMARK_RESULT result = Measure(bResume ? "tls_handshake_resumed" : "tls_handshake_full", 1,
+			[this, &cClient, &sSessionKey, bResume, &nConnected, &nResumed](size_t) -> size_t {
+				if (!bResume)
+					CBenchmarkSSLClient::ForgetSession(sSessionKey);
+
+				char cByte = 0;
+				if (cClient.Connect("127.0.0.1", m_Config.server.sPort) && cClient.Receive(&cByte, 1) == 1)
+				{
+					++nConnected;
+					if (cClient.IsSessionReused())
+						++nResumed;
+				}
+				cClient.Disconnect();
+				return nConnected;
+			}, nIterations);
+
+		size_t nExpected = result.nOperations + m_Messages.size();
+		if (nConnected != nExpected)
+		{
+			result.bCompleted = false;
+			result.sError = "Only " + std::to_string(nConnected) + " of " + std::to_string(nExpected) + " connects succeeded";
+		}
+		else if (bResume ? nResumed < nExpected : nResumed > 0)
+		{
+			result.bCompleted = false;
+			result.sError = std::to_string(nResumed) + " of " + std::to_string(nExpected) + " connects resumed the session";
+		}
+		results.push_back(result);
+	}
+}
+
+void CBenchmark::RunHttpRequests(std::vector<BENCHMARK_RESULT>& results)
+{
+	CLocalTLSServer cServer(m_oLogger, m_Config.server, ServeHttp);
+
+	// As CFCMRegister posts them, the server's certificate must be self-signed for "localhost"
+	const std::string sUrl = "https://localhost:" + m_Config.server.sPort + "/register";
+	const std::string& sCAFile = m_Config.server.sCertFile;
+	const std::vector<std::string> headers = { "Content-Type: application/x-www-form-urlencoded" };
+	const std::string sBody = "app=benchmark&device=1000000&sender=" + std::string(160, 'x');
+	size_t nIterations = (std::min)(m_Config.nIterations, kBenchmarkMaxConnects);
+
+	for (bool bPooled : { false, true })
+	{
+		size_t nSucceeded = 0;
+		std::string sError;
+		curl_slist* pHeaders = nullptr;
+		for (const std::string& sHeader : headers)
+			pHeaders = curl_slist_append(pHeaders, sHeader.c_str());
+
+		BENCHMARK_RESULT result = Measure(bPooled ? "http_post_pooled" : "http_post_fresh", 1,
+			[&, bPooled](size_t) -> size_t {
+				std::string sResponse;
+				bool bPosted;
+				if (bPooled)
+				{
+					CLibCurlWrapper cLibCurlWrapper;
+					cLibCurlWrapper.SetCAFile(sCAFile);
+					cLibCurlWrapper.SetHeaders(headers);
+					bPosted = cLibCurlWrapper.Post(sUrl, sBody, sResponse);
+					if (!bPosted)
+						sError = cLibCurlWrapper.GetError();
+				}
+				else
+				{
+					bPosted = PostWithFreshHandle(sUrl, sCAFile, pHeaders, sBody, sResponse);
+					if (!bPosted)
+						sError = "Error: the request failed";
+				}
+
+				if (bPosted && sResponse == "ok")
+					++nSucceeded;
+				else if (bPosted)
+					sError = "Unexpected response: " + sResponse;
+				return nSucceeded;
+			}, nIterations);
+		curl_slist_free_all(pHeaders);
+
+		size_t nExpected = result.nOperations + m_Messages.size();
+		if (nSucceeded != nExpected)
+		{
+			result.bCompleted = false;
+			result.sError = "Only " + std::to_string(nSucceeded) + " of " + std::to_string(nExpected) + " requests succeeded. " + sError;
+		}
+		results.push_back(result);
+	}
+}
+
+bool CBenchmark::AddSessions(CMockMCSServer& cServer, CSessionManager& cSessionManager, size_t nSessions, std::string& sError)
+{
+	for (size_t nSession = 0; nSession < nSessions; ++nSession)
+	{
+		ECDH_KEYS keys;
+		if (UtilFunction::GenerateECDHKeys(keys) != ECE_OK)
+		{
+			sError = "Cannot generate the session keys";
+			return false;
+		}
+
+		SESSION_CONFIG config;
+		config.sAndroidId = std::to_string(1000000 + nSession);
+		config.sSecurityToken = "benchmark";
+		config.sBase64PrivateKey = keys.sBase64PrivateKey;
+		config.sBase64AuthSecret = keys.sBase64AuthSecret;
+		cServer.AddIdentity(config.sAndroidId, config.sSecurityToken, config.sBase64PrivateKey, config.sBase64AuthSecret);
+		cSessionManager.AddSession(config);
+	}
+
+	return true;
+}
+
+size_t CBenchmark::WaitForSessions(CSessionManager& cSessionManager, size_t nSessions)
+{
+	Clock::time_point loginDeadline = Clock::now() + std::chrono::seconds(kBenchmarkLoginTimeoutSec);
+	size_t nOnline = 0;
+	while ((nOnline = cSessionManager.CountSessions(MCS_SESSION_ONLINE)) < nSessions && Clock::now() < loginDeadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	return nOnline;
+}
+
+bool CBenchmark::RunAckSession(const MOCK_MCS_CONFIG& serverConfig, const std::function<bool(CMockMCSServer&, std::string&)>& check,
+	std::string& sError)
+{
+	CMockMCSServer cServer(m_oLogger, serverConfig);
+	CSessionManager cSessionManager(m_oLogger, 1, m_Config.nDecryptThreadCount);
+	if (!AddSessions(cServer, cSessionManager, 1, sError))
+		return false;
+
+	cServer.Start();
+	cSessionManager.SetServer("127.0.0.1", serverConfig.sPort);
+	cSessionManager.Start();
+
+	bool bPassed = false;
+	if (WaitForSessions(cSessionManager, 1) < 1)
+		sError = "The session did not log in";
+	else
+		bPassed = check(cServer, sError);
+
+	cSessionManager.Stop();
+	cServer.Stop();
+	return bPassed;
+}
+
+BENCHMARK_RESULT CBenchmark::RunAckCheck()
+{
+	BENCHMARK_RESULT result = {};
+	result.sStage = "acks";
+	result.dAllocationsPerOp = -1; // made on the event loop threads, not counted
+	Clock::time_point start = Clock::now();
+
+	// One burst, the first within 100 ms of the login
+	MOCK_MCS_CONFIG serverConfig = m_Config.server;
+	serverConfig.nBurst = kAckCheckBurst;
+	serverConfig.nMessagesPerClient = kAckCheckBurst;
+	serverConfig.dRatePerSecond = kAckCheckBurst * 10.0;
+	serverConfig.nPingIntervalMs = 0;
+	serverConfig.nIqIntervalMs = 0;
+
+	MOCK_MCS_METRICS selectiveAcks = {};
+	double dDelaySec = 0;
+	bool bPassed = RunAckSession(serverConfig, [&selectiveAcks, &dDelaySec](CMockMCSServer& cServer, std::string& sError) {
+		Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+		while (cServer.GetMetrics().nMessagesSent < kAckCheckBurst && Clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		Clock::time_point sent = Clock::now();
+
+		// Every full kMCSSelectiveAckMaxIds ids, or kMCSUnackedPacketsBeforeStreamAck packets, are acked right away
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		MOCK_MCS_METRICS prompt = cServer.GetMetrics();
+		if (prompt.nMessagesSent < kAckCheckBurst || prompt.nAckedIds < kMCSSelectiveAckMaxIds ||
+			prompt.nAckedIds + kMCSSelectiveAckMaxIds <= kAckCheckBurst || prompt.nAckedIds == kAckCheckBurst)
+		{
+			sError = std::to_string(prompt.nAckedIds) + " of " + std::to_string(prompt.nMessagesSent) +
+				" ids were acked within a second";
+			return false;
+		}
+
+		// The rest once kMCSSelectiveAckDelayMs has passed
+		deadline = sent + std::chrono::milliseconds(kMCSSelectiveAckDelayMs + 3000);
+		while ((selectiveAcks = cServer.GetMetrics()).nAckedIds < kAckCheckBurst && Clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		dDelaySec = std::chrono::duration<double>(Clock::now() - sent).count();
+
+		if (selectiveAcks.nAckedIds != kAckCheckBurst || dDelaySec * 1000 < kMCSSelectiveAckDelayMs - 1000)
+		{
+			sError = std::to_string(selectiveAcks.nAckedIds) + " of " + std::to_string(kAckCheckBurst) +
+				" ids were acked, the last " + std::to_string(dDelaySec) + " s after the burst";
+			return false;
+		}
+		if (selectiveAcks.nMaxIdsPerAck > kMCSSelectiveAckMaxIds || selectiveAcks.nStreamAcks > 0)
+		{
+			sError = "A selective ack carried " + std::to_string(selectiveAcks.nMaxIdsPerAck) + " ids, " +
+				std::to_string(selectiveAcks.nStreamAcks) + " stream acks were sent for data messages";
+			return false;
+		}
+		return true;
+	}, result.sError);
+
+	// No data, only HeartbeatPings, each answered with a HeartbeatAck that also reports the stream id
+	serverConfig.dRatePerSecond = 0;
+	serverConfig.nPingIntervalMs = kAckCheckPingIntervalMs;
+
+	MOCK_MCS_METRICS pingAcks = {};
+	bPassed = bPassed && RunAckSession(serverConfig, [&pingAcks](CMockMCSServer& cServer, std::string& sError) {
+		std::this_thread::sleep_for(std::chrono::seconds(kAckCheckPingSec));
+		pingAcks = cServer.GetMetrics();
+
+		// The last ack may still be on its way
+		if (pingAcks.nPingsSent == 0 || pingAcks.nPingAcks > pingAcks.nPingsSent || pingAcks.nPingAcks + 1 < pingAcks.nPingsSent ||
+			pingAcks.nStreamAcks > 0 || pingAcks.nSelectiveAcks > 0)
+		{
+			sError = std::to_string(pingAcks.nPingAcks) + " heartbeat acks, " + std::to_string(pingAcks.nStreamAcks) + " stream acks and " +
+				std::to_string(pingAcks.nSelectiveAcks) + " selective acks for " + std::to_string(pingAcks.nPingsSent) + " pings";
+			return false;
+		}
+		return true;
+	}, result.sError);
+
+	// No data, only IqStanzas, which the client acknowledges with stream acks
+	serverConfig.nPingIntervalMs = 0;
+	serverConfig.nIqIntervalMs = kAckCheckPingIntervalMs;
+
+	MOCK_MCS_METRICS streamAcks = {};
+	bPassed = bPassed && RunAckSession(serverConfig, [&streamAcks](CMockMCSServer& cServer, std::string& sError) {
+		std::this_thread::sleep_for(std::chrono::seconds(kAckCheckPingSec));
+		streamAcks = cServer.GetMetrics();
+
+		// The login response is a packet too, the last ack may still be on its way
+		uint64_t nPackets = streamAcks.nIqsSent + 1;
+		uint64_t nExpected = nPackets / kMCSUnackedPacketsBeforeStreamAck;
+		if (streamAcks.nStreamAcks == 0 || streamAcks.nStreamAcks > nExpected || streamAcks.nStreamAcks + 1 < nExpected ||
+			streamAcks.nSelectiveAcks > 0)
+		{
+			sError = std::to_string(streamAcks.nStreamAcks) + " stream acks and " + std::to_string(streamAcks.nSelectiveAcks) +
+				" selective acks for " + std::to_string(streamAcks.nIqsSent) + " IqStanzas";
+			return false;
+		}
+		return true;
+	}, result.sError);
+
+	result.dElapsedSec = std::chrono::duration<double>(Clock::now() - start).count();
+	if (!bPassed)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CBenchmark][ERROR] acks: ", result.sError);
+		return result;
+	}
+
+	result.nOperations = selectiveAcks.nSelectiveAcks + pingAcks.nPingAcks + streamAcks.nStreamAcks;
+	result.bCompleted = true;
+	std::ostringstream detail;
+	detail << selectiveAcks.nSelectiveAcks << " selective acks for " << kAckCheckBurst << " ids, at most " <<
+		selectiveAcks.nMaxIdsPerAck << " per ack, the last " << dDelaySec << " s after the burst; " <<
+		pingAcks.nPingAcks << " heartbeat acks for " << pingAcks.nPingsSent << " pings; " <<
+		streamAcks.nStreamAcks << " stream acks for " << streamAcks.nIqsSent << " IqStanzas";
+	result.sDetail = detail.str();
+	FCM_LOG_INFO(m_oLogger, "[CBenchmark][INFO] acks: ", result.sDetail);
+	return result;
+}
+
+BENCHMARK_RESULT CBenchmark::RunIdleSessions()
+{
+	BENCHMARK_RESULT result = {};
+	result.sStage = "idle_sessions";
+	result.dAllocationsPerOp = -1; // made on the event loop threads, not counted
+
+	MOCK_MCS_CONFIG serverConfig = m_Config.server;
+	serverConfig.dRatePerSecond = 0;
+
+#ifdef __GLIBC__
+	// Hands the memory the earlier stages freed back, so it is not reused unseen
+	malloc_trim(0);
+#endif
+	uint64_t nBaseBytes = 0;
+	double dBaseCpuSec = 0;
+	if (!GetProcessUsage(nBaseBytes, dBaseCpuSec))
+	{
+		result.sError = "Cannot read the process memory and CPU time";
+		return result;
+	}
+
+	CMockMCSServer cServer(m_oLogger, serverConfig);
+	CSessionManager cSessionManager(m_oLogger, m_Config.nThreadCount, m_Config.nDecryptThreadCount);
+	if (!AddSessions(cServer, cSessionManager, m_Config.nSessions, result.sError))
+		return result;
+
+	cServer.Start();
+	cSessionManager.SetServer("127.0.0.1", m_Config.server.sPort);
+	cSessionManager.Start();
+
+	size_t nOnline = WaitForSessions(cSessionManager, m_Config.nSessions);
+	if (nOnline < m_Config.nSessions)
+	{
+		cSessionManager.Stop();
+		cServer.Stop();
+		result.sError = "Only " + std::to_string(nOnline) + " of " + std::to_string(m_Config.nSessions) + " sessions logged in";
+		FCM_LOG_ERROR(m_oLogger, "[CBenchmark][ERROR] idle_sessions: ", result.sError);
+		return result;
+	}
+
+	uint64_t nOnlineBytes = 0;
+	double dStartCpuSec = 0;
+	Clock::time_point start = Clock::now();
+	GetProcessUsage(nOnlineBytes, dStartCpuSec);
+	std::this_thread::sleep_for(std::chrono::seconds(m_Config.nDurationSec));
+	uint64_t nEndBytes = 0;
+	double dEndCpuSec = 0;
+	GetProcessUsage(nEndBytes, dEndCpuSec);
+	result.dElapsedSec = std::chrono::duration<double>(Clock::now() - start).count();
+
+	cSessionManager.Stop();
+	cServer.Stop();
+
+	result.nOperations = m_Config.nSessions;
+	result.dBytesPerSession = (static_cast<double>(nEndBytes) - static_cast<double>(nBaseBytes)) / m_Config.nSessions;
+	result.dCpuUsPerSessionSec = result.dElapsedSec > 0 ? (dEndCpuSec - dStartCpuSec) * 1e6 / result.dElapsedSec / m_Config.nSessions : 0;
+	result.bCompleted = true;
+
+	FCM_LOG_INFO(m_oLogger, "[CBenchmark][INFO] idle_sessions: ", m_Config.nSessions, " sessions, ",
+		static_cast<uint64_t>(result.dBytesPerSession), " bytes and ", result.dCpuUsPerSessionSec, " us CPU per second per session");
+	return result;
+}
+
+BENCHMARK_RESULT CBenchmark::RunEndToEnd()
+{
+	BENCHMARK_RESULT result = {};
+	result.sStage = "end_to_end";
+	result.dAllocationsPerOp = -1; // made on the event loop threads, not counted
+
+	// Touched only by the session's loop thread until the sessions are stopped
+	struct SESSION_SAMPLES
+	{
+		std::deque<int64_t> sentUs; // of the messages decrypting, in order
+		std::vector<double> latencies;
+	};
+
+	CMockMCSServer cServer(m_oLogger, m_Config.server);
+	CSessionManager cSessionManager(m_oLogger, m_Config.nThreadCount, m_Config.nDecryptThreadCount);
+	std::vector<std::unique_ptr<SESSION_SAMPLES>> sessionSamples;
+	std::atomic<bool> bMeasuring(false);
+
+	if (!AddSessions(cServer, cSessionManager, m_Config.nSessions, result.sError))
+		return result;
+
+	for (size_t nSession = 0; nSession < cSessionManager.SessionCount(); ++nSession)
+	{
+		CFCMClient& cClient = cSessionManager.GetClient(nSession);
+		sessionSamples.push_back(std::make_unique<SESSION_SAMPLES>());
+		SESSION_SAMPLES* pSamples = sessionSamples.back().get();
+
+		// "persistent_id" comes as a message is read and "message" once it is decrypted, in the same order
+		cClient.On("persistent_id", [pSamples](const std::string& sPersistentId) {
+			pSamples->sentUs.push_back(SentUsFromPersistentId(sPersistentId));
+		});
+		cClient.On("message", [pSamples, &bMeasuring](const std::string&) {
+			if (pSamples->sentUs.empty())
+				return;
+
+			int64_t nSentUs = pSamples->sentUs.front();
+			pSamples->sentUs.pop_front();
+			if (bMeasuring.load(std::memory_order_relaxed))
+				pSamples->latencies.push_back(static_cast<double>(NowUs() - nSentUs) * 1000);
+		});
+		cClient.On("disconnected", [pSamples](const std::string&) {
+			pSamples->sentUs.clear();
+		});
+	}
+
+	cServer.Start();
+	cSessionManager.SetServer("127.0.0.1", m_Config.server.sPort);
+	cSessionManager.Start();
+
+	size_t nOnline = WaitForSessions(cSessionManager, m_Config.nSessions);
+	if (nOnline < m_Config.nSessions)
+	{
+		cSessionManager.Stop();
+		cServer.Stop();
+		result.sError = "Only " + std::to_string(nOnline) + " of " + std::to_string(m_Config.nSessions) + " sessions logged in";
+		FCM_LOG_ERROR(m_oLogger, "[CBenchmark][ERROR] end_to_end: ", result.sError);
+		return result;
+	}
+
+	bMeasuring = true;
+	Clock::time_point start = Clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(m_Config.nDurationSec));
+	bMeasuring = false;
+	result.dElapsedSec = std::chrono::duration<double>(Clock::now() - start).count();
+
+	cSessionManager.Stop();
+	cServer.Stop();
+
+	std::vector<double> samples;
+	for (const std::unique_ptr<SESSION_SAMPLES>& pSamples : sessionSamples)
+		samples.insert(samples.end(), pSamples->latencies.begin(), pSamples->latencies.end());
+
+	result.nOperations = samples.size();
+	result.dOpsPerSec = result.dElapsedSec > 0 ? result.nOperations / result.dElapsedSec : 0;
+	result.bCompleted = true;
+	SetLatencies(result, samples);
+
+	FCM_LOG_INFO(m_oLogger, "[CBenchmark][INFO] end_to_end: ", m_Config.nSessions, " sessions, ",
+		static_cast<uint64_t>(result.dOpsPerSec), " messages/s, p50 ", result.dP50Ns, " ns, p99 ", result.dP99Ns, " ns");
+	return result;
+}
+
+std::string CBenchmark::FormatSummary(const BENCHMARK_RESULT& result)
+{
+	std::ostringstream summary;
+	summary << result.sStage << ": ";
+	if (!result.bCompleted)
+		summary << result.sError;
+	else if (!result.sDetail.empty() && result.dOpsPerSec == 0)
+		summary << result.sDetail; // a check stage, not timed
+	else if (result.dBytesPerSession != 0 || result.dCpuUsPerSessionSec != 0)
+		summary << result.nOperations << " sessions, " << static_cast<uint64_t>(result.dBytesPerSession) << " bytes and " <<
+			result.dCpuUsPerSessionSec << " us CPU per second per session";
+	else
+	{
+		summary << static_cast<uint64_t>(result.dOpsPerSec) << " ops/s, p50 " << result.dP50Ns << " ns, p99 " << result.dP99Ns <<
+			" ns, p999 " << result.dP999Ns << " ns";
+		if (result.dAllocationsPerOp >= 0)
+			summary << ", " << result.dAllocationsPerOp << " allocations/op";
+		if (!result.sDetail.empty())
+			summary << ", " << result.sDetail;
+	}
+	return summary.str();
+}
+
+void CBenchmark::SetLatencies(BENCHMARK_RESULT& result, std::vector<double>& samples)
+{
+	if (samples.empty())
+		return;
+
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&samples](double dRank) {
+		return samples[(std::min)(static_cast<size_t>(dRank * samples.size()), samples.size() - 1)];
+	};
+
+	result.dP50Ns = percentile(0.5);
+	result.dP99Ns = percentile(0.99);
+	result.dP999Ns = percentile(0.999);
+	result.dMaxNs = samples.back();
+}
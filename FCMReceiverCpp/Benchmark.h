@@ -0,0 +1,191 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "FCMRegister.h"
+#include "MockMCSServer.h"
+#include "SessionManager.h"
+
+constexpr size_t kBenchmarkDefaultIterations = 100000;
+constexpr size_t kBenchmarkMessageVariants = 16; // distinct encrypted messages cycled through by the stages
+constexpr size_t kBenchmarkDefaultSessions = 100;
+constexpr uint32_t kBenchmarkDefaultDurationSec = 10;
+constexpr uint32_t kBenchmarkLoginTimeoutSec = 30;
+constexpr size_t kBenchmarkMaxConnects = 1000; // the stages that connect take milliseconds per operation
+constexpr const char* kBenchmarkDefaultPort = "15228";
+
+typedef struct _BENCHMARK_CONFIG
+{
+	size_t nIterations = kBenchmarkDefaultIterations; // operations timed per stage
+	size_t nPayloadSize = (kMockMCSDefaultMinPayload + kMockMCSDefaultMaxPayload) / 2; // plaintext size of the stage messages
+
+	// The end-to-end stage: sessions against a mock server on the loopback interface
+	MOCK_MCS_CONFIG server;
+	size_t nSessions = kBenchmarkDefaultSessions;
+	size_t nThreadCount = 0; // session threads, 0 uses one per hardware thread
+	size_t nDecryptThreadCount = 0;
+	uint32_t nDurationSec = kBenchmarkDefaultDurationSec;
+} BENCHMARK_CONFIG;
+
+typedef struct _BENCHMARK_RESULT
+{
+	std::string sStage;
+	bool bCompleted;
+	std::string sError; // why the stage did not complete
+	uint64_t nOperations;
+	double dElapsedSec;
+	double dOpsPerSec;
+	// Latency of one operation, for the end-to-end stage from the server write to the "message" event
+	double dP50Ns;
+	double dP99Ns;
+	double dP999Ns;
+	double dMaxNs;
+	// Heap allocations per operation by the measuring thread, operator new and OpenSSL's,
+	// -1 for the stages whose work runs on other threads
+	double dAllocationsPerOp;
+	// Of the idle_sessions stage: resident memory per session and CPU time per session per second
+	double dBytesPerSession;
+	double dCpuUsPerSessionSec;
+	std::string sDetail; // what a check stage, or the checks of a timed one, observed
+} BENCHMARK_RESULT;
+
+/**
+ * Measures the receive path stage by stage, then end to end.
+ *
+ * The stages run one after the other on the calling thread, over a fixed set of
+ * encrypted DataMessageStanzas prepared up front:
+ *   frame_decode      CMCSFrameDecoder splitting the byte stream into frames
+ *   frame_decode_chunked  the messages and heartbeats as one recorded stream, replayed through
+ *                     PrepareWrite()/CommitWrite() in seeded random chunks of 1 byte to several KB,
+ *                     checking every tag and payload comes out unchanged
+ *   parse_wire        MCSWireParser::ParseDataMessageStanza
+ *   parse_generated   mcs_proto::DataMessageStanza::ParseFromArray, for comparison
+ *   base64_decode     the salt and crypto-key app_data values with Base64.cpp
+ *   ece_base64url_decode_baseline  the same with the quantum at a time loop ece_base64url_decode had
+ *                     before it used FastBase64, kept in the benchmark for comparison
+ *   ece_base64url_decode  the same with ece_base64url_decode, which uses FastBase64
+ *   fast_base64_decode_*  the same with FastBase64::Decode, once per implementation the CPU has
+ *   ece_headers_extract_params  the crypto-key and encryption values, with Http_ece/params.c
+ *   header_parse      the same with EceHeaderParser::ExtractAesgcmParams, as the client does it
+ *   base64_encode, fast_base64_encode  a public key, with Base64.cpp and FastBase64::Encode
+ *   decrypt           ece_webpush_aesgcm_decrypt, ECDH included
+ *   decrypt_ctx       ece_webpush_aesgcm_decrypt_with_ctx, as the client does it
+ *   emit              CEmitter::Emit of the plaintext to one listener
+ *   histogram_record  CLatencyHistogram::RecordSince, the cost of each stage sample the client takes
+ *   client_receive    CFCMClient handling a DataMessageStanza frame, parse to "message" event,
+ *                     decrypting inline, with the persistent ids dropped every
+ *                     kMCSSelectiveAckMaxIds messages as the server's ack confirmations do
+ *   log_enabled       CFCMClient handling a HeartbeatAck frame, its two INFO lines formatted
+ *                     for a logger that drops them
+ *   log_disabled      the same with the runtime level above INFO, as the benchmark runs
+ *
+ * Every stage also counts the heap allocations of its operations: fcm_bench replaces operator new
+ * to report them through CountAllocation(), and OpenSSL's allocation functions are replaced
+ * when the benchmark is created before OpenSSL allocates anything.
+ * Operations shorter than a clock read are timed in batches, a sample is then the
+ * batch average. Then, with the mock server's certificate, clients connect to a CTCPSSLServer
+ * in the same process, at most kBenchmarkMaxConnects times per stage:
+ *   tls_handshake_full     a CTCPSSLClient connecting and reading one byte, without the session cached
+ *   tls_handshake_resumed  the same, offering the session of the previous connect
+ *   http_post_fresh        an HTTPS POST on a new curl handle, as CLibCurlWrapper did before its pool
+ *   http_post_pooled       the same with a CLibCurlWrapper per request, as CFCMRegister sends them,
+ *                          the certificate must be self-signed for localhost
+ * And sessions run against a CMockMCSServer in the same process:
+ *   idle_sessions     sessions the server pushes nothing to, the growth of the resident
+ *                     memory per session and the process CPU time per session while idle,
+ *                     both include the server's side of the connection
+ *   acks              checks one session acknowledges a burst kMCSSelectiveAckMaxIds ids at a
+ *                     time and the rest kMCSSelectiveAckDelayMs later, with SelectiveAcks, that
+ *                     it answers every HeartbeatPing with a HeartbeatAck, and that it sends a
+ *                     StreamAck every kMCSUnackedPacketsBeforeStreamAck other packets
+ *   end_to_end        each message's latency, taken from its persistent id
+ */
+class CBenchmark
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param config The stage sizes and the end-to-end setup.
+	 */
+	CBenchmark(const LogFnCallback oLogger, const BENCHMARK_CONFIG& config);
+
+	CBenchmark(const CBenchmark&) = delete;
+	CBenchmark& operator=(const CBenchmark&) = delete;
+
+	/**
+	 * Runs every stage, blocking.
+	 *
+	 * @param bEndToEnd False to skip the stages that run sessions.
+	 * @return One result per stage, in the order they ran.
+	 */
+	std::vector<BENCHMARK_RESULT> Run(bool bEndToEnd = true);
+
+	/**
+	 * @param config The setup the results were measured under.
+	 * @param results The results of Run().
+	 * @return The report, a json object with the timestamp, the setup and one entry per stage.
+	 */
+	static std::string FormatReport(const BENCHMARK_CONFIG& config, const std::vector<BENCHMARK_RESULT>& results);
+
+	/**
+	 * @param result A result of Run().
+	 * @return One line summing the result up, for the console.
+	 */
+	static std::string FormatSummary(const BENCHMARK_RESULT& result);
+
+	/**
+	 * Counts one heap allocation of the calling thread, for the operator new of the benchmark's
+	 * executable. Without it the stages report 0 allocations from operator new.
+	 */
+	static void CountAllocation();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct MESSAGE
+	{
+		std::vector<uint8_t> frame; // tag, size and stanza
+		size_t nHeaderSize; // tag and size
+		std::string sBase64Salt; // the app_data values, without the "salt=" and "dh=" prefixes
+		std::string sBase64SenderPubKey;
+		std::string sCryptoKey; // the app_data values as FCM sends them
+		std::string sEncryption;
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		std::string sCiphertext;
+		std::string sPlaintext;
+	};
+
+	bool PrepareMessages();
+
+	template <typename Operation>
+	BENCHMARK_RESULT Measure(const char* szStage, size_t nBatch, Operation operation, size_t nIterations = 0);
+	bool AddSessions(CMockMCSServer& cServer, CSessionManager& cSessionManager, size_t nSessions, std::string& sError);
+	size_t WaitForSessions(CSessionManager& cSessionManager, size_t nSessions);
+	bool RunAckSession(const MOCK_MCS_CONFIG& serverConfig, const std::function<bool(CMockMCSServer&, std::string&)>& check,
+		std::string& sError);
+	BENCHMARK_RESULT RunChunkedDecode();
+	BENCHMARK_RESULT RunClientReceive();
+	void RunLogging(std::vector<BENCHMARK_RESULT>& results);
+	void RunHandshakes(std::vector<BENCHMARK_RESULT>& results);
+	void RunHttpRequests(std::vector<BENCHMARK_RESULT>& results);
+	BENCHMARK_RESULT RunAckCheck();
+	BENCHMARK_RESULT RunIdleSessions();
+	BENCHMARK_RESULT RunEndToEnd();
+
+	static void SetLatencies(BENCHMARK_RESULT& result, std::vector<double>& samples);
+
+private:
+	const LogFnCallback m_oLogger;
+	const BENCHMARK_CONFIG m_Config;
+
+	std::string m_sPrivateKey;
+	std::string m_sAuthSecret;
+	ECDH_KEYS m_Keys; // the base64 encoded m_sPrivateKey and m_sAuthSecret, for a CFCMClient
+	std::vector<MESSAGE> m_Messages;
+	volatile size_t m_nSink; // keeps the measured work from being optimized away
+};
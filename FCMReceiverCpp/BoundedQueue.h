@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Bounded multi-producer multi-consumer queue without locks.
+ *
+ * A ring of cells, each tagged with a sequence number that tells producers and
+ * consumers whose turn it is (Dmitry Vyukov's design). TryPush() and TryPop()
+ * never block: they fail when the queue is full or empty.
+ */
+template <typename T>
+class CBoundedQueue
+{
+public:
+	/**
+	 * @param nCapacity The number of items the queue holds, rounded up to a power of two.
+	 */
+	explicit CBoundedQueue(size_t nCapacity) :
+		m_nMask(RoundUpToPowerOfTwo(nCapacity < 2 ? 2 : nCapacity) - 1),
+		m_Cells(new CELL[m_nMask + 1]),
+		m_nEnqueuePos(0),
+		m_nDequeuePos(0)
+	{
+		for (size_t i = 0; i <= m_nMask; ++i)
+			m_Cells[i].nSequence.store(i, std::memory_order_relaxed);
+	}
+
+	CBoundedQueue(const CBoundedQueue&) = delete;
+	CBoundedQueue& operator=(const CBoundedQueue&) = delete;
+
+	/**
+	 * @param item The item, moved from only on success.
+	 * @return True if the item was queued, false if the queue is full.
+	 */
+	bool TryPush(T& item)
+	{
+		size_t nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+		CELL* pCell;
+		for (;;)
+		{
+			pCell = &m_Cells[nPos & m_nMask];
+			size_t nSequence = pCell->nSequence.load(std::memory_order_acquire);
+			intptr_t nDiff = static_cast<intptr_t>(nSequence) - static_cast<intptr_t>(nPos);
+			if (nDiff == 0)
+			{
+				if (m_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1))
+					break;
+			}
+			else if (nDiff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		pCell->data = std::move(item);
+		pCell->nSequence.store(nPos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @param item Receives the item on success.
+	 * @return True if an item was taken, false if the queue is empty.
+	 */
+	bool TryPop(T& item)
+	{
+		size_t nPos = m_nDequeuePos.load(std::memory_order_relaxed);
+		CELL* pCell;
+		for (;;)
+		{
+			pCell = &m_Cells[nPos & m_nMask];
+			size_t nSequence = pCell->nSequence.load(std::memory_order_acquire);
+			intptr_t nDiff = static_cast<intptr_t>(nSequence) - static_cast<intptr_t>(nPos + 1);
+			if (nDiff == 0)
+			{
+				if (m_nDequeuePos.compare_exchange_weak(nPos, nPos + 1))
+					break;
+			}
+			else if (nDiff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				nPos = m_nDequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		item = std::move(pCell->data);
+		pCell->data = T();
+		pCell->nSequence.store(nPos + m_nMask + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @return The number of queued items. Only a snapshot while other threads push or pop.
+	 */
+	size_t Size() const
+	{
+		size_t nDequeuePos = m_nDequeuePos.load();
+		size_t nEnqueuePos = m_nEnqueuePos.load();
+		return nEnqueuePos > nDequeuePos ? nEnqueuePos - nDequeuePos : 0;
+	}
+
+	size_t Capacity() const { return m_nMask + 1; }
+
+private:
+	static size_t RoundUpToPowerOfTwo(size_t n)
+	{
+		size_t nPower = 1;
+		while (nPower < n)
+			nPower <<= 1;
+		return nPower;
+	}
+
+	typedef struct _CELL
+	{
+		std::atomic<size_t> nSequence;
+		T data;
+	} CELL;
+
+	// Producers and consumers each get their own cache line
+	const size_t m_nMask;
+	std::unique_ptr<CELL[]> m_Cells;
+	alignas(64) std::atomic<size_t> m_nEnqueuePos;
+	alignas(64) std::atomic<size_t> m_nDequeuePos;
+};
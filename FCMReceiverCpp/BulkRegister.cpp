@@ -0,0 +1,369 @@
+#include "BulkRegister.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace
+{
+	const char* const g_stageNames[BULK_STAGE_COUNT] =
+	{
+		"key generation",
+		"check-in",
+		"GCM register",
+		"installations",
+		"FCM registrations"
+	};
+
+	// "https://host/path" -> "host"
+	std::string GetHost(const std::string& sUrl)
+	{
+		size_t nStart = sUrl.find("://");
+		nStart = (nStart == std::string::npos) ? 0 : nStart + 3;
+		size_t nEnd = sUrl.find('/', nStart);
+		return sUrl.substr(nStart, nEnd == std::string::npos ? std::string::npos : nEnd - nStart);
+	}
+
+	size_t WriteResponse(char* pData, size_t nSize, size_t nCount, void* pUserData)
+	{
+		static_cast<std::string*>(pUserData)->append(pData, nSize * nCount);
+		return nSize * nCount;
+	}
+}
+
+CBulkRegister::CBulkRegister(const LogFnCallback oLogger, size_t nMaxPerHost, size_t nKeyThreadCount) :
+	m_oLogger(oLogger),
+	m_nMaxPerHost((std::max)(nMaxPerHost, static_cast<size_t>(1))),
+	m_nKeyThreadCount(nKeyThreadCount),
+	m_cRegister(oLogger),
+	m_Stats()
+{
+	// The pool initializes libcurl for the whole process, its handles come with the shared DNS and TLS session caches
+	CCurlHandlePool::Instance();
+
+	m_pMulti = curl_multi_init();
+	if (m_pMulti != nullptr)
+		curl_multi_setopt(m_pMulti, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(m_nMaxPerHost));
+}
+
+CBulkRegister::~CBulkRegister()
+{
+	if (m_pMulti != nullptr)
+		curl_multi_cleanup(m_pMulti);
+}
+
+void CBulkRegister::Add(const FCM_PARAMS& params)
+{
+	std::unique_ptr<JOB> job = std::make_unique<JOB>();
+	job->nIndex = m_Jobs.size();
+	job->params = params;
+	m_Jobs.push_back(std::move(job));
+}
+
+BULK_REGISTER_STATS CBulkRegister::Run(std::vector<FCM_REGISTER_DATA_RETURN>& registered)
+{
+	m_StartTime = Clock::now();
+	m_Stats = BULK_REGISTER_STATS();
+	m_Stats.nIdentities = m_Jobs.size();
+
+	GenerateKeys();
+
+	if (m_pMulti == nullptr)
+	{
+		for (std::unique_ptr<JOB>& job : m_Jobs)
+			Fail(*job, BULK_STAGE_CHECKIN, "Cannot create the curl multi handle");
+	}
+	else
+	{
+		// Installations does not need the check-in, the two go out together
+		for (std::unique_ptr<JOB>& job : m_Jobs)
+		{
+			if (job->bFailed)
+				continue;
+			Queue(*job, BULK_STAGE_CHECKIN);
+			Queue(*job, BULK_STAGE_INSTALLATIONS);
+		}
+	}
+
+	Clock::time_point nextProgress = Clock::now() + std::chrono::milliseconds(kBulkRegisterProgressIntervalMs);
+	while (m_nTransfers > 0)
+	{
+		int nRunning = 0;
+		curl_multi_perform(m_pMulti, &nRunning);
+
+		int nQueued = 0;
+		CURLMsg* pMessage;
+		while ((pMessage = curl_multi_info_read(m_pMulti, &nQueued)) != nullptr)
+		{
+			if (pMessage->msg == CURLMSG_DONE)
+				OnTransferDone(pMessage->easy_handle, pMessage->data.result);
+		}
+
+		if (m_nTransfers == 0)
+			break;
+
+		curl_multi_poll(m_pMulti, nullptr, 0, 1000, nullptr);
+
+		if (Clock::now() >= nextProgress)
+		{
+			LogProgress();
+			nextProgress += std::chrono::milliseconds(kBulkRegisterProgressIntervalMs);
+		}
+	}
+
+	m_Stats.nElapsedMs = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - m_StartTime).count());
+	m_Stats.dPerMinute = m_Stats.nElapsedMs > 0 ? m_Stats.nRegistered * 60000.0 / m_Stats.nElapsedMs : 0;
+
+	registered.clear();
+	registered.reserve(m_Stats.nRegistered);
+	for (const std::unique_ptr<JOB>& job : m_Jobs)
+	{
+		if (job->bFailed || job->sFcmToken.empty())
+			continue;
+
+		FCM_REGISTER_DATA_RETURN data;
+		data.acg.sID = StringUtil::to_string(job->nAndroidId);
+		data.acg.sSecurityToken = StringUtil::to_string(job->nSecurityToken);
+		data.ece.sAuthSecret = job->params.keys.sBase64AuthSecret;
+		data.ece.sPrivateKey = job->params.keys.sBase64PrivateKey;
+		data.sToken = job->sFcmToken;
+		registered.push_back(std::move(data));
+	}
+
+	m_Jobs.clear();
+	return m_Stats;
+}
+
+const char* CBulkRegister::GetStageName(BulkRegisterStage eStage)
+{
+	return eStage < BULK_STAGE_COUNT ? g_stageNames[eStage] : "unknown";
+}
+
+void CBulkRegister::GenerateKeys()
+{
+	size_t nThreadCount = m_nKeyThreadCount;
+	if (nThreadCount == 0)
+		nThreadCount = std::thread::hardware_concurrency();
+	nThreadCount = (std::min)((std::max)(nThreadCount, static_cast<size_t>(1)), m_Jobs.size());
+
+	// Each thread takes every nThreadCount-th job, so no job is touched by two threads
+	std::vector<std::thread> threads;
+	for (size_t nThread = 0; nThread < nThreadCount; ++nThread)
+	{
+		threads.emplace_back([this, nThread, nThreadCount]() {
+			for (size_t nIndex = nThread; nIndex < m_Jobs.size(); nIndex += nThreadCount)
+			{
+				JOB& job = *m_Jobs[nIndex];
+				if (!job.params.keys.sBase64PrivateKey.empty())
+					continue;
+
+				job.bKeysFailed = UtilFunction::GenerateECDHKeys(job.params.keys) != ECE_OK;
+			}
+		});
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (std::unique_ptr<JOB>& job : m_Jobs)
+	{
+		if (job->bKeysFailed)
+			Fail(*job, BULK_STAGE_KEYS, "Unable to generate ECDH keys");
+	}
+}
+
+void CBulkRegister::Queue(JOB& job, BulkRegisterStage eStage)
+{
+	std::unique_ptr<TRANSFER> transfer = std::make_unique<TRANSFER>();
+	transfer->pJob = &job;
+	transfer->eStage = eStage;
+
+	const FCM_PARAMS& params = job.params;
+	switch (eStage)
+	{
+	case BULK_STAGE_CHECKIN:
+		transfer->request = m_cRegister.GetCheckInHttpRequest();
+		break;
+	case BULK_STAGE_GCM_REGISTER:
+		transfer->request = m_cRegister.GetGCMRegisterHttpRequest(params.firebase.sAppID, job.nAndroidId, job.nSecurityToken);
+		break;
+	case BULK_STAGE_INSTALLATIONS:
+		transfer->request = m_cRegister.GetInstallationsHttpRequest(params.firebase.sAppID, params.firebase.sProjectID, params.firebase.sApiKey);
+		break;
+	case BULK_STAGE_FCM_REGISTRATIONS:
+		transfer->request = m_cRegister.GetFcmRegistrationsHttpRequest(params.firebase.sProjectID, params.firebase.sApiKey,
+			params.sVapidKey, params.keys.sBase64AuthSecret, job.sInstallationToken, params.keys.sBase64PublicKey, job.sGcmToken);
+		break;
+	default:
+		return;
+	}
+
+	HOST& host = m_Hosts[GetHost(transfer->request.sUrl)];
+	transfer->pHost = &host;
+
+	// Identities under way go ahead of new ones, so they finish steadily instead of all at the end
+	if (eStage == BULK_STAGE_GCM_REGISTER || eStage == BULK_STAGE_FCM_REGISTRATIONS)
+		host.pending.push_front(std::move(transfer));
+	else
+		host.pending.push_back(std::move(transfer));
+	m_nTransfers++;
+
+	StartTransfers(host);
+}
+
+void CBulkRegister::StartTransfers(HOST& host)
+{
+	while (host.nActive < m_nMaxPerHost && !host.pending.empty())
+	{
+		std::unique_ptr<TRANSFER> transfer = std::move(host.pending.front());
+		host.pending.pop_front();
+
+		CURL* pHandle = CCurlHandlePool::Instance().Acquire();
+		if (pHandle == nullptr)
+		{
+			m_nTransfers--;
+			Fail(*transfer->pJob, transfer->eStage, "Cannot create a curl handle");
+			continue;
+		}
+
+		for (const std::string& sHeader : transfer->request.headers)
+			transfer->pHeaders = curl_slist_append(transfer->pHeaders, sHeader.c_str());
+
+		curl_easy_setopt(pHandle, CURLOPT_URL, transfer->request.sUrl.c_str());
+		curl_easy_setopt(pHandle, CURLOPT_HTTPHEADER, transfer->pHeaders);
+		curl_easy_setopt(pHandle, CURLOPT_POST, 1L);
+		curl_easy_setopt(pHandle, CURLOPT_POSTFIELDS, transfer->request.sBody.c_str());
+		curl_easy_setopt(pHandle, CURLOPT_POSTFIELDSIZE, static_cast<long>(transfer->request.sBody.length()));
+		curl_easy_setopt(pHandle, CURLOPT_WRITEFUNCTION, WriteResponse);
+		curl_easy_setopt(pHandle, CURLOPT_WRITEDATA, &transfer->sResponse);
+		curl_easy_setopt(pHandle, CURLOPT_TIMEOUT, kBulkRegisterRequestTimeoutSec);
+		curl_easy_setopt(pHandle, CURLOPT_PRIVATE, transfer.get());
+
+		if (curl_multi_add_handle(m_pMulti, pHandle) != CURLM_OK)
+		{
+			curl_slist_free_all(transfer->pHeaders);
+			CCurlHandlePool::Instance().Release(pHandle);
+			m_nTransfers--;
+			Fail(*transfer->pJob, transfer->eStage, "Cannot start the request");
+			continue;
+		}
+
+		// The handle owns the transfer until it is done
+		host.nActive++;
+		transfer.release();
+	}
+}
+
+void CBulkRegister::OnTransferDone(CURL* pHandle, CURLcode eResult)
+{
+	char* pPrivate = nullptr;
+	curl_easy_getinfo(pHandle, CURLINFO_PRIVATE, &pPrivate);
+	std::unique_ptr<TRANSFER> transfer(reinterpret_cast<TRANSFER*>(pPrivate));
+
+	long nStatus = 0;
+	curl_easy_getinfo(pHandle, CURLINFO_RESPONSE_CODE, &nStatus);
+
+	// The connections stay with the multi handle for the next request to the host
+	curl_multi_remove_handle(m_pMulti, pHandle);
+	CCurlHandlePool::Instance().Release(pHandle);
+	curl_slist_free_all(transfer->pHeaders);
+	transfer->pHeaders = nullptr;
+
+	HOST& host = *transfer->pHost;
+	host.nActive--;
+	m_nTransfers--;
+
+	if (eResult != CURLE_OK)
+		Fail(*transfer->pJob, transfer->eStage, curl_easy_strerror(eResult));
+	else if (nStatus < 200 || nStatus >= 300)
+		Fail(*transfer->pJob, transfer->eStage, "HTTP " + std::to_string(nStatus) + ": " + transfer->sResponse);
+	else
+		Advance(*transfer);
+
+	StartTransfers(host);
+}
+
+void CBulkRegister::Advance(TRANSFER& transfer)
+{
+	JOB& job = *transfer.pJob;
+	if (job.bFailed)
+		return;
+
+	switch (transfer.eStage)
+	{
+	case BULK_STAGE_CHECKIN:
+	{
+		checkin_proto::AndroidCheckinResponse checkin;
+		if (!m_cRegister.ParseCheckInResponse(transfer.sResponse, checkin) ||
+			checkin.android_id() == 0 || checkin.security_token() == 0)
+		{
+			Fail(job, transfer.eStage, "CheckIn error");
+			return;
+		}
+
+		job.nAndroidId = checkin.android_id();
+		job.nSecurityToken = checkin.security_token();
+		Queue(job, BULK_STAGE_GCM_REGISTER);
+		break;
+	}
+	case BULK_STAGE_GCM_REGISTER:
+		job.sGcmToken = m_cRegister.ParseGCMRegisterResponse(transfer.sResponse);
+		if (job.sGcmToken.empty())
+		{
+			Fail(job, transfer.eStage, "Gcm register error");
+			return;
+		}
+
+		if (!job.sInstallationToken.empty())
+			Queue(job, BULK_STAGE_FCM_REGISTRATIONS);
+		break;
+	case BULK_STAGE_INSTALLATIONS:
+		job.sInstallationToken = m_cRegister.ParseInstallationsResponse(transfer.sResponse);
+		if (job.sInstallationToken.empty())
+		{
+			Fail(job, transfer.eStage, "Post installations error");
+			return;
+		}
+
+		if (!job.sGcmToken.empty())
+			Queue(job, BULK_STAGE_FCM_REGISTRATIONS);
+		break;
+	case BULK_STAGE_FCM_REGISTRATIONS:
+		job.sFcmToken = m_cRegister.ParseFcmRegistrationsResponse(transfer.sResponse);
+		if (job.sFcmToken.empty())
+		{
+			Fail(job, transfer.eStage, "Post FCM Registration error");
+			return;
+		}
+
+		m_Stats.nRegistered++;
+		break;
+	default:
+		break;
+	}
+}
+
+void CBulkRegister::Fail(JOB& job, BulkRegisterStage eStage, const std::string& sReason)
+{
+	// Check-in and installations run side by side, only the first failure counts
+	if (job.bFailed)
+		return;
+
+	job.bFailed = true;
+	m_Stats.nFailed[eStage]++;
+	FCM_LOG_ERROR(m_oLogger, "[CBulkRegister][ERROR] Identity ", job.nIndex, " failed at ", GetStageName(eStage), ": ", sReason);
+}
+
+void CBulkRegister::LogProgress()
+{
+	size_t nFailed = 0;
+	for (size_t nStage = 0; nStage < BULK_STAGE_COUNT; ++nStage)
+		nFailed += m_Stats.nFailed[nStage];
+
+	uint64_t nElapsedMs = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - m_StartTime).count());
+
+	FCM_LOG_INFO(m_oLogger, "[CBulkRegister][INFO] Registered ", m_Stats.nRegistered, " of ", m_Stats.nIdentities,
+		", failed ", nFailed, ", requests pending ", m_nTransfers,
+		", ", static_cast<uint64_t>(nElapsedMs > 0 ? m_Stats.nRegistered * 60000.0 / nElapsedMs : 0), " per minute");
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "FCMRegister.h"
+#include "LibCurlWrapper.h"
+
+constexpr size_t kBulkRegisterDefaultMaxPerHost = 8;
+constexpr long kBulkRegisterRequestTimeoutSec = 30;
+constexpr uint32_t kBulkRegisterProgressIntervalMs = 10 * 1000;
+
+enum BulkRegisterStage
+{
+	BULK_STAGE_KEYS,
+	BULK_STAGE_CHECKIN,
+	BULK_STAGE_GCM_REGISTER,
+	BULK_STAGE_INSTALLATIONS,
+	BULK_STAGE_FCM_REGISTRATIONS,
+	BULK_STAGE_COUNT
+};
+
+typedef struct _BULK_REGISTER_STATS
+{
+	size_t nIdentities;
+	size_t nRegistered;
+	size_t nFailed[BULK_STAGE_COUNT]; // identities lost at each stage
+	uint64_t nElapsedMs; // key generation included
+	double dPerMinute; // registered identities
+} BULK_REGISTER_STATS;
+
+/**
+ * Registers many identities at once.
+ *
+ * The ECDH keys are generated on a pool of threads first. Then every identity walks
+ * the same steps as CFCMRegister::RegisterToFCM, but all of them are driven together
+ * by one curl multi handle on the calling thread: check-in and Firebase Installations
+ * start at once, GCM register follows the check-in, and the FCM registration goes out
+ * when both tokens are in. Each host gets at most a fixed number of requests in flight,
+ * the rest wait their turn, and the connections to a host are kept alive and reused.
+ * The easy handles are borrowed from CCurlHandlePool, so they share its DNS and TLS
+ * session caches with every CLibCurlWrapper.
+ *
+ * An identity that fails a step is dropped, the others carry on.
+ */
+class CBulkRegister
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param nMaxPerHost The number of requests kept in flight per host.
+	 * @param nKeyThreadCount The number of threads generating keys, 0 uses one per hardware thread.
+	 */
+	CBulkRegister(const LogFnCallback oLogger, size_t nMaxPerHost = kBulkRegisterDefaultMaxPerHost, size_t nKeyThreadCount = 0);
+	~CBulkRegister();
+
+	CBulkRegister(const CBulkRegister&) = delete;
+	CBulkRegister& operator=(const CBulkRegister&) = delete;
+
+	/**
+	 * Adds an identity to register.
+	 *
+	 * @param params The Firebase project of the identity. Keys left empty are generated.
+	 */
+	void Add(const FCM_PARAMS& params);
+
+	/**
+	 * Registers every identity added, blocks until all of them succeeded or failed.
+	 *
+	 * @param registered [out] The registration data of the identities that succeeded, in the order they were added.
+	 * @return The counters of the run.
+	 */
+	BULK_REGISTER_STATS Run(std::vector<FCM_REGISTER_DATA_RETURN>& registered);
+
+	/**
+	 * @param eStage The stage.
+	 * @return The name of the stage for messages.
+	 */
+	static const char* GetStageName(BulkRegisterStage eStage);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct JOB
+	{
+		size_t nIndex = 0;
+		FCM_PARAMS params;
+		bool bKeysFailed = false;
+		uint64_t nAndroidId = 0;
+		uint64_t nSecurityToken = 0;
+		std::string sGcmToken;
+		std::string sInstallationToken;
+		std::string sFcmToken;
+		bool bFailed = false;
+	};
+
+	struct HOST;
+
+	struct TRANSFER
+	{
+		JOB* pJob;
+		BulkRegisterStage eStage;
+		HOST* pHost;
+		HTTP_REQUEST request;
+		curl_slist* pHeaders = nullptr;
+		std::string sResponse;
+	};
+
+	struct HOST
+	{
+		size_t nActive = 0;
+		std::deque<std::unique_ptr<TRANSFER>> pending;
+	};
+
+	void GenerateKeys();
+	void Queue(JOB& job, BulkRegisterStage eStage);
+	void StartTransfers(HOST& host);
+	void OnTransferDone(CURL* pHandle, CURLcode eResult);
+	void Advance(TRANSFER& transfer);
+	void Fail(JOB& job, BulkRegisterStage eStage, const std::string& sReason);
+	void LogProgress();
+
+private:
+	const LogFnCallback m_oLogger;
+	const size_t m_nMaxPerHost;
+	const size_t m_nKeyThreadCount;
+	CFCMRegister m_cRegister;
+
+	std::vector<std::unique_ptr<JOB>> m_Jobs;
+	BULK_REGISTER_STATS m_Stats;
+	Clock::time_point m_StartTime;
+
+	CURLM* m_pMulti = nullptr; // the easy handles come from CCurlHandlePool and go back to it
+	std::map<std::string, HOST> m_Hosts;
+	size_t m_nTransfers = 0; // queued and in flight
+};
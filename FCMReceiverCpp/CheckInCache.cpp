@@ -0,0 +1,281 @@
+#include "CheckInCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <codecvt>
+#include <locale>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef WINDOWS
+	const std::wstring& ToNativePath(const std::wstring& sPath)
+	{
+		return sPath;
+	}
+#else
+	std::string ToNativePath(const std::wstring& sPath)
+	{
+		return std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(sPath);
+	}
+#endif
+
+	// Keeps the latest time of every id and counts the lines, returns false if the file exists but cannot be read
+	bool LoadCheckInTimes(const std::wstring& sPath, std::unordered_map<std::string, std::time_t>& checkInTimes, size_t& nLines)
+	{
+		nLines = 0;
+		std::ifstream file(ToNativePath(sPath));
+		if (!file.is_open())
+			return true;
+
+		std::string sLine;
+		while (std::getline(file, sLine))
+		{
+			++nLines;
+			std::istringstream line(sLine);
+			std::string sAndroidId;
+			long long nTime = 0;
+			if (!(line >> sAndroidId >> nTime))
+				continue;
+
+			std::time_t& nLatest = checkInTimes[sAndroidId];
+			nLatest = (std::max)(nLatest, static_cast<std::time_t>(nTime));
+		}
+		return !file.bad();
+	}
+
+	// Processes sharing the cache file must not write the same temporary file
+	std::wstring TempPath(const std::wstring& sPath)
+	{
+#ifdef WINDOWS
+		unsigned long nProcessId = GetCurrentProcessId();
+#else
+		unsigned long nProcessId = static_cast<unsigned long>(getpid());
+#endif
+		return sPath + L"." + std::to_wstring(nProcessId) + L".tmp";
+	}
+
+	void RemoveFile(const std::wstring& sPath)
+	{
+#ifdef WINDOWS
+		DeleteFileW(sPath.c_str());
+#else
+		std::remove(ToNativePath(sPath).c_str());
+#endif
+	}
+}
+
+CCheckInCache::CCheckInCache(const ASocket::LogFnCallback oLogger, uint32_t nTtlSec) :
+	m_oLogger(oLogger),
+	m_nTtlSec(nTtlSec),
+	m_nFileLines(0),
+	m_bStopping(false)
+{
+}
+
+CCheckInCache::~CCheckInCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_CheckInMutex);
+		m_bStopping = true;
+	}
+	m_CheckInCondition.notify_all();
+
+	for (std::thread& thread : m_CheckInThreads)
+		thread.join();
+}
+
+bool CCheckInCache::Open(const std::wstring& sPath)
+{
+	std::lock_guard<std::mutex> saveLock(m_SaveMutex);
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_File.close();
+	m_sPath = sPath;
+	m_CheckInTimes.clear();
+
+	size_t nLines = 0;
+	if (!LoadCheckInTimes(sPath, m_CheckInTimes, nLines))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CCheckInCache][ERROR] Open: Cannot read the check-in cache");
+		return false;
+	}
+
+	// Compacts the lines appended since the last compaction to one per id
+	m_nFileLines = nLines;
+	if (nLines > m_CheckInTimes.size())
+	{
+		std::unordered_map<std::string, std::time_t> checkInTimes = m_CheckInTimes;
+		if (Save(sPath, checkInTimes))
+			m_nFileLines = checkInTimes.size();
+		else
+			FCM_LOG_WARNING(m_oLogger, "[CCheckInCache][WARNING] Open: Cannot compact the check-in cache");
+	}
+
+	m_File.open(ToNativePath(sPath), std::ios::app);
+	if (!m_File.is_open())
+		FCM_LOG_WARNING(m_oLogger, "[CCheckInCache][WARNING] Open: Cannot open the check-in cache for writing");
+	return true;
+}
+
+void CCheckInCache::SetTtl(uint32_t nTtlSec)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_nTtlSec = nTtlSec;
+}
+
+bool CCheckInCache::IsFresh(const std::string& sAndroidId)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_CheckInTimes.find(sAndroidId);
+	if (it == m_CheckInTimes.end())
+		return false;
+
+	// A clock set back gives a negative age, checking in again is the safe answer
+	std::time_t nAge = std::time(nullptr) - it->second;
+	return nAge >= 0 && nAge < static_cast<std::time_t>(m_nTtlSec);
+}
+
+void CCheckInCache::Record(const std::string& sAndroidId)
+{
+	std::time_t nNow = std::time(nullptr);
+	std::wstring sPath;
+	size_t nIds = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_CheckInTimes[sAndroidId] = nNow;
+		if (m_sPath.empty())
+			return;
+		sPath = m_sPath;
+		nIds = m_CheckInTimes.size();
+	}
+
+	// The file is written outside m_Mutex, IsFresh() is called from the event loops
+	std::lock_guard<std::mutex> saveLock(m_SaveMutex);
+	if (!m_File.is_open())
+		return;
+
+	// One line in a single write, a line cut short by a crash is skipped when loading
+	std::string sLine = sAndroidId + ' ' + std::to_string(static_cast<long long>(nNow)) + '\n';
+	if (!m_File.write(sLine.data(), static_cast<std::streamsize>(sLine.size())).flush())
+	{
+		FCM_LOG_WARNING(m_oLogger, "[CCheckInCache][WARNING] Record: Cannot save the check-in cache");
+		m_File.clear();
+		return;
+	}
+
+	if (++m_nFileLines <= kCheckInCompactFactor * nIds + kCheckInCompactMinLines)
+		return;
+
+	std::unordered_map<std::string, std::time_t> checkInTimes;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		checkInTimes = m_CheckInTimes;
+	}
+
+	// The file is replaced, the stream must not keep writing to the old one
+	m_File.close();
+	if (Save(sPath, checkInTimes))
+		m_nFileLines = checkInTimes.size();
+	else
+		FCM_LOG_WARNING(m_oLogger, "[CCheckInCache][WARNING] Record: Cannot compact the check-in cache");
+	m_File.open(ToNativePath(sPath), std::ios::app);
+
+	// Keeps the newer entries other processes saved
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	for (const auto& entry : checkInTimes)
+	{
+		std::time_t& nLatest = m_CheckInTimes[entry.first];
+		nLatest = (std::max)(nLatest, entry.second);
+	}
+}
+
+bool CCheckInCache::CheckInAsync(const std::string& sAndroidId, std::function<bool()> checkIn)
+{
+	if (IsFresh(sAndroidId))
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_CheckInMutex);
+		if (m_bStopping || !m_PendingIds.insert(sAndroidId).second)
+			return false;
+
+		m_CheckIns.emplace_back(sAndroidId, std::move(checkIn));
+		// One more thread while every thread has a check-in, up to kCheckInThreadCount
+		if (m_CheckInThreads.size() < kCheckInThreadCount && m_CheckInThreads.size() < m_PendingIds.size())
+			m_CheckInThreads.emplace_back(&CCheckInCache::CheckInThread, this);
+	}
+	m_CheckInCondition.notify_one();
+	return true;
+}
+
+void CCheckInCache::CheckInThread()
+{
+	std::unique_lock<std::mutex> lock(m_CheckInMutex);
+	for (;;)
+	{
+		m_CheckInCondition.wait(lock, [this]() { return m_bStopping || !m_CheckIns.empty(); });
+		if (m_bStopping)
+			return;
+
+		std::pair<std::string, std::function<bool()>> checkIn = std::move(m_CheckIns.front());
+		m_CheckIns.pop_front();
+		lock.unlock();
+
+		bool bSucceeded = false;
+		try
+		{
+			bSucceeded = checkIn.second();
+		}
+		catch (const std::exception& e)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CCheckInCache][ERROR] CheckInThread: Check-in failed: ", e.what());
+		}
+
+		if (bSucceeded)
+			Record(checkIn.first);
+
+		lock.lock();
+		m_PendingIds.erase(checkIn.first);
+	}
+}
+
+bool CCheckInCache::Save(const std::wstring& sPath, std::unordered_map<std::string, std::time_t>& checkInTimes)
+{
+	// Other processes may share the file, their newer entries are kept
+	size_t nLines = 0;
+	LoadCheckInTimes(sPath, checkInTimes, nLines);
+
+	std::wstring sTempPath = TempPath(sPath);
+	{
+		std::ofstream file(ToNativePath(sTempPath), std::ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		for (const auto& entry : checkInTimes)
+			file << entry.first << ' ' << static_cast<long long>(entry.second) << '\n';
+
+		if (!file.flush())
+		{
+			file.close();
+			RemoveFile(sTempPath);
+			return false;
+		}
+	}
+
+	// Readers see the old file or the new one, never a partial write
+#ifdef WINDOWS
+	bool bRenamed = MoveFileExW(sTempPath.c_str(), sPath.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+	bool bRenamed = std::rename(ToNativePath(sTempPath).c_str(), ToNativePath(sPath).c_str()) == 0;
+#endif
+	if (!bRenamed)
+		RemoveFile(sTempPath);
+	return bRenamed;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "LogUtil.h"
+#include "SecureSocket/Socket.h"
+
+constexpr uint32_t kCheckInDefaultTtlSec = 12 * 60 * 60;
+constexpr size_t kCheckInThreadCount = 4;
+// The cache file is compacted once it has more lines than this many per id, plus kCheckInCompactMinLines
+constexpr size_t kCheckInCompactFactor = 2;
+constexpr size_t kCheckInCompactMinLines = 64;
+
+/**
+ * Remembers when each android id last checked in successfully, so a connect within the
+ * TTL skips the check-in round trip, and runs the check-ins on a few threads of its own
+ * so the event loops that connect the sessions never wait for them.
+ *
+ * The times are kept in a file of "<android id> <unix time>" lines, one appended on every
+ * successful check-in, so restarted processes share what was learned. The latest line of
+ * an id wins. Open() and the check-in that takes the file past kCheckInCompactFactor lines
+ * per id compact it to one line per id: each process writes its own temporary file and
+ * renames it over the cache, a line another process appends meanwhile may be dropped, which
+ * only costs one more check-in. Thread safe.
+ */
+class CCheckInCache
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param nTtlSec How long a check-in stays valid, 0 checks in on every connect.
+	 */
+	explicit CCheckInCache(const ASocket::LogFnCallback oLogger, uint32_t nTtlSec = kCheckInDefaultTtlSec);
+
+	/**
+	 * Waits for the running check-ins, the queued ones are dropped.
+	 */
+	~CCheckInCache();
+
+	CCheckInCache(const CCheckInCache&) = delete;
+	CCheckInCache& operator=(const CCheckInCache&) = delete;
+
+	/**
+	 * Loads the check-in times, a missing file is an empty cache, and compacts the file.
+	 *
+	 * @param sPath The cache file.
+	 * @return False if the file exists but cannot be read.
+	 */
+	bool Open(const std::wstring& sPath);
+
+	void SetTtl(uint32_t nTtlSec);
+
+	/**
+	 * @param sAndroidId The android id.
+	 * @return True if the id checked in less than the TTL ago.
+	 */
+	bool IsFresh(const std::string& sAndroidId);
+
+	/**
+	 * Records a successful check-in and appends it to the cache if a file was opened.
+	 *
+	 * @param sAndroidId The android id.
+	 */
+	void Record(const std::string& sAndroidId);
+
+	/**
+	 * Queues a check-in unless the id checked in less than the TTL ago or one of its
+	 * check-ins is already queued or running. It is recorded when it succeeds.
+	 *
+	 * @param sAndroidId The android id.
+	 * @param checkIn Does the check-in on a cache thread, returns whether it succeeded.
+	 * @return False if the check-in was skipped.
+	 */
+	bool CheckInAsync(const std::string& sAndroidId, std::function<bool()> checkIn);
+
+private:
+	bool Save(const std::wstring& sPath, std::unordered_map<std::string, std::time_t>& checkInTimes);
+	void CheckInThread();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+
+	std::mutex m_Mutex;
+	std::wstring m_sPath;
+	uint32_t m_nTtlSec;
+	std::unordered_map<std::string, std::time_t> m_CheckInTimes;
+
+	// Serializes the file writes, which happen outside m_Mutex, and guards the two below
+	std::mutex m_SaveMutex;
+	std::ofstream m_File; // appends to m_sPath
+	size_t m_nFileLines;
+
+	std::mutex m_CheckInMutex;
+	std::condition_variable m_CheckInCondition;
+	std::deque<std::pair<std::string, std::function<bool()>>> m_CheckIns;
+	std::unordered_set<std::string> m_PendingIds; // queued or running
+	std::vector<std::thread> m_CheckInThreads; // started by the first check-in
+	bool m_bStopping;
+};
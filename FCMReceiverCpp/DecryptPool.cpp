@@ -0,0 +1,165 @@
+#include "DecryptPool.h"
+
+#include <new>
+
+CDecryptPool::CDecryptPool(const ASocket::LogFnCallback oLogger, size_t nWorkerCount, size_t nQueueCapacity) :
+	m_oLogger(oLogger),
+	m_Queue(nQueueCapacity),
+	m_nSleeping(0),
+	m_bStopped(false),
+	m_nBusy(0),
+	m_nCompleted(0),
+	m_nRejected(0),
+	m_nBusyNs(0),
+	m_LastMetricsTime(Clock::now()),
+	m_nLastBusyNs(0)
+{
+	if (nWorkerCount == 0)
+		nWorkerCount = std::thread::hardware_concurrency();
+	if (nWorkerCount == 0)
+		nWorkerCount = 1;
+
+	for (size_t i = 0; i < nWorkerCount; ++i)
+		m_Workers.emplace_back([this]() { WorkerThread(); });
+}
+
+CDecryptPool::~CDecryptPool()
+{
+	Stop();
+}
+
+bool CDecryptPool::Submit(DECRYPT_JOB& job)
+{
+	if (m_bStopped || !m_Queue.TryPush(job))
+	{
+		m_nRejected++;
+		return false;
+	}
+
+	// Pairs with the sleeper count a worker raises before it checks the queue one last time
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_nSleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_WaitMutex);
+		m_WaitCondition.notify_one();
+	}
+	return true;
+}
+
+void CDecryptPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_WaitMutex);
+		if (m_bStopped)
+			return;
+		m_bStopped = true;
+	}
+	m_WaitCondition.notify_all();
+
+	for (std::thread& worker : m_Workers)
+		worker.join();
+}
+
+DECRYPT_POOL_METRICS CDecryptPool::GetMetrics(bool bUtilization)
+{
+	DECRYPT_POOL_METRICS metrics;
+	metrics.nQueueDepth = m_Queue.Size();
+	metrics.nQueueCapacity = m_Queue.Capacity();
+	metrics.nWorkers = m_Workers.size();
+	metrics.nBusyWorkers = m_nBusy;
+	metrics.nCompleted = m_nCompleted;
+	metrics.nRejected = m_nRejected;
+	metrics.nBusyNs = m_nBusyNs;
+	metrics.dUtilization = 0;
+	if (!bUtilization)
+		return metrics;
+
+	std::lock_guard<std::mutex> lock(m_MetricsMutex);
+	Clock::time_point now = Clock::now();
+	uint64_t nBusyNs = metrics.nBusyNs;
+	uint64_t nElapsedNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_LastMetricsTime).count());
+
+	if (nElapsedNs > 0 && !m_Workers.empty())
+		metrics.dUtilization = static_cast<double>(nBusyNs - m_nLastBusyNs) / (static_cast<double>(nElapsedNs) * m_Workers.size());
+	if (metrics.dUtilization > 1)
+		metrics.dUtilization = 1;
+
+	m_LastMetricsTime = now;
+	m_nLastBusyNs = nBusyNs;
+	return metrics;
+}
+
+DECRYPT_RESULT CDecryptPool::Decrypt(const DECRYPT_JOB& job)
+{
+	DECRYPT_RESULT result;
+	result.nDecryptNs = 0;
+
+	size_t nPlaintextLen = ece_aesgcm_plaintext_max_length(job.nRecordSize, job.ciphertext.size());
+	if (nPlaintextLen == 0)
+	{
+		result.nErrorCode = ECE_ERROR_DECRYPT;
+		return result;
+	}
+
+	Clock::time_point start = Clock::now();
+
+	// The plaintext is written straight into the result, it is handed over without another copy
+	result.sPlainText.resize(nPlaintextLen);
+	result.nErrorCode = ece_webpush_aesgcm_decrypt_with_ctx(
+		job.ctx.get(), job.salt, ECE_SALT_LENGTH, job.rawSenderPubKey,
+		ECE_WEBPUSH_PUBLIC_KEY_LENGTH, job.nRecordSize, job.ciphertext.data(), job.ciphertext.size(),
+		reinterpret_cast<uint8_t*>(&result.sPlainText[0]), &nPlaintextLen);
+	result.nDecryptNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+
+	result.sPlainText.resize(result.nErrorCode == ECE_OK ? nPlaintextLen : 0);
+	return result;
+}
+
+void CDecryptPool::WorkerThread()
+{
+	DECRYPT_JOB job;
+	for (;;)
+	{
+		if (m_Queue.TryPop(job))
+		{
+			m_nBusy++;
+			Clock::time_point start = Clock::now();
+
+			// Every job completes, the client holds later messages back until it does
+			DECRYPT_RESULT result;
+			try
+			{
+				result = Decrypt(job);
+			}
+			catch (const std::bad_alloc&)
+			{
+				result.nErrorCode = ECE_ERROR_OUT_OF_MEMORY;
+				result.nDecryptNs = 0;
+			}
+			try
+			{
+				job.onDone(result);
+			}
+			catch (const std::exception& e)
+			{
+				FCM_LOG_ERROR(m_oLogger, "[CDecryptPool][ERROR] Job completion failed: ", e.what());
+			}
+			job = DECRYPT_JOB();
+
+			m_nBusyNs += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+			m_nCompleted++;
+			m_nBusy--;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_WaitMutex);
+		m_nSleeping++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_WaitCondition.wait(lock, [this]() { return m_bStopped || m_Queue.Size() > 0; });
+		m_nSleeping--;
+
+		// Queued jobs are still finished after Stop()
+		if (m_bStopped && m_Queue.Size() == 0)
+			return;
+	}
+}
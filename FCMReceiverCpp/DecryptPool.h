@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "LogUtil.h"
+#include "Http_ece/ece.h"
+#include "SecureSocket/Socket.h"
+
+constexpr size_t kDecryptQueueDefaultCapacity = 4096;
+
+typedef struct _DECRYPT_RESULT
+{
+	int nErrorCode;
+	std::string sPlainText;
+	uint64_t nDecryptNs; // time spent in ece_webpush_aesgcm_decrypt_with_ctx
+} DECRYPT_RESULT;
+
+/**
+ * One "aesgcm" message to decrypt. onDone runs on the thread that decrypted it.
+ */
+typedef struct _DECRYPT_JOB
+{
+	std::shared_ptr<const ece_webpush_decrypt_ctx_t> ctx;
+	uint8_t salt[ECE_SALT_LENGTH];
+	uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+	uint32_t nRecordSize;
+	std::vector<uint8_t> ciphertext;
+	std::function<void(DECRYPT_RESULT&)> onDone;
+} DECRYPT_JOB;
+
+typedef struct _DECRYPT_POOL_METRICS
+{
+	size_t nQueueDepth;
+	size_t nQueueCapacity;
+	size_t nWorkers;
+	size_t nBusyWorkers;
+	uint64_t nCompleted;
+	uint64_t nRejected; // Submit() calls that found the queue full
+	double dUtilization; // share of worker time spent decrypting since the last call, 0 to 1
+	uint64_t nBusyNs; // worker time spent decrypting since the start
+} DECRYPT_POOL_METRICS;
+
+/**
+ * Decrypts Web Push messages on a fixed pool of worker threads, so ECDH, HKDF and
+ * AES-GCM do not hold up the event loops that read the sockets.
+ *
+ * Jobs go through a bounded lock-free queue. Workers sleep only when it is empty.
+ */
+class CDecryptPool
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param nWorkerCount The number of worker threads, 0 uses one per hardware thread.
+	 * @param nQueueCapacity The number of jobs that may wait for a worker.
+	 */
+	CDecryptPool(const ASocket::LogFnCallback oLogger, size_t nWorkerCount = 0, size_t nQueueCapacity = kDecryptQueueDefaultCapacity);
+	~CDecryptPool();
+
+	CDecryptPool(const CDecryptPool&) = delete;
+	CDecryptPool& operator=(const CDecryptPool&) = delete;
+
+	/**
+	 * Queues a job. Thread safe.
+	 *
+	 * @param job The job, moved from only on success.
+	 * @return True if queued, false if the queue is full or the pool is stopped. The caller
+	 * should then decrypt the job itself, which also slows down its socket reads.
+	 */
+	bool Submit(DECRYPT_JOB& job);
+
+	/**
+	 * Finishes the queued jobs and joins the workers.
+	 */
+	void Stop();
+
+	/**
+	 * @param bUtilization False to leave dUtilization at 0 and the utilization window running,
+	 * so a second reader does not shorten the first one's window.
+	 * @return Queue depth and worker utilization. Thread safe.
+	 */
+	DECRYPT_POOL_METRICS GetMetrics(bool bUtilization = true);
+
+	/**
+	 * Decrypts a job on the calling thread.
+	 *
+	 * @param job The job.
+	 * @return The plaintext, or the ECE error code.
+	 */
+	static DECRYPT_RESULT Decrypt(const DECRYPT_JOB& job);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void WorkerThread();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+
+	CBoundedQueue<DECRYPT_JOB> m_Queue;
+	std::vector<std::thread> m_Workers;
+
+	std::mutex m_WaitMutex;
+	std::condition_variable m_WaitCondition;
+	std::atomic<size_t> m_nSleeping;
+	std::atomic<bool> m_bStopped;
+
+	std::atomic<size_t> m_nBusy;
+	std::atomic<uint64_t> m_nCompleted;
+	std::atomic<uint64_t> m_nRejected;
+	std::atomic<uint64_t> m_nBusyNs;
+
+	std::mutex m_MetricsMutex;
+	Clock::time_point m_LastMetricsTime;
+	uint64_t m_nLastBusyNs;
+};
@@ -0,0 +1,258 @@
+#include "EceHeaderParser.h"
+
+#include <array>
+
+#include "FastBase64.h"
+#include "Http_ece/ece.h"
+
+namespace
+{
+	constexpr uint32_t kDefaultRecordSize = 4096;
+
+	constexpr uint8_t kSpaceChar = 1;
+	constexpr uint8_t kNameChar = 2;
+	constexpr uint8_t kValueChar = 4; // both base64 alphabets, base64_decode() used to accept either
+	constexpr uint8_t kQuotedChar = 8; // values and '='
+
+	constexpr std::array<uint8_t, 256> MakeCharClasses()
+	{
+		std::array<uint8_t, 256> classes = {};
+		for (int c = 0; c < 256; ++c)
+		{
+			bool bName = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+			bool bValue = bName || c == '+' || c == '/';
+			classes[c] = static_cast<uint8_t>((c == ' ' || c == '\t' ? kSpaceChar : 0) | (bName ? kNameChar : 0) |
+				(bValue ? kValueChar : 0) | (bValue || c == '=' ? kQuotedChar : 0));
+		}
+		return classes;
+	}
+
+	// One lookup per character, the values are most of every header
+	constexpr std::array<uint8_t, 256> kCharClasses = MakeCharClasses();
+
+	// Returns the position of the first character from nPos on outside nClass
+	size_t Scan(std::string_view sHeader, size_t nPos, uint8_t nClass)
+	{
+		while (nPos < sHeader.size() && (kCharClasses[static_cast<uint8_t>(sHeader[nPos])] & nClass))
+			++nPos;
+		return nPos;
+	}
+
+	// Header parameter names are case insensitive, szName is lower case
+	bool NameIs(const ECE_HEADER_PAIR& pair, const char* szName)
+	{
+		size_t nIndex = 0;
+		for (; nIndex < pair.sName.size(); ++nIndex)
+		{
+			char c = pair.sName[nIndex];
+			if (c >= 'A' && c <= 'Z')
+				c = static_cast<char>(c - 'A' + 'a');
+			if (szName[nIndex] != c)
+				return false;
+		}
+		return szName[nIndex] == '\0';
+	}
+
+	bool ParseRecordSize(std::string_view sValue, uint32_t& nRecordSize)
+	{
+		uint64_t nValue = 0;
+		for (char c : sValue)
+		{
+			if (c < '0' || c > '9')
+				return false;
+			nValue = nValue * 10 + (c - '0');
+			if (nValue > UINT32_MAX)
+				return false;
+		}
+
+		nRecordSize = static_cast<uint32_t>(nValue);
+		return !sValue.empty() && nRecordSize >= ECE_AESGCM_MIN_RS;
+	}
+
+	bool DecodeExact(std::string_view sValue, uint8_t* pOut, size_t nSize)
+	{
+		size_t nDecodedLen = 0;
+		return FastBase64::Decode(sValue, pOut, nSize, nDecodedLen) && nDecodedLen == nSize;
+	}
+}
+
+CEceHeaderReader::CEceHeaderReader(std::string_view sHeader) :
+	m_sHeader(sHeader),
+	m_nPos(0),
+	m_nParam(0),
+	m_bDone(false),
+	m_bFailed(false)
+{
+}
+
+bool CEceHeaderReader::Next(ECE_HEADER_PAIR& pair)
+{
+	if (m_bDone || m_bFailed)
+		return false;
+
+	pair.nParam = m_nParam;
+
+	SkipSpaces();
+	size_t nStart = m_nPos;
+	m_nPos = Scan(m_sHeader, m_nPos, kNameChar);
+	if (m_nPos == nStart)
+		return Fail();
+	pair.sName = m_sHeader.substr(nStart, m_nPos - nStart);
+
+	SkipSpaces();
+	if (m_nPos == m_sHeader.size() || m_sHeader[m_nPos] != '=')
+		return Fail();
+	++m_nPos;
+	SkipSpaces();
+
+	if (m_nPos < m_sHeader.size() && m_sHeader[m_nPos] == '"')
+	{
+		nStart = ++m_nPos;
+		m_nPos = Scan(m_sHeader, m_nPos, kQuotedChar);
+		// Empty and unterminated quoted strings are invalid
+		if (m_nPos == nStart || m_nPos == m_sHeader.size() || m_sHeader[m_nPos] != '"')
+			return Fail();
+		pair.sValue = m_sHeader.substr(nStart, m_nPos - nStart);
+		++m_nPos;
+	}
+	else
+	{
+		nStart = m_nPos;
+		m_nPos = Scan(m_sHeader, m_nPos, kValueChar);
+		if (m_nPos == nStart)
+			return Fail();
+		// Padding only at the end, a '=' in the middle would start another pair
+		while (m_nPos < m_sHeader.size() && m_sHeader[m_nPos] == '=')
+			++m_nPos;
+		pair.sValue = m_sHeader.substr(nStart, m_nPos - nStart);
+	}
+
+	SkipSpaces();
+	if (m_nPos == m_sHeader.size())
+	{
+		m_bDone = true;
+		return true;
+	}
+
+	// A separator has to be followed by another pair, Next() fails on a trailing one
+	switch (m_sHeader[m_nPos++])
+	{
+	case ',':
+		++m_nParam;
+		return true;
+	case ';':
+		return true;
+	default:
+		return Fail();
+	}
+}
+
+void CEceHeaderReader::SkipSpaces()
+{
+	m_nPos = Scan(m_sHeader, m_nPos, kSpaceChar);
+}
+
+bool CEceHeaderReader::Fail()
+{
+	m_bFailed = true;
+	return false;
+}
+
+int EceHeaderParser::ExtractAesgcmParams(std::string_view sCryptoKey, std::string_view sEncryption,
+	uint8_t* salt, uint8_t* rawSenderPubKey, uint32_t& nRecordSize)
+{
+	ECE_HEADER_PAIR pair;
+
+	std::string_view sKeyId;
+	std::string_view sSalt;
+	bool bHasKeyId = false;
+	bool bHasRecordSize = false;
+	bool bHasSalt = false;
+	uint32_t nParsedRecordSize = kDefaultRecordSize;
+
+	CEceHeaderReader cEncryption(sEncryption);
+	while (cEncryption.Next(pair))
+	{
+		// Only the first parameter describes the message, the rest is only validated
+		if (pair.nParam != 0)
+			continue;
+
+		if (NameIs(pair, "keyid"))
+		{
+			if (bHasKeyId)
+				return ECE_ERROR_INVALID_ENCRYPTION_HEADER;
+			sKeyId = pair.sValue;
+			bHasKeyId = true;
+		}
+		else if (NameIs(pair, "rs"))
+		{
+			if (bHasRecordSize)
+				return ECE_ERROR_INVALID_ENCRYPTION_HEADER;
+			if (!ParseRecordSize(pair.sValue, nParsedRecordSize))
+				return ECE_ERROR_INVALID_RS;
+			bHasRecordSize = true;
+		}
+		else if (NameIs(pair, "salt"))
+		{
+			if (bHasSalt)
+				return ECE_ERROR_INVALID_ENCRYPTION_HEADER;
+			sSalt = pair.sValue;
+			bHasSalt = true;
+		}
+	}
+	if (cEncryption.Failed())
+		return ECE_ERROR_INVALID_ENCRYPTION_HEADER;
+
+	if (!bHasSalt || !DecodeExact(sSalt, salt, ECE_SALT_LENGTH))
+		return ECE_ERROR_INVALID_SALT;
+
+	// The first parameter that matches is used, the first dh in it
+	std::string_view sDh;
+	std::string_view sParamDh;
+	size_t nParam = 0;
+	bool bParamMatches = !bHasKeyId;
+	bool bFound = false;
+
+	CEceHeaderReader cCryptoKey(sCryptoKey);
+	while (cCryptoKey.Next(pair))
+	{
+		if (pair.nParam != nParam)
+		{
+			if (!bFound && bParamMatches)
+			{
+				sDh = sParamDh;
+				bFound = true;
+			}
+			nParam = pair.nParam;
+			sParamDh = std::string_view();
+			bParamMatches = false;
+		}
+
+		if (bFound)
+			continue;
+
+		if (NameIs(pair, "dh"))
+		{
+			if (sParamDh.empty())
+				sParamDh = pair.sValue;
+		}
+		else if (bHasKeyId && NameIs(pair, "keyid") && pair.sValue == sKeyId)
+		{
+			bParamMatches = true;
+		}
+	}
+	if (cCryptoKey.Failed())
+		return ECE_ERROR_INVALID_CRYPTO_KEY_HEADER;
+
+	if (!bFound && bParamMatches)
+	{
+		sDh = sParamDh;
+		bFound = true;
+	}
+
+	if (!bFound || sDh.empty() || !DecodeExact(sDh, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH))
+		return ECE_ERROR_INVALID_DH;
+
+	nRecordSize = nParsedRecordSize;
+	return ECE_OK;
+}
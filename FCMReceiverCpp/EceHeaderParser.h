@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+typedef struct _ECE_HEADER_PAIR
+{
+	std::string_view sName;
+	std::string_view sValue; // without the quotes of a quoted value
+	size_t nParam; // index of the ','-separated parameter the pair belongs to
+} ECE_HEADER_PAIR;
+
+/**
+ * Reads the name=value pairs of a Crypto-Key or Encryption header value, in order and
+ * without allocating. The grammar is the one Http_ece/params.c parses:
+ *
+ *   header = param *( OWS "," OWS param )
+ *   param  = pair *( OWS ";" OWS pair )
+ *   pair   = name OWS "=" OWS ( token | quoted-string )
+ *
+ * Tokens are base64 or base64url characters with optional '=' padding, quoted strings
+ * the same without escapes. Every view points into the header.
+ */
+class CEceHeaderReader
+{
+public:
+	explicit CEceHeaderReader(std::string_view sHeader);
+
+	/**
+	 * @param pair [out] The next pair.
+	 * @return False at the end of the header or when it is malformed, see Failed().
+	 */
+	bool Next(ECE_HEADER_PAIR& pair);
+
+	bool Failed() const { return m_bFailed; }
+
+private:
+	void SkipSpaces();
+	bool Fail();
+
+private:
+	const std::string_view m_sHeader;
+	size_t m_nPos;
+	size_t m_nParam;
+	bool m_bDone;
+	bool m_bFailed;
+};
+
+namespace EceHeaderParser
+{
+	/**
+	 * Extracts the aesgcm parameters of a message, as ece_webpush_aesgcm_headers_extract_params()
+	 * does, in one pass over each header and without allocating.
+	 *
+	 * The salt, keyid and rs come from the first parameter of the Encryption header. The
+	 * public key is the dh of the Crypto-Key parameter whose keyid matches, or of the first
+	 * parameter when there is no keyid. Other pairs, such as p256ecdsa, are skipped.
+	 *
+	 * @param sCryptoKey The crypto-key app_data value.
+	 * @param sEncryption The encryption app_data value.
+	 * @param salt [out] ECE_SALT_LENGTH bytes.
+	 * @param rawSenderPubKey [out] ECE_WEBPUSH_PUBLIC_KEY_LENGTH bytes.
+	 * @param nRecordSize [out] The rs, 4096 when the header has none.
+	 * @return ECE_OK, or ECE_ERROR_INVALID_ENCRYPTION_HEADER, ECE_ERROR_INVALID_CRYPTO_KEY_HEADER,
+	 *         ECE_ERROR_INVALID_RS, ECE_ERROR_INVALID_SALT or ECE_ERROR_INVALID_DH.
+	 */
+	int ExtractAesgcmParams(std::string_view sCryptoKey, std::string_view sEncryption,
+		uint8_t* salt, uint8_t* rawSenderPubKey, uint32_t& nRecordSize);
+}
@@ -0,0 +1,370 @@
+#include "EventLoop.h"
+
+#include <stdexcept>
+#include <string>
+
+#ifndef WINDOWS
+#include <sys/eventfd.h>
+#endif
+
+namespace
+{
+	constexpr size_t kMaxEventsPerPoll = 256;
+
+#ifndef WINDOWS
+	uint32_t ToEpollEvents(uint32_t nEvents)
+	{
+		uint32_t nEpollEvents = 0;
+		if (nEvents & EVENT_READ)
+			nEpollEvents |= EPOLLIN | EPOLLRDHUP;
+		if (nEvents & EVENT_WRITE)
+			nEpollEvents |= EPOLLOUT;
+		return nEpollEvents;
+	}
+
+	uint32_t FromEpollEvents(uint32_t nEpollEvents)
+	{
+		uint32_t nEvents = 0;
+		if (nEpollEvents & (EPOLLIN | EPOLLRDHUP))
+			nEvents |= EVENT_READ;
+		if (nEpollEvents & EPOLLOUT)
+			nEvents |= EVENT_WRITE;
+		if (nEpollEvents & (EPOLLERR | EPOLLHUP))
+			nEvents |= EVENT_ERROR;
+		return nEvents;
+	}
+#else
+	SHORT ToPollEvents(uint32_t nEvents)
+	{
+		SHORT nPollEvents = 0;
+		if (nEvents & EVENT_READ)
+			nPollEvents |= POLLRDNORM;
+		if (nEvents & EVENT_WRITE)
+			nPollEvents |= POLLWRNORM;
+		return nPollEvents;
+	}
+
+	uint32_t FromPollEvents(SHORT nPollEvents)
+	{
+		uint32_t nEvents = 0;
+		if (nPollEvents & POLLRDNORM)
+			nEvents |= EVENT_READ;
+		if (nPollEvents & POLLWRNORM)
+			nEvents |= EVENT_WRITE;
+		if (nPollEvents & (POLLERR | POLLHUP | POLLNVAL))
+			nEvents |= EVENT_ERROR;
+		return nEvents;
+	}
+#endif
+}
+
+CEventLoop::CEventLoop(const ASocket::LogFnCallback oLogger) :
+	m_oLogger(oLogger),
+	m_StartTime(Clock::now()),
+	m_bStopped(false),
+	m_LoopThreadId(std::this_thread::get_id())
+{
+#ifdef WINDOWS
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		throw std::runtime_error("WSAStartup failed");
+
+	// A UDP socket connected to itself stands in for eventfd, WSAPoll only accepts sockets
+	m_WakeupSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int nAddrLen = sizeof(addr);
+	u_long nNonBlocking = 1;
+	if (m_WakeupSocket == INVALID_SOCKET ||
+		bind(m_WakeupSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR ||
+		getsockname(m_WakeupSocket, reinterpret_cast<sockaddr*>(&addr), &nAddrLen) == SOCKET_ERROR ||
+		connect(m_WakeupSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR ||
+		ioctlsocket(m_WakeupSocket, FIONBIO, &nNonBlocking) == SOCKET_ERROR)
+	{
+		if (m_WakeupSocket != INVALID_SOCKET)
+			closesocket(m_WakeupSocket);
+		WSACleanup();
+		throw std::runtime_error("Cannot create event loop wakeup socket");
+	}
+#else
+	m_nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_nEpollFd < 0)
+		throw std::runtime_error("epoll_create1 failed");
+
+	m_nWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_nWakeupFd < 0)
+	{
+		close(m_nEpollFd);
+		throw std::runtime_error("eventfd failed");
+	}
+
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = m_nWakeupFd;
+	if (epoll_ctl(m_nEpollFd, EPOLL_CTL_ADD, m_nWakeupFd, &event) < 0)
+	{
+		close(m_nWakeupFd);
+		close(m_nEpollFd);
+		throw std::runtime_error("Cannot watch event loop wakeup fd");
+	}
+
+	m_EpollEvents.resize(kMaxEventsPerPoll);
+#endif
+}
+
+CEventLoop::~CEventLoop()
+{
+#ifdef WINDOWS
+	closesocket(m_WakeupSocket);
+	WSACleanup();
+#else
+	close(m_nWakeupFd);
+	close(m_nEpollFd);
+#endif
+}
+
+bool CEventLoop::AddSocket(ASocket::Socket sd, uint32_t nEvents, IoCallback callback)
+{
+	if (m_Handlers.count(sd) > 0)
+		return false;
+
+#ifndef WINDOWS
+	epoll_event event = {};
+	event.events = ToEpollEvents(nEvents);
+	event.data.fd = sd;
+	if (epoll_ctl(m_nEpollFd, EPOLL_CTL_ADD, sd, &event) < 0)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CEventLoop][ERROR] AddSocket: epoll_ctl failed with errno ", errno);
+		return false;
+	}
+#endif
+
+	m_Handlers[sd] = std::make_shared<IoHandler>(IoHandler{ nEvents, std::move(callback) });
+	return true;
+}
+
+bool CEventLoop::ModifySocket(ASocket::Socket sd, uint32_t nEvents)
+{
+	auto it = m_Handlers.find(sd);
+	if (it == m_Handlers.end())
+		return false;
+
+	if (it->second->nEvents == nEvents)
+		return true;
+
+#ifndef WINDOWS
+	epoll_event event = {};
+	event.events = ToEpollEvents(nEvents);
+	event.data.fd = sd;
+	if (epoll_ctl(m_nEpollFd, EPOLL_CTL_MOD, sd, &event) < 0)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CEventLoop][ERROR] ModifySocket: epoll_ctl failed with errno ", errno);
+		return false;
+	}
+#endif
+
+	it->second->nEvents = nEvents;
+	return true;
+}
+
+void CEventLoop::RemoveSocket(ASocket::Socket sd)
+{
+	auto it = m_Handlers.find(sd);
+	if (it == m_Handlers.end())
+		return;
+
+#ifndef WINDOWS
+	epoll_ctl(m_nEpollFd, EPOLL_CTL_DEL, sd, nullptr);
+#endif
+
+	m_Handlers.erase(it);
+}
+
+TimerId CEventLoop::AddTimer(uint32_t nDelayMs, Task callback)
+{
+	return m_TimerWheel.Schedule(NowTick() + nDelayMs, std::move(callback));
+}
+
+bool CEventLoop::CancelTimer(TimerId nTimerId)
+{
+	return m_TimerWheel.Cancel(nTimerId);
+}
+
+void CEventLoop::Post(Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_PostMutex);
+		m_PostedTasks.push_back(std::move(task));
+	}
+	Wakeup();
+}
+
+void CEventLoop::Run()
+{
+	m_LoopThreadId = std::this_thread::get_id();
+
+	// A Stop() issued before Run() is honoured, Run() consumes it so the loop can run again
+	while (!m_bStopped.exchange(false))
+	{
+		RunOnce();
+	}
+}
+
+void CEventLoop::RunOnce(int nMaxWaitMs)
+{
+	Poll(NextTimeoutMs(nMaxWaitMs));
+	RunTimers();
+	RunPostedTasks();
+}
+
+void CEventLoop::Stop()
+{
+	m_bStopped = true;
+	Wakeup();
+}
+
+uint64_t CEventLoop::NowTick() const
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - m_StartTime).count());
+}
+
+void CEventLoop::Wakeup()
+{
+#ifdef WINDOWS
+	char cByte = 0;
+	send(m_WakeupSocket, &cByte, 1, 0);
+#else
+	uint64_t nOne = 1;
+	ssize_t nWritten = write(m_nWakeupFd, &nOne, sizeof(nOne));
+	(void)nWritten;
+#endif
+}
+
+void CEventLoop::DrainWakeup()
+{
+#ifdef WINDOWS
+	char buf[64];
+	while (recv(m_WakeupSocket, buf, sizeof(buf), 0) > 0)
+	{
+	}
+#else
+	uint64_t nCount;
+	ssize_t nRead = read(m_nWakeupFd, &nCount, sizeof(nCount));
+	(void)nRead;
+#endif
+}
+
+int CEventLoop::NextTimeoutMs(int nMaxWaitMs) const
+{
+	{
+		std::lock_guard<std::mutex> lock(m_PostMutex);
+		if (!m_PostedTasks.empty())
+			return 0;
+	}
+
+	if (m_TimerWheel.Empty())
+		return nMaxWaitMs;
+
+	// The wheel may ask for an early wakeup to move a timer down a level, that costs one empty iteration
+	uint64_t nNextTick = m_TimerWheel.NextEventTick();
+	uint64_t nNowTick = NowTick();
+	if (nNextTick <= nNowTick)
+		return 0;
+
+	uint64_t nUntilNext = nNextTick - nNowTick;
+	if (nMaxWaitMs >= 0 && static_cast<uint64_t>(nMaxWaitMs) < nUntilNext)
+		return nMaxWaitMs;
+	return nUntilNext < INT32_MAX ? static_cast<int>(nUntilNext) : INT32_MAX;
+}
+
+void CEventLoop::Poll(int nTimeoutMs)
+{
+#ifdef WINDOWS
+	m_PollFds.clear();
+	m_PollFds.push_back({ m_WakeupSocket, POLLRDNORM, 0 });
+	for (const auto& handler : m_Handlers)
+		m_PollFds.push_back({ handler.first, ToPollEvents(handler.second->nEvents), 0 });
+
+	int nReady = WSAPoll(m_PollFds.data(), static_cast<ULONG>(m_PollFds.size()), nTimeoutMs);
+	if (nReady == SOCKET_ERROR)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CEventLoop][ERROR] Poll: WSAPoll failed with error ", WSAGetLastError());
+		return;
+	}
+
+	for (const WSAPOLLFD& pollFd : m_PollFds)
+	{
+		if (nReady <= 0)
+			break;
+		if (pollFd.revents == 0)
+			continue;
+
+		nReady--;
+		if (pollFd.fd == m_WakeupSocket)
+			DrainWakeup();
+		else
+			Dispatch(pollFd.fd, FromPollEvents(pollFd.revents));
+	}
+#else
+	int nReady = epoll_wait(m_nEpollFd, m_EpollEvents.data(), static_cast<int>(m_EpollEvents.size()), nTimeoutMs);
+	if (nReady < 0)
+	{
+		if (errno != EINTR)
+			FCM_LOG_ERROR(m_oLogger, "[CEventLoop][ERROR] Poll: epoll_wait failed with errno ", errno);
+		return;
+	}
+
+	for (int i = 0; i < nReady; ++i)
+	{
+		if (m_EpollEvents[i].data.fd == m_nWakeupFd)
+			DrainWakeup();
+		else
+			Dispatch(m_EpollEvents[i].data.fd, FromEpollEvents(m_EpollEvents[i].events));
+	}
+#endif
+}
+
+void CEventLoop::Dispatch(ASocket::Socket sd, uint32_t nEvents)
+{
+	auto it = m_Handlers.find(sd);
+	if (it == m_Handlers.end())
+		return; // removed by an earlier callback in this batch
+
+	// Keep the handler alive in case the callback removes its own socket
+	std::shared_ptr<IoHandler> handler = it->second;
+	handler->callback(nEvents);
+}
+
+void CEventLoop::RunTimers()
+{
+	m_TimerWheel.Advance(NowTick());
+}
+
+void CEventLoop::RunPostedTasks()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_PostMutex);
+		m_RunningTasks.swap(m_PostedTasks);
+	}
+
+	// Cleared even when a task throws something other than std::exception, the tasks left would be swapped back in and run again
+	struct RunningTasksClearer
+	{
+		std::vector<Task>& tasks;
+		~RunningTasksClearer() { tasks.clear(); }
+	} clearer{ m_RunningTasks };
+
+	// A task that throws does not take the ones posted after it down with it
+	for (Task& task : m_RunningTasks)
+	{
+		try
+		{
+			task();
+		}
+		catch (const std::exception& e)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CEventLoop][ERROR] RunPostedTasks: Task failed: ", e.what());
+		}
+	}
+}
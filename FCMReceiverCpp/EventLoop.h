@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LogUtil.h"
+#include "TimerWheel.h"
+#include "SecureSocket/Socket.h"
+
+#ifndef WINDOWS
+#include <sys/epoll.h>
+#endif
+
+enum EventLoopFlag : uint32_t
+{
+	EVENT_READ = 0x01,
+	EVENT_WRITE = 0x02,
+	EVENT_ERROR = 0x04
+};
+
+/**
+ * Single threaded reactor: socket readiness callbacks and timers run on the thread
+ * that calls Run(). Sockets are watched with epoll on Linux and WSAPoll on Windows,
+ * timers are kept in a timer wheel with a 1 ms tick.
+ *
+ * Only Post() and Stop() may be called from other threads.
+ */
+class CEventLoop
+{
+public:
+	typedef std::function<void(uint32_t nEvents)> IoCallback;
+	typedef std::function<void()> Task;
+
+	explicit CEventLoop(const ASocket::LogFnCallback oLogger);
+	~CEventLoop();
+
+	CEventLoop(const CEventLoop&) = delete;
+	CEventLoop& operator=(const CEventLoop&) = delete;
+
+	/**
+	 * Starts watching a socket.
+	 *
+	 * @param sd The socket, it should be in non-blocking mode.
+	 * @param nEvents A combination of EVENT_READ and EVENT_WRITE.
+	 * @param callback Called with the ready events, EVENT_ERROR is always reported.
+	 * @return True on success, false otherwise.
+	 */
+	bool AddSocket(ASocket::Socket sd, uint32_t nEvents, IoCallback callback);
+
+	/**
+	 * Changes the events watched on a socket added with AddSocket().
+	 *
+	 * @param sd The socket.
+	 * @param nEvents A combination of EVENT_READ and EVENT_WRITE.
+	 * @return True on success, false otherwise.
+	 */
+	bool ModifySocket(ASocket::Socket sd, uint32_t nEvents);
+
+	/**
+	 * Stops watching a socket. Safe to call from inside the socket's own callback.
+	 *
+	 * @param sd The socket.
+	 */
+	void RemoveSocket(ASocket::Socket sd);
+
+	/**
+	 * Schedules a callback to run once on the loop thread. O(1), like CancelTimer().
+	 *
+	 * @param nDelayMs The delay in milliseconds.
+	 * @param callback The callback to run.
+	 * @return The timer id, to be passed to CancelTimer().
+	 */
+	TimerId AddTimer(uint32_t nDelayMs, Task callback);
+
+	/**
+	 * Cancels a timer that has not fired yet.
+	 *
+	 * @param nTimerId The timer id returned by AddTimer().
+	 * @return True if the timer was pending, false otherwise.
+	 */
+	bool CancelTimer(TimerId nTimerId);
+
+	/**
+	 * Queues a task to run on the loop thread. Thread safe.
+	 *
+	 * @param task The task to run.
+	 */
+	void Post(Task task);
+
+	/**
+	 * Dispatches events until Stop() is called, returns at once if it was called before.
+	 * Exceptions thrown by callbacks propagate to the caller, the posted tasks still queued
+	 * behind the throwing one are dropped.
+	 */
+	void Run();
+
+	/**
+	 * Waits for events once and dispatches them.
+	 *
+	 * @param nMaxWaitMs The maximum time to wait, -1 waits until the next timer or event.
+	 */
+	void RunOnce(int nMaxWaitMs = -1);
+
+	/**
+	 * Makes Run() return after the current iteration, or the next Run() return at once when
+	 * the loop is not running. Thread safe.
+	 */
+	void Stop();
+
+	bool IsInLoopThread() const { return m_LoopThreadId == std::this_thread::get_id(); }
+	size_t SocketCount() const { return m_Handlers.size(); }
+	size_t TimerCount() const { return m_TimerWheel.Size(); }
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct IoHandler
+	{
+		uint32_t nEvents;
+		IoCallback callback;
+	};
+
+	uint64_t NowTick() const;
+	void Wakeup();
+	void DrainWakeup();
+	int NextTimeoutMs(int nMaxWaitMs) const;
+	void Poll(int nTimeoutMs);
+	void Dispatch(ASocket::Socket sd, uint32_t nEvents);
+	void RunTimers();
+	void RunPostedTasks();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+
+	std::unordered_map<ASocket::Socket, std::shared_ptr<IoHandler>> m_Handlers;
+
+	const Clock::time_point m_StartTime;
+	CTimerWheel m_TimerWheel;
+
+	mutable std::mutex m_PostMutex;
+	std::vector<Task> m_PostedTasks;
+	std::vector<Task> m_RunningTasks;
+
+	std::atomic<bool> m_bStopped;
+	std::thread::id m_LoopThreadId;
+
+#ifdef WINDOWS
+	std::vector<WSAPOLLFD> m_PollFds;
+	ASocket::Socket m_WakeupSocket;
+#else
+	int m_nEpollFd;
+	int m_nWakeupFd;
+	std::vector<epoll_event> m_EpollEvents;
+#endif
+};
@@ -1,5 +1,11 @@
 #include "FCMClient.h"
 
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+#include "EceHeaderParser.h"
+
 CFCMClient::CFCMClient(
 	const LogFnCallback oLogger, 
 	const std::string sAndroidID, 
@@ -10,12 +16,7 @@ CFCMClient::CFCMClient(
 		m_PersistentIds(persistentIDs),
 		m_oLogger(oLogger),
 		m_sAndroidId(sAndroidID),
-		m_sSecurityToken(sSecurityToken),
-		m_nState(MCS_VERSION_TAG_AND_SIZE),
-		m_nSizePacketSoFar(0),
-		m_nMessageTag(0),
-		m_nMessageSize(0),
-		m_nMinBytesNeeded(1)
+		m_sSecurityToken(sSecurityToken)
 {
 	m_SecureTCPClient = std::make_unique<CTCPSSLClient>(oLogger);
 
@@ -25,58 +26,228 @@ CFCMClient::CFCMClient(
 	if (sDecodedPrivatekey.size() != ECE_WEBPUSH_PRIVATE_KEY_LENGTH || sDecodedAuth.size() != ECE_WEBPUSH_AUTH_SECRET_LENGTH)
 	{
 		std::string sError = "[CFCMClient][FATAL] Invalid private key or auth secret";
-		if (bVerbose) m_oLogger(sError);
+		FCM_LOG_FATAL(m_oLogger, sError);
 		throw std::runtime_error("Invalid private key or auth secret");
 	}
 
-	m_RawSubPrivKey.insert(m_RawSubPrivKey.begin(), sDecodedPrivatekey.begin(), sDecodedPrivatekey.end());
-	m_AuthSecret.insert(m_AuthSecret.begin(), sDecodedAuth.begin(), sDecodedAuth.end());
+	// Shared with the decrypt pool jobs still in flight
+	m_DecryptCtx.reset(ece_webpush_decrypt_ctx_new(
+		reinterpret_cast<const uint8_t*>(sDecodedPrivatekey.data()), sDecodedPrivatekey.size(),
+		reinterpret_cast<const uint8_t*>(sDecodedAuth.data()), sDecodedAuth.size()),
+		&ece_webpush_decrypt_ctx_free);
+	if (!m_DecryptCtx)
+	{
+		std::string sError = "[CFCMClient][FATAL] Invalid private key";
+		FCM_LOG_FATAL(m_oLogger, sError);
+		throw std::runtime_error("Invalid private key");
+	}
+
+	m_nPersistentIdCount = m_PersistentIds.size();
 }
 
-CFCMClient::~CFCMClient() {}
+CFCMClient::~CFCMClient()
+{
+	*m_pSelf = nullptr;
+	Detach();
+}
 
 bool CFCMClient::ConnectToServer()
 {
-	CFCMRegister cFcmRegister(m_oLogger);
-	std::uint64_t nAndroidId = 0;
-	std::uint64_t nSecurityToken = 0;
-
 	try 
 	{
-		nAndroidId = std::stoull(m_sAndroidId);
-		nSecurityToken = std::stoull(m_sSecurityToken);
+		std::stoull(m_sAndroidId);
+		std::stoull(m_sSecurityToken);
 	}
 	catch (std::exception& e)
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][FATAL] Invalid Android ID or Security Token");
+		FCM_LOG_FATAL(m_oLogger, "[CFCMClient][FATAL] Invalid Android ID or Security Token");
+		return false;
+	}
+
+	// The check-in does not gate the MCS connection, so both round trips run at once
+	StartCheckIn();
+
+	if (!m_SecureTCPClient->Connect(m_sHost, m_sPort))
+	{
+		std::string sError = "[CFCMClient][FATAL] Unable to connect to server";
+		FCM_LOG_FATAL(m_oLogger, sError);
+		return false;
+	}
+
+	OnConnected();
+
+	return true;
+}
+
+void CFCMClient::StartCheckIn()
+{
+	if (m_pCheckInCache == nullptr)
+		return;
+
+	// Runs on a cache thread and may outlive the client, so nothing of it is captured by reference
+	LogFnCallback oLogger = m_oLogger;
+	std::string sAndroidId = m_sAndroidId;
+	std::string sSecurityToken = m_sSecurityToken;
+	bool bStarted = m_pCheckInCache->CheckInAsync(m_sAndroidId, [oLogger, sAndroidId, sSecurityToken]() {
+		CFCMRegister cFcmRegister(oLogger);
+		checkin_proto::AndroidCheckinResponse checkin = cFcmRegister.CheckIn(std::stoull(sAndroidId), std::stoull(sSecurityToken));
+		if (checkin.android_id() == 0 || checkin.security_token() == 0)
+		{
+			FCM_LOG_ERROR(oLogger, "[CFCMClient][ERROR] CheckIn failed for ", sAndroidId);
+			return false;
+		}
+		return true;
+	});
+
+	if (!bStarted)
+		FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Skipping check-in, the last one is recent or still running");
+}
+
+bool CFCMClient::ConnectAsync(CEventLoop& cEventLoop)
+{
+	if (m_pEventLoop != nullptr)
 		return false;
+
+	// getaddrinfo would block the loop, the address comes from the resolver's cache
+	bool bStarted = false;
+	if (m_pHostResolver == nullptr)
+	{
+		bStarted = m_SecureTCPClient->BeginConnect(m_sHost, m_sPort);
+	}
+	else
+	{
+		RESOLVED_ADDRESS address;
+		if (!m_pHostResolver->Lookup(m_sHost, m_sPort, address))
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] ConnectAsync: ", m_sHost, " is not resolved yet");
+			return false;
+		}
+		bStarted = m_SecureTCPClient->BeginConnect(m_sHost, m_sPort, reinterpret_cast<const sockaddr*>(&address.address), address.nLength);
 	}
 
-	checkin_proto::AndroidCheckinResponse checkin = cFcmRegister.CheckIn(nAndroidId, nSecurityToken);
-	if (checkin.android_id() == 0 || checkin.security_token() == 0)
+	m_nState = MCS_SESSION_CONNECTING;
+	if (!bStarted)
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] Connect to server error: CheckIn failed");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] ConnectAsync: Unable to start connecting to server");
+		m_nState = MCS_SESSION_DISCONNECTED;
+		return false;
 	}
 
-	if (!m_SecureTCPClient->Connect(m_szHost, m_szPort))
+	m_nSocket = m_SecureTCPClient->GetSocketDescriptor();
+	if (!cEventLoop.AddSocket(m_nSocket, EVENT_WRITE, [this](uint32_t nEvents) { OnSocketEvent(nEvents); }))
 	{
-		std::string sError = "[CFCMClient][FATAL] Unable to connect to server";
-		if (bVerbose) m_oLogger(sError);
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] ConnectAsync: Cannot add the socket to the event loop");
+		m_SecureTCPClient->Disconnect();
+		m_nState = MCS_SESSION_DISCONNECTED;
 		return false;
 	}
 
-	Emit("connected", "[CFCMClient][INFO] Connected to server");
-	SendLoginBuffer();
+	m_pEventLoop = &cEventLoop;
+	m_sLastError.clear();
+	m_nConnectTimer = m_pEventLoop->AddTimer(kMCSConnectTimeoutMs, [this]() {
+		m_nConnectTimer = kInvalidTimerId;
+		if (m_nState == MCS_SESSION_CONNECTING && m_pHostResolver != nullptr)
+			m_pHostResolver->Refresh(m_sHost, m_sPort);
+		CloseSession("Connect timed out");
+	});
+
+	StartCheckIn();
 
 	return true;
 }
 
+MCS_LATENCY_HISTOGRAMS& CFCMClient::GetLatencyHistograms()
+{
+	static MCS_LATENCY_HISTOGRAMS s_Histograms;
+	return s_Histograms;
+}
+
+MCS_CLIENT_COUNTERS& CFCMClient::GetCounters()
+{
+	// Zeroed as static storage
+	static MCS_CLIENT_COUNTERS s_Counters;
+	return s_Counters;
+}
+
+void CFCMClient::SetServer(const std::string& sHost, const std::string& sPort)
+{
+	m_sHost = sHost;
+	m_sPort = sPort;
+}
+
+void CFCMClient::SetDecryptPool(CDecryptPool* pDecryptPool, bool bPreserveOrder)
+{
+	m_pDecryptPool = pDecryptPool;
+	m_bPreserveOrder = bPreserveOrder;
+}
+
+void CFCMClient::ContinueConnect(uint32_t nEvents)
+{
+	if (m_nState == MCS_SESSION_CONNECTING)
+	{
+		if (!(nEvents & (EVENT_WRITE | EVENT_ERROR)))
+			return;
+
+		int nError = m_SecureTCPClient->GetConnectError();
+		if (nError != 0)
+		{
+			// The cached address may be stale
+			if (m_pHostResolver != nullptr)
+				m_pHostResolver->Refresh(m_sHost, m_sPort);
+			CloseSession("TCP connect failed with error " + std::to_string(nError));
+			return;
+		}
+
+		m_nState = MCS_SESSION_HANDSHAKING;
+	}
+
+	int iSSLError = 0;
+	int nResult = m_SecureTCPClient->DoHandshake(iSSLError);
+	if (nResult < 0)
+	{
+		CloseSession("TLS handshake failed");
+		return;
+	}
+
+	if (nResult == 0)
+	{
+		m_pEventLoop->ModifySocket(m_nSocket, iSSLError == SSL_ERROR_WANT_WRITE ? EVENT_WRITE : EVENT_READ);
+		return;
+	}
+
+	m_pEventLoop->CancelTimer(m_nConnectTimer);
+	m_nConnectTimer = kInvalidTimerId;
+	OnConnected();
+}
+
+void CFCMClient::OnConnected()
+{
+	m_FrameDecoder.Reset();
+	m_OutBuffer.clear();
+	m_nOutBufferPos = 0;
+	m_bReadWantsWrite = false;
+	m_bClosedByServer = false;
+
+	m_nState = MCS_SESSION_LOGIN_SENT;
+	Emit("connected", "[CFCMClient][INFO] Connected to server");
+	SendLoginBuffer();
+	StartAckDeadline("login response");
+	UpdateSocketEvents();
+}
+
 void CFCMClient::SendLoginBuffer()
 {
+	// Stream ids start over with every connection, ids acknowledged on the last one go with the login instead
+	m_nStreamIdIn = 0;
+	m_nStreamIdOut = 0;
+	m_nStreamIdReported = 0;
+	m_UnackedIds.clear();
+	m_AckedIds.clear();
+
 	std::string sAndroidIdHex = UtilFunction::DecimalToHex(m_sAndroidId);
 
 	mcs_proto::LoginRequest cLoginRequest;
-	cLoginRequest.set_adaptive_heartbeat(false);
+	m_HeartbeatPolicy.FillLoginRequest(cLoginRequest);
 	cLoginRequest.set_auth_service(mcs_proto::LoginRequest_AuthService::LoginRequest_AuthService_ANDROID_ID);
 	cLoginRequest.set_auth_token(m_sSecurityToken.c_str());
 	cLoginRequest.set_id("chrome-87.0.4280.66");
@@ -105,341 +276,874 @@ void CFCMClient::SendLoginBuffer()
 	UtilFunction::_EncodeVarint32(nSize, buf);
 	buf.insert(buf.end(), sSerialized.begin(), sSerialized.end());
 
-	int nBytesSent = m_SecureTCPClient->Send(reinterpret_cast<const char*>(buf.data()), buf.size());
-	if (nBytesSent == SOCKET_ERROR)
+	if (!SendFrame(buf))
 	{
-		std::string sError = "[CFCMClient][FATAL] Send login request failed with error " + WSAGetLastError();
-		if (bVerbose) m_oLogger(sError);
+		std::string sError = "[CFCMClient][FATAL] Send login request failed";
+		FCM_LOG_FATAL(m_oLogger, sError);
 		throw std::runtime_error("Send login request failed");
 	}
+	m_nStreamIdOut++;
 }
 
-void CFCMClient::SendHeartbeat(int32_t nLastStreamIDReceived)
+bool CFCMClient::SendProto(MCSProtoTag eTag, const google::protobuf::MessageLite& cMessage)
 {
-	mcs_proto::HeartbeatPing cHeartbeatPing;
-	cHeartbeatPing.set_status(0);
-	cHeartbeatPing.set_stream_id(0);
-	cHeartbeatPing.set_last_stream_id_received(nLastStreamIDReceived);
-
 	std::string sSerialized;
-	cHeartbeatPing.SerializeToString(&sSerialized);
+	cMessage.SerializeToString(&sSerialized);
 
 	std::vector<std::uint8_t> buf;
-	buf.push_back(kHeartbeatPingTag);
+	buf.push_back(static_cast<uint8_t>(eTag));
 
 	size_t nSize = sSerialized.size();
 	UtilFunction::_EncodeVarint32(nSize, buf);
 	buf.insert(buf.end(), sSerialized.begin(), sSerialized.end());
 
-	int nBytesSent = m_SecureTCPClient->Send(reinterpret_cast<const char*>(buf.data()), buf.size());
-	if (nBytesSent == SOCKET_ERROR)
+	if (!SendFrame(buf))
+		return false;
+
+	m_nStreamIdOut++;
+	return true;
+}
+
+void CFCMClient::SendHeartbeat()
+{
+	mcs_proto::HeartbeatPing cHeartbeatPing;
+	cHeartbeatPing.set_status(0);
+	cHeartbeatPing.set_stream_id(0);
+	cHeartbeatPing.set_last_stream_id_received(m_nStreamIdIn);
+
+	if (!SendProto(kHeartbeatPingTag, cHeartbeatPing))
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] Send heartbeat failed with error " + WSAGetLastError());
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Send heartbeat failed");
+		return;
 	}
 
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Sent heartbeat to server");
+	m_nStreamIdReported = m_nStreamIdIn;
+	m_HeartbeatSentTime = CLatencyHistogram::Clock::now();
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Sent heartbeat to server");
+	StartAckDeadline("heartbeat ack");
 }
 
-void CFCMClient::StartReceiver()
+void CFCMClient::QueueAcks()
 {
-	if (!m_SecureTCPClient->IsConnected())
+	if (m_nState != MCS_SESSION_ONLINE || m_pEventLoop == nullptr)
+		return;
+
+	if (m_UnackedIds.size() >= kMCSSelectiveAckMaxIds ||
+		m_nStreamIdIn - m_nStreamIdReported >= kMCSUnackedPacketsBeforeStreamAck)
 	{
-		std::string sError = "[CFCMClient][FATAL] StartReceiver: It seems like you haven't called ConnectToServer() yet.";
-		if (bVerbose) m_oLogger(sError);
-		throw std::runtime_error("Not connected to server");
+		SendAcks();
+		return;
 	}
 
-	while (true)
+	// The ids of a burst share one ack
+	if (!m_UnackedIds.empty() && m_nSendAckTimer == kInvalidTimerId)
 	{
-		m_nMinBytesNeeded = CalculateMinBytesNeeded();
-		if (m_BytesReadFromServer.size() < m_nMinBytesNeeded)
-		{
-			std::vector<uint8_t> buf(m_nMinBytesNeeded - m_BytesReadFromServer.size());
-			int nBytesRead = m_SecureTCPClient->Receive(reinterpret_cast<char*>(buf.data()), buf.size());
-			if (nBytesRead == SOCKET_ERROR)
-			{
-				if (bVerbose) m_oLogger("[CFCMClient][ERROR] StartReceiver: Receive failed with error " + WSAGetLastError());
-				break;
-			}
-			else
-			if (nBytesRead > 0)
-			{
-				m_BytesReadFromServer.insert(m_BytesReadFromServer.end(), buf.begin(), buf.begin() + nBytesRead);
-				if (bVerbose) m_oLogger("[CFCMClient][INFO] Got data size " + std::to_string(m_BytesReadFromServer.size()) + " need " + std::to_string(m_nMinBytesNeeded));
-
-				if (m_BytesReadFromServer.size() >= m_nMinBytesNeeded)
-				{
-					ProcessData();
-				}
-			}
-		}
+		m_nSendAckTimer = m_pEventLoop->AddTimer(kMCSSelectiveAckDelayMs, [this]() {
+			m_nSendAckTimer = kInvalidTimerId;
+			SendAcks();
+		});
 	}
 }
 
-int CFCMClient::CalculateMinBytesNeeded()
+void CFCMClient::SendAcks()
 {
-	int nMinBytesNeeded = 0;
-	switch (m_nState)
+	if (m_nSendAckTimer != kInvalidTimerId)
 	{
-	case MCS_VERSION_TAG_AND_SIZE:
-		nMinBytesNeeded = kVersionPacketLen + kTagPacketLen + kSizePacketLenMin;
-		break;
-	case MCS_TAG_AND_SIZE:
-		nMinBytesNeeded = kTagPacketLen + kSizePacketLenMin;
-		break;
-	case MCS_SIZE:
-		nMinBytesNeeded = m_nSizePacketSoFar + 1;
-		break;
-	case MCS_PROTO_BYTES:
-		nMinBytesNeeded = m_nMessageSize;
-		break;
-	default:
+		m_pEventLoop->CancelTimer(m_nSendAckTimer);
+		m_nSendAckTimer = kInvalidTimerId;
+	}
+
+	mcs_proto::IqStanza cIqStanza;
+	cIqStanza.set_type(mcs_proto::IqStanza_IqType_SET);
+	cIqStanza.set_id("");
+	cIqStanza.set_last_stream_id_received(m_nStreamIdIn);
+
+	// A selective ack also reports the stream id, a stream ack is only needed without new ids
+	mcs_proto::Extension* pExtension = cIqStanza.mutable_extension();
+	if (!m_UnackedIds.empty())
+	{
+		mcs_proto::SelectiveAck cSelectiveAck;
+		for (const std::string& sPersistentId : m_UnackedIds)
+			cSelectiveAck.add_id(sPersistentId);
+
+		pExtension->set_id(kMCSSelectiveAckExtension);
+		pExtension->set_data(cSelectiveAck.SerializeAsString());
+	}
+	else
+	{
+		pExtension->set_id(kMCSStreamAckExtension);
+		pExtension->set_data("");
+	}
+
+	if (!SendProto(kIqStanzaTag, cIqStanza))
 	{
-		std::string sError = "[CFCMClient][FATAL] CalculateMinBytesNeeded: Unexpected State " + std::to_string(m_nState);
-		if (bVerbose) m_oLogger(sError);
-		throw std::runtime_error("Unexpected State " + std::to_string(m_nState));
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Send ack failed");
+		return;
 	}
-	break;
+
+	m_nStreamIdReported = m_nStreamIdIn;
+	if (m_UnackedIds.empty())
+	{
+		FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Sent stream ack for stream id ", m_nStreamIdIn);
+		return;
 	}
 
-	return nMinBytesNeeded;
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Sent selective ack for ", m_UnackedIds.size(), " messages");
+	m_AckedIds.emplace(m_nStreamIdOut, std::move(m_UnackedIds));
+	m_UnackedIds.clear();
 }
 
-void CFCMClient::ProcessData()
+void CFCMClient::OnServerConfirmedReceipt(int32_t nLastStreamIdReceived)
 {
-	switch (m_nState)
+	std::vector<std::string> confirmedIds;
+	auto it = m_AckedIds.begin();
+	while (it != m_AckedIds.end() && it->first <= nLastStreamIdReceived)
 	{
-	case MCS_VERSION_TAG_AND_SIZE:
-		GotVersion();
-		break;
-	case MCS_TAG_AND_SIZE:
-		GotMessageTag();
-		break;
-	case MCS_SIZE:
-		GotMessageSize();
-		break;
-	case MCS_PROTO_BYTES:
-		GotMessageBytes();
-		break;
-	default:
+		confirmedIds.insert(confirmedIds.end(), it->second.begin(), it->second.end());
+		it = m_AckedIds.erase(it);
+	}
+
+	if (confirmedIds.empty())
+		return;
+
+	std::unordered_set<std::string> confirmed(confirmedIds.begin(), confirmedIds.end());
+	m_PersistentIds.erase(std::remove_if(m_PersistentIds.begin(), m_PersistentIds.end(),
+		[&confirmed](const std::string& sPersistentId) { return confirmed.count(sPersistentId) > 0; }),
+		m_PersistentIds.end());
+	m_nPersistentIdCount = m_PersistentIds.size();
+
+	Emit("persistent_ids_confirmed", StringUtil::join(confirmedIds, ";"));
+}
+
+void CFCMClient::ScheduleHeartbeat()
+{
+	if (m_pEventLoop == nullptr)
+		return;
+
+	//The server closes the connection if no heartbeat is received after 27 minutes, the policy keeps well below that
+	if (m_nHeartbeatTimer != kInvalidTimerId)
+		m_pEventLoop->CancelTimer(m_nHeartbeatTimer);
+
+	uint32_t nIntervalMs = m_HeartbeatPolicy.IntervalMs();
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Next heartbeat in ", nIntervalMs / 1000, " seconds");
+
+	m_nHeartbeatTimer = m_pEventLoop->AddTimer(nIntervalMs, [this, nIntervalMs]() {
+		m_nHeartbeatTimer = kInvalidTimerId;
+		m_nPingIdleMs = nIntervalMs;
+		SendHeartbeat();
+	});
+}
+
+void CFCMClient::StartAckDeadline(const std::string& sAwaited)
+{
+	if (m_pEventLoop == nullptr)
+		return;
+
+	// A half-open connection never reports an error, only the missing answer reveals it
+	StopAckDeadline();
+	m_nAckTimer = m_pEventLoop->AddTimer(kMCSAckTimeoutMs, [this, sAwaited]() {
+		m_nAckTimer = kInvalidTimerId;
+		CloseSession("No " + sAwaited + " within " + std::to_string(kMCSAckTimeoutMs / 1000) + " seconds", true);
+	});
+}
+
+void CFCMClient::StopAckDeadline()
+{
+	if (m_nAckTimer == kInvalidTimerId)
+		return;
+
+	if (m_pEventLoop != nullptr)
+		m_pEventLoop->CancelTimer(m_nAckTimer);
+	m_nAckTimer = kInvalidTimerId;
+}
+
+bool CFCMClient::SendFrame(const std::vector<uint8_t>& frame)
+{
+	if (!m_SecureTCPClient->IsConnected())
+		return false;
+
+	m_OutBuffer.insert(m_OutBuffer.end(), frame.begin(), frame.end());
+	return FlushOutput();
+}
+
+bool CFCMClient::FlushOutput()
+{
+	while (m_nOutBufferPos < m_OutBuffer.size())
 	{
-		std::string sError = "[CFCMClient][FATAL] ProcessData: Unexpected State " + std::to_string(m_nState);
-		if (bVerbose) m_oLogger(sError);
-		throw std::runtime_error("Unexpected State " + std::to_string(m_nState));
+		int iSSLError = 0;
+		int nBytesSent = m_SecureTCPClient->Write(reinterpret_cast<const char*>(m_OutBuffer.data() + m_nOutBufferPos),
+			m_OutBuffer.size() - m_nOutBufferPos, iSSLError);
+
+		if (nBytesSent > 0)
+		{
+			m_nOutBufferPos += nBytesSent;
+			continue;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_WRITE || iSSLError == SSL_ERROR_WANT_READ)
+		{
+			// The rest is sent from OnSocketEvent once the socket is ready again
+			UpdateSocketEvents();
+			return true;
+		}
+
+		return false;
 	}
-	break;
+
+	m_OutBuffer.clear();
+	m_nOutBufferPos = 0;
+	UpdateSocketEvents();
+	return true;
+}
+
+void CFCMClient::UpdateSocketEvents()
+{
+	if (m_pEventLoop == nullptr)
+		return;
+
+	uint32_t nEvents = EVENT_READ;
+	if (m_nOutBufferPos < m_OutBuffer.size() || m_bReadWantsWrite)
+		nEvents |= EVENT_WRITE;
+
+	m_pEventLoop->ModifySocket(m_nSocket, nEvents);
+}
+
+void CFCMClient::StartReceiver()
+{
+	if (!m_SecureTCPClient->IsConnected())
+	{
+		std::string sError = "[CFCMClient][FATAL] StartReceiver: It seems like you haven't called ConnectToServer() yet.";
+		FCM_LOG_FATAL(m_oLogger, sError);
+		throw std::runtime_error("Not connected to server");
 	}
+
+	CEventLoop cEventLoop(m_oLogger);
+	if (!Attach(cEventLoop))
+		throw std::runtime_error("Cannot attach to event loop");
+
+	Once("disconnected", [&cEventLoop](const std::string&) {
+		cEventLoop.Stop();
+	});
+
+	cEventLoop.Run();
+	Detach();
+
+	if (!m_sLastError.empty())
+		throw std::runtime_error(m_sLastError);
 }
 
-void CFCMClient::GotVersion()
+bool CFCMClient::Attach(CEventLoop& cEventLoop)
 {
-	m_nState = MCS_VERSION_TAG_AND_SIZE;
-	if (m_BytesReadFromServer.size() < 1)
+	if (m_pEventLoop != nullptr || !m_SecureTCPClient->IsConnected())
+		return false;
+
+	if (!m_SecureTCPClient->SetNonBlocking(true))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Attach: Cannot switch the socket to non-blocking mode");
+		return false;
+	}
+
+	m_nSocket = m_SecureTCPClient->GetSocketDescriptor();
+	if (!cEventLoop.AddSocket(m_nSocket, EVENT_READ, [this](uint32_t nEvents) { OnSocketEvent(nEvents); }))
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][WARNING] WaitForData: DataSize is too small");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Attach: Cannot add the socket to the event loop");
+		return false;
+	}
+
+	m_pEventLoop = &cEventLoop;
+	m_sLastError.clear();
+	UpdateSocketEvents();
+
+	// The login was sent before attaching, when there was no loop to time the answer
+	if (m_nState == MCS_SESSION_LOGIN_SENT)
+		StartAckDeadline("login response");
+	return true;
+}
+
+void CFCMClient::Detach()
+{
+	if (m_pEventLoop == nullptr)
 		return;
+
+	if (m_nConnectTimer != kInvalidTimerId)
+	{
+		m_pEventLoop->CancelTimer(m_nConnectTimer);
+		m_nConnectTimer = kInvalidTimerId;
 	}
-	int nVersion = m_BytesReadFromServer[0];
-	m_BytesReadFromServer.erase(m_BytesReadFromServer.begin());
 
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got version " + std::to_string(nVersion));
+	if (m_nHeartbeatTimer != kInvalidTimerId)
+	{
+		m_pEventLoop->CancelTimer(m_nHeartbeatTimer);
+		m_nHeartbeatTimer = kInvalidTimerId;
+	}
 
-	if (nVersion < kMCSVersion && nVersion != 38)
+	if (m_nSendAckTimer != kInvalidTimerId)
 	{
-		std::string sError = "[CFCMClient][FATAL] Got version " + std::to_string(nVersion) + " but expected " + std::to_string(kMCSVersion);
-		if (bVerbose) m_oLogger(sError);
-		throw std::runtime_error("Got version " + std::to_string(nVersion) + " but expected " + std::to_string(kMCSVersion));
+		m_pEventLoop->CancelTimer(m_nSendAckTimer);
+		m_nSendAckTimer = kInvalidTimerId;
 	}
 
-	m_nState = MCS_TAG_AND_SIZE;
-	GotMessageTag();
+	StopAckDeadline();
+	m_pEventLoop->RemoveSocket(m_nSocket);
+	m_pEventLoop = nullptr;
 }
 
-void CFCMClient::GotMessageTag()
+void CFCMClient::OnSocketEvent(uint32_t nEvents)
 {
-	if (m_BytesReadFromServer.size() < 1)
+	try
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][WARNING] GotMessageTag: DataSize is too small");
-		return;
-	}
-	m_nMessageTag = m_BytesReadFromServer[0];
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got message tag " + std::to_string(m_nMessageTag));
-	m_BytesReadFromServer.erase(m_BytesReadFromServer.begin());
+		if (m_nState == MCS_SESSION_CONNECTING || m_nState == MCS_SESSION_HANDSHAKING)
+		{
+			ContinueConnect(nEvents);
+			return;
+		}
 
-	m_nState = MCS_SIZE;
-	GotMessageSize();
+		if ((nEvents & (EVENT_READ | EVENT_ERROR)) || (m_bReadWantsWrite && (nEvents & EVENT_WRITE)))
+		{
+			if (!ReadAvailable())
+			{
+				CloseSession("Connection closed or receive failed", true);
+				return;
+			}
+		}
+
+		if (m_pEventLoop != nullptr && !FlushOutput())
+		{
+			CloseSession("Send failed", true);
+			return;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		m_sLastError = e.what();
+		CloseSession(m_sLastError);
+	}
 }
 
-void CFCMClient::GotMessageSize()
+bool CFCMClient::ReadAvailable()
 {
-	size_t nVarintlen;
-	if (!UtilFunction::_DecodeVarint32(m_BytesReadFromServer.data(), m_BytesReadFromServer.size(), 0, m_nMessageSize, nVarintlen))
+	// Read until OpenSSL asks to wait, so records it has already buffered are not left behind,
+	// or until kMCSMaxBytesPerReadEvent so one busy session does not starve the others of the loop
+	m_bReadWantsWrite = false;
+	size_t nBytesThisEvent = 0;
+	while (m_pEventLoop != nullptr)
 	{
-		m_nSizePacketSoFar = 1 + m_BytesReadFromServer.size();
-		return;
+		if (nBytesThisEvent >= kMCSMaxBytesPerReadEvent)
+		{
+			PostRead();
+			return true;
+		}
+
+		uint8_t* pWritable = m_FrameDecoder.PrepareWrite(kMCSReceiveChunkSize);
+
+		int iSSLError = 0;
+		int nBytesRead = m_SecureTCPClient->Read(reinterpret_cast<char*>(pWritable), m_FrameDecoder.WritableSize(), iSSLError);
+		if (nBytesRead > 0)
+		{
+			m_LastReadTime = CLatencyHistogram::Clock::now();
+			if (m_FrameStartTime == CLatencyHistogram::Clock::time_point())
+				m_FrameStartTime = m_LastReadTime;
+
+			m_FrameDecoder.CommitWrite(nBytesRead);
+			nBytesThisEvent += nBytesRead;
+			GetCounters().nBytesRead.fetch_add(nBytesRead, std::memory_order_relaxed);
+			FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got data size ", nBytesRead, " buffered ", m_FrameDecoder.ReadableSize());
+
+			if (m_FrameDecoder.ReadableSize() >= m_FrameDecoder.MinBytesNeeded())
+				ProcessData();
+			continue;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_READ)
+		{
+			if (m_bReleaseIdleBuffers && m_FrameDecoder.Release())
+				std::vector<uint8_t>().swap(m_PlainTextBuffer);
+			return true;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_WRITE)
+		{
+			m_bReadWantsWrite = true;
+			UpdateSocketEvents();
+			return true;
+		}
+
+		return false;
 	}
-	m_BytesReadFromServer.erase(m_BytesReadFromServer.begin(), m_BytesReadFromServer.begin() + nVarintlen);
-	m_nSizePacketSoFar = 0;
 
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got message size " + std::to_string(m_nMessageSize));
+	return true;
+}
+
+void CFCMClient::PostRead()
+{
+	// What OpenSSL has buffered would not wake the loop again, so the rest is read from a posted task
+	if (m_bReadPosted)
+		return;
+
+	m_bReadPosted = true;
+	std::shared_ptr<CFCMClient*> pSelf = m_pSelf;
+	m_pEventLoop->Post([pSelf]() {
+		CFCMClient* pClient = *pSelf;
+		if (pClient == nullptr || !pClient->m_bReadPosted)
+			return;
+
+		pClient->m_bReadPosted = false;
+		if (pClient->m_pEventLoop != nullptr)
+			pClient->OnSocketEvent(EVENT_READ);
+	});
+}
 
-	m_nState = MCS_PROTO_BYTES;
-	if (m_nMessageSize > 0)
+void CFCMClient::Disconnect()
+{
+	if (m_pEventLoop != nullptr)
 	{
+		CloseSession("Closed by client");
 		return;
 	}
 
-	GotMessageBytes();
+	m_SecureTCPClient->Disconnect();
+	m_nState = MCS_SESSION_DISCONNECTED;
+}
+
+void CFCMClient::CloseSession(const std::string& sReason, bool bLinkLost)
+{
+	if (m_pEventLoop == nullptr)
+		return;
+
+	if (bLinkLost && !m_bClosedByServer && m_nState == MCS_SESSION_ONLINE)
+		m_HeartbeatPolicy.OnConnectionLost();
+
+	Detach();
+	m_SecureTCPClient->Disconnect();
+	m_nState = MCS_SESSION_DISCONNECTED;
+
+	m_OutBuffer.clear();
+	m_nOutBufferPos = 0;
+	m_bReadWantsWrite = false;
+	m_bReadPosted = false;
+	m_FrameStartTime = CLatencyHistogram::Clock::time_point();
+	m_HeartbeatSentTime = CLatencyHistogram::Clock::time_point();
+	FlushDecrypted();
+
+	FCM_LOG_WARNING(m_oLogger, "[CFCMClient][WARNING] Connection closed: ", sReason);
+	Emit("disconnected", sReason);
 }
 
-void CFCMClient::GotMessageBytes()
+void CFCMClient::ProcessData()
 {
-	switch (m_nMessageTag)
+	MCS_FRAME frame;
+	try
 	{
+		while (m_FrameDecoder.Next(frame))
+		{
+			GetLatencyHistograms().frameAssembly.Record(CLatencyHistogram::ElapsedNs(m_FrameStartTime, m_LastReadTime));
+			// Whatever follows this frame came with the latest read
+			m_FrameStartTime = m_LastReadTime;
+			GotMessageBytes(frame);
+		}
+
+		if (m_FrameDecoder.ReadableSize() == 0)
+			m_FrameStartTime = CLatencyHistogram::Clock::time_point();
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::string sError = "[CFCMClient][FATAL] ProcessData: " + std::string(e.what());
+		FCM_LOG_FATAL(m_oLogger, sError);
+		throw;
+	}
+}
+
+void CFCMClient::GotMessageBytes(const MCS_FRAME& frame)
+{
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got message tag ", frame.nTag, " size ", frame.nSize);
+	m_nStreamIdIn++;
+
+	MCS_CLIENT_COUNTERS& counters = GetCounters();
+	if (frame.nTag >= 0 && frame.nTag < kNumProtoTypes)
+		counters.frames[frame.nTag].fetch_add(1, std::memory_order_relaxed);
+	else
+		counters.nUnknownFrames.fetch_add(1, std::memory_order_relaxed);
+
+	switch (frame.nTag)
+	{
+	case MCSProtoTag::kHeartbeatPingTag:
+		HandleHeartbeatPing(frame);
+		break;
 	case MCSProtoTag::kLoginResponseTag:
-		HandleLoginResponseTag();
+		HandleLoginResponseTag(frame);
+		break;
+	case MCSProtoTag::kCloseTag:
+		HandleCloseTag(frame);
 		break;
 	case MCSProtoTag::kIqStanzaTag:
-		HandleIqStanzaTag();
+		HandleIqStanzaTag(frame);
 		break;
 	case MCSProtoTag::kDataMessageStanzaTag:
-		HandleDataMessageStanzaTag();
+		HandleDataMessageStanzaTag(frame);
+		break;
+	case MCSProtoTag::kStreamErrorStanzaTag:
+		HandleStreamErrorStanzaTag(frame);
 		break;
 	case MCSProtoTag::kHeartbeatAckTag:
-		HandleHeartbeatAck();
+		HandleHeartbeatAck(frame);
 		break;
 	default:
 		break;
 	}
-	m_BytesReadFromServer.clear();
-	GetNextMessage();
+
+	QueueAcks();
 }
 
-void CFCMClient::HandleLoginResponseTag()
+void CFCMClient::HandleHeartbeatPing(const MCS_FRAME& frame)
 {
-	mcs_proto::LoginResponse cLoginResponse;
-	if (!cLoginResponse.ParseFromArray(m_BytesReadFromServer.data(), m_BytesReadFromServer.size()))
+	mcs_proto::HeartbeatPing& cHeartbeatPing = m_InboundMessages.heartbeatPing;
+	if (!cHeartbeatPing.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][FATAL] HandleLoginResponseTag: Cannot parse LoginResponse");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleHeartbeatPing: Cannot parse HeartbeatPing");
+		return;
+	}
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got kHeartbeatPingTag: ", cHeartbeatPing.last_stream_id_received());
+	OnServerConfirmedReceipt(cHeartbeatPing.last_stream_id_received());
+
+	// The server expects its pings answered, the ack reports the stream id like a stream ack would
+	mcs_proto::HeartbeatAck cHeartbeatAck;
+	cHeartbeatAck.set_status(0);
+	cHeartbeatAck.set_stream_id(0);
+	cHeartbeatAck.set_last_stream_id_received(m_nStreamIdIn);
+	if (!SendProto(kHeartbeatAckTag, cHeartbeatAck))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Send heartbeat ack failed");
+		return;
+	}
+
+	m_nStreamIdReported = m_nStreamIdIn;
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Sent heartbeat ack to server");
+}
+
+void CFCMClient::HandleLoginResponseTag(const MCS_FRAME& frame)
+{
+	mcs_proto::LoginResponse& cLoginResponse = m_InboundMessages.loginResponse;
+	if (!cLoginResponse.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
+	{
+		FCM_LOG_FATAL(m_oLogger, "[CFCMClient][FATAL] HandleLoginResponseTag: Cannot parse LoginResponse");
 		throw std::runtime_error("Cannot parse LoginResponse");
 	}
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got kLoginResponseTag: " + std::to_string(cLoginResponse.last_stream_id_received()));
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got kLoginResponseTag: ", cLoginResponse.last_stream_id_received());
+
+	StopAckDeadline();
+	m_HeartbeatPolicy.OnLoginResponse(cLoginResponse);
+
+	// The login request carried these ids, the server will not send them again
+	if (!m_PersistentIds.empty())
+	{
+		Emit("persistent_ids_confirmed", StringUtil::join(m_PersistentIds, ";"));
+		m_PersistentIds.clear();
+		m_nPersistentIdCount = 0;
+	}
+	m_nState = MCS_SESSION_ONLINE;
+	m_nPingIdleMs = 0;
+	SendHeartbeat();
+}
 
-	m_PersistentIds.clear();
-	SendHeartbeat(cLoginResponse.last_stream_id_received());
+void CFCMClient::HandleCloseTag(const MCS_FRAME& frame)
+{
+	mcs_proto::Close& cClose = m_InboundMessages.close;
+	cClose.ParseFromArray(frame.pData, static_cast<int>(frame.nSize));
+	FCM_LOG_WARNING(m_oLogger, "[CFCMClient][WARNING] Got kCloseTag: server closed the stream");
+	m_bClosedByServer = true;
 }
-void CFCMClient::HandleIqStanzaTag()
+
+void CFCMClient::HandleIqStanzaTag(const MCS_FRAME& frame)
 {
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got kIqStanzaTag");
+	mcs_proto::IqStanza& cIqStanza = m_InboundMessages.iqStanza;
+	if (!cIqStanza.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleIqStanzaTag: Cannot parse IqStanza");
+		return;
+	}
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got kIqStanzaTag: ", cIqStanza.id());
+	OnServerConfirmedReceipt(cIqStanza.last_stream_id_received());
 }
 
-void CFCMClient::HandleDataMessageStanzaTag()
+void CFCMClient::HandleStreamErrorStanzaTag(const MCS_FRAME& frame)
 {
-	mcs_proto::DataMessageStanza cDataMessageStanza;
-	if (!cDataMessageStanza.ParseFromArray(m_BytesReadFromServer.data(), m_BytesReadFromServer.size()))
+	mcs_proto::StreamErrorStanza& cStreamError = m_InboundMessages.streamErrorStanza;
+	if (!cStreamError.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Cannot parse DataMessageStanza");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleStreamErrorStanzaTag: Cannot parse StreamErrorStanza");
 		return;
 	}
+	FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] Got kStreamErrorStanzaTag: ", cStreamError.type(), " ", cStreamError.text());
+	m_bClosedByServer = true;
+}
 
-	std::string sRawData = cDataMessageStanza.raw_data();
+void CFCMClient::HandleDataMessageStanzaTag(const MCS_FRAME& frame)
+{
+	MCS_LATENCY_HISTOGRAMS& histograms = GetLatencyHistograms();
+	CLatencyHistogram::Clock::time_point parseStart = CLatencyHistogram::Clock::now();
 
-	std::vector<uint8_t> salt[ECE_SALT_LENGTH];
-	std::vector<uint8_t> rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
-	for (const mcs_proto::AppData& app : cDataMessageStanza.app_data())
+	DATA_MESSAGE_STANZA_VIEW cDataMessageStanza;
+	if (!MCSWireParser::ParseDataMessageStanza(frame.pData, frame.nSize, cDataMessageStanza))
 	{
-		if (app.key() == "encryption")
-		{
-			std::string sBase64Salt = StringUtil::split(app.value(), "=").at(1);
-			std::string sBase64SaltDecoded = base64_decode(sBase64Salt, true);
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Cannot parse DataMessageStanza");
+		return;
+	}
 
-			if (sBase64SaltDecoded.size() != ECE_SALT_LENGTH)
-			{
-				if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid salt length");
-				return;
-			}
+#ifdef _DEBUG
+	ValidateDataMessageStanza(frame, cDataMessageStanza);
+#endif
 
-			salt->insert(salt->begin(), sBase64SaltDecoded.begin(), sBase64SaltDecoded.end());
-		}
-		else if (app.key() == "crypto-key")
-		{
-			std::string sBase64SenderPubKey = StringUtil::split(app.value(), "=").at(1);
-			std::string sBase64SenderPubKeyDecoded = base64_decode(sBase64SenderPubKey, true);
+	m_nMessageCount++;
+	OnServerConfirmedReceipt(cDataMessageStanza.nLastStreamIdReceived);
 
-			if (sBase64SenderPubKeyDecoded.size() != ECE_WEBPUSH_PUBLIC_KEY_LENGTH)
-			{
-				if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid sender public key length");
-				return;
-			}
+	std::string_view sRawData = cDataMessageStanza.sRawData;
 
-			rawSenderPubKey->insert(rawSenderPubKey->begin(), sBase64SenderPubKeyDecoded.begin(), sBase64SenderPubKeyDecoded.end());
+	uint8_t salt[ECE_SALT_LENGTH];
+	uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+	uint32_t nRecordSize = RS_LENGTH;
+	bool bHasHeaders = !cDataMessageStanza.sEncryption.empty() && !cDataMessageStanza.sCryptoKey.empty();
+	if (bHasHeaders)
+	{
+		int nErrorCode = EceHeaderParser::ExtractAesgcmParams(cDataMessageStanza.sCryptoKey, cDataMessageStanza.sEncryption,
+			salt, rawSenderPubKey, nRecordSize);
+		if (nErrorCode != ECE_OK)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid encryption headers, error code ", nErrorCode);
+			OnDecryptFailed(nErrorCode);
+			return;
 		}
 	}
+	histograms.parse.RecordSince(parseStart);
 
-	std::string nPersistentID = cDataMessageStanza.persistent_id();
-	if (!nPersistentID.empty())
+	std::string_view sPersistentID = cDataMessageStanza.sPersistentId;
+	if (!sPersistentID.empty())
 	{
-		m_PersistentIds.emplace_back(nPersistentID);
-		Emit("persistent_id", StringUtil::join(m_PersistentIds, ";"));
+		m_PersistentIds.emplace_back(sPersistentID);
+		m_nPersistentIdCount = m_PersistentIds.size();
+		m_UnackedIds.emplace_back(sPersistentID);
+		Emit("persistent_id", m_PersistentIds.back());
 	}
 
-	if (salt->empty() || rawSenderPubKey->empty() || sRawData.empty() || sRawData.size() < 1)
+	if (!bHasHeaders || sRawData.empty())
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid DataMessageStanza");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid DataMessageStanza");
 		return;
 	}
 
-	std::vector<uint8_t> ciphertext(sRawData.begin(), sRawData.end());
-	size_t nCiphertextLen = ciphertext.size();
+	// The ciphertext is read in place from the frame buffer
+	const uint8_t* pCiphertext = reinterpret_cast<const uint8_t*>(sRawData.data());
+	size_t nCiphertextLen = sRawData.size();
+
+	if (m_pDecryptPool != nullptr && m_pEventLoop != nullptr)
+	{
+		DECRYPT_JOB job;
+		job.ctx = m_DecryptCtx;
+		std::memcpy(job.salt, salt, ECE_SALT_LENGTH);
+		std::memcpy(job.rawSenderPubKey, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+		job.nRecordSize = nRecordSize;
+		job.ciphertext.assign(pCiphertext, pCiphertext + nCiphertextLen);
+
+		uint64_t nEpoch = m_nDecryptEpoch;
+		uint64_t nSequence = m_nNextDecryptSequence++;
+		CEventLoop* pEventLoop = m_pEventLoop;
+		std::shared_ptr<CFCMClient*> pSelf = m_pSelf;
+		job.onDone = [pEventLoop, pSelf, nEpoch, nSequence](DECRYPT_RESULT& result) {
+			pEventLoop->Post([pSelf, nEpoch, nSequence, result = std::move(result)]() mutable {
+				CFCMClient* pClient = *pSelf;
+				if (pClient == nullptr)
+					return;
 
-	size_t nPlaintextLen = ece_aesgcm_plaintext_max_length(RS_LENGTH, nCiphertextLen);
+				// Handlers throwing here would stop the whole loop, close this session instead like OnSocketEvent does
+				try
+				{
+					pClient->OnDecrypted(nEpoch, nSequence, result);
+				}
+				catch (const std::exception& e)
+				{
+					pClient->m_sLastError = e.what();
+					pClient->CloseSession(pClient->m_sLastError);
+				}
+			});
+		};
+
+		if (m_pDecryptPool->Submit(job))
+			return;
+
+		// The pool is saturated, decrypting here slows the reads down until it catches up
+		DECRYPT_RESULT result = CDecryptPool::Decrypt(job);
+		OnDecrypted(nEpoch, nSequence, result);
+		return;
+	}
+
+	size_t nPlaintextLen = ece_aesgcm_plaintext_max_length(nRecordSize, nCiphertextLen);
 	if (nPlaintextLen == 0)
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid plaintext length");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Invalid plaintext length");
+		OnDecryptFailed(ECE_ERROR_DECRYPT);
 		return;
 	}
 
-	std::vector<uint8_t> plainText(nPlaintextLen);
+	if (m_PlainTextBuffer.size() < nPlaintextLen)
+		m_PlainTextBuffer.resize(nPlaintextLen);
 
-	int nErrorCode = ece_webpush_aesgcm_decrypt(
-		m_RawSubPrivKey.data(), ECE_WEBPUSH_PRIVATE_KEY_LENGTH, m_AuthSecret.data(),
-		ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt->data(), ECE_SALT_LENGTH, rawSenderPubKey->data(),
-		ECE_WEBPUSH_PUBLIC_KEY_LENGTH, RS_LENGTH, ciphertext.data(), nCiphertextLen, plainText.data(),
+	CLatencyHistogram::Clock::time_point decryptStart = CLatencyHistogram::Clock::now();
+	int nErrorCode = ece_webpush_aesgcm_decrypt_with_ctx(
+		m_DecryptCtx.get(), salt, ECE_SALT_LENGTH, rawSenderPubKey,
+		ECE_WEBPUSH_PUBLIC_KEY_LENGTH, nRecordSize, pCiphertext, nCiphertextLen, m_PlainTextBuffer.data(),
 		&nPlaintextLen);
+	histograms.decrypt.RecordSince(decryptStart);
 
 	if (nErrorCode != ECE_OK)
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleDataMessageStanzaTag: Decrypt failed with error code " + std::to_string(nErrorCode));
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Decrypt failed with error code ", nErrorCode);
+		OnDecryptFailed(nErrorCode);
 		return;
 	}
 
-	std::string sPlainText(reinterpret_cast<char*>(plainText.data()), nPlaintextLen);
-	Emit("message", sPlainText);
+	m_sPlainText.assign(reinterpret_cast<const char*>(m_PlainTextBuffer.data()), nPlaintextLen);
+
+	CLatencyHistogram::Clock::time_point emitStart = CLatencyHistogram::Clock::now();
+	Emit("message", m_sPlainText);
+	histograms.emit.RecordSince(emitStart);
 }
 
-void CFCMClient::HandleHeartbeatAck()
+void CFCMClient::OnDecrypted(uint64_t nEpoch, uint64_t nSequence, DECRYPT_RESULT& result)
 {
-	mcs_proto::HeartbeatAck cHeartbeatAck;
-	if (!cHeartbeatAck.ParseFromArray(m_BytesReadFromServer.data(), m_BytesReadFromServer.size()))
+	// Measured on the thread that decrypted, recorded here with the client's other stages
+	GetLatencyHistograms().decrypt.Record(result.nDecryptNs);
+
+	// The connection it came on is closed and its ordered messages already flushed
+	if (!m_bPreserveOrder || nEpoch != m_nDecryptEpoch)
+	{
+		EmitDecrypted(result);
+		return;
+	}
+
+	if (nSequence != m_nNextEmitSequence)
+	{
+		m_DecryptedOutOfOrder.emplace(nSequence, std::move(result));
+
+		// Every job completes, with an error code if need be, so this only happens when a completion
+		// was lost. Give up on the missing messages rather than hold back the later ones for good.
+		if (m_DecryptedOutOfOrder.size() > kMCSMaxDecryptedOutOfOrder)
+		{
+			FCM_LOG_WARNING(m_oLogger, "[CFCMClient][WARNING] OnDecrypted: Skipped ", m_DecryptedOutOfOrder.begin()->first - m_nNextEmitSequence,
+				" messages that never finished decrypting");
+			m_nNextEmitSequence = m_DecryptedOutOfOrder.begin()->first;
+			EmitDecryptedInOrder();
+		}
+		return;
+	}
+
+	EmitDecrypted(result);
+	m_nNextEmitSequence++;
+	EmitDecryptedInOrder();
+}
+
+void CFCMClient::EmitDecryptedInOrder()
+{
+	// Release the messages that were only waiting for the one before them
+	auto it = m_DecryptedOutOfOrder.begin();
+	while (it != m_DecryptedOutOfOrder.end() && it->first == m_nNextEmitSequence)
+	{
+		EmitDecrypted(it->second);
+		m_nNextEmitSequence++;
+		it = m_DecryptedOutOfOrder.erase(it);
+	}
+}
+
+void CFCMClient::FlushDecrypted()
+{
+	// Their persistent ids go out with the next login, so they are emitted rather than dropped.
+	// Messages still decrypting are emitted as they complete.
+	std::map<uint64_t, DECRYPT_RESULT> decrypted;
+	decrypted.swap(m_DecryptedOutOfOrder);
+	m_nDecryptEpoch++;
+	m_nNextDecryptSequence = 0;
+	m_nNextEmitSequence = 0;
+
+	for (auto& entry : decrypted)
+		EmitDecrypted(entry.second);
+}
+
+void CFCMClient::EmitDecrypted(DECRYPT_RESULT& result)
+{
+	if (result.nErrorCode != ECE_OK)
 	{
-		if (bVerbose) m_oLogger("[CFCMClient][ERROR] HandleHeartbeatAck: Cannot parse HeartbeatAck");
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleDataMessageStanzaTag: Decrypt failed with error code ", result.nErrorCode);
+		OnDecryptFailed(result.nErrorCode);
 		return;
 	}
-	if (bVerbose) m_oLogger("[CFCMClient][INFO] Got kHeartbeatAckTag: "
-		+ StringUtil::to_string(cHeartbeatAck.status()) + " "
-		+ StringUtil::to_string(cHeartbeatAck.last_stream_id_received()) + " "
-		+ StringUtil::to_string(cHeartbeatAck.stream_id()));
 
-	//Send heartbeat every 600 seconds because server will close the connection if no heartbeat is received after 27 minutes
-	std::thread([this, cHeartbeatAck]() {
-		std::this_thread::sleep_for(std::chrono::milliseconds(TIME_SEND_HEARTBEAT));
-		this->SendHeartbeat(cHeartbeatAck.last_stream_id_received());
-		}).detach();
+	CLatencyHistogram::Clock::time_point emitStart = CLatencyHistogram::Clock::now();
+	Emit("message", result.sPlainText);
+	GetLatencyHistograms().emit.RecordSince(emitStart);
 }
 
-void CFCMClient::GetNextMessage()
+void CFCMClient::OnDecryptFailed(int nErrorCode)
 {
-	m_nMessageTag = 0;
-	m_nMessageSize = 0;
-	m_nState = MCS_TAG_AND_SIZE;
+	size_t nIndex = nErrorCode < 0 ? static_cast<size_t>(-static_cast<int64_t>(nErrorCode)) : 0;
+	if (nIndex >= kMCSDecryptErrorCodes)
+		nIndex = kMCSDecryptErrorCodes - 1;
+	GetCounters().decryptFailures[nIndex].fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef _DEBUG
+void CFCMClient::ValidateDataMessageStanza(const MCS_FRAME& frame, const DATA_MESSAGE_STANZA_VIEW& stanza)
+{
+	mcs_proto::DataMessageStanza& cDataMessageStanza = m_InboundMessages.dataMessageStanza;
+	if (!cDataMessageStanza.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] ValidateDataMessageStanza: Generated parser rejected a stanza the wire parser accepted");
+		return;
+	}
+
+	std::string_view sEncryption;
+	std::string_view sCryptoKey;
+	for (const mcs_proto::AppData& app : cDataMessageStanza.app_data())
+	{
+		if (app.key() == "encryption")
+			sEncryption = app.value();
+		else if (app.key() == "crypto-key")
+			sCryptoKey = app.value();
+	}
+
+	if (stanza.sFrom != cDataMessageStanza.from() ||
+		stanza.sCategory != cDataMessageStanza.category() ||
+		stanza.sPersistentId != cDataMessageStanza.persistent_id() ||
+		stanza.sRawData != cDataMessageStanza.raw_data() ||
+		stanza.nStreamId != cDataMessageStanza.stream_id() ||
+		stanza.nLastStreamIdReceived != cDataMessageStanza.last_stream_id_received() ||
+		stanza.nAppDataCount != static_cast<size_t>(cDataMessageStanza.app_data_size()) ||
+		stanza.sEncryption != sEncryption ||
+		stanza.sCryptoKey != sCryptoKey)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] ValidateDataMessageStanza: Wire parser and generated parser disagree");
+	}
+}
+#endif
+
+void CFCMClient::HandleHeartbeatAck(const MCS_FRAME& frame)
+{
+	mcs_proto::HeartbeatAck& cHeartbeatAck = m_InboundMessages.heartbeatAck;
+	if (!cHeartbeatAck.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CFCMClient][ERROR] HandleHeartbeatAck: Cannot parse HeartbeatAck");
+		return;
+	}
+	FCM_LOG_INFO(m_oLogger, "[CFCMClient][INFO] Got kHeartbeatAckTag: ",
+		cHeartbeatAck.status(), " ",
+		cHeartbeatAck.last_stream_id_received(), " ",
+		cHeartbeatAck.stream_id());
+
+	if (m_HeartbeatSentTime != CLatencyHistogram::Clock::time_point())
+	{
+		GetLatencyHistograms().heartbeatRtt.RecordSince(m_HeartbeatSentTime);
+		m_HeartbeatSentTime = CLatencyHistogram::Clock::time_point();
+	}
+
+	StopAckDeadline();
+	m_HeartbeatPolicy.OnAck(m_nPingIdleMs);
+	OnServerConfirmedReceipt(cHeartbeatAck.last_stream_id_received());
+	ScheduleHeartbeat();
 }
\ No newline at end of file
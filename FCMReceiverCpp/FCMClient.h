@@ -1,21 +1,34 @@
 #pragma once
 
+#include <map>
+
 #include "mcs.pb.h"
+#include "CheckInCache.h"
+#include "DecryptPool.h"
 #include "Emitter.h"
+#include "EventLoop.h"
 #include "FCMRegister.h"
+#include "HeartbeatPolicy.h"
+#include "HostResolver.h"
+#include "LatencyHistogram.h"
+#include "MCSFrameDecoder.h"
+#include "MCSWireParser.h"
 #include "Http_ece/ece.h"
 #include "SecureSocket/TCPSSLClient.h"
 
 #define RS_LENGTH 4096
-#define TIME_SEND_HEARTBEAT 600000 // 10 minutes
 
-enum ProcessingState
-{
-	MCS_VERSION_TAG_AND_SIZE,
-	MCS_TAG_AND_SIZE,
-	MCS_SIZE,
-	MCS_PROTO_BYTES
-};
+constexpr size_t kMCSReceiveChunkSize = 16 * 1024; // one full TLS record
+constexpr size_t kMCSMaxBytesPerReadEvent = 4 * kMCSReceiveChunkSize; // then the other sockets of the loop get their turn
+constexpr uint32_t kMCSConnectTimeoutMs = 30000;
+constexpr uint32_t kMCSAckTimeoutMs = 60000; // for the login response and heartbeat acks
+constexpr size_t kMCSSelectiveAckMaxIds = 10; // received ids acknowledged at once, sooner if kMCSSelectiveAckDelayMs passes
+constexpr uint32_t kMCSSelectiveAckDelayMs = 5000;
+constexpr int32_t kMCSUnackedPacketsBeforeStreamAck = 10;
+constexpr int32_t kMCSSelectiveAckExtension = 12;
+constexpr int32_t kMCSStreamAckExtension = 13;
+constexpr size_t kMCSMaxDecryptedOutOfOrder = 256; // decrypted messages held back for an earlier one before it is skipped
+constexpr size_t kMCSDecryptErrorCodes = 32; // ECE error codes are 0 to -(kMCSDecryptErrorCodes - 1)
 
 enum MCSProtoTag
 {
@@ -38,16 +51,59 @@ enum MCSProtoTag
 	kNumProtoTypes
 };
 
-constexpr int kVersionPacketLen = 1;
-constexpr int kTagPacketLen = 1;
-constexpr int kSizePacketLenMin = 1;
-constexpr int kSizePacketLenMax = 5;
-constexpr int kMCSVersion = 41;
+enum MCSSessionState
+{
+	MCS_SESSION_DISCONNECTED,
+	MCS_SESSION_CONNECTING,
+	MCS_SESSION_HANDSHAKING,
+	MCS_SESSION_LOGIN_SENT,
+	MCS_SESSION_ONLINE
+};
+
+/**
+ * One reusable instance per inbound message type. ParseFromArray() clears and
+ * refills them in place, so string and repeated-field storage is kept between
+ * frames instead of being reallocated for every push.
+ */
+typedef struct _MCS_INBOUND_MESSAGES
+{
+	mcs_proto::HeartbeatPing heartbeatPing;
+	mcs_proto::HeartbeatAck heartbeatAck;
+	mcs_proto::LoginResponse loginResponse;
+	mcs_proto::Close close;
+	mcs_proto::IqStanza iqStanza;
+	mcs_proto::DataMessageStanza dataMessageStanza;
+	mcs_proto::StreamErrorStanza streamErrorStanza;
+} MCS_INBOUND_MESSAGES;
+
+/**
+ * Where the time of a push goes, shared by every client in the process.
+ */
+typedef struct _MCS_LATENCY_HISTOGRAMS
+{
+	CLatencyHistogram frameAssembly; // from the read that brought a frame's first byte to the one that completed it
+	CLatencyHistogram parse; // DataMessageStanza parsing and the salt and crypto-key decoding
+	CLatencyHistogram decrypt;
+	CLatencyHistogram emit; // the "message" handlers
+	CLatencyHistogram heartbeatRtt;
+} MCS_LATENCY_HISTOGRAMS;
 
-constexpr bool bVerbose = true;
+/**
+ * Counters of every client in the process, safe to read from any thread.
+ */
+typedef struct _MCS_CLIENT_COUNTERS
+{
+	std::atomic<uint64_t> frames[kNumProtoTypes]; // by MCSProtoTag
+	std::atomic<uint64_t> nUnknownFrames; // tags past kNumProtoTypes
+	std::atomic<uint64_t> nBytesRead;
+	std::atomic<uint64_t> decryptFailures[kMCSDecryptErrorCodes]; // by negated ECE error code, the last one also counts any lower code
+} MCS_CLIENT_COUNTERS;
 
 class CFCMClient : public CEmitter
 {
+	// Drives the frame handlers without a connection
+	friend class CBenchmark;
+
 public:
 
     /**
@@ -58,6 +114,9 @@ public:
      * @param sSecurityToken The security token.
      * @param sBase64PrivateKey The base64 encoded private key.
      * @param sBase64AuthSecret The base64 encoded authentication secret.
+     * @param persistentIDs The ids of the messages received but not yet confirmed, sent with the login.
+     * "persistent_id" is emitted with the id of each new message and "persistent_ids_confirmed"
+     * with the ';' separated ids the server acknowledged.
      */
     CFCMClient(const LogFnCallback oLogger,
                const std::string sAndroidID,
@@ -68,43 +127,229 @@ public:
 
 	~CFCMClient();
 
+	/**
+	 * Starts a check-in and connects, blocking. The check-in runs on the check-in cache's
+	 * threads alongside the TCP connect and TLS handshake, see SetCheckInCache().
+	 *
+	 * @return True if connected, a failed check-in is only logged.
+	 */
 	bool ConnectToServer();
+
+	/**
+	 * Makes every connect, ConnectToServer() and ConnectAsync() alike, start a check-in on
+	 * the cache's threads unless the cache holds one done less than its TTL ago. Sessions
+	 * may share a cache.
+	 *
+	 * @param pCheckInCache The cache, nullptr does not check in. Must outlive the client.
+	 */
+	void SetCheckInCache(CCheckInCache* pCheckInCache) { m_pCheckInCache = pCheckInCache; }
+
+	/**
+	 * Makes ConnectAsync() connect to the address the resolver cached for the server
+	 * instead of resolving it on the event loop, and ask it to resolve the server again
+	 * when a connect fails. Sessions may share a resolver.
+	 *
+	 * @param pHostResolver The resolver, nullptr resolves on every connect. Must outlive the client.
+	 */
+	void SetHostResolver(CHostResolver* pHostResolver) { m_pHostResolver = pHostResolver; }
+
+	/**
+	 * Starts a non-blocking connect. The TCP connect, TLS handshake and login are
+	 * driven by the event loop, "connected" is emitted once the login request is sent
+	 * and "disconnected" if any step fails or times out. The check-in does not gate the
+	 * connect, it runs on the check-in cache's threads.
+	 *
+	 * @param cEventLoop The event loop that dispatches the socket and timers.
+	 * @return True if the connect was started, false otherwise, also while the host
+	 * resolver has no address for the server yet.
+	 */
+	bool ConnectAsync(CEventLoop& cEventLoop);
+
+	/**
+	 * Overrides the MCS server, mtalk.google.com:5228 by default.
+	 *
+	 * @param sHost The host name or address.
+	 * @param sPort The port.
+	 */
+	void SetServer(const std::string& sHost, const std::string& sPort);
+
+	/**
+	 * Frees the receive buffers whenever the socket has been drained, so an idle
+	 * session holds no receive memory. Trades one allocation per burst for memory,
+	 * which pays off when many mostly idle sessions share a process.
+	 *
+	 * @param bRelease True to free the buffers while idle.
+	 */
+	void SetReleaseIdleBuffers(bool bRelease) { m_bReleaseIdleBuffers = bRelease; }
+
+	/**
+	 * Hands message decryption to a worker pool instead of the event loop thread. The
+	 * "message" events are still emitted on the loop thread. Only used while attached to
+	 * an event loop, and the client must then be destroyed on the loop thread or after
+	 * the loop has stopped.
+	 *
+	 * @param pDecryptPool The pool, nullptr decrypts on the loop thread. Must outlive the loop.
+	 * @param bPreserveOrder True to emit messages in the order they were received, false to
+	 * emit each one as soon as it is decrypted.
+	 */
+	void SetDecryptPool(CDecryptPool* pDecryptPool, bool bPreserveOrder = true);
+
+	/**
+	 * Runs a private event loop for this client until the connection is closed.
+	 *
+	 * @throws std::runtime_error if the connection was closed because of a protocol error.
+	 */
 	void StartReceiver();
 
+	/**
+	 * Switches the connected socket to non-blocking mode and lets the event loop
+	 * drive it. The client must be destroyed or detached on the loop thread.
+	 * "disconnected" is emitted when the connection closes.
+	 *
+	 * @param cEventLoop The event loop that dispatches the socket and heartbeat timer.
+	 * @return True on success, false otherwise.
+	 */
+	bool Attach(CEventLoop& cEventLoop);
+
+	/**
+	 * Stops watching the socket and cancels the session timers. The connection is kept.
+	 */
+	void Detach();
+
+	/**
+	 * Closes the connection. "disconnected" is emitted if the client was attached to an event loop.
+	 */
+	void Disconnect();
+
+	/**
+	 * @return The connection state, safe to read from any thread.
+	 */
+	MCSSessionState GetState() const { return static_cast<MCSSessionState>(m_nState.load()); }
+
+	/**
+	 * @return The number of data messages received, safe to read from any thread.
+	 */
+	uint64_t GetMessageCount() const { return m_nMessageCount.load(); }
+
+	/**
+	 * @return The number of persistent ids not confirmed by the server yet, safe to read from any thread.
+	 */
+	size_t GetPersistentIdCount() const { return m_nPersistentIdCount.load(); }
+
+	const std::string& GetAndroidId() const { return m_sAndroidId; }
+	const std::string& GetServerHost() const { return m_sHost; }
+	const std::string& GetServerPort() const { return m_sPort; }
+
+	/**
+	 * @return The stage latencies of every client, recorded on the threads that run them.
+	 */
+	static MCS_LATENCY_HISTOGRAMS& GetLatencyHistograms();
+
+	/**
+	 * @return The frame, byte and decrypt failure counts of every client.
+	 */
+	static MCS_CLIENT_COUNTERS& GetCounters();
+
 private:
+	void StartCheckIn();
 	void SendLoginBuffer();
-	void SendHeartbeat(int32_t nLastStreamIDReceived);
-	int CalculateMinBytesNeeded();
+	bool SendProto(MCSProtoTag eTag, const google::protobuf::MessageLite& cMessage);
+	void SendHeartbeat();
+	void ScheduleHeartbeat();
+	void QueueAcks();
+	void SendAcks();
+	void OnServerConfirmedReceipt(int32_t nLastStreamIdReceived);
+	void StartAckDeadline(const std::string& sAwaited);
+	void StopAckDeadline();
+	bool SendFrame(const std::vector<uint8_t>& frame);
+	bool FlushOutput();
+	void UpdateSocketEvents();
+	void OnSocketEvent(uint32_t nEvents);
+	void ContinueConnect(uint32_t nEvents);
+	void OnConnected();
+	bool ReadAvailable();
+	void PostRead();
+	void CloseSession(const std::string& sReason, bool bLinkLost = false);
 	void ProcessData();
-	void GotVersion();
-	void GotMessageTag();
-	void GotMessageSize();
-	void GotMessageBytes();
-	void HandleLoginResponseTag();
-	void HandleIqStanzaTag();
-	void HandleDataMessageStanzaTag();
-	void HandleHeartbeatAck();
-	void GetNextMessage();
+	void GotMessageBytes(const MCS_FRAME& frame);
+	void HandleHeartbeatPing(const MCS_FRAME& frame);
+	void HandleLoginResponseTag(const MCS_FRAME& frame);
+	void HandleCloseTag(const MCS_FRAME& frame);
+	void HandleIqStanzaTag(const MCS_FRAME& frame);
+	void HandleDataMessageStanzaTag(const MCS_FRAME& frame);
+	void OnDecrypted(uint64_t nEpoch, uint64_t nSequence, DECRYPT_RESULT& result);
+	void EmitDecrypted(DECRYPT_RESULT& result);
+	void EmitDecryptedInOrder();
+	void FlushDecrypted();
+	void OnDecryptFailed(int nErrorCode);
+#ifdef _DEBUG
+	void ValidateDataMessageStanza(const MCS_FRAME& frame, const DATA_MESSAGE_STANZA_VIEW& stanza);
+#endif
+	void HandleStreamErrorStanzaTag(const MCS_FRAME& frame);
+	void HandleHeartbeatAck(const MCS_FRAME& frame);
 
 private:
 	std::unique_ptr<CTCPSSLClient> m_SecureTCPClient;
 	const LogFnCallback m_oLogger;
 
-	const char* m_szHost = "mtalk.google.com";
-	const char* m_szPort = "5228";
+	std::string m_sHost = "mtalk.google.com";
+	std::string m_sPort = "5228";
+	CCheckInCache* m_pCheckInCache = nullptr;
+	CHostResolver* m_pHostResolver = nullptr;
+
+	std::atomic<int> m_nState{ MCS_SESSION_DISCONNECTED };
+	std::atomic<uint64_t> m_nMessageCount{ 0 };
+	std::atomic<size_t> m_nPersistentIdCount{ 0 }; // m_PersistentIds.size(), for other threads
+
+	CEventLoop* m_pEventLoop = nullptr;
+	ASocket::Socket m_nSocket = INVALID_SOCKET;
+	TimerId m_nConnectTimer = kInvalidTimerId;
+	TimerId m_nHeartbeatTimer = kInvalidTimerId;
+	TimerId m_nAckTimer = kInvalidTimerId;
+	CHeartbeatPolicy m_HeartbeatPolicy;
+	uint32_t m_nPingIdleMs = 0;
+	bool m_bClosedByServer = false;
+	// Every packet on a connection has a stream id, counted from 1 in each direction
+	int32_t m_nStreamIdIn = 0;
+	int32_t m_nStreamIdOut = 0;
+	int32_t m_nStreamIdReported = 0; // the m_nStreamIdIn last sent to the server
+	TimerId m_nSendAckTimer = kInvalidTimerId;
+	bool m_bReadWantsWrite = false;
+	bool m_bReadPosted = false; // ReadAvailable() stopped at kMCSMaxBytesPerReadEvent and posted the rest
+	bool m_bReleaseIdleBuffers = false;
+	std::string m_sLastError;
+
+	CLatencyHistogram::Clock::time_point m_LastReadTime;
+	CLatencyHistogram::Clock::time_point m_FrameStartTime; // of the read that brought the buffered frame's first byte, unset when none is buffered
+	CLatencyHistogram::Clock::time_point m_HeartbeatSentTime; // unset when no ping is awaiting its ack
+
+	std::vector<uint8_t> m_OutBuffer;
+	size_t m_nOutBufferPos = 0;
 
-	int m_nState;
-	int m_nSizePacketSoFar;
-	int m_nMessageTag;
-	int m_nMinBytesNeeded;
-	uint32_t m_nMessageSize;
+	CMCSFrameDecoder m_FrameDecoder;
+	MCS_INBOUND_MESSAGES m_InboundMessages;
+	std::vector<uint8_t> m_PlainTextBuffer;
+	std::string m_sPlainText;
 
-	std::vector<uint8_t> m_BytesReadFromServer;
+	CDecryptPool* m_pDecryptPool = nullptr;
+	bool m_bPreserveOrder = true;
+	// Sequences are per connection, completions of an earlier one carry an older epoch
+	uint64_t m_nDecryptEpoch = 0;
+	uint64_t m_nNextDecryptSequence = 0;
+	uint64_t m_nNextEmitSequence = 0;
+	std::map<uint64_t, DECRYPT_RESULT> m_DecryptedOutOfOrder;
+	// Completions posted by the pool reach the client through this, it is cleared when the client goes away
+	std::shared_ptr<CFCMClient*> m_pSelf = std::make_shared<CFCMClient*>(this);
 
 	std::string m_sAndroidId;
 	std::string m_sSecurityToken;
-	std::vector<uint8_t> m_RawSubPrivKey;
-	std::vector<uint8_t> m_AuthSecret;
+	// The subscription key is imported once, every message reuses it
+	std::shared_ptr<ece_webpush_decrypt_ctx_t> m_DecryptCtx;
 
+	// Ids not confirmed by the server yet, sent again with the next login
 	std::vector<std::string> m_PersistentIds;
+	// Ids waiting for a selective ack
+	std::vector<std::string> m_UnackedIds;
+	// Ids acknowledged by the ack sent with that stream id, confirmed once the server reports receiving it
+	std::map<int32_t, std::vector<std::string>> m_AckedIds;
 };
\ No newline at end of file
@@ -6,17 +6,27 @@
 #include <ctime>
 #include <locale>
 #include <codecvt>
+#include <mutex>
 
 #include <experimental/filesystem>
 
 #include "FCMClient.h"
 #include "FCMRegister.h"
+#include "SessionManager.h"
 #include "ArgumentParser.h"
+#include "AsyncLogger.h"
+#include "BulkRegister.h"
+#include "CheckInCache.h"
+#include "MetricsServer.h"
+#include "PersistentIdJournal.h"
+#include "ReconnectSupervisor.h"
+#include "TokenBucket.h"
 
 #include "json.hpp"
 using json = nlohmann::json;
 
 std::wstring g_sLogPath = L"FCMReceiver.log";
+CAsyncLogger g_Logger;
 
 //define exit codes
 enum ExitCode 
@@ -35,7 +45,10 @@ enum ExitCode
 	CANT_READ_LISTEN_INPUT_FILE,
 	LISTEN_INPUT_DATA_INVALID,
 	CANT_CONNECT_FCM_SERVER,
-	ERROR_WHILE_LISTENING
+	ERROR_WHILE_LISTENING,
+	SESSIONS_INPUT_FILE_TYPE_INVALID,
+	CANT_READ_SESSIONS_INPUT_FILE,
+	SESSIONS_INPUT_DATA_INVALID
 };
 
 bool IsFolderExist(const std::wstring& sFolder)
@@ -43,11 +56,16 @@ bool IsFolderExist(const std::wstring& sFolder)
 	return std::experimental::filesystem::exists(sFolder) && std::experimental::filesystem::is_directory(sFolder);
 }
 
-bool WriteRegisterDataToFile(const FCM_REGISTER_DATA_RETURN& data, const std::wstring& filename)
+json RegisterDataToJson(const FCM_REGISTER_DATA_RETURN& data)
 {
-	json j = json{ {"acg", {{"ID", data.acg.sID}, {"SecurityToken", data.acg.sSecurityToken}}},
+	return json{ {"acg", {{"ID", data.acg.sID}, {"SecurityToken", data.acg.sSecurityToken}}},
 					{"ece", {{"AuthSecret", data.ece.sAuthSecret}, {"PrivateKey", data.ece.sPrivateKey}}},
 					   {"Token", data.sToken} };
+}
+
+bool WriteRegisterDataToFile(const FCM_REGISTER_DATA_RETURN& data, const std::wstring& filename)
+{
+	json j = RegisterDataToJson(data);
 
 	std::ofstream file(filename);
 	if (!file.is_open())
@@ -59,6 +77,51 @@ bool WriteRegisterDataToFile(const FCM_REGISTER_DATA_RETURN& data, const std::ws
 	return true;
 }
 
+//Writes the records as a json array, the format --sessions reads
+bool WriteBulkRegisterDataToFile(const std::vector<FCM_REGISTER_DATA_RETURN>& registered, const std::wstring& filename)
+{
+	json j = json::array();
+	for (const FCM_REGISTER_DATA_RETURN& data : registered)
+		j.push_back(RegisterDataToJson(data));
+
+	std::ofstream file(filename);
+	if (!file.is_open())
+		return false;
+
+	file << j.dump(4);
+	file.close();
+
+	return !file.fail();
+}
+
+//Writes the metrics the --listen and --sessions modes share
+void CollectReceiverMetrics(CPrometheusText& text, size_t nPersistentIds, const RECONNECT_METRICS& reconnects)
+{
+	CMetricsServer::CollectClientMetrics(text);
+
+	text.Family("fcm_persistent_ids", "gauge", "Persistent ids received and not yet confirmed by the server.");
+	text.Sample("fcm_persistent_ids", "", static_cast<uint64_t>(nPersistentIds));
+
+	text.Family("fcm_reconnects_total", "counter", "Connections restored after a drop.");
+	text.Sample("fcm_reconnects_total", "", reconnects.nReconnects);
+	text.Family("fcm_reconnect_failed_attempts_total", "counter", "Reconnect attempts that failed.");
+	text.Sample("fcm_reconnect_failed_attempts_total", "", reconnects.nFailedAttempts);
+
+	text.Family("fcm_log_queue_depth", "gauge", "Log lines waiting for the writer thread.");
+	text.Sample("fcm_log_queue_depth", "", static_cast<uint64_t>(g_Logger.QueueDepth()));
+	text.Family("fcm_log_lines_dropped_total", "counter", "Log lines dropped because the queue was full.");
+	text.Sample("fcm_log_lines_dropped_total", "", g_Logger.DroppedCount());
+}
+
+//Formats a stage as "<stage> p50/p99/max <a>/<b>/<c> us (<samples>)"
+std::string FormatLatency(const std::string& sStage, const CLatencyHistogram& cHistogram)
+{
+	LATENCY_SNAPSHOT snapshot = cHistogram.Snapshot();
+	return sStage + " p50/p99/max " + std::to_string(snapshot.ValueAtPercentile(50) / 1000) +
+		"/" + std::to_string(snapshot.ValueAtPercentile(99) / 1000) +
+		"/" + std::to_string(snapshot.MaxNs() / 1000) + " us (" + std::to_string(snapshot.nCount) + ")";
+}
+
 bool LoadJsonFromFile(const std::wstring& sFilename, json& jsonData)
 {
 	std::ifstream file(sFilename);
@@ -98,19 +161,6 @@ bool IsRegisterDataValid(const json& data)
 	return true;
 }
 
-bool WritePersistentIDToFile(const std::wstring& sFilename, const std::string& sPersistentIDs)
-{
-	std::ofstream file(sFilename);
-	if (!file.is_open())
-	{
-		return false;
-	}
-
-	file << sPersistentIDs;
-	file.close();
-	return true;
-}
-
 bool LoadPersistentID(const std::wstring& sFilename, std::vector<std::string>& persistentIDs)
 {
 	std::ifstream file(sFilename);
@@ -126,36 +176,38 @@ bool LoadPersistentID(const std::wstring& sFilename, std::vector<std::string>& p
 	return true;
 }
 
-auto MyLogPrinter = [](const std::string& strLogMsg)
+//Loads the persistent ids from the journal, the ids of a persistent id file written by an older
+//version are moved into the journal the first time
+bool OpenPersistentIDJournal(CPersistentIdJournal& cJournal, const std::wstring& sJournalFile, const std::wstring& sLegacyFile, std::vector<std::string>& persistentIDs)
+{
+	if (!cJournal.Open(sJournalFile, persistentIDs))
+		return false;
+
+	std::vector<std::string> legacyIDs;
+	if (!LoadPersistentID(sLegacyFile, legacyIDs))
+		return true;
+
+	for (const std::string& sPersistentID : legacyIDs)
 	{
-		auto now = std::chrono::system_clock::now();
-		std::time_t currentTime = std::chrono::system_clock::to_time_t(now);
+		if (sPersistentID.empty())
+			continue;
 
-		std::stringstream ss;
-		ss << std::put_time(std::localtime(&currentTime), "%H:%M:%S %d-%m-%Y");
-		std::string timeStr = ss.str();
+		if (!cJournal.Append(sPersistentID))
+			return false;
+		persistentIDs.push_back(sPersistentID);
+	}
 
-		std::cout << "[" << timeStr << "] " << strLogMsg << std::endl;
+	if (!cJournal.Sync())
+		return false;
 
-		std::ofstream file(g_sLogPath, std::ios::app);
-		if (file.is_open())
-		{
-			file << "[" << timeStr << "] " << strLogMsg << std::endl;
-			file.close();
-		}
-		else
-		{
-			std::ofstream newFile(g_sLogPath);
-			if (newFile.is_open())
-			{
-				newFile << "[" << timeStr << "] " << strLogMsg << std::endl;
-				newFile.close();
-			}
-			else
-			{
-				std::cerr << "Failed to create the log file." << std::endl;
-			}
-		}
+	std::error_code ec;
+	std::experimental::filesystem::remove(sLegacyFile, ec);
+	return true;
+}
+
+auto MyLogPrinter = [](const std::string& strLogMsg)
+	{
+		g_Logger.Log(strLogMsg);
 	};
 
 int wmain(int argc, wchar_t* argv[])
@@ -166,20 +218,47 @@ int wmain(int argc, wchar_t* argv[])
 	CArgumentOption cRegisterInputFileOption(ArgumentOptionType::InputOption, { }, {L"register_input" }, L"If set, the register info will be taken from this path. Otherwise, the system will attempt to find 'init_fcm_data.json' in the same directory as this executable being called.");
 	CArgumentOption cRegisterOutputFileOption(ArgumentOptionType::InputOption, { }, {L"register_output" }, L"If set, the register info file will be placed in this path. Otherwise, it will be placed in the same directory as this executable being called.");
 
+	CArgumentOption cBulkRegisterOption(ArgumentOptionType::InputOption, { }, { L"bulk_register" }, L"Register many identities concurrently. Takes a json array of 'init_fcm_data.json' objects, one identity per entry (a single object is one identity).");
+	CArgumentOption cBulkCountOption(ArgumentOptionType::InputOption, { }, { L"bulk_count" }, L"Number of identities --bulk_register registers per entry. Defaults to 1.");
+	CArgumentOption cBulkOutputFileOption(ArgumentOptionType::InputOption, { }, { L"bulk_output" }, L"The file --bulk_register writes every registered identity to, a json array that --sessions can read. Defaults to 'fcm_register_bulk.json'.");
+	CArgumentOption cBulkPerHostOption(ArgumentOptionType::InputOption, { }, { L"bulk_per_host" }, L"Number of requests --bulk_register keeps in flight per host. Defaults to 8.");
+
 	CArgumentOption cListenOption({ 'l' }, { L"listen" }, L"Listen to fcm server");
 	CArgumentOption cListenInputFileOption(ArgumentOptionType::InputOption, { }, {L"listen_input" }, L"If set, the register info will be taken from this path. Otherwise, the system will attempt to find 'fcm_register_data.json' in the same directory as this executable being called.");
+	CArgumentOption cCheckInTtlOption(ArgumentOptionType::InputOption, { }, { L"checkin_ttl" }, L"Seconds a successful check-in is remembered in 'checkin.cache', connects of --listen and --sessions within that time skip it. Defaults to 43200, 0 checks in on every connect.");
+
+	CArgumentOption cSessionsOption(ArgumentOptionType::InputOption, { }, { L"sessions" }, L"Listen to fcm server with every register data record in this json file (a json array of 'fcm_register_data.json' objects). The sessions share a fixed pool of threads.");
+	CArgumentOption cThreadsOption(ArgumentOptionType::InputOption, { }, { L"threads" }, L"Number of threads used by --sessions, and by --bulk_register to generate keys. Defaults to one per CPU.");
+	CArgumentOption cDecryptThreadsOption(ArgumentOptionType::InputOption, { }, { L"decrypt_threads" }, L"Number of threads that decrypt messages for --sessions. Defaults to 0, messages are decrypted on the session threads.");
+	CArgumentOption cMcsServerOption(ArgumentOptionType::InputOption, { }, { L"mcs_server" }, L"The MCS server --listen and --sessions connect to, as 'host:port'. Defaults to 'mtalk.google.com:5228'.");
+
+	CArgumentOption cMetricsPortOption(ArgumentOptionType::InputOption, { }, { L"metrics_port" }, L"Serve Prometheus metrics for --listen and --sessions on this port, at /metrics.");
+	CArgumentOption cMetricsAddressOption(ArgumentOptionType::InputOption, { }, { L"metrics_address" }, L"The address --metrics_port listens on. Defaults to '127.0.0.1', '0.0.0.0' serves every interface.");
 
 	CArgumentOption cLogPathOption(ArgumentOptionType::InputOption, { }, { L"log_folder" }, L"If set, log file 'FCMReceiver.log' will be placed in this folder. Otherwise, it will be placed in the same folder as this executable being called.");
+	CArgumentOption cLogLevelOption(ArgumentOptionType::InputOption, { }, { L"log_level" }, L"Lowest level logged by the client: debug, info, warning, error, fatal or off. Defaults to info.");
 
 	CArgumentOption helpOption(ArgumentOptionType::HelpOption, { 'h' }, { L"help" }, L"Prints out this message.");
 	CArgumentOption versionOption(ArgumentOptionType::VersionOption, { 'v' }, { L"version" }, L"Prints out the version.");
 	cArgumentParser.AddArgumentOption({
 		&cListenInputFileOption,
 		&cListenOption,
+		&cCheckInTtlOption,
 		&cRegisterInputFileOption,
 		&cRegisterOutputFileOption,
 		&cRegisterOption,
+		&cBulkRegisterOption,
+		&cBulkCountOption,
+		&cBulkOutputFileOption,
+		&cBulkPerHostOption,
+		&cSessionsOption,
+		&cThreadsOption,
+		&cDecryptThreadsOption,
+		&cMcsServerOption,
+		&cMetricsPortOption,
+		&cMetricsAddressOption,
 		&cLogPathOption,
+		&cLogLevelOption,
 		&helpOption,
 		&versionOption
 		});
@@ -194,9 +273,21 @@ int wmain(int argc, wchar_t* argv[])
 	if (cRegisterOption.WasSet() > 1 || 
 		cRegisterInputFileOption.WasSet() > 1 ||
 		cRegisterOutputFileOption.WasSet() > 1 ||
+		cBulkRegisterOption.WasSet() > 1 ||
+		cBulkCountOption.WasSet() > 1 ||
+		cBulkOutputFileOption.WasSet() > 1 ||
+		cBulkPerHostOption.WasSet() > 1 ||
 		cLogPathOption.WasSet() > 1 ||
+		cLogLevelOption.WasSet() > 1 ||
 		cListenOption.WasSet() > 1 ||
-		cListenInputFileOption.WasSet() > 1) 
+		cListenInputFileOption.WasSet() > 1 ||
+		cCheckInTtlOption.WasSet() > 1 ||
+		cSessionsOption.WasSet() > 1 ||
+		cThreadsOption.WasSet() > 1 ||
+		cDecryptThreadsOption.WasSet() > 1 ||
+		cMcsServerOption.WasSet() > 1 ||
+		cMetricsPortOption.WasSet() > 1 ||
+		cMetricsAddressOption.WasSet() > 1) 
 	{
 		std::wcout << "Error: Option was set more than once.";
 		exit(ExitCode::ARGUMENT_ERROR);
@@ -231,6 +322,76 @@ int wmain(int argc, wchar_t* argv[])
 		}
 	}
 
+	if (cLogLevelOption.WasSet())
+	{
+		std::wstring sLogLevel = cLogLevelOption.GetValue();
+		LogLevel eLogLevel;
+		if (!LogUtil::ParseLevel(std::string(sLogLevel.begin(), sLogLevel.end()), eLogLevel))
+		{
+			std::cerr << "Log level must be one of debug, info, warning, error, fatal or off." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+		LogUtil::SetLevel(eLogLevel);
+	}
+
+	std::string sMcsHost;
+	std::string sMcsPort;
+	if (cMcsServerOption.WasSet())
+	{
+		std::wstring sMcsServer = cMcsServerOption.GetValue();
+		size_t nColon = sMcsServer.rfind(L':');
+		if (nColon == std::wstring::npos || nColon == 0 || nColon + 1 == sMcsServer.size())
+		{
+			std::cerr << "MCS server must be given as host:port." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+		sMcsHost = std::string(sMcsServer.begin(), sMcsServer.begin() + nColon);
+		sMcsPort = std::string(sMcsServer.begin() + nColon + 1, sMcsServer.end());
+	}
+
+	uint32_t nCheckInTtlSec = kCheckInDefaultTtlSec;
+	if (cCheckInTtlOption.WasSet())
+	{
+		try {
+			nCheckInTtlSec = static_cast<uint32_t>(std::stoul(cCheckInTtlOption.GetValue()));
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << "Check-in TTL must be a number." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+	}
+
+	std::string sMetricsPort;
+	if (cMetricsPortOption.WasSet())
+	{
+		std::wstring sPort = cMetricsPortOption.GetValue();
+		try {
+			if (std::stoul(sPort) == 0 || std::stoul(sPort) > 65535)
+				throw std::invalid_argument("port");
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << "Metrics port must be a number from 1 to 65535." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+		sMetricsPort = std::string(sPort.begin(), sPort.end());
+	}
+
+	std::string sMetricsAddress = kMetricsDefaultAddress;
+	if (cMetricsAddressOption.WasSet())
+	{
+		std::wstring sAddress = cMetricsAddressOption.GetValue();
+		if (sAddress.empty())
+		{
+			std::cerr << "Metrics address must not be empty." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+		sMetricsAddress = std::string(sAddress.begin(), sAddress.end());
+	}
+
+	g_Logger.Start(g_sLogPath);
+
 	if (cRegisterOption.WasSet())
 	{
 		std::wstring sRegisterInputFilePath = cRegisterInputFileOption.WasSet()
@@ -296,6 +457,108 @@ int wmain(int argc, wchar_t* argv[])
 		exit(ExitCode::SUCCESS);
 	}
 
+	if (cBulkRegisterOption.WasSet())
+	{
+		std::wstring sManifestFilePath = cBulkRegisterOption.GetValue();
+		if (sManifestFilePath.size() < 5 || sManifestFilePath.substr(sManifestFilePath.size() - 5) != L".json")
+		{
+			std::cerr << "Bulk register input file must be a json file." << std::endl;
+			exit(ExitCode::REGISTER_INPUT_FILE_TYPE_INVALID);
+		}
+
+		json manifest;
+		if (!LoadJsonFromFile(sManifestFilePath, manifest))
+		{
+			std::wcerr << "Unable to read from file: " << sManifestFilePath << std::endl;
+			exit(ExitCode::CANT_READ_REGISTER_INPUT_FILE);
+		}
+
+		if (!manifest.is_array())
+			manifest = json::array({ manifest });
+
+		if (manifest.empty())
+		{
+			std::cerr << "Bulk register input data is empty." << std::endl;
+			exit(ExitCode::REGISTER_INPUT_DATA_INVALID);
+		}
+
+		std::wstring sOutputFileName = cBulkOutputFileOption.WasSet()
+			? cBulkOutputFileOption.GetValue() : L"fcm_register_bulk.json";
+
+		if (sOutputFileName.size() < 5 || sOutputFileName.substr(sOutputFileName.size() - 5) != L".json")
+		{
+			std::cerr << "Bulk register output file must be a json file." << std::endl;
+			exit(ExitCode::REGISTER_OUTPUT_FILE_TYPE_INVALID);
+		}
+
+		size_t nCount = 1;
+		size_t nMaxPerHost = kBulkRegisterDefaultMaxPerHost;
+		size_t nThreadCount = 0;
+		try {
+			if (cBulkCountOption.WasSet())
+				nCount = std::stoul(cBulkCountOption.GetValue());
+			if (cBulkPerHostOption.WasSet())
+				nMaxPerHost = std::stoul(cBulkPerHostOption.GetValue());
+			if (cThreadsOption.WasSet())
+				nThreadCount = std::stoul(cThreadsOption.GetValue());
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << "Bulk count, bulk per host and threads must be numbers." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+
+		if (nCount == 0 || nMaxPerHost == 0)
+		{
+			std::cerr << "Bulk count and bulk per host must be greater than 0." << std::endl;
+			exit(ExitCode::ARGUMENT_ERROR);
+		}
+
+		CBulkRegister cBulkRegister(MyLogPrinter, nMaxPerHost, nThreadCount);
+		for (const json& fcmInitData : manifest)
+		{
+			if (!IsInitFCMDataValid(fcmInitData))
+			{
+				std::cerr << "Bulk register input init data is invalid." << std::endl;
+				exit(ExitCode::REGISTER_INPUT_DATA_INVALID);
+			}
+
+			FCM_PARAMS params;
+			params.firebase.sAppID = fcmInitData["appid"];
+			params.firebase.sProjectID = fcmInitData["projectid"];
+			params.firebase.sApiKey = fcmInitData["apikey"];
+			params.sVapidKey = fcmInitData["vapidkey"];
+
+			for (size_t i = 0; i < nCount; ++i)
+				cBulkRegister.Add(params);
+		}
+
+		std::vector<FCM_REGISTER_DATA_RETURN> registered;
+		BULK_REGISTER_STATS stats = cBulkRegister.Run(registered);
+
+		std::cout << "Registered " << stats.nRegistered << " of " << stats.nIdentities << " identities in "
+			<< stats.nElapsedMs / 1000.0 << " s, " << static_cast<uint64_t>(stats.dPerMinute) << " per minute." << std::endl;
+
+		for (size_t nStage = 0; nStage < BULK_STAGE_COUNT; ++nStage)
+		{
+			if (stats.nFailed[nStage] > 0)
+				std::cout << "Failed at " << CBulkRegister::GetStageName(static_cast<BulkRegisterStage>(nStage)) << ": " << stats.nFailed[nStage] << std::endl;
+		}
+
+		if (!registered.empty())
+		{
+			if (!WriteBulkRegisterDataToFile(registered, sOutputFileName))
+			{
+				std::wcerr << "Unable to write to file: " << sOutputFileName << std::endl;
+				exit(ExitCode::CANT_WRITE_REGISTER_DATA);
+			}
+
+			std::wcout << "FCM registration data has been saved to " << sOutputFileName << std::endl;
+		}
+
+		exit(stats.nRegistered == stats.nIdentities ? ExitCode::SUCCESS : ExitCode::REGISTER_FAILED);
+	}
+
 	if (cListenOption.WasSet())
 	{
 		std::wstring sListenInputFilePath = cListenInputFileOption.WasSet()
@@ -324,7 +587,22 @@ int wmain(int argc, wchar_t* argv[])
 		//and server will send only new messages so we must save this id to a file and read it from there
 		//when we start new connection to the server
 		std::vector<std::string> persistentIDs;
-		LoadPersistentID(L"persistent_id.txt", persistentIDs);
+		CJournalWriter cJournalWriter(MyLogPrinter);
+		CPersistentIdJournal cPersistentIDJournal(MyLogPrinter, cJournalWriter);
+		if (!OpenPersistentIDJournal(cPersistentIDJournal, L"persistent_id.journal", L"persistent_id.txt", persistentIDs))
+		{
+			MyLogPrinter("[MAIN][WARNING] Unable to open persistent id journal.");
+		}
+
+		//Restarted processes skip the check-in while the last one is recent
+		CCheckInCache cCheckInCache(MyLogPrinter, nCheckInTtlSec);
+		if (!cCheckInCache.Open(L"checkin.cache"))
+		{
+			MyLogPrinter("[MAIN][WARNING] Unable to read check-in cache.");
+		}
+
+		//Reconnects run on the event loop and take the server address from here
+		CHostResolver cHostResolver(MyLogPrinter);
 
 		MyLogPrinter("Receiving message in FCM token: " + fcmRegisterData["Token"].dump());
 
@@ -335,38 +613,246 @@ int wmain(int argc, wchar_t* argv[])
 			fcmRegisterData["ece"]["AuthSecret"],
 			persistentIDs);
 
+		cFCMClient.SetCheckInCache(&cCheckInCache);
+		if (!sMcsHost.empty())
+			cFCMClient.SetServer(sMcsHost, sMcsPort);
+		cFCMClient.SetHostResolver(&cHostResolver);
+		cHostResolver.Resolve(cFCMClient.GetServerHost(), cFCMClient.GetServerPort());
 		cFCMClient.Once("connected", MyLogPrinter);
 
-		cFCMClient.On("persistent_id", [](const std::string& sPersistentID) {
-			//MyLogPrinter("[MAIN][INFO] persistent_id list: " + sPersistentID);
-
-			if (!WritePersistentIDToFile(L"persistent_id.txt", sPersistentID))
+		cFCMClient.On("persistent_id", [&cPersistentIDJournal](const std::string& sPersistentID) {
+			if (!cPersistentIDJournal.Append(sPersistentID))
 			{
 				MyLogPrinter("[MAIN][WARNING] Unable to write persistent id to file.");
 			}
 		});
 
+		cFCMClient.On("persistent_ids_confirmed", [&cPersistentIDJournal](const std::string& sPersistentIDs) {
+			cPersistentIDJournal.Confirm(StringUtil::split(sPersistentIDs, ';'));
+		});
+
 		cFCMClient.On("message", [](const std::string& message) {
 			MyLogPrinter("[MAIN][INFO] Message: " + message);
 		});
 
-		if (cFCMClient.ConnectToServer())
+		if (!cFCMClient.ConnectToServer())
+		{
+			exit(ExitCode::CANT_CONNECT_FCM_SERVER);
+		}
+
+		//A dropped connection is restored in process, with backoff, instead of ending the process
+		CEventLoop cEventLoop(MyLogPrinter);
+		CTokenBucket cHandshakeBucket(kSessionStartRatePerSecond, 1);
+		CReconnectSupervisor cReconnectSupervisor(MyLogPrinter, cFCMClient, cEventLoop, cHandshakeBucket);
+		if (!cFCMClient.Attach(cEventLoop))
+		{
+			exit(ExitCode::CANT_CONNECT_FCM_SERVER);
+		}
+		cReconnectSupervisor.Start(false);
+
+		//Scrapes only read counters, the loop thread never waits on them
+		CMetricsServer cMetricsServer(MyLogPrinter, sMetricsPort, [&cFCMClient, &cReconnectSupervisor](CPrometheusText& text) {
+			CollectReceiverMetrics(text, cFCMClient.GetPersistentIdCount(), cReconnectSupervisor.GetMetrics());
+		}, sMetricsAddress);
+		if (!sMetricsPort.empty())
+			cMetricsServer.Start();
+
+		try {
+			cEventLoop.Run();
+		}
+		catch (std::exception& e)
+		{
+			MyLogPrinter("[MAIN][ERROR] " + std::string(e.what()));
+			exit(ExitCode::ERROR_WHILE_LISTENING);
+		}
+
+		exit(ExitCode::SUCCESS);
+	}
+
+	if (cSessionsOption.WasSet())
+	{
+		std::wstring sSessionsInputFilePath = cSessionsOption.GetValue();
+		if (sSessionsInputFilePath.size() < 5 || sSessionsInputFilePath.substr(sSessionsInputFilePath.size() - 5) != L".json")
+		{
+			std::cerr << "Sessions input file must be a json file." << std::endl;
+			exit(ExitCode::SESSIONS_INPUT_FILE_TYPE_INVALID);
+		}
+
+		json sessionsData;
+		if (!LoadJsonFromFile(sSessionsInputFilePath, sessionsData))
+		{
+			std::wcerr << "Unable to read from file: " << sSessionsInputFilePath << std::endl;
+			exit(ExitCode::CANT_READ_SESSIONS_INPUT_FILE);
+		}
+
+		if (!sessionsData.is_array() || sessionsData.empty())
+		{
+			std::cerr << "Sessions input data must be a non-empty json array." << std::endl;
+			exit(ExitCode::SESSIONS_INPUT_DATA_INVALID);
+		}
+
+		size_t nThreadCount = 0;
+		if (cThreadsOption.WasSet())
 		{
 			try {
-				cFCMClient.StartReceiver();
+				nThreadCount = std::stoul(cThreadsOption.GetValue());
 			}
 			catch (std::exception& e)
 			{
-				MyLogPrinter("[MAIN][ERROR] " + std::string(e.what()));
-				exit(ExitCode::ERROR_WHILE_LISTENING);
+				std::cerr << "Threads must be a number." << std::endl;
+				exit(ExitCode::ARGUMENT_ERROR);
 			}
 		}
-		else
+
+		size_t nDecryptThreadCount = 0;
+		if (cDecryptThreadsOption.WasSet())
 		{
-			exit(ExitCode::CANT_CONNECT_FCM_SERVER);
+			try {
+				nDecryptThreadCount = std::stoul(cDecryptThreadsOption.GetValue());
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Decrypt threads must be a number." << std::endl;
+				exit(ExitCode::ARGUMENT_ERROR);
+			}
 		}
 
-		exit(ExitCode::SUCCESS);
+		//Declared first so the journals and the check-in cache outlive the sessions using them,
+		//and the writer the journals
+		CJournalWriter cJournalWriter(MyLogPrinter);
+
+		//One cache for every session, each android id checks in once per TTL however often it reconnects
+		CCheckInCache cCheckInCache(MyLogPrinter, nCheckInTtlSec);
+		if (!cCheckInCache.Open(L"checkin.cache"))
+		{
+			MyLogPrinter("[MAIN][WARNING] Unable to read check-in cache.");
+		}
+
+		std::vector<std::unique_ptr<CPersistentIdJournal>> persistentIDJournals;
+		CSessionManager cSessionManager(MyLogPrinter, nThreadCount, nDecryptThreadCount);
+
+		for (const json& registerData : sessionsData)
+		{
+			if (!IsRegisterDataValid(registerData))
+			{
+				std::cerr << "Sessions input register data is invalid." << std::endl;
+				exit(ExitCode::SESSIONS_INPUT_DATA_INVALID);
+			}
+
+			SESSION_CONFIG config;
+			config.sAndroidId = registerData["acg"]["ID"];
+			config.sSecurityToken = registerData["acg"]["SecurityToken"];
+			config.sBase64PrivateKey = registerData["ece"]["PrivateKey"];
+			config.sBase64AuthSecret = registerData["ece"]["AuthSecret"];
+
+			//Each session keeps its own persistent id journal, named after its android id
+			std::wstring sPersistentIDFile = L"persistent_id_" + std::wstring(config.sAndroidId.begin(), config.sAndroidId.end());
+			persistentIDJournals.push_back(std::make_unique<CPersistentIdJournal>(MyLogPrinter, cJournalWriter));
+			CPersistentIdJournal* pPersistentIDJournal = persistentIDJournals.back().get();
+			if (!OpenPersistentIDJournal(*pPersistentIDJournal, sPersistentIDFile + L".journal", sPersistentIDFile + L".txt", config.persistentIds))
+			{
+				MyLogPrinter("[MAIN][WARNING] Unable to open persistent id journal for " + config.sAndroidId + ".");
+			}
+
+			size_t nIndex;
+			try {
+				nIndex = cSessionManager.AddSession(config);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Sessions input register data is invalid: " << e.what() << std::endl;
+				exit(ExitCode::SESSIONS_INPUT_DATA_INVALID);
+			}
+
+			std::string sAndroidId = config.sAndroidId;
+			CFCMClient& cFCMClient = cSessionManager.GetClient(nIndex);
+
+			cFCMClient.On("persistent_id", [pPersistentIDJournal](const std::string& sPersistentID) {
+				if (!pPersistentIDJournal->Append(sPersistentID))
+				{
+					MyLogPrinter("[MAIN][WARNING] Unable to write persistent id to file.");
+				}
+			});
+
+			cFCMClient.On("persistent_ids_confirmed", [pPersistentIDJournal](const std::string& sPersistentIDs) {
+				pPersistentIDJournal->Confirm(StringUtil::split(sPersistentIDs, ';'));
+			});
+
+			cFCMClient.On("message", [sAndroidId](const std::string& message) {
+				MyLogPrinter("[MAIN][INFO] Message for " + sAndroidId + ": " + message);
+			});
+		}
+
+		if (!sMcsHost.empty())
+			cSessionManager.SetServer(sMcsHost, sMcsPort);
+		cSessionManager.SetCheckInCache(&cCheckInCache);
+
+		cSessionManager.Start();
+
+		//Scrapes only read counters, the loop threads never wait on them
+		CMetricsServer cMetricsServer(MyLogPrinter, sMetricsPort, [&cSessionManager](CPrometheusText& text) {
+			CollectReceiverMetrics(text, cSessionManager.CountPersistentIds(), cSessionManager.GetReconnectMetrics());
+
+			text.Family("fcm_sessions", "gauge", "Sessions by connection state.");
+			size_t nOnline = cSessionManager.CountSessions(MCS_SESSION_ONLINE);
+			size_t nDisconnected = cSessionManager.CountSessions(MCS_SESSION_DISCONNECTED);
+			text.Sample("fcm_sessions", "state=\"online\"", static_cast<uint64_t>(nOnline));
+			text.Sample("fcm_sessions", "state=\"connecting\"", static_cast<uint64_t>(cSessionManager.SessionCount() - (std::min)(cSessionManager.SessionCount(), nOnline + nDisconnected)));
+			text.Sample("fcm_sessions", "state=\"disconnected\"", static_cast<uint64_t>(nDisconnected));
+
+			DECRYPT_POOL_METRICS metrics;
+			if (cSessionManager.GetDecryptMetrics(metrics, false))
+			{
+				text.Family("fcm_decrypt_queue_depth", "gauge", "Messages waiting for a decrypt worker.");
+				text.Sample("fcm_decrypt_queue_depth", "", static_cast<uint64_t>(metrics.nQueueDepth));
+				text.Family("fcm_decrypt_queue_capacity", "gauge", "Messages the decrypt queue holds.");
+				text.Sample("fcm_decrypt_queue_capacity", "", static_cast<uint64_t>(metrics.nQueueCapacity));
+				text.Family("fcm_decrypt_queue_full_total", "counter", "Messages decrypted on a session thread because the queue was full.");
+				text.Sample("fcm_decrypt_queue_full_total", "", metrics.nRejected);
+				text.Family("fcm_decrypt_busy_seconds_total", "counter", "Worker time spent decrypting.");
+				text.Sample("fcm_decrypt_busy_seconds_total", "", static_cast<double>(metrics.nBusyNs) / 1e9);
+			}
+		}, sMetricsAddress);
+		if (!sMetricsPort.empty())
+			cMetricsServer.Start();
+
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(30));
+
+			size_t nOnline = cSessionManager.CountSessions(MCS_SESSION_ONLINE);
+			size_t nDisconnected = cSessionManager.CountSessions(MCS_SESSION_DISCONNECTED);
+			size_t nConnecting = cSessionManager.SessionCount() - nOnline - nDisconnected;
+
+			MyLogPrinter("[MAIN][INFO] Sessions online " + std::to_string(nOnline) +
+				", connecting " + std::to_string(nConnecting) +
+				", disconnected " + std::to_string(nDisconnected) +
+				" of " + std::to_string(cSessionManager.SessionCount()));
+
+			DECRYPT_POOL_METRICS metrics;
+			if (cSessionManager.GetDecryptMetrics(metrics))
+			{
+				MyLogPrinter("[MAIN][INFO] Decrypt queue " + std::to_string(metrics.nQueueDepth) + "/" + std::to_string(metrics.nQueueCapacity) +
+					", workers busy " + std::to_string(metrics.nBusyWorkers) + "/" + std::to_string(metrics.nWorkers) +
+					", utilization " + std::to_string(static_cast<int>(metrics.dUtilization * 100)) + "%" +
+					", decrypted " + std::to_string(metrics.nCompleted) +
+					", queue full " + std::to_string(metrics.nRejected));
+			}
+
+			RECONNECT_METRICS reconnectMetrics = cSessionManager.GetReconnectMetrics();
+			MyLogPrinter("[MAIN][INFO] Reconnects " + std::to_string(reconnectMetrics.nReconnects) +
+				", failed attempts " + std::to_string(reconnectMetrics.nFailedAttempts) +
+				", time to recover last " + std::to_string(reconnectMetrics.nLastRecoveryMs) + " ms" +
+				", max " + std::to_string(reconnectMetrics.nMaxRecoveryMs) + " ms" +
+				", average " + std::to_string(reconnectMetrics.nReconnects > 0 ? reconnectMetrics.nTotalRecoveryMs / reconnectMetrics.nReconnects : 0) + " ms");
+
+			MCS_LATENCY_HISTOGRAMS& histograms = CFCMClient::GetLatencyHistograms();
+			MyLogPrinter("[MAIN][INFO] Latency " + FormatLatency("frame assembly", histograms.frameAssembly) +
+				", " + FormatLatency("parse", histograms.parse) +
+				", " + FormatLatency("decrypt", histograms.decrypt) +
+				", " + FormatLatency("emit", histograms.emit) +
+				", " + FormatLatency("heartbeat rtt", histograms.heartbeatRtt));
+		}
 	}
 
 	std::wcout << cArgumentParser.HelpText();
@@ -1,4 +1,4 @@
-#include "FcmRegister.h"
+#include "FCMRegister.h"
 
 CFCMRegister::CFCMRegister(const LogFnCallback oLogger): m_oLog(oLogger){}
 CFCMRegister::~CFCMRegister(){}
@@ -26,161 +26,213 @@ std::string CFCMRegister::GetCheckinRequest(uint64_t nAndroidId, uint64_t nSecur
     return sBuffer;
 }
 
-checkin_proto::AndroidCheckinResponse CFCMRegister::CheckIn(uint64_t nAndroidId, uint64_t nSecurityToken)
+HTTP_REQUEST CFCMRegister::GetCheckInHttpRequest(uint64_t nAndroidId, uint64_t nSecurityToken)
 {
-    std::string sCheckinUrl = "https://android.clients.google.com/checkin";
-    std::string sBuffer = GetCheckinRequest(nAndroidId, nSecurityToken);
-    std::string sResponseBuffer;
+    HTTP_REQUEST request;
+    request.sUrl = "https://android.clients.google.com/checkin";
+    request.headers.emplace_back("Content-Type: application/x-protobuf");
+    request.sBody = GetCheckinRequest(nAndroidId, nSecurityToken);
 
-    CLibCurlWrapper cLibCurlWrapper;
+    return request;
+}
+
+bool CFCMRegister::ParseCheckInResponse(const std::string& sResponse, checkin_proto::AndroidCheckinResponse& response)
+{
+    if (!response.ParseFromString(sResponse))
+    {
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] CheckIn: Failed to parse checkin response.");
+        return false;
+    }
 
-    std::vector<std::string> headers;
-    headers.reserve(1);
-    headers.emplace_back("Content-Type: application/x-protobuf");
+    return true;
+}
 
-    cLibCurlWrapper.SetHeaders(headers);
-    if (!cLibCurlWrapper.Post(sCheckinUrl, sBuffer, sResponseBuffer))
+checkin_proto::AndroidCheckinResponse CFCMRegister::CheckIn(uint64_t nAndroidId, uint64_t nSecurityToken)
+{
+    std::string sResponseBuffer;
+    std::string sError;
+    if (!Send(GetCheckInHttpRequest(nAndroidId, nSecurityToken), sResponseBuffer, sError))
     {
-        m_oLog("[FCMRegister][Error] CheckIn: " + cLibCurlWrapper.GetError());
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] CheckIn: ", sError);
         return checkin_proto::AndroidCheckinResponse();
     }
 
     checkin_proto::AndroidCheckinResponse protoCheckinResponse;
-    if (!protoCheckinResponse.ParseFromString(sResponseBuffer))
-    {
-        m_oLog("[FCMRegister][Error] CheckIn: Failed to parse checkin response.");
+    if (!ParseCheckInResponse(sResponseBuffer, protoCheckinResponse))
         return checkin_proto::AndroidCheckinResponse();
-    }
 
     return protoCheckinResponse;
 }
 
-std::string CFCMRegister::DoGCMRegister(const std::string& sAppId, uint64_t sAndroidId, uint64_t sSecurityToken)
+HTTP_REQUEST CFCMRegister::GetGCMRegisterHttpRequest(const std::string& sAppId, uint64_t nAndroidId, uint64_t nSecurityToken)
 {
     std::string sServerKeyBase64Encoded = base64_encode(g_serverKey.data(), g_serverKey.size(), true);
     StringUtil::replace_all(sServerKeyBase64Encoded, "=", "");
 
     std::string sHeader = "Authorization: AidLogin ";
-    sHeader.append(StringUtil::to_string(sAndroidId)).append(":").append(StringUtil::to_string(sSecurityToken));
+    sHeader.append(StringUtil::to_string(nAndroidId)).append(":").append(StringUtil::to_string(nSecurityToken));
 
-    std::string sBody;
-    sBody.append("app=org.chromium.linux&X-subtype=").append(sAppId)
-        .append("&device=").append(std::to_string(sAndroidId))
+    HTTP_REQUEST request;
+    request.sUrl = "https://android.clients.google.com/c2dm/register3";
+    request.headers.emplace_back(std::move(sHeader));
+    request.sBody.append("app=org.chromium.linux&X-subtype=").append(sAppId)
+        .append("&device=").append(std::to_string(nAndroidId))
         .append("&sender=").append(sServerKeyBase64Encoded);
 
-    std::string sResponseBuffer;
-    std::string sRegisterUrl = "https://android.clients.google.com/c2dm/register3";
-
-    CLibCurlWrapper cLibCurlWrapper;
-
-    std::vector<std::string> headers;
-    headers.emplace_back(std::move(sHeader));
-    cLibCurlWrapper.SetHeaders(headers);
+    return request;
+}
 
-    if (!cLibCurlWrapper.Post(sRegisterUrl, sBody, sResponseBuffer))
+std::string CFCMRegister::ParseGCMRegisterResponse(const std::string& sResponse)
+{
+    // "token=<token>" on success, "Error=<reason>" otherwise
+    const std::string sPrefix = "token=";
+    if (sResponse.compare(0, sPrefix.size(), sPrefix) != 0)
     {
-        m_oLog("[FCMRegister][Error] DoGCMRegister: Error:" + cLibCurlWrapper.GetError());
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] DoGCMRegister: Error:", sResponse);
         return std::string();
     }
 
-    return StringUtil::split(sResponseBuffer, "=").at(1);
+    return sResponse.substr(sPrefix.size());
 }
 
-std::string CFCMRegister::PostInstallations(const std::string& sAppId, const std::string& sProjectId, const std::string& sApiKey)
+std::string CFCMRegister::DoGCMRegister(const std::string& sAppId, uint64_t nAndroidId, uint64_t nSecurityToken)
 {
-    std::string sBody;
-    sBody.append("{\"appId\":\"").append(sAppId)
-        .append("\",\"authVersion\":\"FIS_v2\",\"sdkVersion\":\"w:0.6.4\",\"fid\":\"")
-        .append(UtilFunction::GenerateFirebaseFID()).append("\"}");
-
     std::string sResponseBuffer;
-    std::string sUrl = "https://firebaseinstallations.googleapis.com/v1/projects/";
-    sUrl.append(sProjectId).append("/installations");
+    std::string sError;
+    if (!Send(GetGCMRegisterHttpRequest(sAppId, nAndroidId, nSecurityToken), sResponseBuffer, sError))
+    {
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] DoGCMRegister: Error:", sError);
+        return std::string();
+    }
 
-    CLibCurlWrapper cLibCurlWrapper;
+    return ParseGCMRegisterResponse(sResponseBuffer);
+}
 
+HTTP_REQUEST CFCMRegister::GetInstallationsHttpRequest(const std::string& sAppId, const std::string& sProjectId, const std::string& sApiKey)
+{
     std::string sHeartbeat = "{\"heartbeats\":[],\"version\":2}";
     std::string sClient = base64_encode(sHeartbeat, true);
 
-    std::vector<std::string> sHeaders;
-    sHeaders.emplace_back("x-firebase-client: " + sClient);
-    sHeaders.emplace_back("x-goog-api-key: " + sApiKey);
-    sHeaders.emplace_back("Content-Type: application/json");
+    HTTP_REQUEST request;
+    request.sUrl = "https://firebaseinstallations.googleapis.com/v1/projects/";
+    request.sUrl.append(sProjectId).append("/installations");
 
-    cLibCurlWrapper.SetHeaders(sHeaders);
+    request.headers.emplace_back("x-firebase-client: " + sClient);
+    request.headers.emplace_back("x-goog-api-key: " + sApiKey);
+    request.headers.emplace_back("Content-Type: application/json");
 
-    if (!cLibCurlWrapper.Post(sUrl, sBody, sResponseBuffer))
-    {
-        m_oLog("[FCMRegister][Error] PostInstallations: Error:" + cLibCurlWrapper.GetError());
-        return std::string();
-    }
+    request.sBody.append("{\"appId\":\"").append(sAppId)
+        .append("\",\"authVersion\":\"FIS_v2\",\"sdkVersion\":\"w:0.6.4\",\"fid\":\"")
+        .append(UtilFunction::GenerateFirebaseFID()).append("\"}");
 
+    return request;
+}
+
+std::string CFCMRegister::ParseInstallationsResponse(const std::string& sResponse)
+{
     json jsonResponse;
     try
     {
-        jsonResponse = json::parse(sResponseBuffer);
+        jsonResponse = json::parse(sResponse);
     }
     catch (const std::exception& e)
     {
-        m_oLog("[FCMRegister][Error] PostInstallations: Failed to parse JSON response:" + std::string(e.what()));
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostInstallations: Failed to parse JSON response:", e.what());
         return std::string();
     }
 
     if (!jsonResponse.contains("authToken") || !jsonResponse["authToken"].contains("token"))
     {
-        m_oLog("[FCMRegister][Error] PostInstallations: Invalid JSON response format.");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostInstallations: Invalid JSON response format.");
         return std::string();
     }
 
     return jsonResponse["authToken"]["token"];
 }
 
-std::string CFCMRegister::PostFcmRegistrations(const std::string& sProjectId, const std::string& sApiKey, const std::string& sVapidKey, const std::string& sAuthSecret, const std::string& sInstallationToken, const std::string& sPublicKey, const std::string& sGcmToken)
+std::string CFCMRegister::PostInstallations(const std::string& sAppId, const std::string& sProjectId, const std::string& sApiKey)
 {
-    std::string sBody;
-    sBody.append("{\"web\":{\"applicationPubKey\":\"").append(sVapidKey)
-        .append("\",\"auth\":\"").append(sAuthSecret)
-        .append("\",\"endpoint\":\"https://fcm.googleapis.com/fcm/send/")
-        .append(sGcmToken).append("\",\"p256dh\":\"").append(sPublicKey).append("\"}}");
-
     std::string sResponseBuffer;
-    std::string sUrl = "https://fcmregistrations.googleapis.com/v1/projects/";
-    sUrl.append(sProjectId).append("/registrations");
-
-    CLibCurlWrapper cLibCurlWrapper;
-
-    std::vector<std::string> headers;
-    headers.emplace_back("Content-Type: application/json");
-    headers.emplace_back("x-goog-api-key: " + sApiKey);
-    headers.emplace_back("x-goog-firebase-installations-auth: " + sInstallationToken);
-
-    cLibCurlWrapper.SetHeaders(headers);
-    if (!cLibCurlWrapper.Post(sUrl, sBody, sResponseBuffer))
+    std::string sError;
+    if (!Send(GetInstallationsHttpRequest(sAppId, sProjectId, sApiKey), sResponseBuffer, sError))
     {
-        m_oLog("[FCMRegister][Error] PostFcmRegistrations: Error: " + cLibCurlWrapper.GetError());
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostInstallations: Error:", sError);
         return std::string();
     }
 
+    return ParseInstallationsResponse(sResponseBuffer);
+}
+
+HTTP_REQUEST CFCMRegister::GetFcmRegistrationsHttpRequest(const std::string& sProjectId, const std::string& sApiKey, const std::string& sVapidKey, const std::string& sAuthSecret, const std::string& sInstallationToken, const std::string& sPublicKey, const std::string& sGcmToken)
+{
+    HTTP_REQUEST request;
+    request.sUrl = "https://fcmregistrations.googleapis.com/v1/projects/";
+    request.sUrl.append(sProjectId).append("/registrations");
+
+    request.headers.emplace_back("Content-Type: application/json");
+    request.headers.emplace_back("x-goog-api-key: " + sApiKey);
+    request.headers.emplace_back("x-goog-firebase-installations-auth: " + sInstallationToken);
+
+    request.sBody.append("{\"web\":{\"applicationPubKey\":\"").append(sVapidKey)
+        .append("\",\"auth\":\"").append(sAuthSecret)
+        .append("\",\"endpoint\":\"https://fcm.googleapis.com/fcm/send/")
+        .append(sGcmToken).append("\",\"p256dh\":\"").append(sPublicKey).append("\"}}");
+
+    return request;
+}
+
+std::string CFCMRegister::ParseFcmRegistrationsResponse(const std::string& sResponse)
+{
     json jsonResponse;
     try
     {
-        jsonResponse = json::parse(sResponseBuffer);
+        jsonResponse = json::parse(sResponse);
     }
     catch (const std::exception& e)
     {
-        m_oLog("[FCMRegister][Error] PostFcmRegistrations: Failed to parse JSON response:" + std::string(e.what()));
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostFcmRegistrations: Failed to parse JSON response:", e.what());
         return std::string();
     }
 
     if (!jsonResponse.contains("token"))
     {
-        m_oLog("[FCMRegister][Error] PostFcmRegistrations: Invalid JSON response format.");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostFcmRegistrations: Invalid JSON response format.");
         return std::string();
     }
 
     return jsonResponse["token"];
 }
 
+std::string CFCMRegister::PostFcmRegistrations(const std::string& sProjectId, const std::string& sApiKey, const std::string& sVapidKey, const std::string& sAuthSecret, const std::string& sInstallationToken, const std::string& sPublicKey, const std::string& sGcmToken)
+{
+    HTTP_REQUEST request = GetFcmRegistrationsHttpRequest(sProjectId, sApiKey, sVapidKey, sAuthSecret,
+        sInstallationToken, sPublicKey, sGcmToken);
+
+    std::string sResponseBuffer;
+    std::string sError;
+    if (!Send(request, sResponseBuffer, sError))
+    {
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] PostFcmRegistrations: Error: ", sError);
+        return std::string();
+    }
+
+    return ParseFcmRegistrationsResponse(sResponseBuffer);
+}
+
+bool CFCMRegister::Send(const HTTP_REQUEST& request, std::string& sResponse, std::string& sError)
+{
+    CLibCurlWrapper cLibCurlWrapper;
+    cLibCurlWrapper.SetHeaders(request.headers);
+
+    if (!cLibCurlWrapper.Post(request.sUrl, request.sBody, sResponse))
+    {
+        sError = cLibCurlWrapper.GetError();
+        return false;
+    }
+
+    return true;
+}
+
 FCM_REGISTER_DATA_RETURN CFCMRegister::RegisterToFCM(const FCM_PARAMS params)
 {
     FCM_REGISTER_DATA_RETURN fcmRegisterData;
@@ -188,7 +240,7 @@ FCM_REGISTER_DATA_RETURN CFCMRegister::RegisterToFCM(const FCM_PARAMS params)
         params.firebase.sApiKey.empty() || params.firebase.sAppID.empty() || params.firebase.sProjectID.empty() ||
         params.sVapidKey.empty())
     {
-        m_oLog("[FCMRegister][Error] RegisterToFCM: Invalid params. Please provide all required fields.");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] RegisterToFCM: Invalid params. Please provide all required fields.");
         return fcmRegisterData;
     }
 
@@ -196,21 +248,21 @@ FCM_REGISTER_DATA_RETURN CFCMRegister::RegisterToFCM(const FCM_PARAMS params)
 
     if (checkin.android_id() == 0 || checkin.security_token() == 0)
     {
-        m_oLog("[FCMRegister][Error] RegisterToFCM: CheckIn error");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] RegisterToFCM: CheckIn error");
         return fcmRegisterData;
     }
 
     std::string sGcmToken = CFCMRegister::DoGCMRegister(params.firebase.sAppID, checkin.android_id(), checkin.security_token());
     if (sGcmToken.empty())
     {
-        m_oLog("[FCMRegister][Error] RegisterToFCM: Gcm register error");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] RegisterToFCM: Gcm register error");
         return fcmRegisterData;
     }
 
     std::string sInstallationToken = CFCMRegister::PostInstallations(params.firebase.sAppID, params.firebase.sProjectID, params.firebase.sApiKey);
     if (sInstallationToken.empty())
     {
-        m_oLog("[FCMRegister][Error] RegisterToFCM: Post installations error");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] RegisterToFCM: Post installations error");
         return fcmRegisterData;
     }
 
@@ -226,7 +278,7 @@ FCM_REGISTER_DATA_RETURN CFCMRegister::RegisterToFCM(const FCM_PARAMS params)
 
     if (sFcmToken.empty())
     {
-        m_oLog("[FCMRegister][Error] RegisterToFCM: Post FCM Registration error");
+        FCM_LOG_ERROR(m_oLog, "[FCMRegister][Error] RegisterToFCM: Post FCM Registration error");
         return fcmRegisterData;
     }
 
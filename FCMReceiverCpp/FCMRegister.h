@@ -11,6 +11,7 @@
 #include "android_checkin.pb.h"
 #include "checkin.pb.h"
 #include "LibCurlWrapper.h"
+#include "LogUtil.h"
 #include "UtilFunction.h"
 #include "json.hpp"
 
@@ -64,6 +65,13 @@ typedef struct _FCM_REGISTER_DATA_RETURN
     std::string sToken;
 } FCM_REGISTER_DATA_RETURN;
 
+typedef struct _HTTP_REQUEST
+{
+    std::string sUrl;
+    std::vector<std::string> headers;
+    std::string sBody;
+} HTTP_REQUEST;
+
 typedef std::function<void(const std::string&)> LogFnCallback;
 
 class CFCMRegister
@@ -96,6 +104,83 @@ public:
      */
     checkin_proto::AndroidCheckinResponse CheckIn(uint64_t nAndroidId = 0, uint64_t nSecurityToken = 0);
 
+    /**
+     * Builds the check-in request, for callers that send it themselves.
+     *
+     * @param nAndroidId The Android ID.
+     * @param nSecurityToken The security token.
+     * @return The POST request.
+     */
+    HTTP_REQUEST GetCheckInHttpRequest(uint64_t nAndroidId = 0, uint64_t nSecurityToken = 0);
+
+    /**
+     * Parses the body of a check-in response.
+     *
+     * @param sResponse The response body.
+     * @param response [out] The parsed response.
+     * @return True if the body could be parsed.
+     */
+    bool ParseCheckInResponse(const std::string& sResponse, checkin_proto::AndroidCheckinResponse& response);
+
+    /**
+     * Builds the GCM register request.
+     *
+     * @param sAppId The app ID.
+     * @param nAndroidId The Android ID returned by the check-in.
+     * @param nSecurityToken The security token returned by the check-in.
+     * @return The POST request.
+     */
+    HTTP_REQUEST GetGCMRegisterHttpRequest(const std::string& sAppId, uint64_t nAndroidId, uint64_t nSecurityToken);
+
+    /**
+     * @param sResponse The body of the GCM register response.
+     * @return The GCM registration token, empty on error.
+     */
+    std::string ParseGCMRegisterResponse(const std::string& sResponse);
+
+    /**
+     * Builds the Firebase Installations request.
+     *
+     * @param sAppId The app ID.
+     * @param sProjectId The project ID.
+     * @param sApiKey The API key.
+     * @return The POST request.
+     */
+    HTTP_REQUEST GetInstallationsHttpRequest(const std::string& sAppId, const std::string& sProjectId, const std::string& sApiKey);
+
+    /**
+     * @param sResponse The body of the Firebase Installations response.
+     * @return The installation auth token, empty on error.
+     */
+    std::string ParseInstallationsResponse(const std::string& sResponse);
+
+    /**
+     * Builds the FCM Registrations request.
+     *
+     * @param sProjectId The project ID.
+     * @param sApiKey The API key.
+     * @param sVapidKey The VAPID key.
+     * @param sAuthSecret The authentication secret.
+     * @param sInstallationToken The installation token.
+     * @param sPublicKey The public key.
+     * @param sGcmToken The GCM registration token.
+     * @return The POST request.
+     */
+    HTTP_REQUEST GetFcmRegistrationsHttpRequest(
+        const std::string& sProjectId,
+        const std::string& sApiKey,
+        const std::string& sVapidKey,
+        const std::string& sAuthSecret,
+        const std::string& sInstallationToken,
+        const std::string& sPublicKey,
+        const std::string& sGcmToken);
+
+    /**
+     * @param sResponse The body of the FCM Registrations response.
+     * @return The FCM registration token, empty on error.
+     */
+    std::string ParseFcmRegistrationsResponse(const std::string& sResponse);
+
 private:
     /**
      * Generates the check-in request for FCM registration.
@@ -107,21 +192,23 @@ private:
     std::string GetCheckinRequest(uint64_t nAndroidId = 0, uint64_t nSecurityToken = 0);
 
     /**
-      * Generates the check-in request for FCM registration.
-      *
-      * @param nAndroidId The Android ID.
-      * @param nSecurityToken The security token.
-      * @return The serialized check-in request.
-      */
-    std::string DoGCMRegister(const std::string& appId, uint64_t nAndroidId = 0, uint64_t nSecurityToken = 0);
+     * Registers the app with GCM.
+     *
+     * @param sAppId The app ID.
+     * @param nAndroidId The Android ID.
+     * @param nSecurityToken The security token.
+     * @return The GCM registration token, empty on error.
+     */
+    std::string DoGCMRegister(const std::string& sAppId, uint64_t nAndroidId = 0, uint64_t nSecurityToken = 0);
 
     /**
-      * Generates the check-in request for FCM registration.
-      *
-      * @param nAndroidId The Android ID.
-      * @param nSecurityToken The security token.
-      * @return The serialized check-in request.
-      */
+     * Sends a POST request to the Firebase Installations API to register an installation.
+     *
+     * @param sAppId The app ID.
+     * @param sProjectId The project ID.
+     * @param sApiKey The API key.
+     * @return The installation auth token, empty on error.
+     */
     std::string PostInstallations(const std::string& sAppId, const std::string& sProjectId, const std::string& sApiKey);
 
     /**
@@ -145,5 +232,15 @@ private:
         const std::string& sPublicKey,
         const std::string& sGcmToken);
 
+    /**
+     * Sends a request with a pooled curl handle.
+     *
+     * @param request The request.
+     * @param sResponse [out] The response body.
+     * @param sError [out] The curl error on failure.
+     * @return True if the request was sent and answered.
+     */
+    bool Send(const HTTP_REQUEST& request, std::string& sResponse, std::string& sError);
+
     const LogFnCallback m_oLog;
 };
@@ -0,0 +1,437 @@
+#include "FastBase64.h"
+
+#include <array>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FAST_BASE64_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC emits any intrinsic regardless of /arch, the dispatch keeps them off CPUs without it
+#define FAST_BASE64_TARGET(x)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define FAST_BASE64_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+namespace
+{
+	constexpr uint8_t kInvalid = 0xFF;
+
+	const char kStandardChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char kUrlChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+	constexpr std::array<uint8_t, 256> MakeDecodeTable(FastBase64::Alphabet eAlphabet)
+	{
+		std::array<uint8_t, 256> table = {};
+		for (size_t nChar = 0; nChar < table.size(); ++nChar)
+			table[nChar] = kInvalid;
+		for (uint8_t nValue = 0; nValue < 26; ++nValue)
+		{
+			table['A' + nValue] = nValue;
+			table['a' + nValue] = nValue + 26;
+		}
+		for (uint8_t nValue = 0; nValue < 10; ++nValue)
+			table['0' + nValue] = nValue + 52;
+		if (eAlphabet != FastBase64::Alphabet::Url)
+		{
+			table['+'] = 62;
+			table['/'] = 63;
+		}
+		if (eAlphabet != FastBase64::Alphabet::Standard)
+		{
+			table['-'] = 62;
+			table['_'] = 63;
+		}
+		return table;
+	}
+
+	constexpr std::array<uint8_t, 256> kDecodeTables[] = {
+		MakeDecodeTable(FastBase64::Alphabet::Standard),
+		MakeDecodeTable(FastBase64::Alphabet::Url),
+		MakeDecodeTable(FastBase64::Alphabet::Either)
+	};
+
+	// nLen is a decodable length without padding and pOut holds DecodedLength(nLen) bytes
+	bool DecodeScalar(const char* pIn, size_t nLen, uint8_t* pOut, const std::array<uint8_t, 256>& table)
+	{
+		for (; nLen >= 4; nLen -= 4, pIn += 4, pOut += 3)
+		{
+			uint32_t a = table[static_cast<uint8_t>(pIn[0])];
+			uint32_t b = table[static_cast<uint8_t>(pIn[1])];
+			uint32_t c = table[static_cast<uint8_t>(pIn[2])];
+			uint32_t d = table[static_cast<uint8_t>(pIn[3])];
+			// kInvalid is the only value with bit 7 set
+			if ((a | b | c | d) & 0x80)
+				return false;
+
+			uint32_t nQuantum = (a << 18) | (b << 12) | (c << 6) | d;
+			pOut[0] = static_cast<uint8_t>(nQuantum >> 16);
+			pOut[1] = static_cast<uint8_t>(nQuantum >> 8);
+			pOut[2] = static_cast<uint8_t>(nQuantum);
+		}
+
+		if (nLen == 0)
+			return true;
+
+		uint32_t nQuantum = 0;
+		for (size_t nIndex = 0; nIndex < nLen; ++nIndex)
+		{
+			uint32_t nValue = table[static_cast<uint8_t>(pIn[nIndex])];
+			if (nValue & 0x80)
+				return false;
+			nQuantum = (nQuantum << 6) | nValue;
+		}
+
+		if (nLen == 2)
+		{
+			pOut[0] = static_cast<uint8_t>(nQuantum >> 4);
+		}
+		else
+		{
+			pOut[0] = static_cast<uint8_t>(nQuantum >> 10);
+			pOut[1] = static_cast<uint8_t>(nQuantum >> 2);
+		}
+		return true;
+	}
+
+	void EncodeScalar(const uint8_t* pIn, size_t nLen, char* pOut, const char* szChars)
+	{
+		for (; nLen >= 3; nLen -= 3, pIn += 3, pOut += 4)
+		{
+			uint32_t nQuantum = (uint32_t(pIn[0]) << 16) | (uint32_t(pIn[1]) << 8) | pIn[2];
+			pOut[0] = szChars[nQuantum >> 18];
+			pOut[1] = szChars[(nQuantum >> 12) & 0x3F];
+			pOut[2] = szChars[(nQuantum >> 6) & 0x3F];
+			pOut[3] = szChars[nQuantum & 0x3F];
+		}
+
+		if (nLen == 1)
+		{
+			pOut[0] = szChars[pIn[0] >> 2];
+			pOut[1] = szChars[(pIn[0] & 0x03) << 4];
+		}
+		else if (nLen == 2)
+		{
+			pOut[0] = szChars[pIn[0] >> 2];
+			pOut[1] = szChars[((pIn[0] & 0x03) << 4) | (pIn[1] >> 4)];
+			pOut[2] = szChars[(pIn[1] & 0x0F) << 2];
+		}
+	}
+
+#ifdef FAST_BASE64_X86
+	// The characters for 62 and 63, a disabled one is matched by a zero mask
+	struct DECODE_CHARS
+	{
+		int nPlusMask;
+		int nMinusMask;
+	};
+
+	DECODE_CHARS DecodeChars(FastBase64::Alphabet eAlphabet)
+	{
+		return { eAlphabet != FastBase64::Alphabet::Url ? -1 : 0, eAlphabet != FastBase64::Alphabet::Standard ? -1 : 0 };
+	}
+
+	// Maps 16 characters to their 6-bit values, ranges compared signed so bytes from 0x80 up
+	// match no range. Returns false if any character is outside the alphabet.
+	FAST_BASE64_TARGET("sse4.1")
+	bool TranslateSse41(__m128i chars, const DECODE_CHARS& alphabet, __m128i& values)
+	{
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('Z' + 1)));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('z' + 1)));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+		__m128i plus = _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('+')), _mm_set1_epi32(alphabet.nPlusMask));
+		__m128i slash = _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('/')), _mm_set1_epi32(alphabet.nPlusMask));
+		__m128i minus = _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('-')), _mm_set1_epi32(alphabet.nMinusMask));
+		__m128i underscore = _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('_')), _mm_set1_epi32(alphabet.nMinusMask));
+
+		__m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+			_mm_or_si128(_mm_or_si128(slash, minus), underscore));
+		if (_mm_movemask_epi8(valid) != 0xFFFF)
+			return false;
+
+		__m128i offsets = _mm_or_si128(_mm_or_si128(
+			_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+			_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')), _mm_and_si128(plus, _mm_set1_epi8(62 - '+')))),
+			_mm_or_si128(
+			_mm_or_si128(_mm_and_si128(slash, _mm_set1_epi8(63 - '/')), _mm_and_si128(minus, _mm_set1_epi8(62 - '-'))),
+			_mm_and_si128(underscore, _mm_set1_epi8(63 - '_'))));
+		values = _mm_add_epi8(chars, offsets);
+		return true;
+	}
+
+	// Packs four 6-bit values per 32-bit lane into 3 bytes, 12 bytes at the front of the register
+	FAST_BASE64_TARGET("sse4.1")
+	__m128i PackSse41(__m128i values)
+	{
+		__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+		__m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+		return _mm_shuffle_epi8(quads, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	}
+
+	// Stores 16 bytes per 16 characters, 12 of them decoded, the caller checks the room
+	FAST_BASE64_TARGET("sse4.1")
+	size_t DecodeSse41(const char*& pIn, size_t nLen, uint8_t*& pOut, size_t nOutRoom, const DECODE_CHARS& alphabet)
+	{
+		size_t nDone = 0;
+		while (nLen - nDone >= 16 && nOutRoom >= 16)
+		{
+			__m128i values;
+			if (!TranslateSse41(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn)), alphabet, values))
+				return kFastBase64Unlimited;
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut), PackSse41(values));
+			pIn += 16;
+			pOut += 12;
+			nDone += 16;
+			nOutRoom -= 12;
+		}
+		return nDone;
+	}
+
+	FAST_BASE64_TARGET("avx2")
+	bool TranslateAvx2(__m256i chars, const DECODE_CHARS& alphabet, __m256i& values)
+	{
+		__m256i upper = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('Z')), _mm256_cmpgt_epi8(chars, _mm256_set1_epi8('A' - 1)));
+		__m256i lower = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('z')), _mm256_cmpgt_epi8(chars, _mm256_set1_epi8('a' - 1)));
+		__m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('9')), _mm256_cmpgt_epi8(chars, _mm256_set1_epi8('0' - 1)));
+		__m256i plus = _mm256_and_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('+')), _mm256_set1_epi32(alphabet.nPlusMask));
+		__m256i slash = _mm256_and_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/')), _mm256_set1_epi32(alphabet.nPlusMask));
+		__m256i minus = _mm256_and_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('-')), _mm256_set1_epi32(alphabet.nMinusMask));
+		__m256i underscore = _mm256_and_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_')), _mm256_set1_epi32(alphabet.nMinusMask));
+
+		__m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, plus)),
+			_mm256_or_si256(_mm256_or_si256(slash, minus), underscore));
+		if (static_cast<uint32_t>(_mm256_movemask_epi8(valid)) != 0xFFFFFFFF)
+			return false;
+
+		__m256i offsets = _mm256_or_si256(_mm256_or_si256(
+			_mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')), _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+			_mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')), _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')))),
+			_mm256_or_si256(
+			_mm256_or_si256(_mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')), _mm256_and_si256(minus, _mm256_set1_epi8(62 - '-'))),
+			_mm256_and_si256(underscore, _mm256_set1_epi8(63 - '_'))));
+		values = _mm256_add_epi8(chars, offsets);
+		return true;
+	}
+
+	// Stores 32 bytes per 32 characters, 24 of them decoded
+	FAST_BASE64_TARGET("avx2")
+	size_t DecodeAvx2(const char*& pIn, size_t nLen, uint8_t*& pOut, size_t nOutRoom, const DECODE_CHARS& alphabet)
+	{
+		size_t nDone = 0;
+		while (nLen - nDone >= 32 && nOutRoom >= 32)
+		{
+			__m256i values;
+			if (!TranslateAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIn)), alphabet, values))
+				return kFastBase64Unlimited;
+
+			__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+			__m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+			// The shuffle stays within each 128-bit lane, the permute joins the two 12-byte halves
+			__m256i packed = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+			packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut), packed);
+			pIn += 32;
+			pOut += 24;
+			nDone += 32;
+			nOutRoom -= 24;
+		}
+		return nDone;
+	}
+
+	// 12 bytes at the front of each 128-bit lane in, 16 characters per lane out
+	FAST_BASE64_TARGET("sse4.1")
+	__m128i EncodeBlockSse41(__m128i in, bool bUrl)
+	{
+		in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		__m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+		__m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(hi, lo);
+
+		// 0 for 26-51, 1-10 for the digits, 11 and 12 for 62 and 63, 13 for the capitals
+		__m128i ranges = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		ranges = _mm_or_si128(ranges, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		__m128i shifts = bUrl ?
+			_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '-' - 62, '_' - 63, 'A', 0, 0) :
+			_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+		return _mm_add_epi8(indices, _mm_shuffle_epi8(shifts, ranges));
+	}
+
+	// Loads 16 bytes per 12 encoded, the caller checks the input is long enough
+	FAST_BASE64_TARGET("sse4.1")
+	size_t EncodeSse41(const uint8_t*& pIn, size_t nLen, char*& pOut, bool bUrl)
+	{
+		size_t nDone = 0;
+		for (; nLen - nDone >= 16; nDone += 12, pIn += 12, pOut += 16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut), EncodeBlockSse41(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn)), bUrl));
+		return nDone;
+	}
+
+	FAST_BASE64_TARGET("avx2")
+	__m256i EncodeBlockAvx2(__m256i in, bool bUrl)
+	{
+		__m256i mask = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+		in = _mm256_shuffle_epi8(in, mask);
+		__m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+		__m256i lo = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(hi, lo);
+
+		__m256i ranges = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		ranges = _mm256_or_si256(ranges, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		char c62 = bUrl ? '-' : '+';
+		char c63 = bUrl ? '_' : '/';
+		__m256i shifts = _mm256_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, c62 - 62, c63 - 63, 'A', 0, 0,
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, c62 - 62, c63 - 63, 'A', 0, 0);
+		return _mm256_add_epi8(indices, _mm256_shuffle_epi8(shifts, ranges));
+	}
+
+	// The two lanes load 16 bytes from 0 and from 12, so 28 bytes must be readable
+	FAST_BASE64_TARGET("avx2")
+	size_t EncodeAvx2(const uint8_t*& pIn, size_t nLen, char*& pOut, bool bUrl)
+	{
+		size_t nDone = 0;
+		for (; nLen - nDone >= 28; nDone += 24, pIn += 24, pOut += 32)
+		{
+			__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn))),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + 12)), 1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut), EncodeBlockAvx2(in, bUrl));
+		}
+		return nDone;
+	}
+
+	FastBase64::Implementation DetectImplementation()
+	{
+		bool bSse41 = false;
+		bool bAvx2 = false;
+#ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 0);
+		int nMaxLeaf = regs[0];
+		__cpuid(regs, 1);
+		bSse41 = (regs[2] & (1 << 19)) != 0;
+		// AVX needs the OS to save the ymm registers
+		bool bOsAvx = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+		if (bOsAvx && nMaxLeaf >= 7)
+		{
+			__cpuidex(regs, 7, 0);
+			bAvx2 = (regs[1] & (1 << 5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		bSse41 = __builtin_cpu_supports("sse4.1");
+		bAvx2 = __builtin_cpu_supports("avx2");
+#endif
+		if (bAvx2 && bSse41)
+			return FastBase64::Implementation::Avx2;
+		return bSse41 ? FastBase64::Implementation::Sse41 : FastBase64::Implementation::Scalar;
+	}
+#endif
+}
+
+FastBase64::Implementation FastBase64::Best()
+{
+#ifdef FAST_BASE64_X86
+	static const Implementation s_eBest = DetectImplementation();
+	return s_eBest;
+#else
+	return Implementation::Scalar;
+#endif
+}
+
+const char* FastBase64::Name(Implementation eImplementation)
+{
+	switch (eImplementation)
+	{
+	case Implementation::Avx2:
+		return "avx2";
+	case Implementation::Sse41:
+		return "sse4.1";
+	default:
+		return "scalar";
+	}
+}
+
+bool FastBase64::Decode(std::string_view sEncoded, uint8_t* pOut, size_t nOutSize, size_t& nDecodedLen,
+	Alphabet eAlphabet, Implementation eImplementation)
+{
+	nDecodedLen = 0;
+
+	size_t nLen = sEncoded.size();
+	for (int nPad = 0; nPad < 2 && nLen > 0 && sEncoded[nLen - 1] == '='; ++nPad)
+		--nLen;
+
+	size_t nRequired = DecodedLength(nLen);
+	if (nRequired == kFastBase64Unlimited || nRequired > nOutSize)
+		return false;
+
+	const char* pIn = sEncoded.data();
+	uint8_t* pNext = pOut;
+#ifdef FAST_BASE64_X86
+	DECODE_CHARS alphabet = DecodeChars(eAlphabet);
+	if (eImplementation == Implementation::Avx2)
+	{
+		size_t nDone = DecodeAvx2(pIn, nLen, pNext, nOutSize, alphabet);
+		if (nDone == kFastBase64Unlimited)
+			return false;
+		nLen -= nDone;
+	}
+	if (eImplementation != Implementation::Scalar)
+	{
+		size_t nDone = DecodeSse41(pIn, nLen, pNext, nOutSize - (pNext - pOut), alphabet);
+		if (nDone == kFastBase64Unlimited)
+			return false;
+		nLen -= nDone;
+	}
+#else
+	(void)eImplementation;
+#endif
+
+	if (!DecodeScalar(pIn, nLen, pNext, kDecodeTables[static_cast<int>(eAlphabet)]))
+		return false;
+
+	nDecodedLen = nRequired;
+	return true;
+}
+
+size_t FastBase64::Encode(const uint8_t* pIn, size_t nLen, char* pOut, size_t nOutSize, bool bUrl, bool bPad,
+	Implementation eImplementation)
+{
+	size_t nRequired = EncodedLength(nLen, bPad);
+	if (nRequired > nOutSize)
+		return 0;
+
+	char* pNext = pOut;
+#ifdef FAST_BASE64_X86
+	// Every block writes exactly the characters it encodes, only the input is read ahead
+	if (eImplementation == Implementation::Avx2)
+		nLen -= EncodeAvx2(pIn, nLen, pNext, bUrl);
+	if (eImplementation != Implementation::Scalar)
+		nLen -= EncodeSse41(pIn, nLen, pNext, bUrl);
+#else
+	(void)eImplementation;
+#endif
+
+	EncodeScalar(pIn, nLen, pNext, bUrl ? kUrlChars : kStandardChars);
+	for (size_t nIndex = EncodedLength(nLen, false) + (pNext - pOut); nIndex < nRequired; ++nIndex)
+		pOut[nIndex] = '=';
+
+	return nRequired;
+}
+
+size_t fast_base64url_decode(const char* base64, size_t base64Len, uint8_t* binary, size_t binaryLen)
+{
+	size_t nDecodedLen = 0;
+	// Padding is for ece_base64url_decode() to strip by its policy, here '=' is invalid
+	if (base64Len > 0 && base64[base64Len - 1] == '=')
+		return 0;
+	if (!FastBase64::Decode(std::string_view(base64, base64Len), binary, binaryLen, nDecodedLen, FastBase64::Alphabet::Url))
+		return 0;
+	return nDecodedLen;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+#include <string_view>
+
+constexpr size_t kFastBase64Unlimited = static_cast<size_t>(-1);
+
+/**
+ * Base64 and base64url codec writing into caller provided buffers, for the receive
+ * path where the app_data values are decoded once per message.
+ *
+ * Blocks of 32 characters are decoded with AVX2 and blocks of 16 with SSE4.1 when the
+ * CPU has them, the rest with a table. The vector paths only store whole registers,
+ * they are used while the full register fits in the output buffer and the scalar code
+ * finishes the tail, so no buffer needs to be larger than its decoded size.
+ */
+namespace FastBase64
+{
+	enum class Alphabet
+	{
+		Standard, // + and /
+		Url, // - and _
+		Either // both, as base64_decode() accepts
+	};
+
+	enum class Implementation
+	{
+		Scalar,
+		Sse41,
+		Avx2
+	};
+
+	/**
+	 * @return The fastest implementation the CPU supports, detected once.
+	 */
+	Implementation Best();
+
+	const char* Name(Implementation eImplementation);
+
+	/**
+	 * @param nEncodedLen The length without padding.
+	 * @return The decoded size, kFastBase64Unlimited if no input has that length.
+	 */
+	constexpr size_t DecodedLength(size_t nEncodedLen)
+	{
+		return nEncodedLen % 4 == 1 ? kFastBase64Unlimited : nEncodedLen / 4 * 3 + (nEncodedLen % 4 == 0 ? 0 : nEncodedLen % 4 - 1);
+	}
+
+	constexpr size_t EncodedLength(size_t nLen, bool bPad)
+	{
+		return bPad ? (nLen + 2) / 3 * 4 : nLen / 3 * 4 + (nLen % 3 == 0 ? 0 : nLen % 3 + 1);
+	}
+
+	/**
+	 * Decodes without allocating. Up to two trailing '=' are accepted, whitespace is not.
+	 *
+	 * @param sEncoded The encoded value.
+	 * @param pOut Receives the bytes.
+	 * @param nOutSize The size of pOut.
+	 * @param nDecodedLen Set to the number of bytes written.
+	 * @param eAlphabet The characters accepted for 62 and 63.
+	 * @param eImplementation The widest vector path to use, the benchmark compares them.
+	 * @return False on a character outside the alphabet, a truncated value or when pOut is too small.
+	 */
+	bool Decode(std::string_view sEncoded, uint8_t* pOut, size_t nOutSize, size_t& nDecodedLen,
+		Alphabet eAlphabet = Alphabet::Either, Implementation eImplementation = Best());
+
+	/**
+	 * Encodes without allocating. Nothing is terminated.
+	 *
+	 * @param pIn The bytes to encode.
+	 * @param nLen The number of bytes.
+	 * @param pOut Receives the characters.
+	 * @param nOutSize The size of pOut.
+	 * @param bUrl Base64url instead of standard base64.
+	 * @param bPad Whether to pad to a multiple of four characters.
+	 * @param eImplementation The widest vector path to use.
+	 * @return The number of characters written, 0 when pOut is too small.
+	 */
+	size_t Encode(const uint8_t* pIn, size_t nLen, char* pOut, size_t nOutSize, bool bUrl, bool bPad,
+		Implementation eImplementation = Best());
+}
+
+extern "C" {
+#endif
+
+/**
+ * The decoder behind ece_base64url_decode(): base64url characters only, no padding.
+ *
+ * @return The number of bytes written, 0 on an invalid or truncated value or when binaryLen is too small.
+ */
+size_t fast_base64url_decode(const char* base64, size_t base64Len, uint8_t* binary, size_t binaryLen);
+
+#ifdef __cplusplus
+}
+#endif
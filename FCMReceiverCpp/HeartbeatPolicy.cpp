@@ -0,0 +1,108 @@
+#include "HeartbeatPolicy.h"
+
+CHeartbeatPolicy::CHeartbeatPolicy() :
+	m_nIntervalMs(kHeartbeatDefaultIntervalMs),
+	m_nServerIntervalMs(0),
+	m_nNatCeilingMs(kHeartbeatMaxIntervalMs),
+	m_nLastAckedMs(0),
+	m_nAckStreak(0),
+	m_bUploadStat(false),
+	m_bHaveStat(false),
+	m_bStatTimeout(false),
+	m_nStatIntervalMs(0)
+{
+}
+
+void CHeartbeatPolicy::FillLoginRequest(mcs_proto::LoginRequest& cLoginRequest)
+{
+	cLoginRequest.set_adaptive_heartbeat(true);
+
+	if (!m_bUploadStat || !m_bHaveStat)
+		return;
+
+	mcs_proto::HeartbeatStat* pStat = cLoginRequest.mutable_heartbeat_stat();
+	pStat->set_ip(m_sStatIp);
+	pStat->set_timeout(m_bStatTimeout);
+	pStat->set_interval_ms(static_cast<int32_t>(m_nStatIntervalMs));
+	m_bHaveStat = false;
+}
+
+void CHeartbeatPolicy::OnLoginResponse(const mcs_proto::LoginResponse& cLoginResponse)
+{
+	if (!cLoginResponse.has_heartbeat_config())
+		return;
+
+	const mcs_proto::HeartbeatConfig& cConfig = cLoginResponse.heartbeat_config();
+	m_bUploadStat = cConfig.upload_stat();
+	m_sStatIp = cConfig.ip();
+
+	if (cConfig.interval_ms() <= 0)
+		return;
+
+	uint32_t nIntervalMs = static_cast<uint32_t>(cConfig.interval_ms());
+	if (nIntervalMs < kHeartbeatMinIntervalMs)
+		nIntervalMs = kHeartbeatMinIntervalMs;
+	if (nIntervalMs > kHeartbeatMaxIntervalMs)
+		nIntervalMs = kHeartbeatMaxIntervalMs;
+
+	m_nServerIntervalMs = nIntervalMs;
+	m_nIntervalMs = CeilingMs();
+	m_nAckStreak = 0;
+}
+
+void CHeartbeatPolicy::OnAck(uint32_t nIdleMs)
+{
+	if (nIdleMs == 0)
+		return;
+
+	m_nLastAckedMs = nIdleMs;
+	SetStat(false, nIdleMs);
+
+	if (++m_nAckStreak < kHeartbeatAcksBeforeStep)
+		return;
+
+	m_nAckStreak = 0;
+	uint32_t nCeilingMs = CeilingMs();
+	if (m_nIntervalMs < nCeilingMs)
+	{
+		m_nIntervalMs = (nCeilingMs - m_nIntervalMs > kHeartbeatStepMs) ? m_nIntervalMs + kHeartbeatStepMs : nCeilingMs;
+		return;
+	}
+
+	// Held at the NAT ceiling: probe one step above it, the NAT may have changed or the drop that
+	// set it was not the NAT's. A failed probe costs one reconnect and lowers the ceiling again.
+	if (m_nNatCeilingMs >= kHeartbeatMaxIntervalMs || (m_nServerIntervalMs != 0 && m_nNatCeilingMs >= m_nServerIntervalMs))
+		return;
+
+	m_nNatCeilingMs = (kHeartbeatMaxIntervalMs - m_nNatCeilingMs > kHeartbeatStepMs) ? m_nNatCeilingMs + kHeartbeatStepMs : kHeartbeatMaxIntervalMs;
+	m_nIntervalMs = CeilingMs();
+}
+
+void CHeartbeatPolicy::OnConnectionLost()
+{
+	SetStat(true, m_nIntervalMs);
+
+	// The NAT idle timeout is somewhere below the interval that just failed
+	m_nNatCeilingMs = (m_nIntervalMs > kHeartbeatMinIntervalMs + kHeartbeatStepMs) ? m_nIntervalMs - kHeartbeatStepMs : kHeartbeatMinIntervalMs;
+
+	if (m_nLastAckedMs != 0 && m_nLastAckedMs < m_nNatCeilingMs)
+		m_nIntervalMs = m_nLastAckedMs;
+	else
+		m_nIntervalMs = m_nNatCeilingMs;
+
+	m_nAckStreak = 0;
+}
+
+uint32_t CHeartbeatPolicy::CeilingMs() const
+{
+	if (m_nServerIntervalMs != 0 && m_nServerIntervalMs < m_nNatCeilingMs)
+		return m_nServerIntervalMs;
+	return m_nNatCeilingMs;
+}
+
+void CHeartbeatPolicy::SetStat(bool bTimeout, uint32_t nIntervalMs)
+{
+	m_bHaveStat = true;
+	m_bStatTimeout = bTimeout;
+	m_nStatIntervalMs = nIntervalMs;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "mcs.pb.h"
+
+constexpr uint32_t kHeartbeatDefaultIntervalMs = 10 * 60 * 1000;
+constexpr uint32_t kHeartbeatMinIntervalMs = 60 * 1000;
+constexpr uint32_t kHeartbeatMaxIntervalMs = 20 * 60 * 1000; // the server closes connections silent for 27 minutes
+constexpr uint32_t kHeartbeatStepMs = 60 * 1000;
+constexpr uint32_t kHeartbeatAcksBeforeStep = 3;
+
+/**
+ * Picks the heartbeat interval of one MCS connection and carries what it learned across reconnects.
+ *
+ * The interval starts at the one sent by the server in LoginResponse.heartbeat_config, or at a
+ * default, and lengthens one step after a few pings in a row are acknowledged, never above the
+ * server interval. A connection lost while online without an explanation is taken as a NAT that
+ * forgot the connection: the interval that failed becomes out of reach and the interval drops
+ * back to the last one that was acknowledged. After a few acknowledged pings at that ceiling it
+ * is raised one step again, so a single drop does not hold the interval down for good.
+ */
+class CHeartbeatPolicy
+{
+public:
+	CHeartbeatPolicy();
+
+	/**
+	 * Asks for adaptive heartbeat and, when the server wants it, reports how the last interval went.
+	 *
+	 * @param cLoginRequest The login request to fill.
+	 */
+	void FillLoginRequest(mcs_proto::LoginRequest& cLoginRequest);
+
+	/**
+	 * Applies the server heartbeat config, if any.
+	 *
+	 * @param cLoginResponse The login response.
+	 */
+	void OnLoginResponse(const mcs_proto::LoginResponse& cLoginResponse);
+
+	/**
+	 * Records an acknowledged ping.
+	 *
+	 * @param nIdleMs How long the connection was idle before the ping, 0 if it was not sent by the heartbeat timer.
+	 */
+	void OnAck(uint32_t nIdleMs);
+
+	/**
+	 * Records a connection lost while online, with no close from the server and no protocol error.
+	 */
+	void OnConnectionLost();
+
+	uint32_t IntervalMs() const { return m_nIntervalMs; }
+
+private:
+	uint32_t CeilingMs() const;
+	void SetStat(bool bTimeout, uint32_t nIntervalMs);
+
+private:
+	uint32_t m_nIntervalMs;
+	uint32_t m_nServerIntervalMs; // 0 until the server sends one
+	uint32_t m_nNatCeilingMs;
+	uint32_t m_nLastAckedMs;
+	uint32_t m_nAckStreak;
+
+	bool m_bUploadStat;
+	std::string m_sStatIp;
+	bool m_bHaveStat;
+	bool m_bStatTimeout;
+	uint32_t m_nStatIntervalMs;
+};
@@ -0,0 +1,153 @@
+#include "HostResolver.h"
+
+#include <algorithm>
+#include <cstring>
+
+CHostResolver::CHostResolver(const ASocket::LogFnCallback oLogger, uint32_t nRefreshSec) :
+	m_oLogger(oLogger),
+	m_RefreshPeriod(std::chrono::seconds(nRefreshSec)),
+	m_bStopping(false)
+{
+}
+
+CHostResolver::~CHostResolver()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStopping = true;
+	}
+	m_Condition.notify_all();
+
+	if (m_ResolverThread.joinable())
+		m_ResolverThread.join();
+}
+
+bool CHostResolver::Resolve(const std::string& sHost, const std::string& sPort)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		HOST_ENTRY& entry = GetEntry(sHost, sPort);
+		entry.lastResolveTime = Clock::now();
+		entry.nextResolveTime = entry.lastResolveTime + m_RefreshPeriod;
+	}
+
+	RESOLVED_ADDRESS address;
+	bool bResolved = ResolveNow(sHost, sPort, address);
+	Store(sHost + ':' + sPort, bResolved, address);
+	if (!bResolved)
+		m_Condition.notify_all();
+	return bResolved;
+}
+
+bool CHostResolver::Lookup(const std::string& sHost, const std::string& sPort, RESOLVED_ADDRESS& address)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	const HOST_ENTRY& entry = GetEntry(sHost, sPort);
+	if (entry.bResolved)
+		address = entry.address;
+	return entry.bResolved;
+}
+
+void CHostResolver::Refresh(const std::string& sHost, const std::string& sPort)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		HOST_ENTRY& entry = GetEntry(sHost, sPort);
+		Clock::time_point retryTime = (std::max)(Clock::now(), entry.lastResolveTime + std::chrono::milliseconds(kHostResolverRetryMs));
+		entry.nextResolveTime = (std::min)(entry.nextResolveTime, retryTime);
+	}
+	m_Condition.notify_all();
+}
+
+bool CHostResolver::ResolveNow(const std::string& sHost, const std::string& sPort, RESOLVED_ADDRESS& address)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	struct addrinfo* pResult = nullptr;
+	int nResult = getaddrinfo(sHost.c_str(), sPort.c_str(), &hints, &pResult);
+	if (nResult != 0 || pResult == nullptr)
+	{
+		FCM_LOG_WARNING(m_oLogger, "[CHostResolver][WARNING] ResolveNow: Cannot resolve ", sHost, ':', sPort, ", error ", nResult);
+		if (pResult != nullptr)
+			freeaddrinfo(pResult);
+		return false;
+	}
+
+	memset(&address, 0, sizeof address);
+	address.nLength = static_cast<int>((std::min)(static_cast<size_t>(pResult->ai_addrlen), sizeof address.address));
+	memcpy(&address.address, pResult->ai_addr, address.nLength);
+	freeaddrinfo(pResult);
+	return true;
+}
+
+void CHostResolver::Store(const std::string& sKey, bool bResolved, const RESOLVED_ADDRESS& address)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	HOST_ENTRY& entry = m_Hosts.at(sKey);
+	if (bResolved)
+	{
+		entry.address = address;
+		entry.bResolved = true;
+	}
+	else if (!entry.bResolved)
+	{
+		// A failed resolve keeps serving the last address, a host without one is retried soon
+		entry.nextResolveTime = (std::min)(entry.nextResolveTime, entry.lastResolveTime + std::chrono::milliseconds(kHostResolverRetryMs));
+	}
+}
+
+CHostResolver::HOST_ENTRY& CHostResolver::GetEntry(const std::string& sHost, const std::string& sPort)
+{
+	auto inserted = m_Hosts.emplace(sHost + ':' + sPort, HOST_ENTRY());
+	HOST_ENTRY& entry = inserted.first->second;
+	if (!inserted.second)
+		return entry;
+
+	// Resolved by the thread right away unless the caller resolves it itself
+	entry.sHost = sHost;
+	entry.sPort = sPort;
+	entry.bResolved = false;
+	entry.lastResolveTime = Clock::time_point();
+	entry.nextResolveTime = Clock::now();
+
+	if (!m_ResolverThread.joinable())
+		m_ResolverThread = std::thread(&CHostResolver::ResolverThread, this);
+	m_Condition.notify_all();
+	return entry;
+}
+
+void CHostResolver::ResolverThread()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (!m_bStopping)
+	{
+		auto next = std::min_element(m_Hosts.begin(), m_Hosts.end(), [](const auto& left, const auto& right) {
+			return left.second.nextResolveTime < right.second.nextResolveTime;
+		});
+
+		Clock::time_point now = Clock::now();
+		if (next->second.nextResolveTime > now)
+		{
+			m_Condition.wait_until(lock, next->second.nextResolveTime);
+			continue;
+		}
+
+		HOST_ENTRY& entry = next->second;
+		entry.lastResolveTime = now;
+		entry.nextResolveTime = now + m_RefreshPeriod;
+		std::string sKey = next->first;
+		std::string sHost = entry.sHost;
+		std::string sPort = entry.sPort;
+		lock.unlock();
+
+		RESOLVED_ADDRESS address;
+		bool bResolved = ResolveNow(sHost, sPort, address);
+		Store(sKey, bResolved, address);
+
+		lock.lock();
+	}
+}
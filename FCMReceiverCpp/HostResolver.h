@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "LogUtil.h"
+#include "SecureSocket/Socket.h"
+
+constexpr uint32_t kHostResolverRefreshSec = 300;
+constexpr uint32_t kHostResolverRetryMs = 5000; // soonest a failed connect resolves a host again
+
+typedef struct _RESOLVED_ADDRESS
+{
+	sockaddr_storage address;
+	int nLength;
+} RESOLVED_ADDRESS;
+
+/**
+ * Resolves host names on a thread of its own, so event loops connect to a cached
+ * address instead of blocking in getaddrinfo on every connect and reconnect.
+ *
+ * Every host looked up is resolved again each refresh period, and sooner after a failed
+ * connect asks for it, the last address is served until the new one arrives. Winsock is
+ * initialized by the sockets of the clients it serves. Thread safe.
+ */
+class CHostResolver
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param nRefreshSec How often each host is resolved again.
+	 */
+	explicit CHostResolver(const ASocket::LogFnCallback oLogger, uint32_t nRefreshSec = kHostResolverRefreshSec);
+
+	/**
+	 * Waits for a running resolve.
+	 */
+	~CHostResolver();
+
+	CHostResolver(const CHostResolver&) = delete;
+	CHostResolver& operator=(const CHostResolver&) = delete;
+
+	/**
+	 * Resolves a host now, blocking. Called before the event loops run so their first
+	 * connects find the address cached.
+	 *
+	 * @param sHost The host name or address.
+	 * @param sPort The port.
+	 * @return False if the host cannot be resolved, a later Lookup() retries it in the background.
+	 */
+	bool Resolve(const std::string& sHost, const std::string& sPort);
+
+	/**
+	 * Returns the cached address without blocking. A host not resolved yet is queued for
+	 * the resolver thread.
+	 *
+	 * @param sHost The host name or address.
+	 * @param sPort The port.
+	 * @param address Receives the address.
+	 * @return False if the host has no address yet.
+	 */
+	bool Lookup(const std::string& sHost, const std::string& sPort, RESOLVED_ADDRESS& address);
+
+	/**
+	 * Resolves a host again in the background, at most once per kHostResolverRetryMs.
+	 * Called when a connect to its cached address fails.
+	 *
+	 * @param sHost The host name or address.
+	 * @param sPort The port.
+	 */
+	void Refresh(const std::string& sHost, const std::string& sPort);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	typedef struct _HOST_ENTRY
+	{
+		std::string sHost;
+		std::string sPort;
+		RESOLVED_ADDRESS address;
+		bool bResolved;
+		Clock::time_point lastResolveTime;
+		Clock::time_point nextResolveTime;
+	} HOST_ENTRY;
+
+	bool ResolveNow(const std::string& sHost, const std::string& sPort, RESOLVED_ADDRESS& address);
+	void Store(const std::string& sKey, bool bResolved, const RESOLVED_ADDRESS& address);
+	HOST_ENTRY& GetEntry(const std::string& sHost, const std::string& sPort);
+	void ResolverThread();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+	const Clock::duration m_RefreshPeriod;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::unordered_map<std::string, HOST_ENTRY> m_Hosts; // keyed by host:port
+	std::thread m_ResolverThread; // started by the first host
+	bool m_bStopping;
+};
@@ -7,25 +7,14 @@
 #include <assert.h>
 #include <stdbool.h>
 
-#define ECE_BASE64URL_INVALID_CHAR 64
+#include "../FastBase64.h"
+
 #define ECE_BASE64URL_INVALID_PADDING 3
 
 // Maps an index to a character in the Base64url alphabet.
 static const char ece_base64url_encode_table[] =
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-// Maps a character in the Base64url alphabet to its index, per RFC 4648,
-// Table 2. Invalid characters map to 64.
-static const uint8_t ece_base64url_decode_table[] = {
-  64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-  64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-  64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 52, 53, 54, 55, 56, 57, 58, 59, 60,
-  61, 64, 64, 64, 64, 64, 64, 64, 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10,
-  11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64,
-  63, 64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
-  43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64,
-};
-
 // Returns the size of the buffer required to hold the Base64url output,
 // or 0 if `binaryLen` is too large.
 static inline size_t
@@ -149,54 +138,6 @@ ece_base64url_binary_length(size_t base64Len) {
   return requiredBinaryLen;
 }
 
-// Converts a Base64url character `c` to its index.
-static inline uint8_t
-ece_base64url_decode_byte(char b) {
-  return (b & ~0x7f) ? ECE_BASE64URL_INVALID_CHAR
-                     : ece_base64url_decode_table[b & 0x7f];
-}
-
-// Decodes a `base64` encoded quantum into `binary`. A 4-byte quantum decodes to
-// 3 bytes, a 3-byte quantum decodes to 2 bytes, and a 2-byte quantum decodes to
-// 1 byte.
-static inline bool
-ece_base64url_decode_quantum(const char* base64, size_t base64Len,
-                             uint8_t* binary) {
-  assert(base64Len <= 4);
-
-  uint32_t quantum = 0;
-  for (size_t i = 0; i < base64Len; i++) {
-    uint8_t b = ece_base64url_decode_byte(base64[i]);
-    if (b == ECE_BASE64URL_INVALID_CHAR) {
-      return false;
-    }
-    quantum <<= 6;
-    quantum |= (uint32_t) b;
-  }
-
-  switch (base64Len) {
-  case 0:
-    return true;
-
-  case 2:
-    binary[0] = (quantum >> 4) & 0xff;
-    return true;
-
-  case 3:
-    binary[0] = (quantum >> 10) & 0xff;
-    binary[1] = (quantum >> 2) & 0xff;
-    return true;
-
-  case 4:
-    binary[0] = (quantum >> 16) & 0xff;
-    binary[1] = (quantum >> 8) & 0xff;
-    binary[2] = quantum & 0xff;
-    return true;
-  }
-
-  return false;
-}
-
 size_t
 ece_base64url_encode(const void* binary, size_t binaryLen,
                      ece_base64url_encode_policy_t paddingPolicy, char* base64,
@@ -273,14 +214,9 @@ ece_base64url_decode(const char* base64, size_t base64Len,
     if (binaryLen < requiredBinaryLen) {
       return 0;
     }
-    for (; base64Len >= 4; base64Len -= 4) {
-      if (!ece_base64url_decode_quantum(base64, 4, binary)) {
-        return 0;
-      }
-      base64 += 4;
-      binary += 3;
-    }
-    if (!ece_base64url_decode_quantum(base64, base64Len, binary)) {
+    // Vectorized where the CPU allows, see FastBase64.h.
+    if (base64Len && fast_base64url_decode(base64, base64Len, binary,
+                                           binaryLen) != requiredBinaryLen) {
       return 0;
     }
   }
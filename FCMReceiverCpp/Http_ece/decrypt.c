@@ -3,6 +3,7 @@
 #include "trailer.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <openssl/evp.h>
@@ -168,21 +169,29 @@ end:
   return err;
 }
 
-// A generic decryption function shared by "aesgcm" and "aes128gcm".
-// `deriveKeyAndNonce` and `unpad` are function pointers that change based on
-// the scheme.
+struct ece_webpush_decrypt_ctx_s {
+  EC_KEY* recvPrivKey;
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+};
+
+// A generic decryption function shared by "aesgcm" and "aes128gcm", for an
+// already imported receiver key. `rawRecvPubKey` is its encoded public key, or
+// `NULL` to encode it for every message. `deriveKeyAndNonce` and `unpad` are
+// function pointers that change based on the scheme.
 static int
-ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
-                    const uint8_t* authSecret, size_t authSecretLen,
-                    const uint8_t* salt, size_t saltLen,
-                    const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
-                    uint32_t rs, size_t padSize, const uint8_t* ciphertext,
-                    size_t ciphertextLen, needs_trailer_t needsTrailer,
-                    derive_key_and_nonce_t deriveKeyAndNonce, unpad_t unpad,
-                    uint8_t* plaintext, size_t* plaintextLen) {
+ece_webpush_decrypt_with_key(EC_KEY* recvPrivKey, const uint8_t* rawRecvPubKey,
+                             const uint8_t* authSecret, size_t authSecretLen,
+                             const uint8_t* salt,
+                             size_t saltLen, const uint8_t* rawSenderPubKey,
+                             size_t rawSenderPubKeyLen, uint32_t rs,
+                             size_t padSize, const uint8_t* ciphertext,
+                             size_t ciphertextLen, needs_trailer_t needsTrailer,
+                             derive_key_and_nonce_t deriveKeyAndNonce,
+                             unpad_t unpad, uint8_t* plaintext,
+                             size_t* plaintextLen) {
   int err = ECE_OK;
 
-  EC_KEY* recvPrivKey = NULL;
   EC_KEY* senderPubKey = NULL;
 
   if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
@@ -204,20 +213,23 @@ ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
     goto end;
   }
 
-  recvPrivKey = ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
-  if (!recvPrivKey) {
-    err = ECE_ERROR_INVALID_PRIVATE_KEY;
-    goto end;
-  }
   senderPubKey = ece_import_public_key(rawSenderPubKey, rawSenderPubKeyLen);
   if (!senderPubKey) {
     err = ECE_ERROR_INVALID_PUBLIC_KEY;
     goto end;
   }
 
+  // The sender key goes into the info strings as is if it is uncompressed.
+  const uint8_t* rawUncompressedSenderPubKey =
+    rawSenderPubKeyLen == ECE_WEBPUSH_PUBLIC_KEY_LENGTH &&
+        rawSenderPubKey[0] == POINT_CONVERSION_UNCOMPRESSED
+      ? rawSenderPubKey
+      : NULL;
+
   uint8_t key[ECE_AES_KEY_LENGTH];
   uint8_t nonce[ECE_NONCE_LENGTH];
   err = deriveKeyAndNonce(ECE_MODE_DECRYPT, recvPrivKey, senderPubKey,
+                          rawRecvPubKey, rawUncompressedSenderPubKey,
                           authSecret, authSecretLen, salt, saltLen, key, nonce);
   if (err) {
     goto end;
@@ -227,11 +239,34 @@ ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
                             unpad, plaintext, plaintextLen);
 
 end:
-  EC_KEY_free(recvPrivKey);
   EC_KEY_free(senderPubKey);
   return err;
 }
 
+// Imports the receiver key for a single message, then decrypts it.
+static int
+ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+                    const uint8_t* authSecret, size_t authSecretLen,
+                    const uint8_t* salt, size_t saltLen,
+                    const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
+                    uint32_t rs, size_t padSize, const uint8_t* ciphertext,
+                    size_t ciphertextLen, needs_trailer_t needsTrailer,
+                    derive_key_and_nonce_t deriveKeyAndNonce, unpad_t unpad,
+                    uint8_t* plaintext, size_t* plaintextLen) {
+  EC_KEY* recvPrivKey =
+    ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
+  if (!recvPrivKey) {
+    return ECE_ERROR_INVALID_PRIVATE_KEY;
+  }
+  int err = ece_webpush_decrypt_with_key(
+    recvPrivKey, NULL, authSecret, authSecretLen, salt, saltLen,
+    rawSenderPubKey, rawSenderPubKeyLen, rs, padSize, ciphertext,
+    ciphertextLen, needsTrailer, deriveKeyAndNonce, unpad, plaintext,
+    plaintextLen);
+  EC_KEY_free(recvPrivKey);
+  return err;
+}
+
 // Removes padding from a decrypted "aesgcm" block.
 static int
 ece_aesgcm_unpad(uint8_t* block, bool lastRecord, size_t* blockLen) {
@@ -321,6 +356,30 @@ end:
   return err;
 }
 
+int
+ece_webpush_derive_public_key(const uint8_t* rawRecvPrivKey,
+                              size_t rawRecvPrivKeyLen, uint8_t* rawRecvPubKey,
+                              size_t rawRecvPubKeyLen) {
+  if (rawRecvPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  EC_KEY* recvPrivKey =
+    ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
+  if (!recvPrivKey) {
+    return ECE_ERROR_INVALID_PRIVATE_KEY;
+  }
+  int err = ECE_OK;
+  if (EC_POINT_point2oct(EC_KEY_get0_group(recvPrivKey),
+                         EC_KEY_get0_public_key(recvPrivKey),
+                         POINT_CONVERSION_UNCOMPRESSED, rawRecvPubKey,
+                         rawRecvPubKeyLen,
+                         NULL) != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  EC_KEY_free(recvPrivKey);
+  return err;
+}
+
 size_t
 ece_aes128gcm_plaintext_max_length(const uint8_t* payload, size_t payloadLen) {
   const uint8_t* salt;
@@ -423,3 +482,97 @@ ece_webpush_aesgcm_decrypt(const uint8_t* rawRecvPrivKey,
     &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_unpad, plaintext,
     plaintextLen);
 }
+
+ece_webpush_decrypt_ctx_t*
+ece_webpush_decrypt_ctx_new(const uint8_t* rawRecvPrivKey,
+                            size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
+                            size_t authSecretLen) {
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    return NULL;
+  }
+
+  ece_webpush_decrypt_ctx_t* ctx = calloc(1, sizeof(ece_webpush_decrypt_ctx_t));
+  if (!ctx) {
+    return NULL;
+  }
+  ctx->recvPrivKey = ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
+  if (!ctx->recvPrivKey) {
+    goto error;
+  }
+
+  // Serialize the public point once, then load it back: the point is now in
+  // affine form, so writing it into the info strings of every message is a
+  // plain copy instead of a field inversion.
+  const EC_GROUP* group = EC_KEY_get0_group(ctx->recvPrivKey);
+  const EC_POINT* pubKeyPt = EC_KEY_get0_public_key(ctx->recvPrivKey);
+  if (EC_POINT_point2oct(group, pubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
+                         ctx->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                         NULL) != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    goto error;
+  }
+  if (EC_KEY_oct2key(ctx->recvPrivKey, ctx->rawRecvPubKey,
+                     ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL) != 1) {
+    goto error;
+  }
+  memcpy(ctx->authSecret, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  return ctx;
+
+error:
+  ece_webpush_decrypt_ctx_free(ctx);
+  return NULL;
+}
+
+void
+ece_webpush_decrypt_ctx_free(ece_webpush_decrypt_ctx_t* ctx) {
+  if (!ctx) {
+    return;
+  }
+  EC_KEY_free(ctx->recvPrivKey);
+  free(ctx);
+}
+
+int
+ece_webpush_aes128gcm_decrypt_with_ctx(const ece_webpush_decrypt_ctx_t* ctx,
+                                       const uint8_t* payload,
+                                       size_t payloadLen, uint8_t* plaintext,
+                                       size_t* plaintextLen) {
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* rawSenderPubKey;
+  size_t rawSenderPubKeyLen;
+  uint32_t rs;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen;
+  int err = ece_aes128gcm_payload_extract_params(
+    payload, payloadLen, &salt, &saltLen, &rawSenderPubKey, &rawSenderPubKeyLen,
+    &rs, &ciphertext, &ciphertextLen);
+  if (err) {
+    return err;
+  }
+  return ece_webpush_decrypt_with_key(
+    ctx->recvPrivKey, ctx->rawRecvPubKey, ctx->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, saltLen, rawSenderPubKey,
+    rawSenderPubKeyLen, rs, ECE_AES128GCM_PAD_SIZE, ciphertext, ciphertextLen,
+    &ece_aes128gcm_needs_trailer, &ece_webpush_aes128gcm_derive_key_and_nonce,
+    &ece_aes128gcm_unpad, plaintext, plaintextLen);
+}
+
+int
+ece_webpush_aesgcm_decrypt_with_ctx(const ece_webpush_decrypt_ctx_t* ctx,
+                                    const uint8_t* salt, size_t saltLen,
+                                    const uint8_t* rawSenderPubKey,
+                                    size_t rawSenderPubKeyLen, uint32_t rs,
+                                    const uint8_t* ciphertext,
+                                    size_t ciphertextLen, uint8_t* plaintext,
+                                    size_t* plaintextLen) {
+  rs = ece_aesgcm_rs(rs);
+  if (!rs) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  return ece_webpush_decrypt_with_key(
+    ctx->recvPrivKey, ctx->rawRecvPubKey, ctx->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, saltLen, rawSenderPubKey,
+    rawSenderPubKeyLen, rs, ECE_AESGCM_PAD_SIZE, ciphertext, ciphertextLen,
+    &ece_aesgcm_needs_trailer, &ece_webpush_aesgcm_derive_key_and_nonce,
+    &ece_aesgcm_unpad, plaintext, plaintextLen);
+}
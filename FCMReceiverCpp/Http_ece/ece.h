@@ -113,6 +113,27 @@ ece_webpush_generate_keys(uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
                           uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
                           uint8_t* authSecret, size_t authSecretLen);
 
+/*!
+ * Derives the public key of a Web Push subscription from its private key.
+ *
+ * \sa                          ece_webpush_generate_keys()
+ *
+ * \param rawRecvPrivKey[in]    The subscription private key.
+ * \param rawRecvPrivKeyLen[in] The length of the subscription private key. Must
+ *                              be `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param rawRecvPubKey[out]    The subscription public key, in uncompressed
+ *                              form.
+ * \param rawRecvPubKeyLen[in]  The length of the subscription public key. Must
+ *                              be `ECE_WEBPUSH_PUBLIC_KEY_LENGTH`.
+ *
+ * \return                      `ECE_OK` on success, or an error code if the
+ *                              private key is invalid.
+ */
+int
+ece_webpush_derive_public_key(const uint8_t* rawRecvPrivKey,
+                              size_t rawRecvPrivKeyLen, uint8_t* rawRecvPubKey,
+                              size_t rawRecvPubKeyLen);
+
 /*!
  * Calculates the maximum "aes128gcm" plaintext length. The caller should
  * allocate and pass an array of this length to the "aes128gcm" decryption
@@ -466,6 +487,67 @@ ece_webpush_aesgcm_decrypt(const uint8_t* rawRecvPrivKey,
                            const uint8_t* ciphertext, size_t ciphertextLen,
                            uint8_t* plaintext, size_t* plaintextLen);
 
+/*!
+ * A receiver key and authentication secret, imported once and reused for
+ * every message decrypted with it. Importing a private key recomputes its
+ * public point, so a context saves one scalar multiplication per message.
+ *
+ * A context is only read after it is created, so several threads may decrypt
+ * with it at once.
+ */
+typedef struct ece_webpush_decrypt_ctx_s ece_webpush_decrypt_ctx_t;
+
+/*!
+ * Creates a decryption context.
+ *
+ * \sa                           ece_webpush_decrypt_ctx_free()
+ *
+ * \param rawRecvPrivKey[in]     The subscription private key.
+ * \param rawRecvPrivKeyLen[in]  The length of the subscription private key.
+ *                               Must be `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param authSecret[in]         The authentication secret.
+ * \param authSecretLen[in]      The length of the authentication secret. Must
+ *                               be `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ *
+ * \return                       The context, or `NULL` if the key or secret
+ *                               is invalid.
+ */
+ece_webpush_decrypt_ctx_t*
+ece_webpush_decrypt_ctx_new(const uint8_t* rawRecvPrivKey,
+                            size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
+                            size_t authSecretLen);
+
+/*!
+ * Frees a decryption context. `ctx` may be `NULL`.
+ */
+void
+ece_webpush_decrypt_ctx_free(ece_webpush_decrypt_ctx_t* ctx);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aes128gcm" scheme with the
+ * key and secret held by `ctx`. See ece_webpush_aes128gcm_decrypt() for the
+ * other parameters.
+ */
+int
+ece_webpush_aes128gcm_decrypt_with_ctx(const ece_webpush_decrypt_ctx_t* ctx,
+                                       const uint8_t* payload,
+                                       size_t payloadLen, uint8_t* plaintext,
+                                       size_t* plaintextLen);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aesgcm" scheme with the
+ * key and secret held by `ctx`. See ece_webpush_aesgcm_decrypt() for the other
+ * parameters.
+ */
+int
+ece_webpush_aesgcm_decrypt_with_ctx(const ece_webpush_decrypt_ctx_t* ctx,
+                                    const uint8_t* salt, size_t saltLen,
+                                    const uint8_t* rawSenderPubKey,
+                                    size_t rawSenderPubKeyLen, uint32_t rs,
+                                    const uint8_t* ciphertext,
+                                    size_t ciphertextLen, uint8_t* plaintext,
+                                    size_t* plaintextLen);
+
 /*!
  * Extracts "aes128gcm" decryption parameters from an encrypted payload.
  * `salt`, `keyId`, and `ciphertext` are pointers into `payload`, and must not
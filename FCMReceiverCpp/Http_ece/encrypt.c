@@ -215,9 +215,9 @@ ece_webpush_encrypt_plaintext(
 
   uint8_t key[ECE_AES_KEY_LENGTH];
   uint8_t nonce[ECE_NONCE_LENGTH];
-  err = deriveKeyAndNonce(ECE_MODE_ENCRYPT, senderPrivKey, recvPubKey,
-                          authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt,
-                          ECE_SALT_LENGTH, key, nonce);
+  err = deriveKeyAndNonce(ECE_MODE_ENCRYPT, senderPrivKey, recvPubKey, NULL,
+                          NULL, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+                          salt, ECE_SALT_LENGTH, key, nonce);
   if (err) {
     goto end;
   }
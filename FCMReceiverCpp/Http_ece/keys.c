@@ -174,10 +174,27 @@ end:
   return sharedSecret;
 }
 
+// Writes the uncompressed public key, copied from `rawKey` if the caller has it
+// encoded already. Returns the length written, or 0 on error.
+static size_t
+ece_write_public_key(EC_KEY* key, const uint8_t* rawKey, uint8_t* out) {
+  if (rawKey) {
+    memcpy(out, rawKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+    return ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  }
+  const EC_GROUP* grp = EC_KEY_get0_group(key);
+  const EC_POINT* pubKeyPt = EC_KEY_get0_public_key(key);
+  return EC_POINT_point2oct(grp, pubKeyPt, POINT_CONVERSION_UNCOMPRESSED, out,
+                            ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+}
+
 // The "aes128gcm" IKM info string is "WebPush: info\0", followed by the
 // receiver and sender public keys.
 static int
-ece_webpush_aes128gcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
+ece_webpush_aes128gcm_generate_info(EC_KEY* recvKey,
+                                    const uint8_t* rawRecvPubKey,
+                                    EC_KEY* senderKey,
+                                    const uint8_t* rawSenderPubKey,
                                     const char* prefix, size_t prefixLen,
                                     uint8_t* info) {
   size_t offset = 0;
@@ -187,22 +204,16 @@ ece_webpush_aes128gcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
   offset += prefixLen;
 
   // Copy the receiver public key.
-  const EC_GROUP* recvGrp = EC_KEY_get0_group(recvKey);
-  const EC_POINT* recvPubKeyPt = EC_KEY_get0_public_key(recvKey);
   size_t recvPubKeyLen =
-    EC_POINT_point2oct(recvGrp, recvPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+    ece_write_public_key(recvKey, rawRecvPubKey, &info[offset]);
   if (!recvPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
   offset += recvPubKeyLen;
 
   // Copy the sender public key.
-  const EC_GROUP* senderGrp = EC_KEY_get0_group(senderKey);
-  const EC_POINT* senderPubKeyPt = EC_KEY_get0_public_key(senderKey);
   size_t senderPubKeyLen =
-    EC_POINT_point2oct(senderGrp, senderPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+    ece_write_public_key(senderKey, rawSenderPubKey, &info[offset]);
   if (!senderPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
@@ -228,6 +239,8 @@ ece_aes128gcm_derive_key_and_nonce(const uint8_t* salt, size_t saltLen,
 int
 ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
                                            EC_KEY* remoteKey,
+                                           const uint8_t* rawRecvPubKey,
+                                           const uint8_t* rawSenderPubKey,
                                            const uint8_t* authSecret,
                                            size_t authSecretLen,
                                            const uint8_t* salt, size_t saltLen,
@@ -251,7 +264,8 @@ ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
     // For encryption, the remote static public key is the receiver key, and the
     // local ephemeral private key is the sender key.
     err = ece_webpush_aes128gcm_generate_info(
-      remoteKey, localKey, ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX,
+      remoteKey, rawRecvPubKey, localKey, rawSenderPubKey,
+      ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX,
       ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX_LENGTH, ikmInfo);
     break;
 
@@ -259,7 +273,8 @@ ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
     // For decryption, the local static private key is the receiver key, and the
     // remote ephemeral public key is the sender key.
     err = ece_webpush_aes128gcm_generate_info(
-      localKey, remoteKey, ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX,
+      localKey, rawRecvPubKey, remoteKey, rawSenderPubKey,
+      ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX,
       ECE_WEBPUSH_AES128GCM_IKM_INFO_PREFIX_LENGTH, ikmInfo);
     break;
 
@@ -290,7 +305,9 @@ end:
 // followed by the length-prefixed (unsigned 16-bit integers) receiver and
 // sender public keys.
 static int
-ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
+ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, const uint8_t* rawRecvPubKey,
+                                 EC_KEY* senderKey,
+                                 const uint8_t* rawSenderPubKey,
                                  const char* prefix, size_t prefixLen,
                                  uint8_t* info) {
   size_t offset = 0;
@@ -302,11 +319,8 @@ ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
   // Copy the length-prefixed receiver public key.
   ece_write_uint16_be(&info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   offset += 2;
-  const EC_GROUP* recvGrp = EC_KEY_get0_group(recvKey);
-  const EC_POINT* recvPubKeyPt = EC_KEY_get0_public_key(recvKey);
   size_t recvPubKeyLen =
-    EC_POINT_point2oct(recvGrp, recvPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+    ece_write_public_key(recvKey, rawRecvPubKey, &info[offset]);
   if (!recvPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
@@ -315,11 +329,8 @@ ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
   // Copy the length-prefixed sender public key.
   ece_write_uint16_be(&info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   offset += 2;
-  const EC_GROUP* senderGrp = EC_KEY_get0_group(senderKey);
-  const EC_POINT* senderPubKeyPt = EC_KEY_get0_public_key(senderKey);
   size_t senderPubKeyLen =
-    EC_POINT_point2oct(senderGrp, senderPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+    ece_write_public_key(senderKey, rawSenderPubKey, &info[offset]);
   if (!senderPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
@@ -330,6 +341,8 @@ ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
 int
 ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
                                         EC_KEY* remoteKey,
+                                        const uint8_t* rawRecvPubKey,
+                                        const uint8_t* rawSenderPubKey,
                                         const uint8_t* authSecret,
                                         size_t authSecretLen,
                                         const uint8_t* salt, size_t saltLen,
@@ -365,25 +378,29 @@ ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
   switch (mode) {
   case ECE_MODE_ENCRYPT:
     err = ece_webpush_aesgcm_generate_info(
-      remoteKey, localKey, ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
+      remoteKey, rawRecvPubKey, localKey, rawSenderPubKey,
+      ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
       ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX_LENGTH, keyInfo);
     if (err) {
       break;
     }
     err = ece_webpush_aesgcm_generate_info(
-      remoteKey, localKey, ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
+      remoteKey, rawRecvPubKey, localKey, rawSenderPubKey,
+      ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
       ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX_LENGTH, nonceInfo);
     break;
 
   case ECE_MODE_DECRYPT:
     err = ece_webpush_aesgcm_generate_info(
-      localKey, remoteKey, ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
+      localKey, rawRecvPubKey, remoteKey, rawSenderPubKey,
+      ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
       ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX_LENGTH, keyInfo);
     if (err) {
       break;
     }
     err = ece_webpush_aesgcm_generate_info(
-      localKey, remoteKey, ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
+      localKey, rawRecvPubKey, remoteKey, rawSenderPubKey,
+      ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
       ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX_LENGTH, nonceInfo);
     break;
 
@@ -38,8 +38,12 @@ typedef enum ece_mode_e {
   ECE_MODE_DECRYPT,
 } ece_mode_t;
 
+// `rawRecvPubKey` and `rawSenderPubKey` are the uncompressed encodings of the
+// receiver and sender public keys, or `NULL` to encode them from the keys.
 typedef int (*derive_key_and_nonce_t)(ece_mode_t mode, EC_KEY* localKey,
                                       EC_KEY* remoteKey,
+                                      const uint8_t* rawRecvPubKey,
+                                      const uint8_t* rawSenderPubKey,
                                       const uint8_t* authSecret,
                                       size_t authSecretLen, const uint8_t* salt,
                                       size_t saltLen, uint8_t* key,
@@ -70,6 +74,8 @@ ece_aes128gcm_derive_key_and_nonce(const uint8_t* salt, size_t saltLen,
 int
 ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
                                            EC_KEY* remoteKey,
+                                           const uint8_t* rawRecvPubKey,
+                                           const uint8_t* rawSenderPubKey,
                                            const uint8_t* authSecret,
                                            size_t authSecretLen,
                                            const uint8_t* salt, size_t saltLen,
@@ -80,6 +86,8 @@ ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
 int
 ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* recvPrivKey,
                                         EC_KEY* senderPubKey,
+                                        const uint8_t* rawRecvPubKey,
+                                        const uint8_t* rawSenderPubKey,
                                         const uint8_t* authSecret,
                                         size_t authSecretLen,
                                         const uint8_t* salt, size_t saltLen,
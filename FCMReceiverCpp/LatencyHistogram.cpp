@@ -0,0 +1,123 @@
+#include "LatencyHistogram.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+	// x must not be 0
+	uint32_t MostSignificantBit(uint64_t x)
+	{
+#ifdef _MSC_VER
+		// _BitScanReverse64 is not available on x86
+		unsigned long nIndex;
+		if (_BitScanReverse(&nIndex, static_cast<unsigned long>(x >> 32)))
+			return nIndex + 32;
+		_BitScanReverse(&nIndex, static_cast<unsigned long>(x));
+		return nIndex;
+#else
+		return static_cast<uint32_t>(63 - __builtin_clzll(x));
+#endif
+	}
+}
+
+uint64_t LATENCY_SNAPSHOT::ValueAtPercentile(double dPercentile) const
+{
+	if (nCount == 0)
+		return 0;
+
+	uint64_t nRank = static_cast<uint64_t>(dPercentile / 100 * nCount);
+	if (nRank >= nCount)
+		nRank = nCount - 1;
+
+	uint64_t nSeen = 0;
+	for (uint32_t nIndex = 0; nIndex < counts.size(); ++nIndex)
+	{
+		nSeen += counts[nIndex];
+		if (nSeen > nRank)
+			return CLatencyHistogram::BucketUpperBound(nIndex);
+	}
+
+	return MaxNs();
+}
+
+uint64_t LATENCY_SNAPSHOT::MaxNs() const
+{
+	for (size_t nIndex = counts.size(); nIndex > 0; --nIndex)
+	{
+		if (counts[nIndex - 1] != 0)
+			return CLatencyHistogram::BucketUpperBound(static_cast<uint32_t>(nIndex - 1));
+	}
+
+	return 0;
+}
+
+CLatencyHistogram::CLatencyHistogram() :
+	m_Shards(new SHARD[kLatencyHistogramShards])
+{
+	for (size_t nShard = 0; nShard < kLatencyHistogramShards; ++nShard)
+	{
+		for (std::atomic<uint64_t>& nCount : m_Shards[nShard].counts)
+			nCount.store(0, std::memory_order_relaxed);
+		m_Shards[nShard].nSumNs.store(0, std::memory_order_relaxed);
+	}
+}
+
+void CLatencyHistogram::Record(uint64_t nNs)
+{
+	SHARD& shard = m_Shards[ShardIndex()];
+	// Uncontended unless more threads record than there are shards
+	shard.counts[BucketIndex(nNs)].fetch_add(1, std::memory_order_relaxed);
+	shard.nSumNs.fetch_add(nNs, std::memory_order_relaxed);
+}
+
+LATENCY_SNAPSHOT CLatencyHistogram::Snapshot() const
+{
+	LATENCY_SNAPSHOT snapshot;
+	snapshot.counts.assign(kLatencyHistogramBuckets, 0);
+
+	for (size_t nShard = 0; nShard < kLatencyHistogramShards; ++nShard)
+	{
+		const SHARD& shard = m_Shards[nShard];
+		for (uint32_t nIndex = 0; nIndex < kLatencyHistogramBuckets; ++nIndex)
+		{
+			uint64_t nCount = shard.counts[nIndex].load(std::memory_order_relaxed);
+			snapshot.counts[nIndex] += nCount;
+			snapshot.nCount += nCount;
+		}
+		snapshot.nSumNs += shard.nSumNs.load(std::memory_order_relaxed);
+	}
+
+	return snapshot;
+}
+
+uint32_t CLatencyHistogram::BucketIndex(uint64_t nNs)
+{
+	if (nNs < kLatencyHistogramSubBuckets * 2)
+		return static_cast<uint32_t>(nNs);
+
+	if (nNs >= (uint64_t(1) << kLatencyHistogramMaxBits))
+		return kLatencyHistogramBuckets - 1;
+
+	// The top kLatencyHistogramSubBucketBits + 1 bits pick the bucket, the leading one
+	// is implied by the shift
+	uint32_t nShift = MostSignificantBit(nNs) - kLatencyHistogramSubBucketBits;
+	return nShift * kLatencyHistogramSubBuckets + static_cast<uint32_t>(nNs >> nShift);
+}
+
+uint64_t CLatencyHistogram::BucketLowerBound(uint32_t nIndex)
+{
+	if (nIndex < kLatencyHistogramSubBuckets * 2)
+		return nIndex;
+
+	uint32_t nShift = nIndex / kLatencyHistogramSubBuckets - 1;
+	return static_cast<uint64_t>(nIndex - nShift * kLatencyHistogramSubBuckets) << nShift;
+}
+
+size_t CLatencyHistogram::ShardIndex()
+{
+	static std::atomic<size_t> s_nNextShard(0);
+	thread_local size_t nShard = s_nNextShard.fetch_add(1, std::memory_order_relaxed) % kLatencyHistogramShards;
+	return nShard;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+constexpr uint32_t kLatencyHistogramSubBucketBits = 4; // 16 sub-buckets per power of two, values within 1/16 of their bucket
+constexpr uint32_t kLatencyHistogramSubBuckets = 1u << kLatencyHistogramSubBucketBits;
+constexpr uint32_t kLatencyHistogramMaxBits = 36; // about 68 seconds in nanoseconds, longer samples are clamped
+constexpr uint32_t kLatencyHistogramBuckets = (kLatencyHistogramMaxBits - kLatencyHistogramSubBucketBits + 1) * kLatencyHistogramSubBuckets;
+constexpr size_t kLatencyHistogramShards = 16; // threads beyond this share shards
+
+typedef struct _LATENCY_SNAPSHOT
+{
+	std::vector<uint64_t> counts; // per bucket, see CLatencyHistogram::BucketLowerBound()
+	uint64_t nCount = 0;
+	uint64_t nSumNs = 0;
+
+	/**
+	 * @param dPercentile 0 to 100.
+	 * @return The upper bound of the bucket holding that percentile, 0 when empty.
+	 */
+	uint64_t ValueAtPercentile(double dPercentile) const;
+	uint64_t MaxNs() const;
+} LATENCY_SNAPSHOT;
+
+/**
+ * Log-linear latency histogram in nanoseconds, HDR style: every power of two is split
+ * into kLatencyHistogramSubBuckets linear buckets, so the relative error stays the same
+ * from nanoseconds to seconds.
+ *
+ * Record() is lock free and meant for hot paths. Each thread is given a shard of its own
+ * counters on first use, so recording threads do not share cache lines. Snapshot()
+ * merges the shards, it may miss samples recorded while it runs but never blocks them.
+ */
+class CLatencyHistogram
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	CLatencyHistogram();
+
+	CLatencyHistogram(const CLatencyHistogram&) = delete;
+	CLatencyHistogram& operator=(const CLatencyHistogram&) = delete;
+
+	/**
+	 * Adds a sample. Thread safe.
+	 *
+	 * @param nNs The latency in nanoseconds.
+	 */
+	void Record(uint64_t nNs);
+
+	/**
+	 * Adds the time elapsed since start. Thread safe.
+	 */
+	void RecordSince(Clock::time_point start) { Record(ElapsedNs(start, Clock::now())); }
+
+	/**
+	 * @return The counts of every shard added up. Thread safe.
+	 */
+	LATENCY_SNAPSHOT Snapshot() const;
+
+	static uint32_t BucketIndex(uint64_t nNs);
+	static uint64_t BucketLowerBound(uint32_t nIndex);
+	static uint64_t BucketUpperBound(uint32_t nIndex) { return BucketLowerBound(nIndex + 1) - 1; }
+
+	static uint64_t ElapsedNs(Clock::time_point start, Clock::time_point end)
+	{
+		return end > start ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) : 0;
+	}
+
+private:
+	// Written by the threads mapped to it only, aligned so neighbouring shards do not false share
+	struct alignas(64) SHARD
+	{
+		std::array<std::atomic<uint64_t>, kLatencyHistogramBuckets> counts;
+		std::atomic<uint64_t> nSumNs;
+	};
+
+	static size_t ShardIndex();
+
+private:
+	std::unique_ptr<SHARD[]> m_Shards;
+};
@@ -1,24 +1,106 @@
 #include "LibCurlWrapper.h"
 
 #include <curl/curl.h>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <map>
 
+CCurlHandlePool& CCurlHandlePool::Instance()
+{
+    static CCurlHandlePool pool;
+    return pool;
+}
+
+CURL* CCurlHandlePool::Acquire()
+{
+    CURL* pHandle = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_PoolMutex);
+        if (!m_IdleHandles.empty())
+        {
+            pHandle = m_IdleHandles.back();
+            m_IdleHandles.pop_back();
+        }
+    }
+
+    if (pHandle == nullptr)
+        pHandle = curl_easy_init();
+    if (pHandle == nullptr)
+        return nullptr;
+
+    if (m_pShare != nullptr)
+        curl_easy_setopt(pHandle, CURLOPT_SHARE, m_pShare);
+    curl_easy_setopt(pHandle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(pHandle, CURLOPT_NOSIGNAL, 1L); // requests may run on any thread
+    return pHandle;
+}
+
+void CCurlHandlePool::Release(CURL* pHandle)
+{
+    // Options go, the handle's connection cache and the shared caches stay
+    curl_easy_reset(pHandle);
+
+    {
+        std::lock_guard<std::mutex> lock(m_PoolMutex);
+        if (m_IdleHandles.size() < kCurlPoolMaxIdleHandles)
+        {
+            m_IdleHandles.push_back(pHandle);
+            return;
+        }
+    }
+    curl_easy_cleanup(pHandle);
+}
+
+CCurlHandlePool::CCurlHandlePool()
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    m_pShare = curl_share_init();
+    if (m_pShare == nullptr)
+        return;
+
+    curl_share_setopt(m_pShare, CURLSHOPT_LOCKFUNC, LockShare);
+    curl_share_setopt(m_pShare, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+    curl_share_setopt(m_pShare, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // libcurl does not support a shared connection cache across threads, each pooled
+    // handle keeps its own and the last released handle, the warmest, is reused first
+}
+
+CCurlHandlePool::~CCurlHandlePool()
+{
+    for (CURL* pHandle : m_IdleHandles)
+        curl_easy_cleanup(pHandle);
+    if (m_pShare != nullptr)
+        curl_share_cleanup(m_pShare);
+    curl_global_cleanup();
+}
+
+void CCurlHandlePool::LockShare(CURL*, curl_lock_data eData, curl_lock_access, void* pUserData)
+{
+    static_cast<CCurlHandlePool*>(pUserData)->m_ShareMutexes[eData % CURL_LOCK_DATA_LAST].lock();
+}
+
+void CCurlHandlePool::UnlockShare(CURL*, curl_lock_data eData, void* pUserData)
+{
+    static_cast<CCurlHandlePool*>(pUserData)->m_ShareMutexes[eData % CURL_LOCK_DATA_LAST].unlock();
+}
+
 CLibCurlWrapper::CLibCurlWrapper()
 	: curl(nullptr)
 	, curlHeaders(nullptr)
 {
-	curl_global_init(CURL_GLOBAL_ALL);
-	curl = curl_easy_init();
+	curl = CCurlHandlePool::Instance().Acquire();
 }
 
 CLibCurlWrapper::~CLibCurlWrapper()
 {
     if (curl) {
-        curl_easy_cleanup(curl);
+        CCurlHandlePool::Instance().Release(curl);
     }
-    curl_global_cleanup();
+    curl_slist_free_all(curlHeaders);
 }
 
 BOOL CLibCurlWrapper::Get(const std::string& sUrl, std::string& sResponse)
@@ -45,6 +127,11 @@ void CLibCurlWrapper::SetHeaders(const std::vector<std::string>& sHeaders)
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, curlHeaders);
 }
 
+void CLibCurlWrapper::SetCAFile(const std::string& sCAFile)
+{
+    curl_easy_setopt(curl, CURLOPT_CAINFO, sCAFile.c_str());
+}
+
 std::string CLibCurlWrapper::GetError()
 {
     return m_sError;
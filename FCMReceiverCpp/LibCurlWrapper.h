@@ -1,16 +1,80 @@
 #pragma once
 
 #include <curl/curl.h>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <map>
 
+#ifndef WINDOWS
+// On Windows these come with the system headers curl.h includes
+typedef int BOOL;
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#endif
+
+constexpr size_t kCurlPoolMaxIdleHandles = 16;
+
+/**
+ * The process-wide libcurl state: initializes libcurl once, on first use, and cleans it up
+ * at exit. Pools easy handles that share one DNS cache and TLS session cache, for
+ * CLibCurlWrapper and for anything that drives its own multi handle. Thread safe.
+ */
+class CCurlHandlePool
+{
+public:
+    static CCurlHandlePool& Instance();
+
+    CCurlHandlePool(const CCurlHandlePool&) = delete;
+    CCurlHandlePool& operator=(const CCurlHandlePool&) = delete;
+
+    /**
+     * @return An idle handle, or a new one, set up with the shared caches. nullptr if libcurl cannot create one.
+     */
+    CURL* Acquire();
+
+    /**
+     * Resets the handle's options and keeps it for the next Acquire(), up to kCurlPoolMaxIdleHandles.
+     *
+     * @param pHandle A handle from Acquire(), not in a multi handle.
+     */
+    void Release(CURL* pHandle);
+
+private:
+    CCurlHandlePool();
+    ~CCurlHandlePool();
+
+    static void LockShare(CURL*, curl_lock_data eData, curl_lock_access, void* pUserData);
+    static void UnlockShare(CURL*, curl_lock_data eData, void* pUserData);
+
+private:
+    CURLSH* m_pShare = nullptr;
+    std::mutex m_ShareMutexes[CURL_LOCK_DATA_LAST];
+
+    std::mutex m_PoolMutex;
+    std::vector<CURL*> m_IdleHandles;
+};
+
+/**
+ * One HTTP request at a time over a process-wide pool.
+ *
+ * libcurl is initialized once per process. The easy handle is borrowed from a pool and given
+ * back by the destructor with its open keep-alive connections, so consecutive requests to
+ * the same host reuse a warm connection whichever wrapper sends them. All handles share one
+ * DNS cache and TLS session cache, so even a new connection skips the lookup and resumes
+ * its TLS session. Wrappers may be used from several threads at once.
+ */
 class CLibCurlWrapper
 {
 public:
     CLibCurlWrapper();
     ~CLibCurlWrapper();
 
+    CLibCurlWrapper(const CLibCurlWrapper&) = delete;
+    CLibCurlWrapper& operator=(const CLibCurlWrapper&) = delete;
+
 
     /**
      * Performs a GET request to the specified URL.
@@ -38,6 +102,13 @@ public:
      */
     void SetHeaders(const std::vector<std::string>& sHeaders);
 
+    /**
+     * Trusts the certificates in a file instead of the system's, e.g. a test server's.
+     * 
+     * @param sCAFile The PEM file.
+     */
+    void SetCAFile(const std::string& sCAFile);
+
     /**
      * Gets the error message associated with the last request.
      * 
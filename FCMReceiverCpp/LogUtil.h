@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+enum LogLevel : int
+{
+	LOG_LEVEL_DEBUG = 0,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_FATAL,
+	LOG_LEVEL_OFF
+};
+
+// Levels below this one are compiled out, e.g. /DFCM_LOG_COMPILE_LEVEL=2 keeps warnings, errors and fatals
+#ifndef FCM_LOG_COMPILE_LEVEL
+#define FCM_LOG_COMPILE_LEVEL 0
+#endif
+
+/**
+ * Level filter shared by every LogFnCallback user.
+ *
+ * A level is logged when it is at or above both the compile time level and the
+ * runtime level. The FCM_LOG_* macros evaluate and format their arguments only
+ * after that check, so a disabled line costs one comparison, and nothing when
+ * compiled out.
+ */
+namespace LogUtil
+{
+	constexpr int kCompiledLevel = FCM_LOG_COMPILE_LEVEL;
+
+	inline std::atomic<int> g_nRuntimeLevel(LOG_LEVEL_INFO);
+
+	inline void SetLevel(LogLevel eLevel)
+	{
+		g_nRuntimeLevel.store(eLevel, std::memory_order_relaxed);
+	}
+
+	inline LogLevel GetLevel()
+	{
+		return static_cast<LogLevel>(g_nRuntimeLevel.load(std::memory_order_relaxed));
+	}
+
+	inline bool IsEnabled(LogLevel eLevel)
+	{
+		return eLevel >= kCompiledLevel && eLevel >= g_nRuntimeLevel.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @param sName "debug", "info", "warning", "error", "fatal" or "off".
+	 * @param eLevel Receives the level.
+	 * @return False if the name is unknown.
+	 */
+	inline bool ParseLevel(const std::string& sName, LogLevel& eLevel)
+	{
+		static const char* const levelNames[] = { "debug", "info", "warning", "error", "fatal", "off" };
+		for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; ++i)
+		{
+			if (sName == levelNames[i])
+			{
+				eLevel = static_cast<LogLevel>(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline void Append(std::string& sLine, const std::string& sValue) { sLine += sValue; }
+	inline void Append(std::string& sLine, const char* szValue) { sLine += szValue; }
+	inline void Append(std::string& sLine, char cValue) { sLine += cValue; }
+
+	template <typename T>
+	inline typename std::enable_if<std::is_arithmetic<T>::value>::type Append(std::string& sLine, T value)
+	{
+		sLine += std::to_string(value);
+	}
+
+	/**
+	 * Joins strings and numbers into one line with a single growing buffer.
+	 */
+	template <typename... Args>
+	inline std::string Concat(const Args&... args)
+	{
+		std::string sLine;
+		sLine.reserve(128);
+		(Append(sLine, args), ...);
+		return sLine;
+	}
+}
+
+#define FCM_LOG(oLogger, eLevel, ...) \
+	do { if (LogUtil::IsEnabled(eLevel)) (oLogger)(LogUtil::Concat(__VA_ARGS__)); } while (0)
+
+#define FCM_LOG_DEBUG(oLogger, ...) FCM_LOG(oLogger, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define FCM_LOG_INFO(oLogger, ...) FCM_LOG(oLogger, LOG_LEVEL_INFO, __VA_ARGS__)
+#define FCM_LOG_WARNING(oLogger, ...) FCM_LOG(oLogger, LOG_LEVEL_WARNING, __VA_ARGS__)
+#define FCM_LOG_ERROR(oLogger, ...) FCM_LOG(oLogger, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define FCM_LOG_FATAL(oLogger, ...) FCM_LOG(oLogger, LOG_LEVEL_FATAL, __VA_ARGS__)
@@ -0,0 +1,168 @@
+#include "MCSFrameDecoder.h"
+#include "UtilFunction.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+CMCSFrameDecoder::CMCSFrameDecoder(size_t nCapacity) :
+	m_nCapacity(nCapacity > 0 ? nCapacity : kMCSDecoderDefaultCapacity),
+	m_nReadPos(0),
+	m_nWritePos(0),
+	m_nState(MCS_VERSION_TAG_AND_SIZE),
+	m_nVersion(0),
+	m_nMessageTag(0),
+	m_nMessageSize(0),
+	m_nSizePacketSoFar(0)
+{
+}
+
+void CMCSFrameDecoder::Reset()
+{
+	m_nReadPos = 0;
+	m_nWritePos = 0;
+	m_nState = MCS_VERSION_TAG_AND_SIZE;
+	m_nVersion = 0;
+	m_nMessageTag = 0;
+	m_nMessageSize = 0;
+	m_nSizePacketSoFar = 0;
+}
+
+bool CMCSFrameDecoder::Release()
+{
+	if (ReadableSize() > 0)
+		return false;
+
+	std::vector<uint8_t>().swap(m_Buffer);
+	m_nReadPos = 0;
+	m_nWritePos = 0;
+	return true;
+}
+
+uint8_t* CMCSFrameDecoder::PrepareWrite(size_t nMinSize)
+{
+	if (m_nReadPos == m_nWritePos)
+	{
+		m_nReadPos = 0;
+		m_nWritePos = 0;
+	}
+
+	if (m_Buffer.empty())
+		m_Buffer.resize(nMinSize > m_nCapacity ? nMinSize : m_nCapacity);
+
+	if (m_Buffer.size() - m_nWritePos < nMinSize)
+	{
+		// Move the unread tail to the front once, instead of erasing consumed bytes one by one
+		size_t nReadable = ReadableSize();
+		if (m_nReadPos > 0)
+		{
+			std::memmove(m_Buffer.data(), m_Buffer.data() + m_nReadPos, nReadable);
+			m_nReadPos = 0;
+			m_nWritePos = nReadable;
+		}
+
+		if (m_Buffer.size() - m_nWritePos < nMinSize)
+			m_Buffer.resize(m_nWritePos + nMinSize);
+	}
+
+	return m_Buffer.data() + m_nWritePos;
+}
+
+void CMCSFrameDecoder::CommitWrite(size_t nSize)
+{
+	if (nSize > WritableSize())
+		throw std::runtime_error("CommitWrite past the end of the decoder buffer");
+
+	m_nWritePos += nSize;
+}
+
+void CMCSFrameDecoder::Feed(const uint8_t* pData, size_t nSize)
+{
+	if (nSize == 0)
+		return;
+
+	std::memcpy(PrepareWrite(nSize), pData, nSize);
+	CommitWrite(nSize);
+}
+
+bool CMCSFrameDecoder::Next(MCS_FRAME& frame)
+{
+	switch (m_nState)
+	{
+	case MCS_VERSION_TAG_AND_SIZE:
+	{
+		if (ReadableSize() < kVersionPacketLen)
+			return false;
+
+		m_nVersion = m_Buffer[m_nReadPos++];
+		if (m_nVersion < kMCSVersion && m_nVersion != 38)
+			throw std::runtime_error("Got version " + std::to_string(m_nVersion) + " but expected " + std::to_string(kMCSVersion));
+
+		m_nState = MCS_TAG_AND_SIZE;
+	}
+	// fall through
+	case MCS_TAG_AND_SIZE:
+	{
+		if (ReadableSize() < kTagPacketLen)
+			return false;
+
+		m_nMessageTag = m_Buffer[m_nReadPos++];
+		m_nSizePacketSoFar = 0;
+		m_nState = MCS_SIZE;
+	}
+	// fall through
+	case MCS_SIZE:
+	{
+		size_t nVarintLen = 0;
+		if (!UtilFunction::_DecodeVarint32(m_Buffer.data() + m_nReadPos, ReadableSize(), 0, m_nMessageSize, nVarintLen))
+		{
+			m_nSizePacketSoFar = ReadableSize();
+			if (m_nSizePacketSoFar >= kSizePacketLenMax)
+				throw std::runtime_error("Invalid message size varint");
+			return false;
+		}
+
+		if (nVarintLen > kSizePacketLenMax || m_nMessageSize > kMCSMaxMessageSize)
+			throw std::runtime_error("Message size " + std::to_string(m_nMessageSize) + " exceeds limit");
+
+		m_nReadPos += nVarintLen;
+		m_nSizePacketSoFar = 0;
+		m_nState = MCS_PROTO_BYTES;
+	}
+	// fall through
+	case MCS_PROTO_BYTES:
+	{
+		if (ReadableSize() < m_nMessageSize)
+			return false;
+
+		frame.nTag = m_nMessageTag;
+		frame.pData = m_Buffer.data() + m_nReadPos;
+		frame.nSize = m_nMessageSize;
+
+		m_nReadPos += m_nMessageSize;
+		m_nMessageTag = 0;
+		m_nMessageSize = 0;
+		m_nState = MCS_TAG_AND_SIZE;
+		return true;
+	}
+	default:
+		throw std::runtime_error("Unexpected State " + std::to_string(m_nState));
+	}
+}
+
+size_t CMCSFrameDecoder::MinBytesNeeded() const
+{
+	switch (m_nState)
+	{
+	case MCS_VERSION_TAG_AND_SIZE:
+		return kVersionPacketLen + kTagPacketLen + kSizePacketLenMin;
+	case MCS_TAG_AND_SIZE:
+		return kTagPacketLen + kSizePacketLenMin;
+	case MCS_SIZE:
+		return m_nSizePacketSoFar + 1;
+	case MCS_PROTO_BYTES:
+		return m_nMessageSize;
+	default:
+		throw std::runtime_error("Unexpected State " + std::to_string(m_nState));
+	}
+}
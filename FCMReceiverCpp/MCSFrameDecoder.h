@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum ProcessingState
+{
+	MCS_VERSION_TAG_AND_SIZE,
+	MCS_TAG_AND_SIZE,
+	MCS_SIZE,
+	MCS_PROTO_BYTES
+};
+
+constexpr int kVersionPacketLen = 1;
+constexpr int kTagPacketLen = 1;
+constexpr int kSizePacketLenMin = 1;
+constexpr int kSizePacketLenMax = 5;
+constexpr int kMCSVersion = 41;
+
+constexpr size_t kMCSDecoderDefaultCapacity = 32 * 1024;
+constexpr uint32_t kMCSMaxMessageSize = 4 * 1024 * 1024;
+
+/**
+ * A complete MCS frame. pData points into the decoder buffer and stays valid
+ * until the next call to Next(), PrepareWrite() or Feed().
+ */
+typedef struct _MCS_FRAME
+{
+	int nTag;
+	const uint8_t* pData;
+	size_t nSize;
+} MCS_FRAME;
+
+/**
+ * Splits the MCS byte stream into (tag, payload) frames.
+ *
+ * Bytes are appended at a write cursor and consumed at a read cursor over one
+ * reusable slab, so parsing a frame header never shifts the buffer. Unread
+ * bytes are moved to the front only when the free tail is too small for the
+ * next write. The slab is allocated on the first write.
+ */
+class CMCSFrameDecoder
+{
+public:
+	explicit CMCSFrameDecoder(size_t nCapacity = kMCSDecoderDefaultCapacity);
+
+	/**
+	 * Drops any buffered bytes and expects a version byte next, as on a fresh connection.
+	 */
+	void Reset();
+
+	/**
+	 * Frees the buffer if no bytes are pending. The next PrepareWrite() allocates it again.
+	 * Lets idle connections hold no receive memory.
+	 *
+	 * @return True if the buffer was freed, false if bytes are pending.
+	 */
+	bool Release();
+
+	/**
+	 * Returns a writable region of at least nMinSize bytes at the write cursor.
+	 * Call CommitWrite() with the number of bytes actually written.
+	 *
+	 * @param nMinSize The minimum number of bytes the caller wants to write.
+	 * @return Pointer to the writable region. Its size is given by WritableSize().
+	 */
+	uint8_t* PrepareWrite(size_t nMinSize);
+
+	/**
+	 * @return The number of bytes that can be written after the last PrepareWrite().
+	 */
+	size_t WritableSize() const { return m_Buffer.size() - m_nWritePos; }
+
+	/**
+	 * Advances the write cursor after data has been written into the PrepareWrite() region.
+	 *
+	 * @param nSize The number of bytes written.
+	 */
+	void CommitWrite(size_t nSize);
+
+	/**
+	 * Copies bytes into the decoder.
+	 *
+	 * @param pData The bytes to append.
+	 * @param nSize The number of bytes to append.
+	 */
+	void Feed(const uint8_t* pData, size_t nSize);
+
+	/**
+	 * Decodes the next complete frame, if one is buffered.
+	 *
+	 * @param frame [out] The decoded frame.
+	 * @return True if a frame was decoded, false if more bytes are needed.
+	 * @throws std::runtime_error on an unsupported version or an oversized frame.
+	 */
+	bool Next(MCS_FRAME& frame);
+
+	/**
+	 * @return The number of bytes needed before the current state can make progress.
+	 */
+	size_t MinBytesNeeded() const;
+
+	size_t ReadableSize() const { return m_nWritePos - m_nReadPos; }
+	int GetState() const { return m_nState; }
+	int GetVersion() const { return m_nVersion; }
+
+private:
+	std::vector<uint8_t> m_Buffer;
+	size_t m_nCapacity;
+	size_t m_nReadPos;
+	size_t m_nWritePos;
+
+	int m_nState;
+	int m_nVersion;
+	int m_nMessageTag;
+	uint32_t m_nMessageSize;
+	size_t m_nSizePacketSoFar;
+};
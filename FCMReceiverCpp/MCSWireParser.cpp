@@ -0,0 +1,242 @@
+#include "MCSWireParser.h"
+
+namespace
+{
+	enum WireType
+	{
+		WIRETYPE_VARINT = 0,
+		WIRETYPE_FIXED64 = 1,
+		WIRETYPE_LENGTH_DELIMITED = 2,
+		WIRETYPE_START_GROUP = 3,
+		WIRETYPE_END_GROUP = 4,
+		WIRETYPE_FIXED32 = 5
+	};
+
+	enum FieldKind
+	{
+		FIELD_SKIP,
+		FIELD_STRING,
+		FIELD_INT32,
+		FIELD_BOOL,
+		FIELD_APP_DATA
+	};
+
+	struct FieldEntry
+	{
+		FieldKind eKind;
+		std::string_view DATA_MESSAGE_STANZA_VIEW::* pString;
+		int32_t DATA_MESSAGE_STANZA_VIEW::* pInt32;
+		bool DATA_MESSAGE_STANZA_VIEW::* pBool;
+	};
+
+	constexpr uint32_t kFieldFrom = 3;
+	constexpr uint32_t kFieldCategory = 5;
+	constexpr uint32_t kMaxFieldNumber = 24;
+
+	// Indexed by field number, see DataMessageStanza in proto/mcs.proto
+	const FieldEntry kDataMessageStanzaFields[kMaxFieldNumber + 1] =
+	{
+		/*  0 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/*  1 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/*  2 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sId, nullptr, nullptr },
+		/*  3 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sFrom, nullptr, nullptr },
+		/*  4 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/*  5 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sCategory, nullptr, nullptr },
+		/*  6 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sToken, nullptr, nullptr },
+		/*  7 */ { FIELD_APP_DATA, nullptr, nullptr, nullptr },
+		/*  8 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/*  9 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sPersistentId, nullptr, nullptr },
+		/* 10 */ { FIELD_INT32, nullptr, &DATA_MESSAGE_STANZA_VIEW::nStreamId, nullptr },
+		/* 11 */ { FIELD_INT32, nullptr, &DATA_MESSAGE_STANZA_VIEW::nLastStreamIdReceived, nullptr },
+		/* 12 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 13 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 14 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 15 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 16 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 17 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 18 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 19 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 20 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 21 */ { FIELD_STRING, &DATA_MESSAGE_STANZA_VIEW::sRawData, nullptr, nullptr },
+		/* 22 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 23 */ { FIELD_SKIP, nullptr, nullptr, nullptr },
+		/* 24 */ { FIELD_BOOL, nullptr, nullptr, &DATA_MESSAGE_STANZA_VIEW::bImmediateAck },
+	};
+
+	inline uint32_t ExpectedWireType(FieldKind eKind)
+	{
+		return (eKind == FIELD_INT32 || eKind == FIELD_BOOL) ? WIRETYPE_VARINT : WIRETYPE_LENGTH_DELIMITED;
+	}
+
+	inline bool ReadVarint(const uint8_t*& p, const uint8_t* pEnd, uint64_t& nValue)
+	{
+		nValue = 0;
+		for (uint32_t nShift = 0; nShift < 64; nShift += 7)
+		{
+			if (p >= pEnd)
+				return false;
+
+			uint8_t nByte = *p++;
+			nValue |= static_cast<uint64_t>(nByte & 0x7F) << nShift;
+			if (!(nByte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	inline bool ReadLengthDelimited(const uint8_t*& p, const uint8_t* pEnd, std::string_view& sValue)
+	{
+		uint64_t nLength;
+		if (!ReadVarint(p, pEnd, nLength) || nLength > static_cast<uint64_t>(pEnd - p))
+			return false;
+
+		sValue = std::string_view(reinterpret_cast<const char*>(p), static_cast<size_t>(nLength));
+		p += nLength;
+		return true;
+	}
+
+	inline bool SkipField(const uint8_t*& p, const uint8_t* pEnd, uint32_t nWireType)
+	{
+		uint64_t nValue;
+		std::string_view sValue;
+		switch (nWireType)
+		{
+		case WIRETYPE_VARINT:
+			return ReadVarint(p, pEnd, nValue);
+		case WIRETYPE_FIXED64:
+			if (pEnd - p < 8)
+				return false;
+			p += 8;
+			return true;
+		case WIRETYPE_LENGTH_DELIMITED:
+			return ReadLengthDelimited(p, pEnd, sValue);
+		case WIRETYPE_FIXED32:
+			if (pEnd - p < 4)
+				return false;
+			p += 4;
+			return true;
+		default:
+			// Groups are not used by mcs.proto
+			return false;
+		}
+	}
+
+	bool ParseAppData(std::string_view sAppData, DATA_MESSAGE_STANZA_VIEW& stanza)
+	{
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(sAppData.data());
+		const uint8_t* pEnd = p + sAppData.size();
+
+		std::string_view sKey;
+		std::string_view sValue;
+		bool bHasKey = false;
+		bool bHasValue = false;
+
+		while (p < pEnd)
+		{
+			uint64_t nTag;
+			if (!ReadVarint(p, pEnd, nTag))
+				return false;
+
+			uint32_t nFieldNumber = static_cast<uint32_t>(nTag >> 3);
+			uint32_t nWireType = static_cast<uint32_t>(nTag & 0x7);
+
+			if (nFieldNumber == 1 && nWireType == WIRETYPE_LENGTH_DELIMITED)
+			{
+				if (!ReadLengthDelimited(p, pEnd, sKey))
+					return false;
+				bHasKey = true;
+			}
+			else if (nFieldNumber == 2 && nWireType == WIRETYPE_LENGTH_DELIMITED)
+			{
+				if (!ReadLengthDelimited(p, pEnd, sValue))
+					return false;
+				bHasValue = true;
+			}
+			else if (!SkipField(p, pEnd, nWireType))
+			{
+				return false;
+			}
+		}
+
+		// key and value are both required in AppData
+		if (!bHasKey || !bHasValue)
+			return false;
+
+		if (sKey == "encryption")
+			stanza.sEncryption = sValue;
+		else if (sKey == "crypto-key")
+			stanza.sCryptoKey = sValue;
+
+		stanza.nAppDataCount++;
+		return true;
+	}
+}
+
+bool MCSWireParser::ParseDataMessageStanza(const uint8_t* pData, size_t nSize, DATA_MESSAGE_STANZA_VIEW& stanza)
+{
+	stanza = DATA_MESSAGE_STANZA_VIEW();
+
+	const uint8_t* p = pData;
+	const uint8_t* pEnd = pData + nSize;
+	bool bHasFrom = false;
+	bool bHasCategory = false;
+
+	while (p < pEnd)
+	{
+		uint64_t nTag;
+		if (!ReadVarint(p, pEnd, nTag))
+			return false;
+
+		uint32_t nFieldNumber = static_cast<uint32_t>(nTag >> 3);
+		uint32_t nWireType = static_cast<uint32_t>(nTag & 0x7);
+		if (nFieldNumber == 0)
+			return false;
+
+		const FieldEntry& entry = nFieldNumber <= kMaxFieldNumber
+			? kDataMessageStanzaFields[nFieldNumber] : kDataMessageStanzaFields[0];
+
+		FieldKind eKind = entry.eKind;
+		if (eKind != FIELD_SKIP && nWireType != ExpectedWireType(eKind))
+		{
+			// Like the generated parser, a known field with the wrong wire type is treated as unknown
+			eKind = FIELD_SKIP;
+		}
+
+		uint64_t nValue;
+		std::string_view sValue;
+		switch (eKind)
+		{
+		case FIELD_STRING:
+			if (!ReadLengthDelimited(p, pEnd, sValue))
+				return false;
+			stanza.*entry.pString = sValue;
+			break;
+		case FIELD_INT32:
+			if (!ReadVarint(p, pEnd, nValue))
+				return false;
+			stanza.*entry.pInt32 = static_cast<int32_t>(nValue);
+			break;
+		case FIELD_BOOL:
+			if (!ReadVarint(p, pEnd, nValue))
+				return false;
+			stanza.*entry.pBool = nValue != 0;
+			break;
+		case FIELD_APP_DATA:
+			if (!ReadLengthDelimited(p, pEnd, sValue) || !ParseAppData(sValue, stanza))
+				return false;
+			break;
+		default:
+			if (!SkipField(p, pEnd, nWireType))
+				return false;
+			continue;
+		}
+
+		if (nFieldNumber == kFieldFrom)
+			bHasFrom = true;
+		else if (nFieldNumber == kFieldCategory)
+			bHasCategory = true;
+	}
+
+	// from and category are required in DataMessageStanza
+	return bHasFrom && bHasCategory;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * The DataMessageStanza fields the receive path uses. Every string_view points
+ * into the frame the stanza was parsed from and is only valid as long as that frame.
+ */
+typedef struct _DATA_MESSAGE_STANZA_VIEW
+{
+	std::string_view sId;
+	std::string_view sFrom;
+	std::string_view sCategory;
+	std::string_view sToken;
+	std::string_view sPersistentId;
+	std::string_view sRawData;
+
+	int32_t nStreamId;
+	int32_t nLastStreamIdReceived;
+	bool bImmediateAck;
+
+	// app_data values for the "encryption" and "crypto-key" keys
+	std::string_view sEncryption;
+	std::string_view sCryptoKey;
+	size_t nAppDataCount;
+} DATA_MESSAGE_STANZA_VIEW;
+
+namespace MCSWireParser
+{
+	/**
+	 * Decodes a serialized mcs_proto::DataMessageStanza without allocating.
+	 * Fields that the receive path does not use are skipped.
+	 *
+	 * @param pData The serialized stanza.
+	 * @param nSize The size of the serialized stanza.
+	 * @param stanza [out] The decoded fields.
+	 * @return True if the stanza is well formed and has its required fields, false otherwise.
+	 */
+	bool ParseDataMessageStanza(const uint8_t* pData, size_t nSize, DATA_MESSAGE_STANZA_VIEW& stanza);
+}
@@ -0,0 +1,252 @@
+#include "MetricsServer.h"
+
+#include <chrono>
+#include <cstdio>
+
+#ifndef WINDOWS
+#include <csignal>
+#endif
+
+#include "FCMClient.h"
+
+namespace
+{
+	constexpr uint32_t kHistogramFirstBucketBits = 10; // the first "le" is 2^10 ns, about a microsecond
+
+	const char* const kProtoTagNames[kNumProtoTypes] = {
+		"heartbeat_ping",
+		"heartbeat_ack",
+		"login_request",
+		"login_response",
+		"close",
+		"message_stanza",
+		"presence_stanza",
+		"iq_stanza",
+		"data_message_stanza",
+		"batch_presence_stanza",
+		"stream_error_stanza",
+		"http_request",
+		"http_response",
+		"bind_account_request",
+		"bind_account_response",
+		"talk_metadata"
+	};
+
+	std::string FormatDouble(double dValue)
+	{
+		char szValue[32];
+		std::snprintf(szValue, sizeof(szValue), "%.12g", dValue);
+		return szValue;
+	}
+
+	std::string JoinLabels(const std::string& sLabels, const std::string& sLabel)
+	{
+		return sLabels.empty() ? sLabel : sLabels + "," + sLabel;
+	}
+}
+
+void CPrometheusText::Family(const std::string& sName, const std::string& sType, const std::string& sHelp)
+{
+	m_sText += "# HELP " + sName + " " + sHelp + "\n";
+	m_sText += "# TYPE " + sName + " " + sType + "\n";
+}
+
+void CPrometheusText::Sample(const std::string& sName, const std::string& sLabels, double dValue)
+{
+	AppendName(sName, sLabels);
+	m_sText += FormatDouble(dValue) + "\n";
+}
+
+void CPrometheusText::Sample(const std::string& sName, const std::string& sLabels, uint64_t nValue)
+{
+	AppendName(sName, sLabels);
+	m_sText += std::to_string(nValue) + "\n";
+}
+
+void CPrometheusText::Histogram(const std::string& sName, const std::string& sLabels, const LATENCY_SNAPSHOT& snapshot)
+{
+	// One cumulative bucket per power of two, the last one also holds the clamped samples
+	uint64_t nCumulative = 0;
+	uint32_t nIndex = 0;
+	for (uint32_t nBits = kHistogramFirstBucketBits; nBits <= kLatencyHistogramMaxBits; ++nBits)
+	{
+		uint32_t nEnd = (nBits == kLatencyHistogramMaxBits) ? kLatencyHistogramBuckets : CLatencyHistogram::BucketIndex(uint64_t(1) << nBits);
+		for (; nIndex < nEnd; ++nIndex)
+			nCumulative += snapshot.counts[nIndex];
+
+		Sample(sName + "_bucket", JoinLabels(sLabels, "le=\"" + FormatDouble(static_cast<double>(uint64_t(1) << nBits) / 1e9) + "\""), nCumulative);
+	}
+
+	Sample(sName + "_bucket", JoinLabels(sLabels, "le=\"+Inf\""), snapshot.nCount);
+	Sample(sName + "_sum", sLabels, static_cast<double>(snapshot.nSumNs) / 1e9);
+	Sample(sName + "_count", sLabels, snapshot.nCount);
+}
+
+void CPrometheusText::AppendName(const std::string& sName, const std::string& sLabels)
+{
+	m_sText += sName;
+	if (!sLabels.empty())
+		m_sText += "{" + sLabels + "}";
+	m_sText += " ";
+}
+
+CMetricsServer::CMetricsServer(const ASocket::LogFnCallback oLogger, const std::string& sPort, CollectFn oCollect,
+	const std::string& sAddress) :
+	m_oLogger(oLogger),
+	m_sPort(sPort),
+	m_sAddress(sAddress),
+	m_oCollect(oCollect),
+	m_bRunning(false)
+{
+}
+
+CMetricsServer::~CMetricsServer()
+{
+	Stop();
+}
+
+void CMetricsServer::Start()
+{
+	if (m_bRunning)
+		return;
+
+#ifndef WINDOWS
+	// A scraper that goes away mid-response must not take the process down with it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	m_bRunning = true;
+	m_ServeThread = std::thread([this]() { ServeLoop(); });
+}
+
+void CMetricsServer::Stop()
+{
+	if (!m_bRunning.exchange(false))
+		return;
+
+	m_ServeThread.join();
+	m_TCPServer.reset();
+}
+
+void CMetricsServer::ServeLoop()
+{
+	try
+	{
+		m_TCPServer = std::make_unique<CTCPServer>(m_oLogger, m_sPort, ASocket::ALL_FLAGS, m_sAddress);
+	}
+	catch (const std::exception& e)
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CMetricsServer][ERROR] Cannot listen on ", m_sAddress.empty() ? "*" : m_sAddress, ":", m_sPort, ": ", e.what());
+		return;
+	}
+
+	FCM_LOG_INFO(m_oLogger, "[CMetricsServer][INFO] Serving metrics on ", m_sAddress.empty() ? "*" : m_sAddress, ":", m_sPort);
+
+	while (m_bRunning)
+	{
+		ASocket::Socket clientSocket = INVALID_SOCKET;
+		auto start = std::chrono::steady_clock::now();
+		if (!m_TCPServer->Listen(clientSocket, kMetricsAcceptPollMs))
+		{
+			// Failed without waiting, the port cannot be bound, do not spin
+			if (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(kMetricsAcceptPollMs / 5))
+				std::this_thread::sleep_for(std::chrono::milliseconds(kMetricsAcceptPollMs));
+			continue;
+		}
+
+		ServeRequest(clientSocket);
+		m_TCPServer->Disconnect(clientSocket);
+	}
+}
+
+void CMetricsServer::ServeRequest(ASocket::Socket clientSocket)
+{
+	m_TCPServer->SetRcvTimeout(clientSocket, kMetricsRequestTimeoutMs);
+	m_TCPServer->SetSndTimeout(clientSocket, kMetricsRequestTimeoutMs);
+
+	// Only the request line matters, the headers are read so the client sees its request consumed
+	std::string sRequest;
+	char szChunk[1024];
+	while (sRequest.find("\r\n\r\n") == std::string::npos)
+	{
+		if (sRequest.size() >= kMetricsMaxRequestSize)
+			return;
+
+		int nReceived = m_TCPServer->Receive(clientSocket, szChunk, sizeof(szChunk), false);
+		if (nReceived <= 0)
+			return;
+		sRequest.append(szChunk, nReceived);
+	}
+
+	std::string sRequestLine = sRequest.substr(0, sRequest.find("\r\n"));
+	size_t nMethodEnd = sRequestLine.find(' ');
+	size_t nPathEnd = nMethodEnd == std::string::npos ? std::string::npos : sRequestLine.find(' ', nMethodEnd + 1);
+	std::string sMethod = sRequestLine.substr(0, nMethodEnd);
+	std::string sPath = nPathEnd == std::string::npos ? "" : sRequestLine.substr(nMethodEnd + 1, nPathEnd - nMethodEnd - 1);
+	sPath = sPath.substr(0, sPath.find('?'));
+
+	std::string sStatus = "200 OK";
+	std::string sContentType = "text/plain; version=0.0.4; charset=utf-8";
+	std::string sBody;
+	if (sMethod != "GET")
+	{
+		sStatus = "405 Method Not Allowed";
+		sContentType = "text/plain";
+	}
+	else if (sPath != "/metrics" && sPath != "/")
+	{
+		sStatus = "404 Not Found";
+		sContentType = "text/plain";
+	}
+	else
+	{
+		CPrometheusText text;
+		try
+		{
+			m_oCollect(text);
+		}
+		catch (const std::exception& e)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CMetricsServer][ERROR] Collecting the metrics failed: ", e.what());
+			sStatus = "500 Internal Server Error";
+		}
+		sBody = text.Text();
+	}
+
+	std::string sResponse = "HTTP/1.1 " + sStatus + "\r\n" +
+		"Content-Type: " + sContentType + "\r\n" +
+		"Content-Length: " + std::to_string(sBody.size()) + "\r\n" +
+		"Connection: close\r\n\r\n" + sBody;
+	m_TCPServer->Send(clientSocket, sResponse);
+}
+
+void CMetricsServer::CollectClientMetrics(CPrometheusText& text)
+{
+	MCS_CLIENT_COUNTERS& counters = CFCMClient::GetCounters();
+
+	text.Family("fcm_frames_received_total", "counter", "MCS frames received, by tag.");
+	for (int nTag = 0; nTag < kNumProtoTypes; ++nTag)
+		text.Sample("fcm_frames_received_total", std::string("tag=\"") + kProtoTagNames[nTag] + "\"", counters.frames[nTag].load(std::memory_order_relaxed));
+	text.Sample("fcm_frames_received_total", "tag=\"unknown\"", counters.nUnknownFrames.load(std::memory_order_relaxed));
+
+	text.Family("fcm_bytes_read_total", "counter", "Bytes read from the MCS connections, after TLS.");
+	text.Sample("fcm_bytes_read_total", "", counters.nBytesRead.load(std::memory_order_relaxed));
+
+	text.Family("fcm_decrypt_failures_total", "counter", "Messages that could not be decrypted, by ECE error code.");
+	for (size_t nIndex = 0; nIndex < kMCSDecryptErrorCodes; ++nIndex)
+	{
+		uint64_t nFailures = counters.decryptFailures[nIndex].load(std::memory_order_relaxed);
+		if (nFailures > 0)
+			text.Sample("fcm_decrypt_failures_total", "code=\"" + std::to_string(-static_cast<int>(nIndex)) + "\"", nFailures);
+	}
+
+	MCS_LATENCY_HISTOGRAMS& histograms = CFCMClient::GetLatencyHistograms();
+	text.Family("fcm_stage_latency_seconds", "histogram", "Time spent in each receive stage.");
+	text.Histogram("fcm_stage_latency_seconds", "stage=\"frame_assembly\"", histograms.frameAssembly.Snapshot());
+	text.Histogram("fcm_stage_latency_seconds", "stage=\"parse\"", histograms.parse.Snapshot());
+	text.Histogram("fcm_stage_latency_seconds", "stage=\"decrypt\"", histograms.decrypt.Snapshot());
+	text.Histogram("fcm_stage_latency_seconds", "stage=\"emit\"", histograms.emit.Snapshot());
+
+	text.Family("fcm_heartbeat_rtt_seconds", "histogram", "Time from a heartbeat ping to its ack.");
+	text.Histogram("fcm_heartbeat_rtt_seconds", "", histograms.heartbeatRtt.Snapshot());
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "LatencyHistogram.h"
+#include "LogUtil.h"
+#include "SecureSocket/TCPServer.h"
+
+constexpr const char* kMetricsDefaultAddress = "127.0.0.1"; // the metrics reveal traffic, only local scrapers by default
+constexpr uint32_t kMetricsAcceptPollMs = 500;
+constexpr uint32_t kMetricsRequestTimeoutMs = 2000; // for reading the request and writing the response
+constexpr size_t kMetricsMaxRequestSize = 8 * 1024;
+
+/**
+ * Builds a Prometheus text exposition (format 0.0.4).
+ *
+ * Every metric family starts with Family(), its samples follow. Latencies are
+ * written in seconds, the Prometheus base unit.
+ */
+class CPrometheusText
+{
+public:
+	/**
+	 * Writes the HELP and TYPE lines of a family.
+	 *
+	 * @param sName The metric name.
+	 * @param sType counter, gauge or histogram.
+	 * @param sHelp The description.
+	 */
+	void Family(const std::string& sName, const std::string& sType, const std::string& sHelp);
+
+	/**
+	 * @param sName The metric name.
+	 * @param sLabels The labels without braces, 'stage="parse"', or empty.
+	 * @param dValue The value.
+	 */
+	void Sample(const std::string& sName, const std::string& sLabels, double dValue);
+	void Sample(const std::string& sName, const std::string& sLabels, uint64_t nValue);
+
+	/**
+	 * Writes the buckets, sum and count of a histogram family. The buckets are the
+	 * histogram's powers of two from one microsecond up.
+	 *
+	 * @param sName The metric name, without the _bucket, _sum and _count suffixes.
+	 * @param sLabels Labels added to every sample, or empty.
+	 * @param snapshot The merged histogram.
+	 */
+	void Histogram(const std::string& sName, const std::string& sLabels, const LATENCY_SNAPSHOT& snapshot);
+
+	const std::string& Text() const { return m_sText; }
+
+private:
+	void AppendName(const std::string& sName, const std::string& sLabels);
+
+private:
+	std::string m_sText;
+};
+
+/**
+ * Serves the process metrics over HTTP for Prometheus to scrape, on its own thread.
+ *
+ * Requests are answered one at a time with whatever the collect callback writes. The
+ * callback runs on the server thread and must only read counters that are safe to
+ * read from any thread, so a scrape never waits on a receive loop and a slow or
+ * stalled scraper only holds up other scrapes.
+ */
+class CMetricsServer
+{
+public:
+	typedef std::function<void(CPrometheusText&)> CollectFn;
+
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param sPort The port to listen on.
+	 * @param oCollect Writes the metrics, called once per scrape on the server thread.
+	 * @param sAddress The address to listen on, empty for every interface.
+	 */
+	CMetricsServer(const ASocket::LogFnCallback oLogger, const std::string& sPort, CollectFn oCollect,
+		const std::string& sAddress = kMetricsDefaultAddress);
+	~CMetricsServer();
+
+	CMetricsServer(const CMetricsServer&) = delete;
+	CMetricsServer& operator=(const CMetricsServer&) = delete;
+
+	/**
+	 * Starts the server thread. The port is bound there, a failure is logged.
+	 */
+	void Start();
+
+	/**
+	 * Stops serving and joins the server thread.
+	 */
+	void Stop();
+
+	/**
+	 * Writes the counters and stage latencies every CFCMClient in the process shares.
+	 *
+	 * @param text The exposition to append to.
+	 */
+	static void CollectClientMetrics(CPrometheusText& text);
+
+private:
+	void ServeLoop();
+	void ServeRequest(ASocket::Socket clientSocket);
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+	const std::string m_sPort;
+	const std::string m_sAddress;
+	const CollectFn m_oCollect;
+
+	std::unique_ptr<CTCPServer> m_TCPServer;
+	std::thread m_ServeThread;
+	std::atomic<bool> m_bRunning;
+};
@@ -0,0 +1,663 @@
+#include "MockMCSServer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#ifndef WINDOWS
+#include <csignal>
+#endif
+
+#include "Base64.h"
+#include "StringUtil.h"
+#include "UtilFunction.h"
+#include "Http_ece/ece.h"
+
+CMockMCSServer::CMockMCSServer(const LogFnCallback oLogger, const MOCK_MCS_CONFIG& config) :
+	m_oLogger(oLogger),
+	m_Config(config),
+	m_nPushIntervalMs(config.dRatePerSecond > 0
+		? (std::max)(1u, static_cast<uint32_t>(std::lround((std::max)(config.nBurst, size_t(1)) * 1000.0 / config.dRatePerSecond)))
+		: 0),
+	m_nNextWorker(0),
+	m_bRunning(false),
+	m_nAccepted(0),
+	m_nActive(0),
+	m_nLoggedIn(0),
+	m_nLoginRejected(0),
+	m_nHeartbeats(0),
+	m_nMessagesSent(0),
+	m_nBytesSent(0),
+	m_nAckedIds(0),
+	m_nBurstsSkipped(0),
+	m_nPingsSent(0),
+	m_nPingAcks(0),
+	m_nIqsSent(0),
+	m_nSelectiveAcks(0),
+	m_nMaxIdsPerAck(0),
+	m_nStreamAcks(0)
+{
+}
+
+CMockMCSServer::~CMockMCSServer()
+{
+	Stop();
+}
+
+void CMockMCSServer::AddIdentity(const std::string& sAndroidId, const std::string& sSecurityToken,
+	const std::string& sBase64PrivateKey, const std::string& sBase64AuthSecret)
+{
+	if (m_bRunning)
+		throw std::runtime_error("Identities must be added before Start()");
+
+	std::string sPrivateKey = base64_decode(sBase64PrivateKey, true);
+	std::string sAuthSecret = base64_decode(sBase64AuthSecret, true);
+	if (sPrivateKey.size() != ECE_WEBPUSH_PRIVATE_KEY_LENGTH || sAuthSecret.size() != ECE_WEBPUSH_AUTH_SECRET_LENGTH)
+		throw std::runtime_error("Invalid private key or auth secret for " + sAndroidId);
+
+	IDENTITY identity;
+	identity.sSecurityToken = sSecurityToken;
+	std::memcpy(identity.authSecret, sAuthSecret.data(), ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+
+	if (ece_webpush_derive_public_key(reinterpret_cast<const uint8_t*>(sPrivateKey.data()), sPrivateKey.size(),
+		identity.rawPublicKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH) != ECE_OK)
+		throw std::runtime_error("Invalid private key for " + sAndroidId);
+
+	m_Identities[sAndroidId] = identity;
+}
+
+void CMockMCSServer::Start()
+{
+	if (m_bRunning)
+		return;
+
+#ifndef WINDOWS
+	// A client that resets its connection must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	m_SSLServer = std::make_unique<CTCPSSLServer>(m_oLogger, m_Config.sPort);
+	m_SSLServer->SetSSLCertFile(m_Config.sCertFile);
+	m_SSLServer->SetSSLKeyFile(m_Config.sKeyFile);
+
+	size_t nThreadCount = m_Config.nThreadCount;
+	if (nThreadCount == 0)
+		nThreadCount = std::thread::hardware_concurrency();
+	if (nThreadCount == 0)
+		nThreadCount = 1;
+
+	m_bRunning = true;
+	FCM_LOG_INFO(m_oLogger, "[CMockMCSServer][INFO] Listening on port ", m_Config.sPort, " with ", m_Identities.size(),
+		" identities on ", nThreadCount, " threads, pushing ", m_Config.dRatePerSecond, " messages per second in bursts of ",
+		m_Config.nBurst, ", payloads ", m_Config.nMinPayload, "-", m_Config.nMaxPayload, " bytes");
+
+	std::random_device randomDevice;
+	for (size_t nWorker = 0; nWorker < nThreadCount; ++nWorker)
+	{
+		m_Workers.push_back(std::make_unique<WORKER>());
+		WORKER* pWorker = m_Workers.back().get();
+		pWorker->loop = std::make_unique<CEventLoop>(m_oLogger);
+		pWorker->random.seed(randomDevice());
+		pWorker->thread = std::thread([this, pWorker, nWorker]() {
+			try
+			{
+				pWorker->loop->Run();
+			}
+			catch (const std::exception& e)
+			{
+				FCM_LOG_FATAL(m_oLogger, "[CMockMCSServer][FATAL] Event loop ", nWorker, " stopped: ", e.what());
+			}
+		});
+	}
+
+	m_AcceptThread = std::thread([this]() { AcceptLoop(); });
+}
+
+void CMockMCSServer::Stop()
+{
+	if (!m_bRunning.exchange(false))
+		return;
+
+	m_AcceptThread.join();
+
+	// Runs after the connections the accept thread has already posted
+	for (std::unique_ptr<WORKER>& worker : m_Workers)
+	{
+		WORKER* pWorker = worker.get();
+		pWorker->loop->Post([this, pWorker]() {
+			while (!pWorker->connections.empty())
+				CloseConnection(*pWorker->connections.begin()->second, "Server stopped");
+			pWorker->loop->Stop();
+		});
+	}
+
+	for (std::unique_ptr<WORKER>& worker : m_Workers)
+		worker->thread.join();
+
+	m_Workers.clear();
+	m_SSLServer.reset();
+}
+
+MOCK_MCS_METRICS CMockMCSServer::GetMetrics() const
+{
+	MOCK_MCS_METRICS metrics;
+	metrics.nAccepted = m_nAccepted;
+	metrics.nActive = m_nActive;
+	metrics.nLoggedIn = m_nLoggedIn;
+	metrics.nLoginRejected = m_nLoginRejected;
+	metrics.nHeartbeats = m_nHeartbeats;
+	metrics.nMessagesSent = m_nMessagesSent;
+	metrics.nBytesSent = m_nBytesSent;
+	metrics.nAckedIds = m_nAckedIds;
+	metrics.nBurstsSkipped = m_nBurstsSkipped;
+	metrics.nPingsSent = m_nPingsSent;
+	metrics.nPingAcks = m_nPingAcks;
+	metrics.nIqsSent = m_nIqsSent;
+	metrics.nSelectiveAcks = m_nSelectiveAcks;
+	metrics.nMaxIdsPerAck = m_nMaxIdsPerAck;
+	metrics.nStreamAcks = m_nStreamAcks;
+	return metrics;
+}
+
+void CMockMCSServer::AcceptLoop()
+{
+	while (m_bRunning)
+	{
+		// Only the TCP accept is done here, the loops run the TLS handshakes
+		std::unique_ptr<CONNECTION> connection = std::make_unique<CONNECTION>();
+		auto start = std::chrono::steady_clock::now();
+		if (!m_SSLServer->BeginAccept(connection->socket, kMockMCSAcceptPollMs))
+		{
+			if (connection->socket.m_SockFd != INVALID_SOCKET)
+				m_SSLServer->Disconnect(connection->socket);
+
+			// Failed without waiting, the port cannot be bound, do not spin
+			if (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(kMockMCSAcceptPollMs / 5))
+				std::this_thread::sleep_for(std::chrono::milliseconds(kMockMCSAcceptPollMs / 5));
+			continue;
+		}
+
+		WORKER* pWorker = m_Workers[m_nNextWorker++ % m_Workers.size()].get();
+		connection->pWorker = pWorker;
+
+		// Owned by the loop from here on
+		CONNECTION* pConnection = connection.release();
+		pWorker->loop->Post([this, pConnection]() {
+			AddConnection(*pConnection->pWorker, std::unique_ptr<CONNECTION>(pConnection));
+		});
+	}
+}
+
+void CMockMCSServer::AddConnection(WORKER& worker, std::unique_ptr<CONNECTION> connection)
+{
+	ASocket::Socket sd = connection->socket.m_SockFd;
+	CONNECTION* pConnection = connection.get();
+	// The client speaks first, with its ClientHello
+	if (!worker.loop->AddSocket(sd, EVENT_READ, [this, pConnection](uint32_t nEvents) { OnSocketEvent(*pConnection, nEvents); }))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CMockMCSServer][ERROR] Cannot add a client socket to the event loop");
+		m_SSLServer->Disconnect(connection->socket);
+		return;
+	}
+
+	pConnection->nHandshakeTimer = worker.loop->AddTimer(kMockMCSHandshakeTimeoutMs, [this, pConnection]() {
+		pConnection->nHandshakeTimer = kInvalidTimerId;
+		CloseConnection(*pConnection, "TLS handshake timed out");
+	});
+
+	worker.connections[sd] = std::move(connection);
+	m_nActive++;
+}
+
+void CMockMCSServer::CloseConnection(CONNECTION& connection, const std::string& sReason)
+{
+	WORKER& worker = *connection.pWorker;
+	if (connection.nPushTimer != kInvalidTimerId)
+		worker.loop->CancelTimer(connection.nPushTimer);
+	if (connection.nPingTimer != kInvalidTimerId)
+		worker.loop->CancelTimer(connection.nPingTimer);
+	if (connection.nIqTimer != kInvalidTimerId)
+		worker.loop->CancelTimer(connection.nIqTimer);
+	if (connection.nHandshakeTimer != kInvalidTimerId)
+		worker.loop->CancelTimer(connection.nHandshakeTimer);
+
+	ASocket::Socket sd = connection.socket.m_SockFd;
+	worker.loop->RemoveSocket(sd);
+	m_SSLServer->Disconnect(connection.socket);
+
+	FCM_LOG_INFO(m_oLogger, "[CMockMCSServer][INFO] Closed client ", connection.sAndroidId, ": ", sReason);
+	m_nActive--;
+	worker.connections.erase(sd);
+}
+
+void CMockMCSServer::OnSocketEvent(CONNECTION& connection, uint32_t nEvents)
+{
+	if (connection.bHandshaking)
+	{
+		ContinueHandshake(connection);
+		return;
+	}
+
+	if ((nEvents & (EVENT_READ | EVENT_ERROR)) || (connection.bReadWantsWrite && (nEvents & EVENT_WRITE)))
+	{
+		if (!ReadAvailable(connection))
+			return;
+	}
+
+	if (!FlushOutput(connection))
+		CloseConnection(connection, "Send failed");
+}
+
+void CMockMCSServer::ContinueHandshake(CONNECTION& connection)
+{
+	int iSSLError = 0;
+	int nResult = m_SSLServer->DoHandshake(connection.socket, iSSLError);
+	if (nResult < 0)
+	{
+		CloseConnection(connection, "TLS handshake failed");
+		return;
+	}
+
+	if (nResult == 0)
+	{
+		connection.pWorker->loop->ModifySocket(connection.socket.m_SockFd, iSSLError == SSL_ERROR_WANT_WRITE ? EVENT_WRITE : EVENT_READ);
+		return;
+	}
+
+	connection.bHandshaking = false;
+	connection.pWorker->loop->CancelTimer(connection.nHandshakeTimer);
+	connection.nHandshakeTimer = kInvalidTimerId;
+	m_nAccepted++;
+
+	// The login request may have come with the end of the handshake
+	if (ReadAvailable(connection) && !FlushOutput(connection))
+		CloseConnection(connection, "Send failed");
+}
+
+bool CMockMCSServer::ReadAvailable(CONNECTION& connection)
+{
+	connection.bReadWantsWrite = false;
+	while (true)
+	{
+		uint8_t* pWritable = connection.decoder.PrepareWrite(kMCSReceiveChunkSize);
+
+		int iSSLError = 0;
+		int nBytesRead = m_SSLServer->Read(connection.socket, reinterpret_cast<char*>(pWritable),
+			connection.decoder.WritableSize(), iSSLError);
+		if (nBytesRead > 0)
+		{
+			connection.decoder.CommitWrite(nBytesRead);
+
+			MCS_FRAME frame;
+			try
+			{
+				while (connection.decoder.Next(frame))
+				{
+					if (!HandleFrame(connection, frame))
+						return false;
+				}
+			}
+			catch (const std::runtime_error& e)
+			{
+				CloseConnection(connection, e.what());
+				return false;
+			}
+			continue;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_READ)
+		{
+			// Clients talk little, idle ones hold no receive buffer
+			connection.decoder.Release();
+			return true;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_WRITE)
+		{
+			connection.bReadWantsWrite = true;
+			UpdateSocketEvents(connection);
+			return true;
+		}
+
+		CloseConnection(connection, "Connection closed or receive failed");
+		return false;
+	}
+}
+
+bool CMockMCSServer::FlushOutput(CONNECTION& connection)
+{
+	while (connection.nOutBufferPos < connection.outBuffer.size())
+	{
+		int iSSLError = 0;
+		int nBytesSent = m_SSLServer->Write(connection.socket,
+			reinterpret_cast<const char*>(connection.outBuffer.data() + connection.nOutBufferPos),
+			connection.outBuffer.size() - connection.nOutBufferPos, iSSLError);
+
+		if (nBytesSent > 0)
+		{
+			connection.nOutBufferPos += nBytesSent;
+			m_nBytesSent += nBytesSent;
+			continue;
+		}
+
+		if (iSSLError == SSL_ERROR_WANT_WRITE || iSSLError == SSL_ERROR_WANT_READ)
+		{
+			UpdateSocketEvents(connection);
+			return true;
+		}
+
+		return false;
+	}
+
+	connection.outBuffer.clear();
+	connection.nOutBufferPos = 0;
+	UpdateSocketEvents(connection);
+	return true;
+}
+
+void CMockMCSServer::UpdateSocketEvents(CONNECTION& connection)
+{
+	uint32_t nEvents = EVENT_READ;
+	if (connection.nOutBufferPos < connection.outBuffer.size() || connection.bReadWantsWrite)
+		nEvents |= EVENT_WRITE;
+
+	connection.pWorker->loop->ModifySocket(connection.socket.m_SockFd, nEvents);
+}
+
+void CMockMCSServer::SendProto(CONNECTION& connection, MCSProtoTag eTag, const google::protobuf::MessageLite& cMessage, bool bVersion)
+{
+	std::string& sSerialized = connection.pWorker->sSerialized;
+	cMessage.SerializeToString(&sSerialized);
+
+	std::vector<uint8_t>& buf = connection.outBuffer;
+	if (bVersion)
+		buf.push_back(kMCSVersion);
+	buf.push_back(static_cast<uint8_t>(eTag));
+	UtilFunction::_EncodeVarint32(static_cast<uint32_t>(sSerialized.size()), buf);
+	buf.insert(buf.end(), sSerialized.begin(), sSerialized.end());
+
+	connection.nStreamIdOut++;
+}
+
+bool CMockMCSServer::HandleFrame(CONNECTION& connection, const MCS_FRAME& frame)
+{
+	connection.nStreamIdIn++;
+
+	if (connection.pIdentity == nullptr && frame.nTag != kLoginRequestTag)
+	{
+		CloseConnection(connection, "Expected a login request, got tag " + std::to_string(frame.nTag));
+		return false;
+	}
+
+	switch (frame.nTag)
+	{
+	case MCSProtoTag::kLoginRequestTag:
+		return HandleLoginRequest(connection, frame);
+	case MCSProtoTag::kHeartbeatPingTag:
+		HandleHeartbeatPing(connection, frame);
+		break;
+	case MCSProtoTag::kHeartbeatAckTag:
+		m_nPingAcks++;
+		break;
+	case MCSProtoTag::kIqStanzaTag:
+		HandleIqStanza(connection, frame);
+		break;
+	case MCSProtoTag::kCloseTag:
+		CloseConnection(connection, "Closed by client");
+		return false;
+	default:
+		break;
+	}
+
+	return true;
+}
+
+bool CMockMCSServer::HandleLoginRequest(CONNECTION& connection, const MCS_FRAME& frame)
+{
+	if (connection.pIdentity != nullptr)
+	{
+		CloseConnection(connection, "Logged in twice");
+		return false;
+	}
+
+	mcs_proto::LoginRequest cLoginRequest;
+	if (!cLoginRequest.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)))
+	{
+		CloseConnection(connection, "Cannot parse LoginRequest");
+		return false;
+	}
+
+	auto it = m_Identities.find(cLoginRequest.user());
+	if (it == m_Identities.end() || it->second.sSecurityToken != cLoginRequest.auth_token())
+	{
+		m_nLoginRejected++;
+		connection.sAndroidId = cLoginRequest.user();
+		CloseConnection(connection, "Login rejected");
+		return false;
+	}
+
+	connection.pIdentity = &it->second;
+	connection.sAndroidId = it->first;
+
+	// The ids a client resends with its login are the ones it never got a confirmation for
+	m_nAckedIds += cLoginRequest.received_persistent_id_size();
+
+	if (m_nPushIntervalMs > 0 && !EncryptPayloads(connection))
+	{
+		CloseConnection(connection, "Cannot encrypt payloads");
+		return false;
+	}
+
+	mcs_proto::LoginResponse cLoginResponse;
+	cLoginResponse.set_id("mock");
+	cLoginResponse.set_stream_id(connection.nStreamIdOut + 1);
+	cLoginResponse.set_last_stream_id_received(connection.nStreamIdIn);
+	cLoginResponse.set_server_timestamp(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+	SendProto(connection, kLoginResponseTag, cLoginResponse, true);
+
+	m_nLoggedIn++;
+	FCM_LOG_INFO(m_oLogger, "[CMockMCSServer][INFO] Client ", connection.sAndroidId, " logged in");
+
+	if (m_nPushIntervalMs > 0)
+	{
+		// Spread the clients over the interval so their bursts do not line up
+		SchedulePush(connection, std::uniform_int_distribution<uint32_t>(0, m_nPushIntervalMs)(connection.pWorker->random));
+	}
+	if (m_Config.nPingIntervalMs > 0)
+		SchedulePing(connection);
+	if (m_Config.nIqIntervalMs > 0)
+		ScheduleIq(connection);
+	return true;
+}
+
+void CMockMCSServer::HandleHeartbeatPing(CONNECTION& connection, const MCS_FRAME& frame)
+{
+	mcs_proto::HeartbeatPing cHeartbeatPing;
+	cHeartbeatPing.ParseFromArray(frame.pData, static_cast<int>(frame.nSize));
+
+	mcs_proto::HeartbeatAck cHeartbeatAck;
+	cHeartbeatAck.set_stream_id(connection.nStreamIdOut + 1);
+	cHeartbeatAck.set_last_stream_id_received(connection.nStreamIdIn);
+	cHeartbeatAck.set_status(cHeartbeatPing.status());
+	SendProto(connection, kHeartbeatAckTag, cHeartbeatAck);
+
+	m_nHeartbeats++;
+}
+
+void CMockMCSServer::HandleIqStanza(CONNECTION& connection, const MCS_FRAME& frame)
+{
+	mcs_proto::IqStanza cIqStanza;
+	if (!cIqStanza.ParseFromArray(frame.pData, static_cast<int>(frame.nSize)) || !cIqStanza.has_extension())
+		return;
+
+	// A stream ack only reports last_stream_id_received, it gets no answer
+	if (cIqStanza.extension().id() == kMCSStreamAckExtension)
+		m_nStreamAcks++;
+	if (cIqStanza.extension().id() != kMCSSelectiveAckExtension)
+		return;
+
+	mcs_proto::SelectiveAck cSelectiveAck;
+	if (cSelectiveAck.ParseFromString(cIqStanza.extension().data()))
+	{
+		uint64_t nIds = static_cast<uint64_t>(cSelectiveAck.id_size());
+		m_nAckedIds += nIds;
+		m_nSelectiveAcks++;
+
+		uint64_t nMaxIds = m_nMaxIdsPerAck;
+		while (nIds > nMaxIds && !m_nMaxIdsPerAck.compare_exchange_weak(nMaxIds, nIds))
+		{
+		}
+	}
+
+	// The result carries the stream id the client waits for before it forgets the acked ids
+	mcs_proto::IqStanza cResult;
+	cResult.set_type(mcs_proto::IqStanza_IqType_RESULT);
+	cResult.set_id(cIqStanza.id());
+	cResult.set_stream_id(connection.nStreamIdOut + 1);
+	cResult.set_last_stream_id_received(connection.nStreamIdIn);
+	SendProto(connection, kIqStanzaTag, cResult);
+}
+
+bool CMockMCSServer::EncryptPayloads(CONNECTION& connection)
+{
+	const IDENTITY& identity = *connection.pIdentity;
+	size_t nMinPayload = (std::min)(m_Config.nMinPayload, m_Config.nMaxPayload);
+	std::uniform_int_distribution<size_t> sizeDistribution(nMinPayload, m_Config.nMaxPayload);
+
+	connection.payloads.resize(kMockMCSPayloadVariants);
+	for (mcs_proto::DataMessageStanza& cStanza : connection.payloads)
+	{
+		std::string sPlaintext(sizeDistribution(connection.pWorker->random), ' ');
+		for (size_t i = 0; i < sPlaintext.size(); ++i)
+			sPlaintext[i] = static_cast<char>('a' + i % 26);
+
+		uint8_t salt[ECE_SALT_LENGTH];
+		uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		std::string sCiphertext(ece_aesgcm_ciphertext_max_length(RS_LENGTH, 0, sPlaintext.size()), '\0');
+		size_t nCiphertextLen = sCiphertext.size();
+
+		int nErrorCode = ece_webpush_aesgcm_encrypt(identity.rawPublicKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+			identity.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, RS_LENGTH, 0,
+			reinterpret_cast<const uint8_t*>(sPlaintext.data()), sPlaintext.size(),
+			salt, ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+			reinterpret_cast<uint8_t*>(&sCiphertext[0]), &nCiphertextLen);
+		if (nErrorCode != ECE_OK)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CMockMCSServer][ERROR] EncryptPayloads: Encrypt failed with error code ", nErrorCode);
+			return false;
+		}
+		sCiphertext.resize(nCiphertextLen);
+
+		// FCM sends these values unpadded, Http_ece's parser rejects padding outside quotes
+		std::string sSalt = base64_encode(salt, ECE_SALT_LENGTH, true);
+		std::string sSenderPubKey = base64_encode(rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, true);
+		StringUtil::replace_all(sSalt, "=", "");
+		StringUtil::replace_all(sSenderPubKey, "=", "");
+
+		cStanza.set_from("mock");
+		cStanza.set_category("org.chromium.linux");
+		mcs_proto::AppData* pAppData = cStanza.add_app_data();
+		pAppData->set_key("crypto-key");
+		pAppData->set_value("dh=" + sSenderPubKey);
+		pAppData = cStanza.add_app_data();
+		pAppData->set_key("encryption");
+		pAppData->set_value("salt=" + sSalt);
+		cStanza.set_raw_data(std::move(sCiphertext));
+	}
+
+	return true;
+}
+
+void CMockMCSServer::SchedulePush(CONNECTION& connection, uint32_t nDelayMs)
+{
+	CONNECTION* pConnection = &connection;
+	connection.nPushTimer = connection.pWorker->loop->AddTimer(nDelayMs, [this, pConnection]() {
+		pConnection->nPushTimer = kInvalidTimerId;
+		PushBurst(*pConnection);
+	});
+}
+
+void CMockMCSServer::SchedulePing(CONNECTION& connection)
+{
+	CONNECTION* pConnection = &connection;
+	connection.nPingTimer = connection.pWorker->loop->AddTimer(m_Config.nPingIntervalMs, [this, pConnection]() {
+		pConnection->nPingTimer = kInvalidTimerId;
+
+		mcs_proto::HeartbeatPing cHeartbeatPing;
+		cHeartbeatPing.set_stream_id(pConnection->nStreamIdOut + 1);
+		cHeartbeatPing.set_last_stream_id_received(pConnection->nStreamIdIn);
+		SendProto(*pConnection, kHeartbeatPingTag, cHeartbeatPing);
+		m_nPingsSent++;
+
+		if (!FlushOutput(*pConnection))
+		{
+			CloseConnection(*pConnection, "Send failed");
+			return;
+		}
+		SchedulePing(*pConnection);
+	});
+}
+
+void CMockMCSServer::ScheduleIq(CONNECTION& connection)
+{
+	CONNECTION* pConnection = &connection;
+	connection.nIqTimer = connection.pWorker->loop->AddTimer(m_Config.nIqIntervalMs, [this, pConnection]() {
+		pConnection->nIqTimer = kInvalidTimerId;
+
+		mcs_proto::IqStanza cIqStanza;
+		cIqStanza.set_type(mcs_proto::IqStanza_IqType_RESULT);
+		cIqStanza.set_id("mock");
+		cIqStanza.set_stream_id(pConnection->nStreamIdOut + 1);
+		cIqStanza.set_last_stream_id_received(pConnection->nStreamIdIn);
+		SendProto(*pConnection, kIqStanzaTag, cIqStanza);
+		m_nIqsSent++;
+
+		if (!FlushOutput(*pConnection))
+		{
+			CloseConnection(*pConnection, "Send failed");
+			return;
+		}
+		ScheduleIq(*pConnection);
+	});
+}
+
+void CMockMCSServer::PushBurst(CONNECTION& connection)
+{
+	if (connection.outBuffer.size() - connection.nOutBufferPos > kMockMCSMaxPendingBytes)
+	{
+		m_nBurstsSkipped++;
+		SchedulePush(connection, m_nPushIntervalMs);
+		return;
+	}
+
+	WORKER& worker = *connection.pWorker;
+	size_t nBurst = (std::max)(m_Config.nBurst, size_t(1));
+	for (size_t i = 0; i < nBurst; ++i)
+	{
+		if (m_Config.nMessagesPerClient > 0 && connection.nMessagesSent >= m_Config.nMessagesPerClient)
+			break;
+
+		int64_t nNowUs = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+
+		mcs_proto::DataMessageStanza& cStanza = connection.payloads[worker.random() % connection.payloads.size()];
+		cStanza.set_persistent_id("0:" + std::to_string(nNowUs) + "%" + connection.sAndroidId + "-" + std::to_string(connection.nMessagesSent));
+		cStanza.set_stream_id(connection.nStreamIdOut + 1);
+		cStanza.set_last_stream_id_received(connection.nStreamIdIn);
+		SendProto(connection, kDataMessageStanzaTag, cStanza);
+
+		connection.nMessagesSent++;
+		m_nMessagesSent++;
+	}
+
+	if (!FlushOutput(connection))
+	{
+		CloseConnection(connection, "Send failed");
+		return;
+	}
+
+	if (m_Config.nMessagesPerClient == 0 || connection.nMessagesSent < m_Config.nMessagesPerClient)
+		SchedulePush(connection, m_nPushIntervalMs);
+}
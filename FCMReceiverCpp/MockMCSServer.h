@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "mcs.pb.h"
+#include "EventLoop.h"
+#include "FCMClient.h"
+#include "MCSFrameDecoder.h"
+#include "SecureSocket/TCPSSLServer.h"
+
+constexpr uint32_t kMockMCSAcceptPollMs = 500;
+constexpr uint32_t kMockMCSHandshakeTimeoutMs = 10000; // clients that do not finish the TLS handshake in time are closed
+constexpr size_t kMockMCSPayloadVariants = 4; // encrypted payloads kept per connection
+constexpr size_t kMockMCSMaxPendingBytes = 256 * 1024; // bursts are skipped while a client is this far behind
+constexpr size_t kMockMCSDefaultMinPayload = 256;
+constexpr size_t kMockMCSDefaultMaxPayload = 1024;
+
+typedef struct _MOCK_MCS_CONFIG
+{
+	std::string sPort;
+	std::string sCertFile;
+	std::string sKeyFile;
+	size_t nThreadCount = 0; // connection threads, 0 uses one per hardware thread
+	double dRatePerSecond = 1; // messages pushed per second to each logged in client, 0 pushes none
+	size_t nBurst = 1; // messages written back to back, bursts are spaced to keep the rate
+	size_t nMinPayload = kMockMCSDefaultMinPayload; // plaintext sizes are uniform in [nMinPayload, nMaxPayload]
+	size_t nMaxPayload = kMockMCSDefaultMaxPayload;
+	uint64_t nMessagesPerClient = 0; // pushes stop after this many, 0 never stops
+	uint32_t nPingIntervalMs = 0; // HeartbeatPings sent to each logged in client, 0 sends none
+	uint32_t nIqIntervalMs = 0; // IqStanzas without an extension, which clients only stream ack, 0 sends none
+} MOCK_MCS_CONFIG;
+
+typedef struct _MOCK_MCS_METRICS
+{
+	uint64_t nAccepted; // TLS handshake done
+	uint64_t nActive;
+	uint64_t nLoggedIn;
+	uint64_t nLoginRejected; // unknown android id or wrong security token
+	uint64_t nHeartbeats;
+	uint64_t nMessagesSent;
+	uint64_t nBytesSent;
+	uint64_t nAckedIds; // selective acks and the ids resent with a login
+	uint64_t nBurstsSkipped; // the client had not read the previous ones yet
+	uint64_t nPingsSent;
+	uint64_t nPingAcks; // HeartbeatAcks the clients answered the pings with
+	uint64_t nIqsSent;
+	uint64_t nSelectiveAcks; // IqStanzas with a SelectiveAck extension
+	uint64_t nMaxIdsPerAck; // the most ids one selective ack carried
+	uint64_t nStreamAcks; // IqStanzas with a StreamAck extension
+} MOCK_MCS_METRICS;
+
+/**
+ * Stands in for mtalk.google.com so clients can be load tested offline.
+ *
+ * Clients log in with the android id and security token of a registered identity,
+ * get a LoginResponse and then a HeartbeatAck for every HeartbeatPing. Once logged in,
+ * each client is pushed DataMessageStanzas encrypted with its identity's keys, at a
+ * fixed rate and in bursts. Selective acks are answered with an IqStanza result, so the
+ * clients confirm their persistent ids like they do against the real server. Selective
+ * and stream acks are counted, and HeartbeatPings and bare IqStanzas can be sent on a timer,
+ * to check when clients acknowledge what they receive.
+ *
+ * Each persistent id carries the unix time in microseconds the message was written,
+ * "0:<time>%<android id>-<sequence>", so the receiving side can measure the latency.
+ *
+ * An accept thread only accepts the TCP connections and spreads them over a fixed pool
+ * of event loop threads, which run the TLS handshakes non-blocking, so a client that
+ * stalls its handshake holds up no one else and is closed after kMockMCSHandshakeTimeoutMs.
+ * A handful of payloads is encrypted per client at login and reused, so the server
+ * spends its CPU on the I/O and not on the crypto.
+ */
+class CMockMCSServer
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging, called from every thread.
+	 * @param config The listen port, certificate and push pattern.
+	 */
+	CMockMCSServer(const LogFnCallback oLogger, const MOCK_MCS_CONFIG& config);
+	~CMockMCSServer();
+
+	CMockMCSServer(const CMockMCSServer&) = delete;
+	CMockMCSServer& operator=(const CMockMCSServer&) = delete;
+
+	/**
+	 * Lets a client log in. Must be called before Start().
+	 *
+	 * @param sAndroidId The android id.
+	 * @param sSecurityToken The security token.
+	 * @param sBase64PrivateKey The base64 encoded private key, the public key is derived from it.
+	 * @param sBase64AuthSecret The base64 encoded authentication secret.
+	 * @throws std::runtime_error if the private key or auth secret is invalid.
+	 */
+	void AddIdentity(const std::string& sAndroidId, const std::string& sSecurityToken,
+		const std::string& sBase64PrivateKey, const std::string& sBase64AuthSecret);
+
+	/**
+	 * Starts accepting clients. The port is bound by the accept thread, a failure is logged.
+	 */
+	void Start();
+
+	/**
+	 * Stops accepting and closes every client. Blocks until the threads have exited.
+	 */
+	void Stop();
+
+	/**
+	 * @return The counters since Start(). Thread safe.
+	 */
+	MOCK_MCS_METRICS GetMetrics() const;
+
+	size_t IdentityCount() const { return m_Identities.size(); }
+
+private:
+	typedef ASecureSocket::SSLSocket SSLSocket;
+
+	struct IDENTITY
+	{
+		std::string sSecurityToken;
+		uint8_t rawPublicKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+		uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+	};
+
+	struct WORKER;
+
+	struct CONNECTION
+	{
+		WORKER* pWorker;
+		SSLSocket socket;
+		CMCSFrameDecoder decoder;
+		std::vector<uint8_t> outBuffer;
+		size_t nOutBufferPos = 0;
+		bool bReadWantsWrite = false;
+		bool bHandshaking = true;
+		TimerId nHandshakeTimer = kInvalidTimerId;
+
+		const IDENTITY* pIdentity = nullptr;
+		std::string sAndroidId;
+		int32_t nStreamIdIn = 0;
+		int32_t nStreamIdOut = 0;
+		std::vector<mcs_proto::DataMessageStanza> payloads;
+		uint64_t nMessagesSent = 0;
+		TimerId nPushTimer = kInvalidTimerId;
+		TimerId nPingTimer = kInvalidTimerId;
+		TimerId nIqTimer = kInvalidTimerId;
+	};
+
+	struct WORKER
+	{
+		std::unique_ptr<CEventLoop> loop;
+		std::thread thread;
+		std::unordered_map<ASocket::Socket, std::unique_ptr<CONNECTION>> connections;
+		std::mt19937 random;
+		std::string sSerialized; // reused for every frame the loop writes
+	};
+
+	void AcceptLoop();
+	void AddConnection(WORKER& worker, std::unique_ptr<CONNECTION> connection);
+	void CloseConnection(CONNECTION& connection, const std::string& sReason);
+
+	void OnSocketEvent(CONNECTION& connection, uint32_t nEvents);
+	void ContinueHandshake(CONNECTION& connection);
+	bool ReadAvailable(CONNECTION& connection);
+	bool FlushOutput(CONNECTION& connection);
+	void UpdateSocketEvents(CONNECTION& connection);
+	void SendProto(CONNECTION& connection, MCSProtoTag eTag, const google::protobuf::MessageLite& cMessage, bool bVersion = false);
+
+	bool HandleFrame(CONNECTION& connection, const MCS_FRAME& frame);
+	bool HandleLoginRequest(CONNECTION& connection, const MCS_FRAME& frame);
+	void HandleHeartbeatPing(CONNECTION& connection, const MCS_FRAME& frame);
+	void HandleIqStanza(CONNECTION& connection, const MCS_FRAME& frame);
+
+	bool EncryptPayloads(CONNECTION& connection);
+	void SchedulePush(CONNECTION& connection, uint32_t nDelayMs);
+	void PushBurst(CONNECTION& connection);
+	void SchedulePing(CONNECTION& connection);
+	void ScheduleIq(CONNECTION& connection);
+
+private:
+	const LogFnCallback m_oLogger;
+	const MOCK_MCS_CONFIG m_Config;
+	const uint32_t m_nPushIntervalMs;
+
+	std::unordered_map<std::string, IDENTITY> m_Identities;
+
+	std::unique_ptr<CTCPSSLServer> m_SSLServer;
+	std::thread m_AcceptThread;
+	std::vector<std::unique_ptr<WORKER>> m_Workers;
+	size_t m_nNextWorker;
+	std::atomic<bool> m_bRunning;
+
+	std::atomic<uint64_t> m_nAccepted;
+	std::atomic<uint64_t> m_nActive;
+	std::atomic<uint64_t> m_nLoggedIn;
+	std::atomic<uint64_t> m_nLoginRejected;
+	std::atomic<uint64_t> m_nHeartbeats;
+	std::atomic<uint64_t> m_nMessagesSent;
+	std::atomic<uint64_t> m_nBytesSent;
+	std::atomic<uint64_t> m_nAckedIds;
+	std::atomic<uint64_t> m_nBurstsSkipped;
+	std::atomic<uint64_t> m_nPingsSent;
+	std::atomic<uint64_t> m_nPingAcks;
+	std::atomic<uint64_t> m_nIqsSent;
+	std::atomic<uint64_t> m_nSelectiveAcks;
+	std::atomic<uint64_t> m_nMaxIdsPerAck;
+	std::atomic<uint64_t> m_nStreamAcks;
+};
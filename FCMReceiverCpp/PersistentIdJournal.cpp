@@ -0,0 +1,577 @@
+#include "PersistentIdJournal.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <unordered_set>
+
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <cerrno>
+#include <codecvt>
+#include <cstdio>
+#include <fcntl.h>
+#include <locale>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	uint32_t Crc32(const char* pData, size_t nLength)
+	{
+		static const std::array<uint32_t, 256> table = []() {
+			std::array<uint32_t, 256> crcTable;
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t nCrc = i;
+				for (int j = 0; j < 8; ++j)
+					nCrc = (nCrc & 1) ? (nCrc >> 1) ^ 0xEDB88320u : nCrc >> 1;
+				crcTable[i] = nCrc;
+			}
+			return crcTable;
+		}();
+
+		uint32_t nCrc = 0xFFFFFFFFu;
+		for (size_t i = 0; i < nLength; ++i)
+			nCrc = table[(nCrc ^ static_cast<uint8_t>(pData[i])) & 0xFF] ^ (nCrc >> 8);
+		return nCrc ^ 0xFFFFFFFFu;
+	}
+
+	void AppendRecord(const std::string& sPersistentId, std::string& sOut)
+	{
+		static const char hexDigits[] = "0123456789abcdef";
+		uint32_t nCrc = Crc32(sPersistentId.data(), sPersistentId.size());
+
+		sOut += sPersistentId;
+		sOut += ' ';
+		for (int nShift = 28; nShift >= 0; nShift -= 4)
+			sOut += hexDigits[(nCrc >> nShift) & 0xF];
+		sOut += '\n';
+	}
+
+	// Returns false for a line cut short or damaged by a crash
+	bool ParseRecord(const char* pLine, size_t nLength, std::string& sPersistentId)
+	{
+		constexpr size_t kCrcDigits = 8;
+		if (nLength < kCrcDigits + 2 || pLine[nLength - kCrcDigits - 1] != ' ')
+			return false;
+
+		uint32_t nCrc = 0;
+		for (size_t i = nLength - kCrcDigits; i < nLength; ++i)
+		{
+			char c = pLine[i];
+			uint32_t nDigit;
+			if (c >= '0' && c <= '9')
+				nDigit = c - '0';
+			else if (c >= 'a' && c <= 'f')
+				nDigit = c - 'a' + 10;
+			else
+				return false;
+			nCrc = (nCrc << 4) | nDigit;
+		}
+
+		size_t nIdLength = nLength - kCrcDigits - 1;
+		if (Crc32(pLine, nIdLength) != nCrc)
+			return false;
+
+		sPersistentId.assign(pLine, nIdLength);
+		return true;
+	}
+
+#ifdef WINDOWS
+	bool ReadWholeFile(const std::wstring& sPath, std::string& sContent)
+	{
+		HANDLE hFile = CreateFileW(sPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+		LARGE_INTEGER nSize;
+		bool bOk = GetFileSizeEx(hFile, &nSize) != FALSE;
+		if (bOk)
+		{
+			sContent.resize(static_cast<size_t>(nSize.QuadPart));
+			size_t nOffset = 0;
+			while (nOffset < sContent.size())
+			{
+				DWORD nRead = 0;
+				if (!ReadFile(hFile, &sContent[nOffset], static_cast<DWORD>(sContent.size() - nOffset), &nRead, NULL) || nRead == 0)
+					break;
+				nOffset += nRead;
+			}
+			sContent.resize(nOffset);
+		}
+		CloseHandle(hFile);
+		return bOk;
+	}
+
+	bool WriteAll(HANDLE hFile, const std::string& sData)
+	{
+		size_t nOffset = 0;
+		while (nOffset < sData.size())
+		{
+			DWORD nWritten = 0;
+			if (!WriteFile(hFile, sData.data() + nOffset, static_cast<DWORD>(sData.size() - nOffset), &nWritten, NULL) || nWritten == 0)
+				return false;
+			nOffset += nWritten;
+		}
+		return true;
+	}
+#else
+	std::string ToNativePath(const std::wstring& sPath)
+	{
+		return std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(sPath);
+	}
+
+	bool ReadWholeFile(const std::wstring& sPath, std::string& sContent)
+	{
+		int nFd = open(ToNativePath(sPath).c_str(), O_RDONLY | O_CLOEXEC);
+		if (nFd < 0)
+			return errno == ENOENT;
+
+		char buffer[16384];
+		for (;;)
+		{
+			ssize_t nRead = read(nFd, buffer, sizeof(buffer));
+			if (nRead < 0 && errno == EINTR)
+				continue;
+			if (nRead < 0)
+			{
+				close(nFd);
+				return false;
+			}
+			if (nRead == 0)
+				break;
+			sContent.append(buffer, static_cast<size_t>(nRead));
+		}
+		close(nFd);
+		return true;
+	}
+
+	bool WriteAll(int nFd, const std::string& sData)
+	{
+		size_t nOffset = 0;
+		while (nOffset < sData.size())
+		{
+			ssize_t nWritten = write(nFd, sData.data() + nOffset, sData.size() - nOffset);
+			if (nWritten < 0 && errno == EINTR)
+				continue;
+			if (nWritten <= 0)
+				return false;
+			nOffset += static_cast<size_t>(nWritten);
+		}
+		return true;
+	}
+
+	// Makes a rename durable
+	void SyncParentDirectory(const std::string& sPath)
+	{
+		size_t nSlash = sPath.find_last_of('/');
+		std::string sDirectory = nSlash == std::string::npos ? "." : sPath.substr(0, nSlash + 1);
+		int nFd = open(sDirectory.c_str(), O_RDONLY | O_CLOEXEC);
+		if (nFd >= 0)
+		{
+			fsync(nFd);
+			close(nFd);
+		}
+	}
+#endif
+}
+
+CJournalWriter::CJournalWriter(const ASocket::LogFnCallback oLogger) :
+	m_oLogger(oLogger),
+	m_pFlushing(nullptr),
+	m_bStopping(false),
+	m_Thread(&CJournalWriter::WriterThread, this)
+{
+}
+
+CJournalWriter::~CJournalWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStopping = true;
+	}
+	m_Condition.notify_all();
+	m_Thread.join();
+}
+
+void CJournalWriter::Schedule(CPersistentIdJournal* pJournal, Clock::time_point deadline)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		auto it = m_Deadlines.find(pJournal);
+		if (it != m_Deadlines.end())
+		{
+			if (it->second <= deadline)
+				return;
+			m_Queue.erase(std::make_pair(it->second, pJournal));
+			it->second = deadline;
+		}
+		else
+		{
+			m_Deadlines.emplace(pJournal, deadline);
+		}
+		m_Queue.emplace(deadline, pJournal);
+	}
+	m_Condition.notify_all();
+}
+
+void CJournalWriter::Cancel(CPersistentIdJournal* pJournal)
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	auto it = m_Deadlines.find(pJournal);
+	if (it != m_Deadlines.end())
+	{
+		m_Queue.erase(std::make_pair(it->second, pJournal));
+		m_Deadlines.erase(it);
+	}
+	m_Condition.wait(lock, [this, pJournal]() { return m_pFlushing != pJournal; });
+}
+
+void CJournalWriter::WriterThread()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (!m_bStopping)
+	{
+		if (m_Queue.empty())
+		{
+			m_Condition.wait(lock);
+			continue;
+		}
+
+		auto it = m_Queue.begin();
+		if (it->first > Clock::now())
+		{
+			m_Condition.wait_until(lock, it->first);
+			continue;
+		}
+
+		CPersistentIdJournal* pJournal = it->second;
+		m_Queue.erase(it);
+		m_Deadlines.erase(pJournal);
+		m_pFlushing = pJournal;
+
+		lock.unlock();
+		try
+		{
+			pJournal->Flush();
+		}
+		catch (const std::exception& e)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CJournalWriter][ERROR] WriterThread: Flush failed: ", e.what());
+		}
+		lock.lock();
+
+		// Cancel() waits on the same condition
+		m_pFlushing = nullptr;
+		m_Condition.notify_all();
+	}
+}
+
+CPersistentIdJournal::CPersistentIdJournal(const ASocket::LogFnCallback oLogger, CJournalWriter& cWriter) :
+	m_oLogger(oLogger),
+	m_cWriter(cWriter),
+	m_bCompact(false),
+	m_bRewriting(false),
+	m_nUnsynced(0),
+	m_LastSyncTime(Clock::now()),
+#ifdef WINDOWS
+	m_hFile(INVALID_HANDLE_VALUE)
+#else
+	m_nFd(-1)
+#endif
+{
+}
+
+CPersistentIdJournal::~CPersistentIdJournal()
+{
+	Close();
+}
+
+bool CPersistentIdJournal::Open(const std::wstring& sPath, std::vector<std::string>& persistentIds)
+{
+	Close();
+	m_sPath = sPath;
+
+	std::string sContent;
+	if (!ReadWholeFile(m_sPath, sContent))
+	{
+		FCM_LOG_ERROR(m_oLogger, "[CPersistentIdJournal][ERROR] Open: Cannot read the journal");
+		return false;
+	}
+
+	std::vector<std::string> loadedIds;
+	size_t nPos = 0;
+	size_t nDroppedBytes = 0;
+	std::string sPersistentId;
+	while (nPos < sContent.size())
+	{
+		size_t nLineEnd = sContent.find('\n', nPos);
+		if (nLineEnd == std::string::npos)
+		{
+			nDroppedBytes += sContent.size() - nPos;
+			break;
+		}
+
+		if (ParseRecord(sContent.data() + nPos, nLineEnd - nPos, sPersistentId))
+			loadedIds.push_back(sPersistentId);
+		else
+			nDroppedBytes += nLineEnd + 1 - nPos;
+		nPos = nLineEnd + 1;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_PersistentIds = loadedIds;
+		m_bCompact = false;
+		m_nUnsynced = 0;
+		m_LastSyncTime = Clock::now();
+	}
+
+	// Damaged records are cut out now, a torn tail would otherwise swallow the next record appended
+	if (nDroppedBytes > 0)
+	{
+		FCM_LOG_WARNING(m_oLogger, "[CPersistentIdJournal][WARNING] Open: Dropped ", nDroppedBytes,
+			" bytes of damaged records, kept ", loadedIds.size(), " ids");
+		if (!Rewrite())
+			return false;
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (!OpenForAppend())
+			return false;
+	}
+
+	persistentIds.swap(loadedIds);
+	return true;
+}
+
+bool CPersistentIdJournal::Append(const std::string& sPersistentId)
+{
+	std::string sRecord;
+	sRecord.reserve(sPersistentId.size() + 10);
+	AppendRecord(sPersistentId, sRecord);
+
+	Clock::time_point deadline;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+#ifdef WINDOWS
+		bool bWritten = m_hFile != INVALID_HANDLE_VALUE && WriteAll(m_hFile, sRecord);
+#else
+		bool bWritten = m_nFd >= 0 && WriteAll(m_nFd, sRecord);
+#endif
+		if (!bWritten)
+		{
+			FCM_LOG_ERROR(m_oLogger, "[CPersistentIdJournal][ERROR] Append: Cannot write to the journal");
+			return false;
+		}
+
+		m_PersistentIds.push_back(sPersistentId);
+		if (m_bRewriting)
+			m_RewriteAppendedIds.push_back(sPersistentId);
+
+		// The first unsynced id arms the flush, a full batch brings it forward
+		++m_nUnsynced;
+		if (m_nUnsynced == kJournalSyncRecords)
+			deadline = Clock::now();
+		else if (m_nUnsynced == 1)
+			deadline = (std::max)(Clock::now(), m_LastSyncTime + std::chrono::milliseconds(kJournalSyncIntervalMs));
+		else
+			return true;
+	}
+
+	m_cWriter.Schedule(this, deadline);
+	return true;
+}
+
+void CPersistentIdJournal::Confirm(const std::vector<std::string>& confirmedIds)
+{
+	if (confirmedIds.empty())
+		return;
+
+	std::unordered_set<std::string> confirmed(confirmedIds.begin(), confirmedIds.end());
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_PersistentIds.erase(std::remove_if(m_PersistentIds.begin(), m_PersistentIds.end(),
+			[&confirmed](const std::string& sPersistentId) { return confirmed.count(sPersistentId) != 0; }),
+			m_PersistentIds.end());
+		m_bCompact = true;
+	}
+
+	m_cWriter.Schedule(this, Clock::now());
+}
+
+bool CPersistentIdJournal::Sync()
+{
+	// Only the writer thread and Close() replace the file, so it stays open while it is synced unlocked
+#ifdef WINDOWS
+	HANDLE hFile;
+#else
+	int nFd;
+#endif
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+#ifdef WINDOWS
+		hFile = m_hFile;
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+#else
+		nFd = m_nFd;
+		if (nFd < 0)
+			return false;
+#endif
+		if (m_nUnsynced == 0)
+			return true;
+		m_nUnsynced = 0;
+		m_LastSyncTime = Clock::now();
+	}
+
+#ifdef WINDOWS
+	return FlushFileBuffers(hFile) != FALSE;
+#else
+	return fsync(nFd) == 0;
+#endif
+}
+
+void CPersistentIdJournal::Close()
+{
+	m_cWriter.Cancel(this);
+	Sync();
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	CloseFile();
+}
+
+size_t CPersistentIdJournal::Size() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_PersistentIds.size();
+}
+
+void CPersistentIdJournal::Flush()
+{
+	bool bCompact;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		bCompact = m_bCompact;
+		m_bCompact = false;
+	}
+
+	// A failed compaction keeps the confirmed ids in the file, the next Confirm() retries
+	if (bCompact)
+		Rewrite();
+
+	if (!Sync())
+		FCM_LOG_ERROR(m_oLogger, "[CPersistentIdJournal][ERROR] Flush: Cannot sync the journal");
+}
+
+bool CPersistentIdJournal::OpenForAppend()
+{
+#ifdef WINDOWS
+	m_hFile = CreateFileW(m_sPath.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	bool bOpened = m_hFile != INVALID_HANDLE_VALUE;
+#else
+	m_nFd = open(ToNativePath(m_sPath).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	bool bOpened = m_nFd >= 0;
+#endif
+	if (!bOpened)
+		FCM_LOG_ERROR(m_oLogger, "[CPersistentIdJournal][ERROR] Cannot open the journal for writing");
+	return bOpened;
+}
+
+void CPersistentIdJournal::CloseFile()
+{
+#ifdef WINDOWS
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+#else
+	if (m_nFd >= 0)
+		close(m_nFd);
+	m_nFd = -1;
+#endif
+}
+
+bool CPersistentIdJournal::Rewrite()
+{
+	// Appends go on to the current file while the ids are copied, and are carried over below
+	std::string sContent;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		for (const std::string& sPersistentId : m_PersistentIds)
+			AppendRecord(sPersistentId, sContent);
+		m_bRewriting = true;
+		m_RewriteAppendedIds.clear();
+	}
+
+	std::wstring sTempPath = m_sPath + L".tmp";
+	bool bWritten = false;
+
+	// The journal is replaced only once the new content is on disk, a crash leaves one or the other
+#ifdef WINDOWS
+	HANDLE hTempFile = CreateFileW(sTempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTempFile != INVALID_HANDLE_VALUE)
+		bWritten = WriteAll(hTempFile, sContent) && FlushFileBuffers(hTempFile);
+#else
+	std::string sNativeTempPath = ToNativePath(sTempPath);
+	std::string sNativePath = ToNativePath(m_sPath);
+	int nTempFd = open(sNativeTempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (nTempFd >= 0)
+		bWritten = WriteAll(nTempFd, sContent) && fsync(nTempFd) == 0;
+#endif
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+
+	// The ids appended meanwhile count as unsynced until the next Sync()
+	std::string sAppended;
+	for (const std::string& sPersistentId : m_RewriteAppendedIds)
+		AppendRecord(sPersistentId, sAppended);
+	m_bRewriting = false;
+	m_RewriteAppendedIds.clear();
+
+#ifdef WINDOWS
+	if (hTempFile != INVALID_HANDLE_VALUE)
+	{
+		bWritten = bWritten && WriteAll(hTempFile, sAppended);
+		CloseHandle(hTempFile);
+	}
+	if (bWritten)
+	{
+		CloseFile();
+		bWritten = MoveFileExW(sTempPath.c_str(), m_sPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+	}
+	if (!bWritten)
+		DeleteFileW(sTempPath.c_str());
+#else
+	if (nTempFd >= 0)
+	{
+		bWritten = bWritten && WriteAll(nTempFd, sAppended);
+		close(nTempFd);
+	}
+	if (bWritten)
+	{
+		CloseFile();
+		bWritten = std::rename(sNativeTempPath.c_str(), sNativePath.c_str()) == 0;
+	}
+	if (!bWritten)
+		std::remove(sNativeTempPath.c_str());
+#endif
+
+	if (!bWritten)
+		FCM_LOG_ERROR(m_oLogger, "[CPersistentIdJournal][ERROR] Rewrite: Cannot replace the journal");
+
+#ifdef WINDOWS
+	bool bOpened = m_hFile != INVALID_HANDLE_VALUE || OpenForAppend();
+#else
+	bool bOpened = m_nFd >= 0 || OpenForAppend();
+	lock.unlock();
+	if (bWritten)
+		SyncParentDirectory(sNativePath);
+#endif
+	return bOpened && bWritten;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "LogUtil.h"
+#include "SecureSocket/Socket.h"
+
+constexpr uint32_t kJournalSyncRecords = 32;
+constexpr uint32_t kJournalSyncIntervalMs = 200;
+
+class CPersistentIdJournal;
+
+/**
+ * Runs the fsyncs and compactions of persistent id journals on one background thread,
+ * so the event loop threads appending to the journals never wait for the disk.
+ *
+ * Each journal has at most one pending deadline, the earliest one asked for. Must
+ * outlive the journals that use it.
+ */
+class CJournalWriter
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 */
+	explicit CJournalWriter(const ASocket::LogFnCallback oLogger);
+	~CJournalWriter();
+
+	CJournalWriter(const CJournalWriter&) = delete;
+	CJournalWriter& operator=(const CJournalWriter&) = delete;
+
+private:
+	friend class CPersistentIdJournal;
+	typedef std::chrono::steady_clock Clock;
+
+	// Thread safe
+	void Schedule(CPersistentIdJournal* pJournal, Clock::time_point deadline);
+
+	// Drops the pending deadline of the journal and waits for a flush of it in progress
+	void Cancel(CPersistentIdJournal* pJournal);
+
+	void WriterThread();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::set<std::pair<Clock::time_point, CPersistentIdJournal*>> m_Queue;
+	std::map<CPersistentIdJournal*, Clock::time_point> m_Deadlines;
+	CPersistentIdJournal* m_pFlushing;
+	bool m_bStopping;
+	std::thread m_Thread;
+};
+
+/**
+ * Append-only file of the persistent ids received but not yet confirmed by the server.
+ *
+ * Every id is one line "<id> <crc32>\n", written with a single write call as soon as it
+ * arrives, so the id survives a crash of the process right away. The first id written
+ * after a sync arms a flush on the CJournalWriter kJournalSyncIntervalMs after that sync,
+ * or right away when it is older, and kJournalSyncRecords ids bring the flush forward.
+ * A lone message is synced at once and a burst shares one fsync. An id that was not
+ * synced yet when the machine lost power is at worst received again.
+ *
+ * Loading reads the file once and skips the lines that are cut short or fail their checksum,
+ * which is what a crash in the middle of a write leaves behind. Confirmed ids are
+ * dropped by the writer, which rewrites the file to a temporary one and renames it over
+ * the journal. Ids appended meanwhile are carried over to the new file.
+ *
+ * Append() and Confirm() are called from the thread that runs the client, the writer
+ * thread flushes concurrently. Open(), Sync() and Close() block on the disk.
+ */
+class CPersistentIdJournal
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param cWriter Syncs and compacts the journal.
+	 */
+	CPersistentIdJournal(const ASocket::LogFnCallback oLogger, CJournalWriter& cWriter);
+	~CPersistentIdJournal();
+
+	CPersistentIdJournal(const CPersistentIdJournal&) = delete;
+	CPersistentIdJournal& operator=(const CPersistentIdJournal&) = delete;
+
+	/**
+	 * Loads the journal, creating it if needed, and opens it for appending.
+	 *
+	 * @param sPath The journal file.
+	 * @param persistentIds Receives the ids still waiting for confirmation.
+	 * @return False if the file cannot be read or opened.
+	 */
+	bool Open(const std::wstring& sPath, std::vector<std::string>& persistentIds);
+
+	/**
+	 * @param sPersistentId A received persistent id.
+	 * @return False if the id could not be written.
+	 */
+	bool Append(const std::string& sPersistentId);
+
+	/**
+	 * Drops the ids the server confirmed, the writer compacts the file. A file that cannot
+	 * be rewritten keeps the ids, they are confirmed again after the next login.
+	 *
+	 * @param confirmedIds The ids sent in a login request the server answered.
+	 */
+	void Confirm(const std::vector<std::string>& confirmedIds);
+
+	/**
+	 * Syncs the appended ids to disk, blocking.
+	 */
+	bool Sync();
+
+	void Close();
+
+	/**
+	 * @return The number of ids waiting for confirmation.
+	 */
+	size_t Size() const;
+
+private:
+	friend class CJournalWriter;
+	typedef CJournalWriter::Clock Clock;
+
+	// Runs on the writer thread
+	void Flush();
+
+	// m_Mutex held
+	bool OpenForAppend();
+	void CloseFile();
+
+	bool Rewrite();
+
+private:
+	const ASocket::LogFnCallback m_oLogger;
+	CJournalWriter& m_cWriter;
+
+	// Guards everything below but the path, the file is synced and rewritten outside of it
+	mutable std::mutex m_Mutex;
+	std::wstring m_sPath;
+	std::vector<std::string> m_PersistentIds;
+	bool m_bCompact;
+	bool m_bRewriting;
+	std::vector<std::string> m_RewriteAppendedIds; // appended while a rewrite copies the ids
+
+	uint32_t m_nUnsynced;
+	Clock::time_point m_LastSyncTime;
+#ifdef WINDOWS
+	void* m_hFile;
+#else
+	int m_nFd;
+#endif
+};
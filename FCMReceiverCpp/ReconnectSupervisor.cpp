@@ -0,0 +1,163 @@
+#include "ReconnectSupervisor.h"
+
+#include <algorithm>
+
+CReconnectSupervisor::CReconnectSupervisor(const LogFnCallback oLogger, CFCMClient& cClient, CEventLoop& cEventLoop, CTokenBucket& cHandshakeBucket) :
+	m_oLogger(oLogger),
+	m_cClient(cClient),
+	m_cEventLoop(cEventLoop),
+	m_cHandshakeBucket(cHandshakeBucket),
+	m_Random(std::random_device{}())
+{
+	std::weak_ptr<CReconnectSupervisor*> pWeakSelf = m_pSelf;
+	m_cClient.On("connected", [pWeakSelf](const std::string&) {
+		std::shared_ptr<CReconnectSupervisor*> pSelf = pWeakSelf.lock();
+		if (pSelf && *pSelf != nullptr)
+			(*pSelf)->OnConnected();
+	});
+	m_cClient.On("disconnected", [pWeakSelf](const std::string& sReason) {
+		std::shared_ptr<CReconnectSupervisor*> pSelf = pWeakSelf.lock();
+		if (pSelf && *pSelf != nullptr)
+			(*pSelf)->OnDisconnected(sReason);
+	});
+}
+
+CReconnectSupervisor::~CReconnectSupervisor()
+{
+	*m_pSelf = nullptr;
+	Stop();
+}
+
+void CReconnectSupervisor::Start(bool bConnect)
+{
+	if (m_bRunning)
+		return;
+
+	m_bRunning = true;
+	m_bConnected = !bConnect;
+	m_ConnectedTime = Clock::now();
+	if (bConnect)
+		Attempt();
+}
+
+void CReconnectSupervisor::Stop()
+{
+	m_bRunning = false;
+	m_bWaitingForToken = false;
+	if (m_nRetryTimer != kInvalidTimerId)
+	{
+		m_cEventLoop.CancelTimer(m_nRetryTimer);
+		m_nRetryTimer = kInvalidTimerId;
+	}
+}
+
+RECONNECT_METRICS CReconnectSupervisor::GetMetrics() const
+{
+	RECONNECT_METRICS metrics;
+	metrics.nReconnects = m_nReconnects.load(std::memory_order_relaxed);
+	metrics.nFailedAttempts = m_nFailedAttempts.load(std::memory_order_relaxed);
+	metrics.nLastRecoveryMs = m_nLastRecoveryMs.load(std::memory_order_relaxed);
+	metrics.nMaxRecoveryMs = m_nMaxRecoveryMs.load(std::memory_order_relaxed);
+	metrics.nTotalRecoveryMs = m_nTotalRecoveryMs.load(std::memory_order_relaxed);
+	return metrics;
+}
+
+void CReconnectSupervisor::OnConnected()
+{
+	if (!m_bRunning)
+		return;
+
+	m_bConnected = true;
+	m_ConnectedTime = Clock::now();
+	if (!m_bDropped)
+		return;
+
+	uint64_t nRecoveryMs = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(m_ConnectedTime - m_DroppedTime).count());
+	m_bDropped = false;
+
+	m_nReconnects.fetch_add(1, std::memory_order_relaxed);
+	m_nLastRecoveryMs.store(nRecoveryMs, std::memory_order_relaxed);
+	m_nTotalRecoveryMs.fetch_add(nRecoveryMs, std::memory_order_relaxed);
+	if (nRecoveryMs > m_nMaxRecoveryMs.load(std::memory_order_relaxed))
+		m_nMaxRecoveryMs.store(nRecoveryMs, std::memory_order_relaxed);
+
+	FCM_LOG_INFO(m_oLogger, "[CReconnectSupervisor][INFO] ", m_cClient.GetAndroidId(), " reconnected after ", nRecoveryMs,
+		" ms and ", m_nAttempt, " attempts");
+}
+
+void CReconnectSupervisor::OnDisconnected(const std::string& sReason)
+{
+	if (!m_bRunning)
+		return;
+
+	Clock::time_point now = Clock::now();
+	if (m_bConnected)
+	{
+		// Only a connection that held for a while proves the server is reachable again
+		if (now - m_ConnectedTime >= std::chrono::milliseconds(kReconnectStableMs))
+			m_nAttempt = 0;
+
+		m_bConnected = false;
+		if (!m_bDropped)
+		{
+			m_bDropped = true;
+			m_DroppedTime = now;
+		}
+	}
+	else
+	{
+		m_nFailedAttempts.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint32_t nDelayMs = NextBackoffMs();
+	FCM_LOG_INFO(m_oLogger, "[CReconnectSupervisor][INFO] ", m_cClient.GetAndroidId(), " disconnected (", sReason,
+		"), reconnecting in ", nDelayMs, " ms");
+	ScheduleAttempt(nDelayMs);
+}
+
+void CReconnectSupervisor::ScheduleAttempt(uint32_t nDelayMs)
+{
+	if (m_nRetryTimer != kInvalidTimerId)
+		m_cEventLoop.CancelTimer(m_nRetryTimer);
+
+	m_nRetryTimer = m_cEventLoop.AddTimer(nDelayMs, [this]() {
+		m_nRetryTimer = kInvalidTimerId;
+		Attempt();
+	});
+}
+
+void CReconnectSupervisor::Attempt()
+{
+	if (!m_bRunning)
+		return;
+
+	// The token is taken once, the wait it asks for is the slot it reserved
+	if (!m_bWaitingForToken)
+	{
+		uint32_t nWaitMs = m_cHandshakeBucket.Reserve();
+		if (nWaitMs > 0)
+		{
+			m_bWaitingForToken = true;
+			ScheduleAttempt(nWaitMs);
+			return;
+		}
+	}
+	m_bWaitingForToken = false;
+
+	if (!m_cClient.ConnectAsync(m_cEventLoop))
+	{
+		m_nFailedAttempts.fetch_add(1, std::memory_order_relaxed);
+		ScheduleAttempt(NextBackoffMs());
+	}
+}
+
+uint32_t CReconnectSupervisor::NextBackoffMs()
+{
+	uint64_t nCeilingMs = static_cast<uint64_t>(kReconnectBackoffBaseMs) << std::min<uint32_t>(m_nAttempt, 20);
+	nCeilingMs = std::min<uint64_t>(nCeilingMs, kReconnectBackoffMaxMs);
+	m_nAttempt++;
+
+	std::uniform_int_distribution<uint32_t> distribution(0, static_cast<uint32_t>(nCeilingMs));
+	return distribution(m_Random);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "EventLoop.h"
+#include "FCMClient.h"
+#include "TokenBucket.h"
+
+constexpr uint32_t kReconnectBackoffBaseMs = 1000;
+constexpr uint32_t kReconnectBackoffMaxMs = 5 * 60 * 1000;
+constexpr uint32_t kReconnectStableMs = 60 * 1000; // a connection that lasted this long starts the backoff over
+
+typedef struct _RECONNECT_METRICS
+{
+	uint64_t nReconnects; // connections restored after a drop
+	uint64_t nFailedAttempts;
+	uint64_t nLastRecoveryMs; // from the drop to the connection being back
+	uint64_t nMaxRecoveryMs;
+	uint64_t nTotalRecoveryMs;
+} RECONNECT_METRICS;
+
+/**
+ * Keeps one client connected on an event loop.
+ *
+ * When the connection drops, the next attempt waits a random delay between 0 and a
+ * ceiling that doubles with every failed attempt (full jitter), then takes a token
+ * from a bucket shared by every session, so a mass disconnect turns into a paced
+ * stream of TLS handshakes. The client keeps its unconfirmed persistent ids and
+ * heartbeat state, the next login carries them.
+ *
+ * Everything but GetMetrics() runs on the loop thread.
+ */
+class CReconnectSupervisor
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging.
+	 * @param cClient The client to keep connected, must outlive the supervisor.
+	 * @param cEventLoop The loop the client runs on.
+	 * @param cHandshakeBucket Paces the connects, shared by every supervisor.
+	 */
+	CReconnectSupervisor(const LogFnCallback oLogger, CFCMClient& cClient, CEventLoop& cEventLoop, CTokenBucket& cHandshakeBucket);
+	~CReconnectSupervisor();
+
+	CReconnectSupervisor(const CReconnectSupervisor&) = delete;
+	CReconnectSupervisor& operator=(const CReconnectSupervisor&) = delete;
+
+	/**
+	 * Starts supervising.
+	 *
+	 * @param bConnect True to connect now, as soon as the bucket allows, false if the
+	 * client is already attached to the loop.
+	 */
+	void Start(bool bConnect);
+
+	/**
+	 * Stops reconnecting, the current connection is left alone.
+	 */
+	void Stop();
+
+	/**
+	 * @return The reconnect counters, safe to read from any thread.
+	 */
+	RECONNECT_METRICS GetMetrics() const;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void OnConnected();
+	void OnDisconnected(const std::string& sReason);
+	void ScheduleAttempt(uint32_t nDelayMs);
+	void Attempt();
+	uint32_t NextBackoffMs();
+
+private:
+	const LogFnCallback m_oLogger;
+	CFCMClient& m_cClient;
+	CEventLoop& m_cEventLoop;
+	CTokenBucket& m_cHandshakeBucket;
+
+	bool m_bRunning = false;
+	bool m_bWaitingForToken = false;
+	TimerId m_nRetryTimer = kInvalidTimerId;
+	uint32_t m_nAttempt = 0;
+	std::mt19937 m_Random;
+
+	bool m_bConnected = false;
+	bool m_bDropped = false; // lost a connection and not back yet
+	Clock::time_point m_DroppedTime;
+	Clock::time_point m_ConnectedTime;
+	// The client's event handlers reach the supervisor through this, it is cleared when the supervisor goes away
+	std::shared_ptr<CReconnectSupervisor*> m_pSelf = std::make_shared<CReconnectSupervisor*>(this);
+
+	std::atomic<uint64_t> m_nReconnects{ 0 };
+	std::atomic<uint64_t> m_nFailedAttempts{ 0 };
+	std::atomic<uint64_t> m_nLastRecoveryMs{ 0 };
+	std::atomic<uint64_t> m_nMaxRecoveryMs{ 0 };
+	std::atomic<uint64_t> m_nTotalRecoveryMs{ 0 };
+};
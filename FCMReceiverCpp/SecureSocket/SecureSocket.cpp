@@ -9,6 +9,8 @@
 #include "SecureSocket.h"
 
 #include <iostream>
+#include <map>
+#include <mutex>
 
 #ifndef LINUX
 // to avoid link problems in prod/test program
@@ -58,69 +60,223 @@ ASecureSocket::~ASecureSocket()
 {
 }
 
+namespace
+{
+   /* contexts and client sessions shared by all the sockets, freed before OpenSSL is cleaned up */
+   struct SharedSSLState
+   {
+      ~SharedSSLState()
+      {
+         for (auto& ctx : mapCtx)
+            SSL_CTX_free(ctx.second);
+         for (auto& session : mapSessions)
+            SSL_SESSION_free(session.second);
+      }
+
+      std::mutex                             mtxCtx;
+      std::map<std::string, SSL_CTX*>        mapCtx;
+      std::mutex                             mtxSessions;
+      std::map<std::string, SSL_SESSION*>    mapSessions;
+   };
+
+   SharedSSLState& GetSharedSSLState()
+   {
+      static SharedSSLState state;
+      return state;
+   }
+}
+
 void ASecureSocket::SetUpCtxClient(SSLSocket& Socket)
 {
+   Socket.m_pCTXSSL = GetSharedCtx(false);
+   Socket.m_pMTHDSSL = (Socket.m_pCTXSSL != nullptr) ?
+      const_cast<SSL_METHOD*>(SSL_CTX_get_ssl_method(Socket.m_pCTXSSL)) : nullptr;
+}
+
+void ASecureSocket::SetUpCtxServer(SSLSocket& Socket)
+{
+   Socket.m_pCTXSSL = GetSharedCtx(true);
+   Socket.m_pMTHDSSL = (Socket.m_pCTXSSL != nullptr) ?
+      const_cast<SSL_METHOD*>(SSL_CTX_get_ssl_method(Socket.m_pCTXSSL)) : nullptr;
+}
+
+SSL_CTX* ASecureSocket::GetSharedCtx(bool bServer)
+{
+   const std::string strKey = std::string(bServer ? "server|" : "client|") +
+      std::to_string(static_cast<int>(m_eOpenSSLProtocol)) + '|' +
+      m_strCAFile + '|' + m_strSSLCertFile + '|' + m_strSSLKeyFile;
+
+   SharedSSLState& state = GetSharedSSLState();
+   std::lock_guard<std::mutex> lock(state.mtxCtx);
+
+   SSL_CTX* pCtx;
+   auto it = state.mapCtx.find(strKey);
+   if (it != state.mapCtx.end())
+      pCtx = it->second;
+   else
+   {
+      pCtx = CreateCtx(bServer);
+      if (pCtx == nullptr)
+         return nullptr;
+      state.mapCtx.emplace(strKey, pCtx);
+   }
+
+   // the caller's reference, released by ShutdownSSL()
+   SSL_CTX_up_ref(pCtx);
+   return pCtx;
+}
+
+SSL_CTX* ASecureSocket::CreateCtx(bool bServer)
+{
+   const SSL_METHOD* pMethod;
    switch (m_eOpenSSLProtocol)
    {
       default:
       case OpenSSLProtocol::TLS:
          // Standard Protocol as of 11/2018, OpenSSL will choose highest possible TLS standard between peers
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(TLS_client_method());
+         pMethod = bServer ? TLS_server_method() : TLS_client_method();
          break;
 
       case OpenSSLProtocol::SSL_V23:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv23_client_method());
+         pMethod = bServer ? SSLv23_server_method() : SSLv23_client_method();
          break;
 
       #ifndef LINUX
       // deprecated in newer versions of OpenSSL
       //case OpenSSLProtocol::SSL_V2:
-         //Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv2_client_method());
+         //pMethod = bServer ? SSLv2_server_method() : SSLv2_client_method();
          //break;
       #endif
 
       // deprecated
       /*case OpenSSLProtocol::SSL_V3:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv3_client_method());
+         pMethod = bServer ? SSLv3_server_method() : SSLv3_client_method();
          break;*/
 
       case OpenSSLProtocol::TLS_V1:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(TLSv1_client_method());
+         pMethod = bServer ? TLSv1_server_method() : TLSv1_client_method();
          break;
    }
-   Socket.m_pCTXSSL = SSL_CTX_new(Socket.m_pMTHDSSL);
+
+   SSL_CTX* pCtx = SSL_CTX_new(pMethod);
+   if (pCtx == nullptr)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[SecureSocket][Error] SSL_CTX_new failed.");
+      return nullptr;
+   }
+
+   //SSL_CTX_set_options(pCtx, SSL_OP_SINGLE_DH_USE);
+   //SSL_CTX_set_cert_verify_callback(pCtx, AlwaysTrueCallback, nullptr);
+
+   /* process SSL certificates */
+   /* Load the server certificate, or the optional client certificate, into the SSL context. */
+   if (!m_strSSLCertFile.empty())
+   {
+      if (SSL_CTX_use_certificate_file(pCtx, m_strSSLCertFile.c_str(), SSL_FILETYPE_PEM) <= 0)
+      {
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
+            m_oLog("[SecureSocket][Error] Loading cert file failed.");
+         //ERR_print_errors_fp(stdout);
+         SSL_CTX_free(pCtx);
+         return nullptr;
+      }
+   }
+   /* Load trusted CA. Mandatory for the client to verify server's certificate */
+   if (!m_strCAFile.empty())
+   {
+      if (!SSL_CTX_load_verify_locations(pCtx, m_strCAFile.c_str(), nullptr))
+      {
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
+            m_oLog("[SecureSocket][Error] Loading CA file failed.");
+         SSL_CTX_free(pCtx);
+         return nullptr;
+      }
+      /* Set to require peer (client) certificate verification. */
+      //SSL_CTX_set_verify(pCtx, SSL_VERIFY_PEER, VerifyCallback);
+      /* Set the verification depth to 1 */
+      SSL_CTX_set_verify_depth(pCtx, 1);
+   }
+   /* Load a private-key into the SSL_CTX structure.
+    * set key file that corresponds to the server or client certificate.
+    * In the SSL handshake, a certificate (which contains the public key) is transmitted to allow
+    * the peer to use it for encryption. The encrypted message sent from the peer can be decrypted
+    * only using the private key. */
+   if (!m_strSSLKeyFile.empty())
+   {
+      if (SSL_CTX_use_PrivateKey_file(pCtx, m_strSSLKeyFile.c_str(), SSL_FILETYPE_PEM) <= 0)
+      {
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
+            m_oLog("[SecureSocket][Error] Loading key file failed.");
+         //ERR_print_errors_fp(stdout);
+         SSL_CTX_free(pCtx);
+         return nullptr;
+      }
+
+      /* verify private key */
+      /*if (!SSL_CTX_check_private_key(pCtx))
+      {
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
+            m_oLog("[SecureSocket][Error] Private key does not match the public certificate.");
+         SSL_CTX_free(pCtx);
+         return nullptr;
+      }*/
+   }
+
+   if (!bServer)
+   {
+      /* sessions are kept per host:port by OnNewSession() rather than by the context,
+       * with TLS 1.3 they arrive after the handshake */
+      SSL_CTX_set_session_cache_mode(pCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_sess_set_new_cb(pCtx, OnNewSession);
+   }
+   /* a server context lives as long as the process, so the tickets it issues stay
+    * valid across connections and clients can resume */
+
+   return pCtx;
 }
 
-void ASecureSocket::SetUpCtxServer(SSLSocket& Socket)
+void ASecureSocket::SetUpSessionResumption(SSL* pSSL, const std::string* pSessionKey)
 {
-   switch (m_eOpenSSLProtocol)
-   {
-      default:
-      case OpenSSLProtocol::TLS:
-         // Standard Protocol as of 11/2018, OpenSSL will choose highest possible TLS standard between peers
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(TLS_server_method());
-         break;
+   SSL_set_app_data(pSSL, const_cast<std::string*>(pSessionKey));
 
-      #ifndef LINUX
-      //case OpenSSLProtocol::SSL_V2:
-         //Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv2_server_method());
-         //break;
-      #endif
+   SharedSSLState& state = GetSharedSSLState();
+   std::lock_guard<std::mutex> lock(state.mtxSessions);
 
-      // deprecated
-      /*case OpenSSLProtocol::SSL_V3:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv3_server_method());
-         break;*/
+   auto it = state.mapSessions.find(*pSessionKey);
+   if (it != state.mapSessions.end() && SSL_SESSION_is_resumable(it->second))
+      SSL_set_session(pSSL, it->second);
+}
 
-      case OpenSSLProtocol::TLS_V1:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(TLSv1_server_method());
-         break;
+void ASecureSocket::ForgetSession(const std::string& strSessionKey)
+{
+   SharedSSLState& state = GetSharedSSLState();
+   std::lock_guard<std::mutex> lock(state.mtxSessions);
 
-      case OpenSSLProtocol::SSL_V23:
-         Socket.m_pMTHDSSL = const_cast<SSL_METHOD*>(SSLv23_server_method());
-         break;
+   auto it = state.mapSessions.find(strSessionKey);
+   if (it != state.mapSessions.end())
+   {
+      SSL_SESSION_free(it->second);
+      state.mapSessions.erase(it);
    }
-   Socket.m_pCTXSSL = SSL_CTX_new(Socket.m_pMTHDSSL);
+}
+
+int ASecureSocket::OnNewSession(SSL* pSSL, SSL_SESSION* pSession)
+{
+   const std::string* pSessionKey = static_cast<const std::string*>(SSL_get_app_data(pSSL));
+   if (pSessionKey == nullptr || pSessionKey->empty())
+      return 0;
+
+   SharedSSLState& state = GetSharedSSLState();
+   std::lock_guard<std::mutex> lock(state.mtxSessions);
+
+   SSL_SESSION*& pCached = state.mapSessions[*pSessionKey];
+   if (pCached != nullptr)
+      SSL_SESSION_free(pCached);
+   pCached = pSession;
+
+   // returning 1 keeps the reference OpenSSL passed in
+   return 1;
 }
 
 void ASecureSocket::InitializeSSL()
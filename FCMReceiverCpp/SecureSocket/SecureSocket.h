@@ -115,11 +115,17 @@ public:
 
 protected:
    // object methods
+   /* contexts are created and configured once per protocol and certificate files, then shared
+    * by every socket of the process, each socket holds a reference released by ShutdownSSL() */
    void SetUpCtxClient(SSLSocket& Socket);
    void SetUpCtxServer(SSLSocket& Socket);
    //void SetUpCtxCombined(SSLSocket& Socket);
 
    // class methods
+   /* client session resumption: the last session the server issued for strSessionKey
+    * ("host:port") is offered by the next connection, pSessionKey must outlive pSSL */
+   static void SetUpSessionResumption(SSL* pSSL, const std::string* pSessionKey);
+   static void ForgetSession(const std::string& strSessionKey);
    static void ShutdownSSL(SSLSocket& SSLSocket);
    static const char* GetSSLErrorString(int iErrorCode);
    static int AlwaysTrueCallback(X509_STORE_CTX* pCTX, void* pArg);
@@ -132,6 +138,10 @@ protected:
    //std::string          m_strSSLKeyPwd;
 
 private:
+   SSL_CTX* GetSharedCtx(bool bServer);
+   SSL_CTX* CreateCtx(bool bServer);
+   static int OnNewSession(SSL* pSSL, SSL_SESSION* pSession);
+
    friend class SecureSocketGlobalInitializer;
    class SecureSocketGlobalInitializer {
    public:
@@ -37,6 +37,8 @@
 #include <unistd.h>
 #endif
 
+#include "../LogUtil.h"
+
 #include <limits>
 #define ACCEPT_WAIT_INF_DELAY std::numeric_limits<size_t>::max()
 
@@ -79,6 +81,12 @@ public:
    static std::string StringFormat(const std::string strFormat, ...);
 
 protected:
+   // true if ENABLE_LOG is set and eLevel passes the LogUtil level filter
+   bool IsLogEnabled(const LogLevel eLevel) const
+   {
+      return (m_eSettingsFlags & ENABLE_LOG) && LogUtil::IsEnabled(eLevel);
+   }
+
    // Log printer callback
    /*mutable*/const LogFnCallback         m_oLog;
 
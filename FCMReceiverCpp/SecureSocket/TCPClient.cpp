@@ -6,6 +6,11 @@
 
 #include "TCPClient.h"
 
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
 CTCPClient::CTCPClient(const LogFnCallback oLogger,
                        const SettingsFlag eSettings /*= ALL_FLAGS*/) :
    ASocket(oLogger, eSettings),
@@ -30,7 +35,7 @@ bool CTCPClient::SetRcvTimeout(unsigned int msec_timeout) {
     // it's expecting an int but it doesn't matter...
     iErr = setsockopt(m_ConnectSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&msec_timeout, sizeof(struct timeval));
     if (iErr < 0) {
-        if (m_eSettingsFlags & ENABLE_LOG)
+        if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog("[TCPServer][Error] CTCPClient::SetRcvTimeout : Socket error in SO_RCVTIMEO call to setsockopt.");
 
         return false;
@@ -46,7 +51,7 @@ bool CTCPClient::SetRcvTimeout(struct timeval timeout) {
 
 	iErr = setsockopt(m_ConnectSocket, SOL_SOCKET, SO_RCVTIMEO, (char*) &timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPClient::SetRcvTimeout : Socket error in SO_RCVTIMEO call to setsockopt.");
 
 		return false;
@@ -68,7 +73,7 @@ bool CTCPClient::SetSndTimeout(unsigned int msec_timeout) {
     // it's expecting an int but it doesn't matter...
     iErr = setsockopt(m_ConnectSocket, SOL_SOCKET, SO_SNDTIMEO, (char*)&msec_timeout, sizeof(struct timeval));
     if (iErr < 0) {
-        if (m_eSettingsFlags & ENABLE_LOG)
+        if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog("[TCPServer][Error] CTCPClient::SetSndTimeout : Socket error in SO_SNDTIMEO call to setsockopt.");
 
         return false;
@@ -84,7 +89,7 @@ bool CTCPClient::SetSndTimeout(struct timeval timeout) {
 
 	iErr = setsockopt(m_ConnectSocket, SOL_SOCKET, SO_SNDTIMEO, (char*) &timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPClient::SetSndTimeout : Socket error in SO_SNDTIMEO call to setsockopt.");
 
 		return false;
@@ -94,13 +99,34 @@ bool CTCPClient::SetSndTimeout(struct timeval timeout) {
 }
 #endif
 
+bool CTCPClient::SetNonBlocking(bool bNonBlocking)
+{
+#ifdef WINDOWS
+   u_long iMode = bNonBlocking ? 1 : 0;
+   int iErr = ioctlsocket(m_ConnectSocket, FIONBIO, &iMode);
+#else
+   int iErr = -1;
+   int iFlags = fcntl(m_ConnectSocket, F_GETFL, 0);
+   if (iFlags >= 0)
+      iErr = fcntl(m_ConnectSocket, F_SETFL, bNonBlocking ? (iFlags | O_NONBLOCK) : (iFlags & ~O_NONBLOCK));
+#endif
+   if (iErr < 0) {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPClient][Error] CTCPClient::SetNonBlocking : Socket error while changing the blocking mode.");
+
+      return false;
+   }
+
+   return true;
+}
+
 // Connexion au serveur
 bool CTCPClient::Connect(const std::string& strServer, const std::string& strPort)
 {
    if (m_eStatus == CONNECTED)
    {
       Disconnect();
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_WARNING))
          m_oLog("[TCPClient][Warning] Opening a new connexion. The last one was automatically closed.");
    }
 
@@ -117,7 +143,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
    int iResult = getaddrinfo(strServer.c_str(), strPort.c_str(), &m_HintsAddrInfo, &m_pResultAddrInfo);
    if (iResult != 0)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog(StringFormat("[TCPClient][Error] getaddrinfo failed : %d", iResult));
 
       if (m_pResultAddrInfo != nullptr)
@@ -136,7 +162,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
 
    if (m_ConnectSocket == INVALID_SOCKET)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog(StringFormat("[TCPClient][Error] socket failed : %d", WSAGetLastError()));
 
       freeaddrinfo(m_pResultAddrInfo);
@@ -151,7 +177,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
    iErr = setsockopt(m_ConnectSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
    if (iErr == INVALID_SOCKET)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog("[TCPClient][Error] Socket error in call to setsockopt");
 
       closesocket(m_ConnectSocket);
@@ -192,7 +218,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
 
       // retry mechanism
       //if (uRetry < m_uRetryCount)
-         //if (m_eSettingsFlags & ENABLE_LOG)
+         //if (IsLogEnabled(LOG_LEVEL_ERROR))
             /*m_oLog(StringFormat("[TCPClient][Error] connect retry %u after %u second(s)",
             m_uRetryCount + 1, m_uRetryPeriod));*/
 
@@ -211,7 +237,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
       m_eStatus = CONNECTED;
       return true;
    }
-   if (m_eSettingsFlags & ENABLE_LOG)
+   if (IsLogEnabled(LOG_LEVEL_ERROR))
       m_oLog(StringFormat("[TCPClient][Error] Unable to connect to server : %d", WSAGetLastError()));
 
    #else
@@ -224,7 +250,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
    int iAddrInfoRet = getaddrinfo(strServer.c_str(), strPort.c_str(), &m_HintsAddrInfo, &m_pResultAddrInfo);
    if (iAddrInfoRet != 0)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog(StringFormat("[TCPClient][Error] getaddrinfo failed : %s", gai_strerror(iAddrInfoRet)));
 
       if (m_pResultAddrInfo != nullptr)
@@ -274,7 +300,7 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
    }
 
    /* No address succeeded */
-   if (m_eSettingsFlags & ENABLE_LOG)
+   if (IsLogEnabled(LOG_LEVEL_ERROR))
       m_oLog("[TCPClient][Error] no such host.");
 
    #endif
@@ -282,6 +308,104 @@ bool CTCPClient::Connect(const std::string& strServer, const std::string& strPor
    return false;
 }
 
+// Non-blocking connexion, completes in the background
+bool CTCPClient::BeginConnect(const std::string& strServer, const std::string& strPort)
+{
+   memset(&m_HintsAddrInfo, 0, sizeof m_HintsAddrInfo);
+   m_HintsAddrInfo.ai_family = AF_INET;
+   m_HintsAddrInfo.ai_socktype = SOCK_STREAM;
+   m_HintsAddrInfo.ai_protocol = IPPROTO_TCP;
+
+   /* blocks while the name is resolved, event loops pass an address resolved beforehand */
+   int iResult = getaddrinfo(strServer.c_str(), strPort.c_str(), &m_HintsAddrInfo, &m_pResultAddrInfo);
+   if (iResult != 0)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog(StringFormat("[TCPClient][Error] getaddrinfo failed : %d", iResult));
+
+      if (m_pResultAddrInfo != nullptr)
+      {
+         freeaddrinfo(m_pResultAddrInfo);
+         m_pResultAddrInfo = nullptr;
+      }
+
+      return false;
+   }
+
+   bool bStarted = BeginConnect(m_pResultAddrInfo->ai_addr, static_cast<int>(m_pResultAddrInfo->ai_addrlen));
+
+   freeaddrinfo(m_pResultAddrInfo);
+   m_pResultAddrInfo = nullptr;
+   return bStarted;
+}
+
+bool CTCPClient::BeginConnect(const struct sockaddr* pAddress, int iAddressLen)
+{
+   if (m_eStatus == CONNECTED)
+   {
+      Disconnect();
+      if (IsLogEnabled(LOG_LEVEL_WARNING))
+         m_oLog("[TCPClient][Warning] Opening a new connexion. The last one was automatically closed.");
+   }
+
+   m_ConnectSocket = socket(pAddress->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+   if (m_ConnectSocket == INVALID_SOCKET)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPClient][Error] socket failed.");
+
+      return false;
+   }
+
+   int on = 1;
+   setsockopt(m_ConnectSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+
+   bool bStarted = SetNonBlocking(true);
+   if (bStarted)
+   {
+      int iResult = connect(m_ConnectSocket, pAddress, iAddressLen);
+      #ifdef WINDOWS
+      bStarted = iResult != SOCKET_ERROR || WSAGetLastError() == WSAEWOULDBLOCK;
+      #else
+      bStarted = iResult >= 0 || errno == EINPROGRESS;
+      #endif
+   }
+
+   if (!bStarted)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPClient][Error] Unable to start connecting to server.");
+
+      #ifdef WINDOWS
+      closesocket(m_ConnectSocket);
+      #else
+      close(m_ConnectSocket);
+      #endif
+      m_ConnectSocket = INVALID_SOCKET;
+      return false;
+   }
+
+   /* the socket is open, wait until it is writable then check GetConnectError() */
+   m_eStatus = CONNECTED;
+   return true;
+}
+
+int CTCPClient::GetConnectError() const
+{
+   int iError = 0;
+   #ifdef WINDOWS
+   int iLen = sizeof(iError);
+   #else
+   socklen_t iLen = sizeof(iError);
+   #endif
+
+   if (getsockopt(m_ConnectSocket, SOL_SOCKET, SO_ERROR, (char*)&iError, &iLen) < 0)
+      return -1;
+
+   return iError;
+}
+
 bool CTCPClient::Send(const char* pData, const size_t uSize) const
 {
    if (!pData || !uSize)
@@ -289,7 +413,7 @@ bool CTCPClient::Send(const char* pData, const size_t uSize) const
 
    if (m_eStatus != CONNECTED)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog("[TCPClient][Error] send failed : not connected to a server.");
       
       return false;
@@ -305,7 +429,7 @@ bool CTCPClient::Send(const char* pData, const size_t uSize) const
 
       if (nSent < 0)
       {
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog("[TCPClient][Error] Socket error in call to send.");
 
          return false;
@@ -337,7 +461,7 @@ int CTCPClient::Receive(char* pData, const size_t uSize, bool bReadFully /*= tru
 
    if (m_eStatus != CONNECTED)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog("[TCPClient][Error] recv failed : not connected to a server.");
 
       return -1;
@@ -369,7 +493,7 @@ int CTCPClient::Receive(char* pData, const size_t uSize, bool bReadFully /*= tru
            continue;
          }
 
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog("[TCPClient][Error] Socket error in call to recv.");
 
          break;
@@ -395,7 +519,7 @@ bool CTCPClient::Disconnect()
    int iResult = shutdown(m_ConnectSocket, SD_SEND);
    if (iResult == SOCKET_ERROR)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog(StringFormat("[TCPClient][Error] shutdown failed : %d", WSAGetLastError()));
       
       return false;
@@ -49,6 +49,9 @@ public:
 
 	// Session
    bool Connect(const std::string& strServer, const std::string& strPort); // connect to a TCP server
+   bool BeginConnect(const std::string& strServer, const std::string& strPort); // start a non-blocking connect
+   bool BeginConnect(const struct sockaddr* pAddress, int iAddressLen); // the same to an address resolved beforehand
+   int  GetConnectError() const; // SO_ERROR once the socket is writable, 0 when the connect succeeded
    bool Disconnect(); // disconnect from the TCP server
    bool Send(const char* pData, const size_t uSize) const; // send data to a TCP server
    bool Send(const std::string& strData) const;
@@ -64,6 +67,9 @@ public:
    bool SetSndTimeout(struct timeval Timeout);
 #endif
 
+   // Can be called after Connect, send/recv then return immediately instead of waiting
+   bool SetNonBlocking(bool bNonBlocking);
+
    bool IsConnected() const { return m_eStatus == CONNECTED; }
 
    Socket GetSocketDescriptor() const { return m_ConnectSocket; }
@@ -34,102 +34,65 @@ bool CTCPSSLClient::SetSndTimeout(struct timeval timeout){
 }
 #endif
 
-// Connexion au serveur
-bool CTCPSSLClient::Connect(const std::string& strServer, const std::string& strPort)
+/* take the shared SSL context and create the connection state for the connected TCP socket */
+bool CTCPSSLClient::SetUpSSL()
 {
-   if (m_TCPClient.Connect(strServer, strPort))
-   {
-      m_SSLConnectSocket.m_SockFd = m_TCPClient.m_ConnectSocket;
-      SetUpCtxClient(m_SSLConnectSocket);
+   m_SSLConnectSocket.m_SockFd = m_TCPClient.m_ConnectSocket;
+   SetUpCtxClient(m_SSLConnectSocket);
 
-      if (m_SSLConnectSocket.m_pCTXSSL == nullptr)
-      {
-         if (m_eSettingsFlags & ENABLE_LOG)
-            m_oLog("[TCPSSLClient][Error] SSL_CTX_new failed.");
-         //ERR_print_errors_fp(stdout);
-         return false;
-      }
-
-      /* process SSL certificates */
-      /* Load a client certificate into the SSL_CTX structure. */
-      if (!m_strSSLCertFile.empty())
-      {
-         if (SSL_CTX_use_certificate_file(m_SSLConnectSocket.m_pCTXSSL,
-            m_strSSLCertFile.c_str(), SSL_FILETYPE_PEM) <= 0)
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLClient][Error] Loading cert file failed.");
+   if (m_SSLConnectSocket.m_pCTXSSL == nullptr)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPSSLClient][Error] SSL context setup failed.");
+      //ERR_print_errors_fp(stdout);
+      return false;
+   }
 
-            return false;
-         }
-      }
-      /* Load trusted CA. Mandatory to verify server's certificate */
-      if (!m_strCAFile.empty())
-      {
-         if (!SSL_CTX_load_verify_locations(m_SSLConnectSocket.m_pCTXSSL, m_strCAFile.c_str(), nullptr))
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLClient][Error] Loading CA file failed.");
+   /* create new SSL connection state */
+   m_SSLConnectSocket.m_pSSL = SSL_new(m_SSLConnectSocket.m_pCTXSSL);
+   SSL_set_fd(m_SSLConnectSocket.m_pSSL, m_SSLConnectSocket.m_SockFd);
 
-            return false;
-         }
-         SSL_CTX_set_verify_depth(m_SSLConnectSocket.m_pCTXSSL, 1);
-      }
-      /* Load a private-key into the SSL_CTX structure.
-       * set key file that corresponds to the server or client certificate.
-       * In the SSL handshake, a certificate (which contains the public key) is transmitted to allow
-       * the peer to use it for encryption. The encrypted message sent from the peer can be decrypted
-       * only using the private key. */
-      if (!m_strSSLKeyFile.empty())
-      {
-         if (SSL_CTX_use_PrivateKey_file(m_SSLConnectSocket.m_pCTXSSL,
-            m_strSSLKeyFile.c_str(), SSL_FILETYPE_PEM) <= 0)
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLClient][Error] Loading key file failed.");
-            //ERR_print_errors_fp(stdout);
-            return false;
-         }
+   /* offer the session of the last connection to this server for an abbreviated handshake */
+   SetUpSessionResumption(m_SSLConnectSocket.m_pSSL, &m_strSessionKey);
 
-         /* verify private key */
-         /*if (!SSL_CTX_check_private_key(m_SSLConnectSocket.m_pCTXSSL))
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLClient][Error] Private key does not match the public certificate.");
-            return false;
-         }*/
-      }
-      //SSL_CTX_set_cert_verify_callback(m_SSLConnectSocket.m_pCTXSSL, AlwaysTrueCallback, nullptr);
+   return true;
+}
 
-      /* create new SSL connection state */
-      m_SSLConnectSocket.m_pSSL = SSL_new(m_SSLConnectSocket.m_pCTXSSL);
-      SSL_set_fd(m_SSLConnectSocket.m_pSSL, m_SSLConnectSocket.m_SockFd);
+// Connexion au serveur
+bool CTCPSSLClient::Connect(const std::string& strServer, const std::string& strPort)
+{
+   if (m_TCPClient.Connect(strServer, strPort))
+   {
+      m_strSessionKey = strServer + ':' + strPort;
+      if (!SetUpSSL())
+         return false;
 
       /* initiate the TLS/SSL handshake with an TLS/SSL server */
       int iResult = SSL_connect(m_SSLConnectSocket.m_pSSL);
       if (iResult > 0)
       {
          /* The data can now be transmitted securely over this connection. */
-         if (m_eSettingsFlags & ENABLE_LOG)
-            m_oLog(StringFormat("[TCPSSLClient][Info] Connected with '%s' encryption.",
-                             SSL_get_cipher(m_SSLConnectSocket.m_pSSL)));
+         if (IsLogEnabled(LOG_LEVEL_INFO))
+            m_oLog(StringFormat("[TCPSSLClient][Info] Connected with '%s' encryption%s.",
+                             SSL_get_cipher(m_SSLConnectSocket.m_pSSL),
+                             IsSessionReused() ? " (resumed session)" : ""));
          
          /*if (SSL_get_peer_certificate(m_SSLConnectSocket.m_pSSL) != nullptr)
          {
             if (SSL_get_verify_result(m_SSLConnectSocket.m_pSSL) == X509_V_OK)
             {
-               if (m_eSettingsFlags & ENABLE_LOG)
+               if (IsLogEnabled(LOG_LEVEL_ERROR))
                   m_oLog("client verification with SSL_get_verify_result() succeeded.");
             }
             else
             {
-               if (m_eSettingsFlags & ENABLE_LOG)
+               if (IsLogEnabled(LOG_LEVEL_ERROR))
                   m_oLog("client verification with SSL_get_verify_result() failed.\n");
 
                return false;
             }
          }
-         else if (m_eSettingsFlags & ENABLE_LOG)
+         else if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog("the peer certificate was not presented.");*/
 
          return true;
@@ -139,24 +102,99 @@ bool CTCPSSLClient::Connect(const std::string& strServer, const std::string& str
       ERR_print_errors_fp(stdout);
       #endif
 
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog(StringFormat("[TCPSSLClient][Error] SSL_connect failed (Error=%d | %s)",
             iResult, GetSSLErrorString(SSL_get_error(m_SSLConnectSocket.m_pSSL, iResult))));
 
+      // do not offer a session the server may have choked on again
+      ForgetSession(m_strSessionKey);
+
       return false;
    }
 
-   if (m_eSettingsFlags & ENABLE_LOG)
+   if (IsLogEnabled(LOG_LEVEL_ERROR))
       m_oLog("[TCPSSLClient][Error] Unable to establish a TCP connection with the server.");
 
    return false;
 }
 
+bool CTCPSSLClient::BeginConnect(const std::string& strServer, const std::string& strPort)
+{
+   if (!m_TCPClient.BeginConnect(strServer, strPort))
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPSSLClient][Error] Unable to start a TCP connection with the server.");
+
+      return false;
+   }
+
+   return BeginHandshake(strServer, strPort);
+}
+
+bool CTCPSSLClient::BeginConnect(const std::string& strServer, const std::string& strPort,
+                                 const struct sockaddr* pAddress, int iAddressLen)
+{
+   if (!m_TCPClient.BeginConnect(pAddress, iAddressLen))
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPSSLClient][Error] Unable to start a TCP connection with the server.");
+
+      return false;
+   }
+
+   return BeginHandshake(strServer, strPort);
+}
+
+bool CTCPSSLClient::BeginHandshake(const std::string& strServer, const std::string& strPort)
+{
+   m_strSessionKey = strServer + ':' + strPort;
+   if (!SetUpSSL() || !SetNonBlocking(true))
+   {
+      Disconnect();
+      return false;
+   }
+
+   SSL_set_connect_state(m_SSLConnectSocket.m_pSSL);
+   return true;
+}
+
+int CTCPSSLClient::GetConnectError() const
+{
+   return m_TCPClient.GetConnectError();
+}
+
+int CTCPSSLClient::DoHandshake(int& iSSLError)
+{
+   iSSLError = SSL_ERROR_NONE;
+
+   ERR_clear_error();
+   int iResult = SSL_do_handshake(m_SSLConnectSocket.m_pSSL);
+   if (iResult == 1)
+   {
+      if (IsLogEnabled(LOG_LEVEL_INFO))
+         m_oLog(StringFormat("[TCPSSLClient][Info] Connected with '%s' encryption%s.",
+                          SSL_get_cipher(m_SSLConnectSocket.m_pSSL),
+                          IsSessionReused() ? " (resumed session)" : ""));
+      return 1;
+   }
+
+   iSSLError = SSL_get_error(m_SSLConnectSocket.m_pSSL, iResult);
+   if (iSSLError == SSL_ERROR_WANT_READ || iSSLError == SSL_ERROR_WANT_WRITE)
+      return 0;
+
+   if (IsLogEnabled(LOG_LEVEL_ERROR))
+      m_oLog(StringFormat("[TCPSSLClient][Error] SSL handshake failed (Error=%d | %s)",
+         iResult, GetSSLErrorString(iSSLError)));
+
+   ForgetSession(m_strSessionKey);
+   return -1;
+}
+
 bool CTCPSSLClient::Send(const char* pData, const size_t uSize) const
 {
    if (m_TCPClient.m_eStatus != CTCPClient::CONNECTED)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog("[TCPSSLClient][Error] SSL send failed : not connected to an SSL server.");
 
       return false;
@@ -169,7 +207,7 @@ bool CTCPSSLClient::Send(const char* pData, const size_t uSize) const
       int nSent = SSL_write(m_SSLConnectSocket.m_pSSL, pData + total, uSize - total);
       if (nSent <= 0)
       {
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog(StringFormat("[TCPSSLClient][Error] SSL_write failed (Error=%d | %s)",
                   nSent, GetSSLErrorString(SSL_get_error(m_SSLConnectSocket.m_pSSL, nSent))));
 
@@ -214,7 +252,7 @@ int CTCPSSLClient::Receive(char* pData, const size_t uSize, bool bReadFully /*=
 {
    if (m_TCPClient.m_eStatus != CTCPClient::CONNECTED)
    {
-      if (m_eSettingsFlags & ENABLE_LOG)
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
          m_oLog("[TCPSSLClient][Error] SSL recv failed : not connected to a server.");
 
       return -1;
@@ -227,7 +265,7 @@ int CTCPSSLClient::Receive(char* pData, const size_t uSize, bool bReadFully /*=
 
       if (nRecvd <= 0)
       {
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog(StringFormat("[TCPSSLClient][Error] SSL_read failed (Error=%d | %s)",
                   nRecvd, GetSSLErrorString(SSL_get_error(m_SSLConnectSocket.m_pSSL, nRecvd))));
          
@@ -241,6 +279,74 @@ int CTCPSSLClient::Receive(char* pData, const size_t uSize, bool bReadFully /*=
    return total;
 }
 
+bool CTCPSSLClient::SetNonBlocking(bool bNonBlocking)
+{
+   if (m_SSLConnectSocket.m_pSSL == nullptr)
+      return false;
+
+   if (bNonBlocking)
+   {
+      /* a write that returned SSL_ERROR_WANT_WRITE is retried from a buffer that may have
+       * grown (and moved) in the meantime, and may complete partially.
+       * Idle connections give their read/write buffers back to OpenSSL. */
+      SSL_set_mode(m_SSLConnectSocket.m_pSSL, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                   SSL_MODE_RELEASE_BUFFERS);
+   }
+
+   return m_TCPClient.SetNonBlocking(bNonBlocking);
+}
+
+int CTCPSSLClient::Read(char* pData, const size_t uSize, int& iSSLError)
+{
+   iSSLError = SSL_ERROR_NONE;
+   if (m_TCPClient.m_eStatus != CTCPClient::CONNECTED)
+   {
+      iSSLError = SSL_ERROR_SSL;
+      return -1;
+   }
+
+   ERR_clear_error();
+   int nRecvd = SSL_read(m_SSLConnectSocket.m_pSSL, pData, static_cast<int>(uSize));
+   if (nRecvd <= 0)
+   {
+      iSSLError = SSL_get_error(m_SSLConnectSocket.m_pSSL, nRecvd);
+      if (iSSLError != SSL_ERROR_WANT_READ && iSSLError != SSL_ERROR_WANT_WRITE &&
+          iSSLError != SSL_ERROR_ZERO_RETURN && (IsLogEnabled(LOG_LEVEL_ERROR)))
+         m_oLog(StringFormat("[TCPSSLClient][Error] SSL_read failed (Error=%d | %s)",
+               nRecvd, GetSSLErrorString(iSSLError)));
+   }
+
+   return nRecvd;
+}
+
+int CTCPSSLClient::Write(const char* pData, const size_t uSize, int& iSSLError)
+{
+   iSSLError = SSL_ERROR_NONE;
+   if (m_TCPClient.m_eStatus != CTCPClient::CONNECTED)
+   {
+      iSSLError = SSL_ERROR_SSL;
+      return -1;
+   }
+
+   ERR_clear_error();
+   int nSent = SSL_write(m_SSLConnectSocket.m_pSSL, pData, static_cast<int>(uSize));
+   if (nSent <= 0)
+   {
+      iSSLError = SSL_get_error(m_SSLConnectSocket.m_pSSL, nSent);
+      if (iSSLError != SSL_ERROR_WANT_READ && iSSLError != SSL_ERROR_WANT_WRITE &&
+          (IsLogEnabled(LOG_LEVEL_ERROR)))
+         m_oLog(StringFormat("[TCPSSLClient][Error] SSL_write failed (Error=%d | %s)",
+               nSent, GetSSLErrorString(iSSLError)));
+   }
+
+   return nSent;
+}
+
+bool CTCPSSLClient::IsSessionReused() const
+{
+   return m_SSLConnectSocket.m_pSSL != nullptr && SSL_session_reused(m_SSLConnectSocket.m_pSSL) == 1;
+}
+
 bool CTCPSSLClient::IsConnected() const
 {
     return m_TCPClient.m_eStatus == CTCPClient::CONNECTED;
@@ -27,6 +27,16 @@ public:
    /* connect to a TCP SSL server */
    bool Connect(const std::string& strServer, const std::string& strPort);
 
+   /* non-blocking connect: BeginConnect() starts the TCP connection, once the socket
+    * is writable GetConnectError() tells if it succeeded, then DoHandshake() is called
+    * on every readiness event until it returns 1 (connected) or -1 (failed) */
+   bool BeginConnect(const std::string& strServer, const std::string& strPort);
+   /* the same to an address resolved beforehand, strServer and strPort only name the TLS session */
+   bool BeginConnect(const std::string& strServer, const std::string& strPort,
+                     const struct sockaddr* pAddress, int iAddressLen);
+   int GetConnectError() const;
+   int DoHandshake(int& iSSLError);
+
    bool SetRcvTimeout(unsigned int timeout);
    bool SetSndTimeout(unsigned int timeout);
 
@@ -49,11 +59,28 @@ public:
 
    int Receive(char* pData, const size_t uSize, bool bReadFully = true) const;
 
+   /* non-blocking I/O, to be driven by socket readiness events
+    * ret > 0   : bytes read/written
+    * ret <= 0  : iSSLError holds SSL_get_error(), SSL_ERROR_WANT_READ and
+    *             SSL_ERROR_WANT_WRITE mean retry once the socket is ready */
+   bool SetNonBlocking(bool bNonBlocking);
+   int Read(char* pData, const size_t uSize, int& iSSLError);
+   int Write(const char* pData, const size_t uSize, int& iSSLError);
+
+   Socket GetSocketDescriptor() const { return m_TCPClient.GetSocketDescriptor(); }
+
    bool IsConnected() const;
 
+   /* true if the handshake resumed the session of an earlier connection to the same server */
+   bool IsSessionReused() const;
+
 protected:
+   bool SetUpSSL();
+   bool BeginHandshake(const std::string& strServer, const std::string& strPort);
+
    CTCPClient  m_TCPClient;
    SSLSocket   m_SSLConnectSocket;
+   std::string m_strSessionKey; // host:port the session cache is keyed by
 
 };
 
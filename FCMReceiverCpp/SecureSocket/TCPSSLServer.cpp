@@ -41,78 +41,15 @@ bool CTCPSSLServer::Listen(SSLSocket& ClientSocket, size_t msec /*= ACCEPT_WAIT_
 {
    if (m_TCPServer.Listen(ClientSocket.m_SockFd, msec))
    {
-      SetUpCtxServer(ClientSocket);
-
-      if (ClientSocket.m_pCTXSSL == nullptr)
-      {
-         if (m_eSettingsFlags & ENABLE_LOG)
-            m_oLog("[TCPSSLServer][Error] SSL CTX failed.");
-         //ERR_print_errors_fp(stdout);
+      if (!SetUpSSL(ClientSocket))
          return false;
-      }
-
-      //SSL_CTX_set_options(ClientSocket.m_pCTXSSL, SSL_OP_SINGLE_DH_USE);
-      //SSL_CTX_set_cert_verify_callback(ClientSocket.m_pCTXSSL, AlwaysTrueCallback, nullptr);
-
-      /* Load server certificate into the SSL context. */
-      if (!m_strSSLCertFile.empty())
-      {
-         if (SSL_CTX_use_certificate_file(ClientSocket.m_pCTXSSL,
-            m_strSSLCertFile.c_str(), SSL_FILETYPE_PEM) <= 0)
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLServer][Error] Loading cert file failed.");
-            //ERR_print_errors_fp(stdout);
-            return false;
-         }
-      }
-      /* Load trusted CA file. */
-      if (!m_strCAFile.empty())
-      {
-         if (!SSL_CTX_load_verify_locations(ClientSocket.m_pCTXSSL, m_strCAFile.c_str(), nullptr))
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLServer][Error] Loading CA file failed.");
-
-            return false;
-         }
-         /* Set to require peer (client) certificate verification. */
-         //SSL_CTX_set_verify(m_SSLConnectSocket.m_pCTXSSL, SSL_VERIFY_PEER, VerifyCallback);
-         /* Set the verification depth to 1 */
-         SSL_CTX_set_verify_depth(ClientSocket.m_pCTXSSL, 1);
-      }
-      /* Load the server private-key into the SSL context. */
-      if (!m_strSSLKeyFile.empty())
-      {
-         if (SSL_CTX_use_PrivateKey_file(ClientSocket.m_pCTXSSL,
-            m_strSSLKeyFile.c_str(), SSL_FILETYPE_PEM) <= 0)
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLServer][Error] Loading key file failed.");
-            //ERR_print_errors_fp(stdout);
-            return false;
-         }
-
-         // verify private key
-         /*if (!SSL_CTX_check_private_key(ClientSocket.m_pCTXSSL))
-         {
-            if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog("[TCPSSLServer][Error] Private key does not match the public certificate.");
-
-            return false;
-         }*/
-      }
-
-      ClientSocket.m_pSSL = SSL_new(ClientSocket.m_pCTXSSL);
-      // set the socket directly into the SSL structure or we can use a BIO structure
-      SSL_set_fd(ClientSocket.m_pSSL, ClientSocket.m_SockFd);
 
       /* wait for a TLS/SSL client to initiate a TLS/SSL handshake */
       int iSSLErr = SSL_accept(ClientSocket.m_pSSL);
       if (iSSLErr <= 0)
       {
          //Error occurred, log and close down ssl
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog(StringFormat("[TCPSSLServer][Error] accept failed. (Error=%d | %s)",
                              iSSLErr, GetSSLErrorString(SSL_get_error(ClientSocket.m_pSSL, iSSLErr))));
 
@@ -133,12 +70,70 @@ bool CTCPSSLServer::Listen(SSLSocket& ClientSocket, size_t msec /*= ACCEPT_WAIT_
       return true;
    }
 
-   if (m_eSettingsFlags & ENABLE_LOG)
-      m_oLog("[TCPSSLServer][Error] Unable to accept an incoming TCP connection with a client.");
+   /* CTCPServer::Listen has logged the cause, a timeout is not an error */
+   if (IsLogEnabled(LOG_LEVEL_DEBUG))
+      m_oLog("[TCPSSLServer][Debug] Unable to accept an incoming TCP connection with a client.");
 
    return false;
 }
 
+/* accepts a client like Listen() but leaves the handshake to DoHandshake(), on a non-blocking socket */
+bool CTCPSSLServer::BeginAccept(SSLSocket& ClientSocket, size_t msec /*= ACCEPT_WAIT_INF_DELAY*/)
+{
+   if (!m_TCPServer.Listen(ClientSocket.m_SockFd, msec))
+   {
+      if (IsLogEnabled(LOG_LEVEL_DEBUG))
+         m_oLog("[TCPSSLServer][Debug] Unable to accept an incoming TCP connection with a client.");
+
+      return false;
+   }
+
+   if (!SetUpSSL(ClientSocket) || !SetNonBlocking(ClientSocket, true))
+      return false;
+
+   SSL_set_accept_state(ClientSocket.m_pSSL);
+   return true;
+}
+
+int CTCPSSLServer::DoHandshake(SSLSocket& ClientSocket, int& iSSLError) const
+{
+   iSSLError = SSL_ERROR_NONE;
+
+   ERR_clear_error();
+   int iResult = SSL_do_handshake(ClientSocket.m_pSSL);
+   if (iResult == 1)
+      return 1;
+
+   iSSLError = SSL_get_error(ClientSocket.m_pSSL, iResult);
+   if (iSSLError == SSL_ERROR_WANT_READ || iSSLError == SSL_ERROR_WANT_WRITE)
+      return 0;
+
+   if (IsLogEnabled(LOG_LEVEL_ERROR))
+      m_oLog(StringFormat("[TCPSSLServer][Error] accept failed. (Error=%d | %s)",
+         iResult, GetSSLErrorString(iSSLError)));
+
+   return -1;
+}
+
+bool CTCPSSLServer::SetUpSSL(SSLSocket& ClientSocket)
+{
+   /* the context, certificates included, is set up once and shared by all the accepted clients */
+   SetUpCtxServer(ClientSocket);
+
+   if (ClientSocket.m_pCTXSSL == nullptr)
+   {
+      if (IsLogEnabled(LOG_LEVEL_ERROR))
+         m_oLog("[TCPSSLServer][Error] SSL CTX failed.");
+      //ERR_print_errors_fp(stdout);
+      return false;
+   }
+
+   ClientSocket.m_pSSL = SSL_new(ClientSocket.m_pCTXSSL);
+   // set the socket directly into the SSL structure or we can use a BIO structure
+   SSL_set_fd(ClientSocket.m_pSSL, ClientSocket.m_SockFd);
+   return true;
+}
+
 bool CTCPSSLServer::HasPending(const SSLSocket& ClientSocket)
 {
    int pend;
@@ -171,7 +166,7 @@ int CTCPSSLServer::Receive(const SSLSocket& ClientSocket,
 
       if (nRecvd <= 0)
       {
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog(StringFormat("[TCPSSLServer][Error] SSL_read failed (Error=%d | %s)",
                   nRecvd, GetSSLErrorString(SSL_get_error(ClientSocket.m_pSSL, nRecvd))));
 
@@ -201,7 +196,7 @@ bool CTCPSSLServer::Send(const SSLSocket& ClientSocket, const char* pData, const
 
       if (nSent <= 0)
       {
-         if (m_eSettingsFlags & ENABLE_LOG)
+         if (IsLogEnabled(LOG_LEVEL_ERROR))
             m_oLog(StringFormat("[TCPSSLServer][Error] SSL_write failed (Error=%d | %s).",
             nSent, GetSSLErrorString(SSL_get_error(ClientSocket.m_pSSL, nSent))));
 
@@ -239,6 +234,67 @@ bool CTCPSSLServer::Disconnect(SSLSocket& ClientSocket) const
    return m_TCPServer.Disconnect(ClientSocket.m_SockFd);
 }
 
+bool CTCPSSLServer::SetNonBlocking(SSLSocket& ClientSocket, bool bNonBlocking) const
+{
+   if (ClientSocket.m_pSSL == nullptr)
+      return false;
+
+   if (bNonBlocking)
+   {
+      /* same modes as CTCPSSLClient::SetNonBlocking, writes are retried from a growing buffer */
+      SSL_set_mode(ClientSocket.m_pSSL, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                   SSL_MODE_RELEASE_BUFFERS);
+   }
+
+   return m_TCPServer.SetNonBlocking(ClientSocket.m_SockFd, bNonBlocking);
+}
+
+int CTCPSSLServer::Read(const SSLSocket& ClientSocket, char* pData, const size_t uSize, int& iSSLError) const
+{
+   iSSLError = SSL_ERROR_NONE;
+   if (ClientSocket.m_pSSL == nullptr)
+   {
+      iSSLError = SSL_ERROR_SSL;
+      return -1;
+   }
+
+   ERR_clear_error();
+   int nRecvd = SSL_read(ClientSocket.m_pSSL, pData, static_cast<int>(uSize));
+   if (nRecvd <= 0)
+   {
+      iSSLError = SSL_get_error(ClientSocket.m_pSSL, nRecvd);
+      if (iSSLError != SSL_ERROR_WANT_READ && iSSLError != SSL_ERROR_WANT_WRITE &&
+          iSSLError != SSL_ERROR_ZERO_RETURN && (IsLogEnabled(LOG_LEVEL_ERROR)))
+         m_oLog(StringFormat("[TCPSSLServer][Error] SSL_read failed (Error=%d | %s)",
+               nRecvd, GetSSLErrorString(iSSLError)));
+   }
+
+   return nRecvd;
+}
+
+int CTCPSSLServer::Write(const SSLSocket& ClientSocket, const char* pData, const size_t uSize, int& iSSLError) const
+{
+   iSSLError = SSL_ERROR_NONE;
+   if (ClientSocket.m_pSSL == nullptr)
+   {
+      iSSLError = SSL_ERROR_SSL;
+      return -1;
+   }
+
+   ERR_clear_error();
+   int nSent = SSL_write(ClientSocket.m_pSSL, pData, static_cast<int>(uSize));
+   if (nSent <= 0)
+   {
+      iSSLError = SSL_get_error(ClientSocket.m_pSSL, nSent);
+      if (iSSLError != SSL_ERROR_WANT_READ && iSSLError != SSL_ERROR_WANT_WRITE &&
+          (IsLogEnabled(LOG_LEVEL_ERROR)))
+         m_oLog(StringFormat("[TCPSSLServer][Error] SSL_write failed (Error=%d | %s)",
+               nSent, GetSSLErrorString(iSSLError)));
+   }
+
+   return nSent;
+}
+
 CTCPSSLServer::~CTCPSSLServer()
 {
 
@@ -32,6 +32,14 @@ public:
 
    bool Listen(SSLSocket& ClientSocket, size_t msec = ACCEPT_WAIT_INF_DELAY);
 
+   /* non-blocking accept: BeginAccept() accepts the TCP connection and makes the socket
+    * non-blocking, DoHandshake() is then called whenever it is ready
+    * ret 1  : handshake done
+    * ret 0  : retry once the socket is ready, iSSLError is SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE
+    * ret -1 : handshake failed, Disconnect() the client */
+   bool BeginAccept(SSLSocket& ClientSocket, size_t msec = ACCEPT_WAIT_INF_DELAY);
+   int DoHandshake(SSLSocket& ClientSocket, int& iSSLError) const;
+
    bool SetRcvTimeout(SSLSocket& ClientSocket, unsigned int msec_timeout);
    bool SetSndTimeout(SSLSocket& ClientSocket, unsigned int timeout);
    
@@ -51,7 +59,17 @@ public:
 
    bool Disconnect(SSLSocket& ClientSocket) const;
 
+   /* non-blocking I/O on an accepted client, to be driven by socket readiness events
+    * ret > 0   : bytes read/written
+    * ret <= 0  : iSSLError holds SSL_get_error(), SSL_ERROR_WANT_READ and
+    *             SSL_ERROR_WANT_WRITE mean retry once the socket is ready */
+   bool SetNonBlocking(SSLSocket& ClientSocket, bool bNonBlocking) const;
+   int Read(const SSLSocket& ClientSocket, char* pData, const size_t uSize, int& iSSLError) const;
+   int Write(const SSLSocket& ClientSocket, const char* pData, const size_t uSize, int& iSSLError) const;
+
 protected:
+   bool SetUpSSL(SSLSocket& ClientSocket);
+
    CTCPServer m_TCPServer;
 
 };
@@ -6,17 +6,21 @@
 
 #include "TCPServer.h"
 
+#ifndef WINDOWS
+#include <fcntl.h>
+#endif
+
 CTCPServer::CTCPServer(const LogFnCallback oLogger,
-					   /*const std::string& strAddr,*/
 					   const std::string& strPort,
-					   const SettingsFlag eSettings /*= ALL_FLAGS*/)
+					   const SettingsFlag eSettings /*= ALL_FLAGS*/,
+					   const std::string& strAddr /*= std::string()*/)
 					   /*throw (EResolveError)*/ :
 		ASocket(oLogger, eSettings),
 		m_ListenSocket(INVALID_SOCKET),
 #ifdef WINDOWS
 		m_pResultAddrInfo(nullptr),
 #endif
-		//m_strHost(strAddr),
+		m_strHost(strAddr),
 		m_strPort(strPort) {
 #ifdef WINDOWS
 	// Resolve the server address and port
@@ -31,7 +35,7 @@ CTCPServer::CTCPServer(const LogFnCallback oLogger,
 	* address structure in a call to the bind function.*/
 	m_HintsAddrInfo.ai_flags = AI_PASSIVE;
 
-	int iResult = getaddrinfo(nullptr, strPort.c_str(), &m_HintsAddrInfo, &m_pResultAddrInfo);
+	int iResult = getaddrinfo(strAddr.empty() ? nullptr : strAddr.c_str(), strPort.c_str(), &m_HintsAddrInfo, &m_pResultAddrInfo);
 	if (iResult != 0)
 	{
 	   if (m_pResultAddrInfo != nullptr)
@@ -54,7 +58,25 @@ CTCPServer::CTCPServer(const LogFnCallback oLogger,
 
 	// automatically be filled with current host's IP address
 	m_ServAddr.sin_addr.s_addr = INADDR_ANY;
-	//m_ServAddr.sin_addr.s_addr = inet_addr(strAddr.c_str()); // doesn't work !
+	if (!strAddr.empty())
+	{
+		struct addrinfo hints;
+		struct addrinfo* pResult = nullptr;
+		bzero((char*) &hints, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		int iResult = getaddrinfo(strAddr.c_str(), nullptr, &hints, &pResult);
+		if (iResult != 0 || pResult == nullptr)
+		{
+			if (pResult != nullptr)
+				freeaddrinfo(pResult);
+			throw EResolveError(StringFormat("[TCPServer][Error] getaddrinfo failed : %s", gai_strerror(iResult)));
+		}
+
+		m_ServAddr.sin_addr = reinterpret_cast<struct sockaddr_in*>(pResult->ai_addr)->sin_addr;
+		freeaddrinfo(pResult);
+	}
 
 	// convert short integer value for port must be converted into network byte order
 	m_ServAddr.sin_port = htons(iPort);
@@ -72,7 +94,7 @@ bool CTCPServer::SetRcvTimeout(ASocket::Socket& ClientSocket, unsigned int msec_
 
 	iErr = setsockopt(ClientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&msec_timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPServer::SetRcvTimeout : Socket error in SO_RCVTIMEO call to setsockopt.");
 
 		return false;
@@ -87,13 +109,13 @@ bool CTCPServer::SetSndTimeout(ASocket::Socket& ClientSocket, unsigned int msec_
 #ifndef WINDOWS
 	struct timeval t = ASocket::TimevalFromMsec(msec_timeout);
 
-	return this->SetRcvTimeout(ClientSocket, t);
+	return this->SetSndTimeout(ClientSocket, t);
 #else
 	int iErr;
 
 	iErr = setsockopt(ClientSocket, SOL_SOCKET, SO_SNDTIMEO, (char*)&msec_timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPServer::SetSndTimeout : Socket error in SO_SNDTIMEO call to setsockopt.");
 
 		return false;
@@ -109,7 +131,7 @@ bool CTCPServer::SetRcvTimeout(ASocket::Socket& ClientSocket, struct timeval Tim
 
 	iErr = setsockopt(ClientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&Timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPServer::SetRcvTimeout : Socket error in SO_RCVTIMEO call to setsockopt.");
 
 		return false;
@@ -123,7 +145,7 @@ bool CTCPServer::SetSndTimeout(ASocket::Socket& ClientSocket, struct timeval Tim
 
 	iErr = setsockopt(ClientSocket, SOL_SOCKET, SO_SNDTIMEO, (char*) &Timeout, sizeof(struct timeval));
 	if (iErr < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog("[TCPServer][Error] CTCPServer::SetSndTimeout : Socket error in SO_SNDTIMEO call to setsockopt.");
 
 		return false;
@@ -148,7 +170,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 
 		if (m_ListenSocket == INVALID_SOCKET)
 		{
-		   if (m_eSettingsFlags & ENABLE_LOG)
+		   if (IsLogEnabled(LOG_LEVEL_ERROR))
 			  m_oLog(StringFormat("[TCPServer][Error] socket failed : %d", WSAGetLastError()));
 		   freeaddrinfo(m_pResultAddrInfo);
 		   m_pResultAddrInfo = nullptr;
@@ -162,7 +184,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 		iErr = setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&opt), sizeof(int));
 		if (iErr < 0)
 		{
-		   if (m_eSettingsFlags & ENABLE_LOG)
+		   if (IsLogEnabled(LOG_LEVEL_ERROR))
 			  m_oLog("[TCPServer][Error] CTCPServer::Listen : Socket error in call to setsockopt.");
 
 		   closesocket(m_ListenSocket);
@@ -183,7 +205,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 
 		if (iResult == SOCKET_ERROR)
 		{
-		   if (m_eSettingsFlags & ENABLE_LOG)
+		   if (IsLogEnabled(LOG_LEVEL_ERROR))
 			  m_oLog(StringFormat("[TCPServer][Error] bind failed : %d", WSAGetLastError()));
 		   closesocket(m_ListenSocket);
 		   m_ListenSocket = INVALID_SOCKET;
@@ -195,7 +217,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 		// socket(int domain, int type, int protocol)
 		m_ListenSocket = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
 		if (m_ListenSocket < 0) {
-			if (m_eSettingsFlags & ENABLE_LOG)
+			if (IsLogEnabled(LOG_LEVEL_ERROR))
 				m_oLog(StringFormat("[TCPServer][Error] opening socket : %s", strerror(errno)));
 
 			m_ListenSocket = INVALID_SOCKET;
@@ -208,7 +230,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 
 		iErr = setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&opt), sizeof(int));
 		if (iErr < 0) {
-			if (m_eSettingsFlags & ENABLE_LOG)
+			if (IsLogEnabled(LOG_LEVEL_ERROR))
 				m_oLog("[TCPServer][Error] CTCPServer::Listen : Socket error in SO_REUSEADDR call to setsockopt.");
 
 			close(m_ListenSocket);
@@ -221,7 +243,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 		iErr = setsockopt(m_ListenSocket, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<char*>(&opt), sizeof(int));
 		if (iErr < 0)
 		{
-		   if (m_eSettingsFlags & ENABLE_LOG)
+		   if (IsLogEnabled(LOG_LEVEL_ERROR))
 			  m_oLog("[TCPServer][Error] CTCPServer::Listen : Socket error in SO_KEEPALIVE call to setsockopt.");
 
 		   close(m_ListenSocket);
@@ -239,8 +261,12 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 						   reinterpret_cast<struct sockaddr*>(&m_ServAddr),
 						   sizeof(m_ServAddr));
 		if (iResult < 0) {
-			if (m_eSettingsFlags & ENABLE_LOG)
+			if (IsLogEnabled(LOG_LEVEL_ERROR))
 				m_oLog(StringFormat("[TCPServer][Error] bind failed : %s", strerror(errno)));
+
+			/* otherwise the next call would listen on the unbound socket, on a random port */
+			close(m_ListenSocket);
+			m_ListenSocket = INVALID_SOCKET;
 			return false;
 		}
 #endif
@@ -253,7 +279,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 	iResult = listen(m_ListenSocket, SOMAXCONN);
 	if (iResult == SOCKET_ERROR)
 	{
-	   if (m_eSettingsFlags & ENABLE_LOG)
+	   if (IsLogEnabled(LOG_LEVEL_ERROR))
 		  m_oLog(StringFormat("[TCPServer][Error] listen failed : %d", WSAGetLastError()));
 	   closesocket(m_ListenSocket);
 	   m_ListenSocket = INVALID_SOCKET;
@@ -265,15 +291,15 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 	   int ret = SelectSocket(m_ListenSocket, msec);
 	   if (ret == 0)
 	   {
-		  if (m_eSettingsFlags & ENABLE_LOG)
-			 m_oLog("[TCPServer][Error] CTCPServer::Listen : Timed out.");
+		  if (IsLogEnabled(LOG_LEVEL_DEBUG))
+			 m_oLog("[TCPServer][Debug] CTCPServer::Listen : Timed out.");
 
 		  return false;
 	   }
 
 	   if (ret == -1)
 	   {
-		  if (m_eSettingsFlags & ENABLE_LOG)
+		  if (IsLogEnabled(LOG_LEVEL_ERROR))
 			 m_oLog("[TCPServer][Error] CTCPServer::Listen : Error selecting socket.");
 
 		  return false;
@@ -285,14 +311,14 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 	ClientSocket = accept(m_ListenSocket, &addrClient, &iAddrLen);
 	if (ClientSocket == INVALID_SOCKET)
 	{
-	   if (m_eSettingsFlags & ENABLE_LOG)
+	   if (IsLogEnabled(LOG_LEVEL_ERROR))
 		  m_oLog(StringFormat("[TCPServer][Error] accept failed : %d", WSAGetLastError()));
 
 	   return false;
 	}
 
 	{
-	   if (m_eSettingsFlags & ENABLE_LOG)
+	   if (IsLogEnabled(LOG_LEVEL_INFO))
 		  // TODO : a version that handles IPv6
 		  m_oLog( StringFormat("[TCPServer][Info] Incoming connection from '%s' port '%d'",
 			   (addrClient.sa_family == AF_INET) ? inet_ntoa(((struct sockaddr_in*)&addrClient)->sin_addr) : "",
@@ -312,7 +338,7 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 	// Here, we set the maximum size for the backlog queue to SOMAXCONN.
 	int iResult = listen(m_ListenSocket, SOMAXCONN);
 	if (iResult < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog(StringFormat("[TCPServer][Error] listen failed : %s", strerror(errno)));
 
 		return false;
@@ -321,14 +347,14 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 	if (msec != ACCEPT_WAIT_INF_DELAY) {
 		int ret = SelectSocket(m_ListenSocket, msec);
 		if (ret == 0) {
-			if (m_eSettingsFlags & ENABLE_LOG)
-				m_oLog("[TCPServer][Error] CTCPServer::Listen : Timed out.");
+			if (IsLogEnabled(LOG_LEVEL_DEBUG))
+				m_oLog("[TCPServer][Debug] CTCPServer::Listen : Timed out.");
 
 			return false;
 		}
 
 		if (ret == -1) {
-			if (m_eSettingsFlags & ENABLE_LOG)
+			if (IsLogEnabled(LOG_LEVEL_ERROR))
 				m_oLog("[TCPServer][Error] CTCPServer::Listen : Error selecting socket.");
 
 			return false;
@@ -350,13 +376,13 @@ bool CTCPServer::Listen(ASocket::Socket& ClientSocket, size_t msec /*= ACCEPT_WA
 						  &uClientLen);
 
 	if (ClientSocket < 0) {
-		if (m_eSettingsFlags & ENABLE_LOG)
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
 			m_oLog(StringFormat("[TCPServer][Error] accept failed : %s", strerror(errno)));
 
 		return false;
 	}
 
-	if (m_eSettingsFlags & ENABLE_LOG)
+	if (IsLogEnabled(LOG_LEVEL_INFO))
 		m_oLog(StringFormat("[TCPServer][Info] Incoming connection from '%s' port '%d'",
 							inet_ntoa(ClientAddr.sin_addr), ntohs(ClientAddr.sin_port)));
 #endif
@@ -399,7 +425,7 @@ int CTCPServer::Receive(const CTCPServer::Socket ClientSocket,
 			 continue;
 		   }
 
-		   if (m_eSettingsFlags & ENABLE_LOG)
+		   if (IsLogEnabled(LOG_LEVEL_ERROR))
 			  m_oLog("[TCPServer][Error] Socket error in call to recv.");
 
 		   break;
@@ -425,7 +451,7 @@ bool CTCPServer::Send(const Socket ClientSocket, const char* pData, size_t uSize
 		nSent = send(ClientSocket, pData + total, uSize - total, flags);
 
 		if (nSent < 0) {
-			if (m_eSettingsFlags & ENABLE_LOG)
+			if (IsLogEnabled(LOG_LEVEL_ERROR))
 				m_oLog("[TCPServer][Error] Socket error in call to send.");
 
 			return false;
@@ -451,7 +477,7 @@ bool CTCPServer::Disconnect(const CTCPServer::Socket ClientSocket) const {
 
 	if (iResult == SOCKET_ERROR)
 	{
-	   if (m_eSettingsFlags & ENABLE_LOG)
+	   if (IsLogEnabled(LOG_LEVEL_ERROR))
 		  m_oLog(StringFormat("[TCPServer][Error] shutdown failed : %d", WSAGetLastError()));
 
 	   return false;
@@ -467,6 +493,26 @@ bool CTCPServer::Disconnect(const CTCPServer::Socket ClientSocket) const {
 	return true;
 }
 
+bool CTCPServer::SetNonBlocking(const Socket ClientSocket, bool bNonBlocking) const {
+#ifdef WINDOWS
+	u_long iMode = bNonBlocking ? 1 : 0;
+	int iErr = ioctlsocket(ClientSocket, FIONBIO, &iMode);
+#else
+	int iErr = -1;
+	int iFlags = fcntl(ClientSocket, F_GETFL, 0);
+	if (iFlags >= 0)
+		iErr = fcntl(ClientSocket, F_SETFL, bNonBlocking ? (iFlags | O_NONBLOCK) : (iFlags & ~O_NONBLOCK));
+#endif
+	if (iErr < 0) {
+		if (IsLogEnabled(LOG_LEVEL_ERROR))
+			m_oLog("[TCPServer][Error] CTCPServer::SetNonBlocking : Socket error while changing the blocking mode.");
+
+		return false;
+	}
+
+	return true;
+}
+
 CTCPServer::~CTCPServer() {
 #ifdef WINDOWS
 	// close listen socket
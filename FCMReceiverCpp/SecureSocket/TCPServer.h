@@ -30,10 +30,11 @@
 class CTCPServer : public ASocket
 {
 public:
+   /* strAddr is the IPv4 address or host name to bind, empty binds every interface */
    explicit CTCPServer(const LogFnCallback oLogger,
-                       /*const std::string& strAddr,*/
                        const std::string& strPort,
-                       const SettingsFlag eSettings = ALL_FLAGS)
+                       const SettingsFlag eSettings = ALL_FLAGS,
+                       const std::string& strAddr = std::string())
                        /*throw (EResolveError)*/;
    
    ~CTCPServer() override;
@@ -56,6 +57,9 @@ public:
 
    bool Disconnect(const Socket ClientSocket) const;
 
+   // Can be called after Listen, send/recv on the accepted socket then return immediately instead of waiting
+   bool SetNonBlocking(const Socket ClientSocket, bool bNonBlocking) const;
+
    bool SetRcvTimeout(ASocket::Socket& ClientSocket, unsigned int msec_timeout);
    bool SetSndTimeout(ASocket::Socket& ClientSocket, unsigned int msec_timeout);
    
@@ -67,7 +71,7 @@ public:
 protected:
    Socket m_ListenSocket;
 
-   //std::string m_strHost;
+   std::string m_strHost;
    std::string m_strPort;
 
    #ifdef WINDOWS
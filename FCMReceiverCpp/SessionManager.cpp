@@ -0,0 +1,213 @@
+#include "SessionManager.h"
+
+#include <algorithm>
+#include <set>
+
+#ifndef WINDOWS
+#include <sys/resource.h>
+#endif
+
+CSessionManager::CSessionManager(const LogFnCallback oLogger, size_t nThreadCount, size_t nDecryptThreadCount) :
+	m_oLogger(oLogger),
+	m_HandshakeBucket(kSessionStartRatePerSecond, kSessionStartRatePerSecond / 10),
+	m_HostResolver(oLogger),
+	m_bRunning(false)
+{
+	if (nThreadCount == 0)
+		nThreadCount = std::thread::hardware_concurrency();
+	if (nThreadCount == 0)
+		nThreadCount = 1;
+
+	for (size_t i = 0; i < nThreadCount; ++i)
+		m_EventLoops.push_back(std::make_unique<CEventLoop>(oLogger));
+
+	if (nDecryptThreadCount > 0)
+		m_DecryptPool = std::make_unique<CDecryptPool>(oLogger, nDecryptThreadCount);
+}
+
+CSessionManager::~CSessionManager()
+{
+	Stop();
+}
+
+size_t CSessionManager::AddSession(const SESSION_CONFIG& config)
+{
+	if (m_bRunning)
+		throw std::runtime_error("Sessions must be added before Start()");
+
+	SESSION session;
+	session.client = std::make_unique<CFCMClient>(m_oLogger,
+		config.sAndroidId,
+		config.sSecurityToken,
+		config.sBase64PrivateKey,
+		config.sBase64AuthSecret,
+		config.persistentIds);
+	session.client->SetReleaseIdleBuffers(true);
+	session.client->SetHostResolver(&m_HostResolver);
+	if (m_DecryptPool)
+		session.client->SetDecryptPool(m_DecryptPool.get());
+	session.nLoop = m_Sessions.size() % m_EventLoops.size();
+	session.supervisor = std::make_unique<CReconnectSupervisor>(m_oLogger, *session.client,
+		*m_EventLoops[session.nLoop], m_HandshakeBucket);
+
+	m_Sessions.push_back(std::move(session));
+	return m_Sessions.size() - 1;
+}
+
+void CSessionManager::SetServer(const std::string& sHost, const std::string& sPort)
+{
+	for (SESSION& session : m_Sessions)
+		session.client->SetServer(sHost, sPort);
+}
+
+void CSessionManager::SetCheckInCache(CCheckInCache* pCheckInCache)
+{
+	for (SESSION& session : m_Sessions)
+		session.client->SetCheckInCache(pCheckInCache);
+}
+
+void CSessionManager::SetStartRate(uint32_t nSessionsPerSecond)
+{
+	// A tenth of a second worth of connects may go at once
+	m_HandshakeBucket.SetRate(nSessionsPerSecond, nSessionsPerSecond / 10);
+}
+
+void CSessionManager::Start()
+{
+	if (m_bRunning)
+		return;
+
+#ifndef WINDOWS
+	// Every session holds one socket, the default soft limit of 1024 is far too low
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	m_bRunning = true;
+	FCM_LOG_INFO(m_oLogger, "[CSessionManager][INFO] Starting ", m_Sessions.size(), " sessions on ",
+		m_EventLoops.size(), " threads");
+
+	// Sessions whose server is not resolved yet retry with backoff until the resolver thread gets it
+	std::set<std::pair<std::string, std::string>> servers;
+	for (const SESSION& session : m_Sessions)
+		servers.emplace(session.client->GetServerHost(), session.client->GetServerPort());
+	for (const auto& server : servers)
+		m_HostResolver.Resolve(server.first, server.second);
+
+	for (size_t nLoop = 0; nLoop < m_EventLoops.size(); ++nLoop)
+	{
+		m_EventLoops[nLoop]->Post([this, nLoop]() { StartSessions(nLoop); });
+		m_Threads.emplace_back([this, nLoop]() {
+			// The other sessions of the loop keep running when a callback throws, a Stop() still ends it
+			for (;;)
+			{
+				try
+				{
+					m_EventLoops[nLoop]->Run();
+					return;
+				}
+				catch (const std::exception& e)
+				{
+					FCM_LOG_ERROR(m_oLogger, "[CSessionManager][ERROR] Event loop ", nLoop, " callback failed: ", e.what());
+				}
+			}
+		});
+	}
+}
+
+void CSessionManager::Stop()
+{
+	if (!m_bRunning)
+		return;
+
+	for (size_t nLoop = 0; nLoop < m_EventLoops.size(); ++nLoop)
+	{
+		m_EventLoops[nLoop]->Post([this, nLoop]() {
+			StopSessions(nLoop);
+			m_EventLoops[nLoop]->Stop();
+		});
+	}
+
+	for (std::thread& thread : m_Threads)
+		thread.join();
+
+	m_Threads.clear();
+	m_bRunning = false;
+}
+
+void CSessionManager::StartSessions(size_t nLoop)
+{
+	// The handshake bucket hands out the connect slots, so the sessions of all loops are spread evenly over time
+	for (size_t nIndex = nLoop; nIndex < m_Sessions.size(); nIndex += m_EventLoops.size())
+		m_Sessions[nIndex].supervisor->Start(true);
+}
+
+void CSessionManager::StopSessions(size_t nLoop)
+{
+	for (size_t nIndex = nLoop; nIndex < m_Sessions.size(); nIndex += m_EventLoops.size())
+	{
+		m_Sessions[nIndex].supervisor->Stop();
+		m_Sessions[nIndex].client->Disconnect();
+	}
+}
+
+std::vector<SESSION_STATUS> CSessionManager::GetStatus() const
+{
+	std::vector<SESSION_STATUS> status;
+	status.reserve(m_Sessions.size());
+
+	for (size_t nIndex = 0; nIndex < m_Sessions.size(); ++nIndex)
+	{
+		const CFCMClient& client = *m_Sessions[nIndex].client;
+		status.push_back({ nIndex, client.GetAndroidId(), client.GetState(), client.GetMessageCount() });
+	}
+
+	return status;
+}
+
+bool CSessionManager::GetDecryptMetrics(DECRYPT_POOL_METRICS& metrics, bool bUtilization)
+{
+	if (!m_DecryptPool)
+		return false;
+
+	metrics = m_DecryptPool->GetMetrics(bUtilization);
+	return true;
+}
+
+RECONNECT_METRICS CSessionManager::GetReconnectMetrics() const
+{
+	RECONNECT_METRICS total = {};
+	for (const SESSION& session : m_Sessions)
+	{
+		RECONNECT_METRICS metrics = session.supervisor->GetMetrics();
+		total.nReconnects += metrics.nReconnects;
+		total.nFailedAttempts += metrics.nFailedAttempts;
+		total.nLastRecoveryMs = (std::max)(total.nLastRecoveryMs, metrics.nLastRecoveryMs);
+		total.nMaxRecoveryMs = (std::max)(total.nMaxRecoveryMs, metrics.nMaxRecoveryMs);
+		total.nTotalRecoveryMs += metrics.nTotalRecoveryMs;
+	}
+	return total;
+}
+
+size_t CSessionManager::CountPersistentIds() const
+{
+	size_t nCount = 0;
+	for (const SESSION& session : m_Sessions)
+		nCount += session.client->GetPersistentIdCount();
+	return nCount;
+}
+
+size_t CSessionManager::CountSessions(MCSSessionState eState) const
+{
+	size_t nCount = 0;
+	for (const SESSION& session : m_Sessions)
+	{
+		if (session.client->GetState() == eState)
+			nCount++;
+	}
+	return nCount;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DecryptPool.h"
+#include "EventLoop.h"
+#include "FCMClient.h"
+#include "HostResolver.h"
+#include "ReconnectSupervisor.h"
+#include "TokenBucket.h"
+
+constexpr uint32_t kSessionStartRatePerSecond = 500;
+
+typedef struct _SESSION_CONFIG
+{
+	std::string sAndroidId;
+	std::string sSecurityToken;
+	std::string sBase64PrivateKey;
+	std::string sBase64AuthSecret;
+	std::vector<std::string> persistentIds;
+} SESSION_CONFIG;
+
+typedef struct _SESSION_STATUS
+{
+	size_t nIndex;
+	std::string sAndroidId;
+	MCSSessionState eState;
+	uint64_t nMessageCount;
+} SESSION_STATUS;
+
+/**
+ * Runs many MCS sessions on a fixed pool of event loop threads.
+ *
+ * Sessions are added and configured before Start(). Each session is pinned to one
+ * loop, so its callbacks ("connected", "message", "persistent_id", "persistent_ids_confirmed",
+ * "disconnected") always run on the same thread, but different sessions' callbacks run concurrently.
+ * A session that loses its connection reconnects with backoff until Stop().
+ */
+class CSessionManager
+{
+public:
+	/**
+	 * @param oLogger The callback function for logging, called from every loop thread.
+	 * @param nThreadCount The number of event loop threads, 0 uses one per hardware thread.
+	 * @param nDecryptThreadCount The number of decrypt worker threads, 0 decrypts on the loop threads.
+	 */
+	CSessionManager(const LogFnCallback oLogger, size_t nThreadCount = 0, size_t nDecryptThreadCount = 0);
+	~CSessionManager();
+
+	CSessionManager(const CSessionManager&) = delete;
+	CSessionManager& operator=(const CSessionManager&) = delete;
+
+	/**
+	 * Creates a session. Must be called before Start().
+	 *
+	 * @param config The registration record of the session.
+	 * @return The session index.
+	 * @throws std::runtime_error if the private key or auth secret is invalid.
+	 */
+	size_t AddSession(const SESSION_CONFIG& config);
+
+	/**
+	 * Gives access to a session's client to register event handlers or override the server.
+	 * Must only be used before Start().
+	 *
+	 * @param nIndex The session index returned by AddSession().
+	 * @return The session's client.
+	 */
+	CFCMClient& GetClient(size_t nIndex) { return *m_Sessions.at(nIndex).client; }
+
+	/**
+	 * Overrides the MCS server for every session added so far.
+	 *
+	 * @param sHost The host name or address.
+	 * @param sPort The port.
+	 */
+	void SetServer(const std::string& sHost, const std::string& sPort);
+
+	/**
+	 * Shares one check-in cache between every session added so far, so each android id
+	 * checks in once per TTL however often its session reconnects.
+	 *
+	 * @param pCheckInCache The cache, nullptr does not check in. Must outlive the manager.
+	 */
+	void SetCheckInCache(CCheckInCache* pCheckInCache);
+
+	/**
+	 * Limits how fast sessions connect, at Start() and when they reconnect, so a large
+	 * pool does not open every TLS connection at once.
+	 *
+	 * @param nSessionsPerSecond The number of new connections per second across all loops.
+	 */
+	void SetStartRate(uint32_t nSessionsPerSecond);
+
+	/**
+	 * Resolves the MCS servers, blocking, then starts the loop threads and connects every
+	 * session. The loops connect to the resolved addresses, which a resolver thread keeps fresh.
+	 */
+	void Start();
+
+	/**
+	 * Disconnects every session and joins the loop threads.
+	 */
+	void Stop();
+
+	/**
+	 * @return The state of every session. Safe to call from any thread while running.
+	 */
+	std::vector<SESSION_STATUS> GetStatus() const;
+
+	/**
+	 * @param eState The state to count.
+	 * @return The number of sessions in the given state. Safe to call from any thread while running.
+	 */
+	size_t CountSessions(MCSSessionState eState) const;
+
+	/**
+	 * @param metrics Receives the decrypt queue depth and worker utilization.
+	 * @param bUtilization False to skip the utilization, see CDecryptPool::GetMetrics().
+	 * @return False if there are no decrypt workers.
+	 */
+	bool GetDecryptMetrics(DECRYPT_POOL_METRICS& metrics, bool bUtilization = true);
+
+	/**
+	 * @return The persistent ids not confirmed yet, summed over every session. Safe to call from any thread while running.
+	 */
+	size_t CountPersistentIds() const;
+
+	/**
+	 * @return The reconnect counters summed over every session, the recovery times are the
+	 * largest last and max ones. Safe to call from any thread while running.
+	 */
+	RECONNECT_METRICS GetReconnectMetrics() const;
+
+	size_t SessionCount() const { return m_Sessions.size(); }
+	size_t ThreadCount() const { return m_EventLoops.size(); }
+
+private:
+	void StartSessions(size_t nLoop);
+	void StopSessions(size_t nLoop);
+
+private:
+	typedef struct _SESSION
+	{
+		std::unique_ptr<CFCMClient> client;
+		std::unique_ptr<CReconnectSupervisor> supervisor; // destroyed before the client it watches
+		size_t nLoop;
+	} SESSION;
+
+	const LogFnCallback m_oLogger;
+
+	std::vector<std::unique_ptr<CEventLoop>> m_EventLoops;
+	std::vector<std::thread> m_Threads;
+	// Every TLS handshake of every loop takes a token
+	CTokenBucket m_HandshakeBucket;
+	// Shared by every session so the loops never call getaddrinfo, outlives the clients
+	CHostResolver m_HostResolver;
+	std::vector<SESSION> m_Sessions;
+	// Declared last so it is joined first, its workers post results to the loops
+	std::unique_ptr<CDecryptPool> m_DecryptPool;
+
+	bool m_bRunning;
+};
@@ -0,0 +1,250 @@
+#include "TimerWheel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+	constexpr uint64_t kSlotMask = kTimerWheelSlots - 1;
+
+	// x must not be 0
+	uint32_t CountTrailingZeros(uint64_t x)
+	{
+#ifdef _MSC_VER
+		// _BitScanForward64 is not available on x86
+		unsigned long nIndex;
+		if (_BitScanForward(&nIndex, static_cast<unsigned long>(x)))
+			return nIndex;
+		_BitScanForward(&nIndex, static_cast<unsigned long>(x >> 32));
+		return nIndex + 32;
+#else
+		return static_cast<uint32_t>(__builtin_ctzll(x));
+#endif
+	}
+
+	uint32_t LevelShift(uint32_t nLevel)
+	{
+		return nLevel * kTimerWheelSlotBits;
+	}
+}
+
+CTimerWheel::CTimerWheel(uint64_t nStartTick) :
+	m_nFreeHead(kNil),
+	m_nCurrentTick(nStartTick),
+	m_nSize(0)
+{
+	for (uint32_t i = 0; i < kTimerWheelLevels * kTimerWheelSlots; ++i)
+	{
+		m_SlotHeads[i] = kNil;
+		m_SlotTails[i] = kNil;
+	}
+
+	for (uint32_t i = 0; i < kTimerWheelLevels; ++i)
+		m_SlotMasks[i] = 0;
+}
+
+TimerId CTimerWheel::Schedule(uint64_t nExpiryTick, Task callback)
+{
+	uint32_t nIndex = AllocateNode();
+	TIMER_NODE& node = m_Nodes[nIndex];
+	node.callback = std::move(callback);
+	node.nExpiryTick = nExpiryTick > m_nCurrentTick ? nExpiryTick : m_nCurrentTick + 1;
+
+	Link(nIndex);
+	m_nSize++;
+
+	return (static_cast<TimerId>(node.nGeneration) << 32) | nIndex;
+}
+
+bool CTimerWheel::Cancel(TimerId nTimerId)
+{
+	uint32_t nIndex = static_cast<uint32_t>(nTimerId);
+	uint32_t nGeneration = static_cast<uint32_t>(nTimerId >> 32);
+	if (nIndex >= m_Nodes.size())
+		return false;
+
+	TIMER_NODE& node = m_Nodes[nIndex];
+	if (node.nSlot == kNil || node.nGeneration != nGeneration)
+		return false;
+
+	Unlink(nIndex);
+	FreeNode(nIndex);
+	m_nSize--;
+	return true;
+}
+
+size_t CTimerWheel::Advance(uint64_t nNowTick)
+{
+	size_t nRun = 0;
+	while (m_nCurrentTick < nNowTick)
+	{
+		// Jump straight to the next tick that has a slot to process, the ticks in between have nothing to do
+		uint64_t nNextTick = NextEventTick();
+		if (nNextTick > nNowTick)
+		{
+			m_nCurrentTick = nNowTick;
+			break;
+		}
+		m_nCurrentTick = nNextTick;
+
+		// Move the timers of every level that wrapped on this tick down, highest level first
+		for (uint32_t nLevel = kTimerWheelLevels - 1; nLevel > 0; --nLevel)
+		{
+			if ((m_nCurrentTick & ((1ull << LevelShift(nLevel)) - 1)) == 0)
+				Cascade(nLevel);
+		}
+
+		// Everything left in this level 0 slot expires on this very tick
+		uint32_t nSlotIndex = static_cast<uint32_t>(m_nCurrentTick & kSlotMask);
+		while (m_SlotHeads[nSlotIndex] != kNil)
+		{
+			uint32_t nIndex = m_SlotHeads[nSlotIndex];
+			Unlink(nIndex);
+
+			// Release the node first, so the callback can reschedule or cancel freely
+			Task callback = std::move(m_Nodes[nIndex].callback);
+			FreeNode(nIndex);
+			m_nSize--;
+
+			callback();
+			nRun++;
+		}
+	}
+
+	return nRun;
+}
+
+uint64_t CTimerWheel::NextEventTick() const
+{
+	uint64_t nNextTick = UINT64_MAX;
+	if (m_nSize == 0)
+		return nNextTick;
+
+	for (uint32_t nLevel = 0; nLevel < kTimerWheelLevels; ++nLevel)
+	{
+		uint64_t nMask = m_SlotMasks[nLevel];
+		if (nMask == 0)
+			continue;
+
+		// Find the first non-empty slot after the current one, wrapping around the level
+		uint64_t nBase = m_nCurrentTick >> LevelShift(nLevel);
+		uint32_t nStart = static_cast<uint32_t>((nBase + 1) & kSlotMask);
+		uint64_t nRotated = nStart == 0 ? nMask : (nMask >> nStart) | (nMask << (kTimerWheelSlots - nStart));
+
+		uint64_t nTick = (nBase + 1 + CountTrailingZeros(nRotated)) << LevelShift(nLevel);
+		if (nTick < nNextTick)
+			nNextTick = nTick;
+	}
+
+	return nNextTick;
+}
+
+uint32_t CTimerWheel::AllocateNode()
+{
+	if (m_nFreeHead != kNil)
+	{
+		uint32_t nIndex = m_nFreeHead;
+		m_nFreeHead = m_Nodes[nIndex].nNext;
+		return nIndex;
+	}
+
+	TIMER_NODE node;
+	node.nExpiryTick = 0;
+	node.nGeneration = 1;
+	node.nPrev = kNil;
+	node.nNext = kNil;
+	node.nSlot = kNil;
+	m_Nodes.push_back(std::move(node));
+	return static_cast<uint32_t>(m_Nodes.size() - 1);
+}
+
+void CTimerWheel::FreeNode(uint32_t nIndex)
+{
+	TIMER_NODE& node = m_Nodes[nIndex];
+	node.callback = nullptr;
+	node.nSlot = kNil;
+
+	// A new generation invalidates every id handed out for this node, 0 is skipped so no id equals kInvalidTimerId
+	if (++node.nGeneration == 0)
+		node.nGeneration = 1;
+
+	node.nNext = m_nFreeHead;
+	m_nFreeHead = nIndex;
+}
+
+void CTimerWheel::Link(uint32_t nIndex)
+{
+	TIMER_NODE& node = m_Nodes[nIndex];
+
+	// The lowest level on which the expiry and the current tick share every higher digit
+	uint64_t nDiff = node.nExpiryTick ^ m_nCurrentTick;
+	uint32_t nLevel = 0;
+	while (nLevel < kTimerWheelLevels && (nDiff >> LevelShift(nLevel + 1)) != 0)
+		nLevel++;
+
+	uint32_t nSlot;
+	if (nLevel == kTimerWheelLevels)
+	{
+		// Beyond the wheel: wait in the top level slot reached when the next top level rotation starts
+		nLevel = kTimerWheelLevels - 1;
+		nSlot = 0;
+	}
+	else
+	{
+		nSlot = static_cast<uint32_t>((node.nExpiryTick >> LevelShift(nLevel)) & kSlotMask);
+	}
+
+	uint32_t nSlotIndex = nLevel * kTimerWheelSlots + nSlot;
+	node.nSlot = nSlotIndex;
+	node.nNext = kNil;
+	node.nPrev = m_SlotTails[nSlotIndex];
+
+	if (node.nPrev != kNil)
+		m_Nodes[node.nPrev].nNext = nIndex;
+	else
+		m_SlotHeads[nSlotIndex] = nIndex;
+
+	m_SlotTails[nSlotIndex] = nIndex;
+	m_SlotMasks[nLevel] |= 1ull << nSlot;
+}
+
+void CTimerWheel::Unlink(uint32_t nIndex)
+{
+	TIMER_NODE& node = m_Nodes[nIndex];
+	uint32_t nSlotIndex = node.nSlot;
+
+	if (node.nPrev != kNil)
+		m_Nodes[node.nPrev].nNext = node.nNext;
+	else
+		m_SlotHeads[nSlotIndex] = node.nNext;
+
+	if (node.nNext != kNil)
+		m_Nodes[node.nNext].nPrev = node.nPrev;
+	else
+		m_SlotTails[nSlotIndex] = node.nPrev;
+
+	if (m_SlotHeads[nSlotIndex] == kNil)
+		m_SlotMasks[nSlotIndex / kTimerWheelSlots] &= ~(1ull << (nSlotIndex % kTimerWheelSlots));
+
+	node.nSlot = kNil;
+}
+
+void CTimerWheel::Cascade(uint32_t nLevel)
+{
+	uint32_t nSlot = static_cast<uint32_t>((m_nCurrentTick >> LevelShift(nLevel)) & kSlotMask);
+	uint32_t nSlotIndex = nLevel * kTimerWheelSlots + nSlot;
+
+	// Detach the whole list first, timers beyond the wheel are linked back into this same slot
+	uint32_t nIndex = m_SlotHeads[nSlotIndex];
+	m_SlotHeads[nSlotIndex] = kNil;
+	m_SlotTails[nSlotIndex] = kNil;
+	m_SlotMasks[nLevel] &= ~(1ull << nSlot);
+
+	while (nIndex != kNil)
+	{
+		uint32_t nNext = m_Nodes[nIndex].nNext;
+		Link(nIndex);
+		nIndex = nNext;
+	}
+}
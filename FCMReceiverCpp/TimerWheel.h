@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+typedef uint64_t TimerId;
+constexpr TimerId kInvalidTimerId = 0;
+
+constexpr uint32_t kTimerWheelSlotBits = 6;
+constexpr uint32_t kTimerWheelSlots = 1 << kTimerWheelSlotBits; // 64 slots per level
+constexpr uint32_t kTimerWheelLevels = 4; // 64^4 ticks, about 4.6 hours at 1 ms per tick
+
+/**
+ * Hierarchical timer wheel with O(1) insert and cancel.
+ *
+ * Timers live in intrusive lists, one per slot. A timer is placed on the lowest
+ * level whose slot rotation still contains its expiry, and moves down a level each
+ * time the wheel reaches its slot, until it fires from level 0 on its exact tick.
+ * Timers due on the same tick fire in scheduling order. Timers beyond the top level
+ * wait in its first slot and are placed again when the next top level rotation starts.
+ *
+ * The wheel has no notion of time: the owner picks the tick unit and calls Advance().
+ */
+class CTimerWheel
+{
+public:
+	typedef std::function<void()> Task;
+
+	explicit CTimerWheel(uint64_t nStartTick = 0);
+
+	CTimerWheel(const CTimerWheel&) = delete;
+	CTimerWheel& operator=(const CTimerWheel&) = delete;
+
+	/**
+	 * Schedules a callback.
+	 *
+	 * @param nExpiryTick The tick to fire at, ticks not after the current tick fire on the next one.
+	 * @param callback The callback to run.
+	 * @return The timer id, to be passed to Cancel().
+	 */
+	TimerId Schedule(uint64_t nExpiryTick, Task callback);
+
+	/**
+	 * Cancels a timer that has not fired yet. Ids of fired or cancelled timers are never reused.
+	 *
+	 * @param nTimerId The timer id returned by Schedule().
+	 * @return True if the timer was pending, false otherwise.
+	 */
+	bool Cancel(TimerId nTimerId);
+
+	/**
+	 * Moves the wheel to a tick and runs every timer due up to it, in expiry order.
+	 * Callbacks may schedule and cancel timers.
+	 *
+	 * @param nNowTick The current tick.
+	 * @return The number of timers run.
+	 */
+	size_t Advance(uint64_t nNowTick);
+
+	/**
+	 * @return The next tick at which Advance() has work to do, UINT64_MAX if no timer is pending.
+	 * It may come before the next expiry when a timer only moves down a level.
+	 */
+	uint64_t NextEventTick() const;
+
+	uint64_t CurrentTick() const { return m_nCurrentTick; }
+	size_t Size() const { return m_nSize; }
+	bool Empty() const { return m_nSize == 0; }
+
+private:
+	static constexpr uint32_t kNil = UINT32_MAX;
+
+	typedef struct _TIMER_NODE
+	{
+		Task callback;
+		uint64_t nExpiryTick;
+		uint32_t nGeneration;
+		uint32_t nPrev;
+		uint32_t nNext;
+		uint32_t nSlot; // level * kTimerWheelSlots + slot, kNil when free
+	} TIMER_NODE;
+
+	uint32_t AllocateNode();
+	void FreeNode(uint32_t nIndex);
+	void Link(uint32_t nIndex);
+	void Unlink(uint32_t nIndex);
+	void Cascade(uint32_t nLevel);
+
+private:
+	std::vector<TIMER_NODE> m_Nodes;
+	uint32_t m_nFreeHead;
+
+	uint32_t m_SlotHeads[kTimerWheelLevels * kTimerWheelSlots];
+	uint32_t m_SlotTails[kTimerWheelLevels * kTimerWheelSlots];
+	uint64_t m_SlotMasks[kTimerWheelLevels]; // bit set for every non-empty slot
+
+	uint64_t m_nCurrentTick;
+	size_t m_nSize;
+};
@@ -0,0 +1,43 @@
+#include "TokenBucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+CTokenBucket::CTokenBucket(uint32_t nRatePerSecond, uint32_t nBurst) :
+	m_dRatePerMs(0),
+	m_dBurst(0),
+	m_dTokens(0),
+	m_LastRefill(Clock::now())
+{
+	SetRate(nRatePerSecond, nBurst);
+	m_dTokens = m_dBurst;
+}
+
+void CTokenBucket::SetRate(uint32_t nRatePerSecond, uint32_t nBurst)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	Refill(Clock::now());
+
+	m_dRatePerMs = std::max<uint32_t>(nRatePerSecond, 1) / 1000.0;
+	m_dBurst = std::max<uint32_t>(nBurst, 1);
+	m_dTokens = std::min(m_dTokens, m_dBurst);
+}
+
+uint32_t CTokenBucket::Reserve()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	Refill(Clock::now());
+
+	m_dTokens -= 1;
+	if (m_dTokens >= 0)
+		return 0;
+
+	return static_cast<uint32_t>(std::ceil(-m_dTokens / m_dRatePerMs));
+}
+
+void CTokenBucket::Refill(Clock::time_point now)
+{
+	double dElapsedMs = std::chrono::duration<double, std::milli>(now - m_LastRefill).count();
+	m_LastRefill = now;
+	m_dTokens = std::min(m_dBurst, m_dTokens + dElapsedMs * m_dRatePerMs);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Rate limiter shared by threads: tokens refill at a fixed rate up to a burst size.
+ *
+ * Reserve() never refuses, it takes a token and returns how long the caller must wait
+ * before using it. The bucket goes into debt instead, so callers that arrive together
+ * are handed consecutive slots rather than retrying all at the same moment.
+ */
+class CTokenBucket
+{
+public:
+	/**
+	 * @param nRatePerSecond The number of tokens added per second.
+	 * @param nBurst The number of tokens that can be taken at once after an idle period.
+	 */
+	CTokenBucket(uint32_t nRatePerSecond, uint32_t nBurst);
+
+	CTokenBucket(const CTokenBucket&) = delete;
+	CTokenBucket& operator=(const CTokenBucket&) = delete;
+
+	/**
+	 * @param nRatePerSecond The number of tokens added per second.
+	 * @param nBurst The number of tokens that can be taken at once after an idle period.
+	 */
+	void SetRate(uint32_t nRatePerSecond, uint32_t nBurst);
+
+	/**
+	 * Takes a token. Thread safe.
+	 *
+	 * @return The delay in milliseconds before the token may be used, 0 if it can be used now.
+	 */
+	uint32_t Reserve();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void Refill(Clock::time_point now);
+
+private:
+	std::mutex m_Mutex;
+	double m_dRatePerMs;
+	double m_dBurst;
+	double m_dTokens; // negative when slots were handed out ahead of time
+	Clock::time_point m_LastRefill;
+};